@@ -0,0 +1,448 @@
+/**
+ * @file bench.c
+ * @brief In-process benchmarks of the NUFS storage layers.
+ *
+ * Usage: nufs_bench [-s size] [-j blocks] [-n files] [-l label] image
+ *
+ * Formats the image, then times the storage_* entry points and the
+ * inode, directory and bitmap layers under them directly, without FUSE
+ * or the kernel in the way. The image is overwritten.
+ *
+ * Every measurement is printed as one JSON object per line:
+ *
+ * {"suite":"micro","label":"","bench":"seq_write","size":65536,"ops":512,
+ *  "seconds":0.012,"ns_per_op":23437.5,"mb_per_s":2796.20}
+ *
+ * size is the bytes each operation moves, 0 where that means nothing.
+ * The label, from -l, tells runs apart when results are collected from
+ * before and after a change.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "directory.h"
+#include "inode.h"
+#include "storage.h"
+#include "helpers/bitmap.h"
+#include "helpers/blocks.h"
+
+// Default image size
+#define BENCH_DEFAULT_SIZE (256L << 20)
+
+// Files in the large directory, unless -n says otherwise
+#define BENCH_DEFAULT_FILES 2000
+
+// Directories above the file looked up by the deep path benchmarks
+#define BENCH_DEPTH 16
+
+// Largest bytes moved by the sequential and random I/O benchmarks
+#define BENCH_MAX_SPAN (64L << 20)
+
+// Label printed with every result
+static const char *bench_label = "";
+
+/**
+ * Get the current time.
+ *
+ * @return CLOCK_MONOTONIC time in seconds.
+ */
+static double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Print one result.
+ *
+ * @param name Benchmark name.
+ * @param size Bytes each operation moves, 0 if it moves none.
+ * @param ops Operations timed.
+ * @param seconds Time they took.
+ */
+static void bench_report(const char *name, long size, long ops, double seconds) {
+    double mb_per_s = seconds > 0 ? size * (double)ops / seconds / (1 << 20) : 0;
+    printf("{\"suite\":\"micro\",\"label\":\"%s\",\"bench\":\"%s\",\"size\":%ld,"
+           "\"ops\":%ld,\"seconds\":%.6f,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f}\n",
+           bench_label, name, size, ops, seconds, ops > 0 ? seconds * 1e9 / ops : 0,
+           mb_per_s);
+    fflush(stdout);
+}
+
+/**
+ * Get a random number.
+ *
+ * @param state Generator state, updated.
+ *
+ * @return Next 64-bit value of an xorshift generator.
+ */
+static unsigned long bench_rand(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+/**
+ * Count entries passed to a readdir callback.
+ *
+ * @return 0, to keep listing.
+ */
+static int bench_count_entry(void *ctx, const char *name, const struct stat *st, int next) {
+    ++*(long *)ctx;
+    return 0;
+}
+
+/**
+ * Time creating, stat'ing, listing and removing a directory of files.
+ *
+ * @param files Number of files.
+ */
+static void bench_files(int files) {
+    char path[64];
+    storage_mknod("/many", S_IFDIR | 0755);
+
+    double start = bench_now();
+    for (int ii = 0; ii < files; ++ii) {
+        snprintf(path, sizeof(path), "/many/file%d", ii);
+        storage_mknod(path, S_IFREG | 0644);
+    }
+    bench_report("mknod", 0, files, bench_now() - start);
+
+    struct stat st;
+    start = bench_now();
+    for (int ii = 0; ii < files; ++ii) {
+        snprintf(path, sizeof(path), "/many/file%d", ii);
+        storage_stat(path, &st);
+    }
+    bench_report("stat", 0, files, bench_now() - start);
+
+    // Missing names scan as far as a lookup can
+    start = bench_now();
+    for (int ii = 0; ii < files; ++ii) {
+        snprintf(path, sizeof(path), "/many/none%d", ii);
+        storage_stat(path, &st);
+    }
+    bench_report("stat_missing", 0, files, bench_now() - start);
+
+    // What df and free-space pollers ask for
+    struct statvfs sv;
+    int polls = files * 10;
+    start = bench_now();
+    for (int ii = 0; ii < polls; ++ii) {
+        storage_statfs(&sv);
+    }
+    bench_report("statfs", 0, polls, bench_now() - start);
+
+    long entries = 0;
+    int rounds = 20;
+    start = bench_now();
+    for (int rr = 0; rr < rounds; ++rr) {
+        storage_readdir("/many", 0, bench_count_entry, &entries);
+    }
+    bench_report("readdir", 0, entries, bench_now() - start);
+
+    // Lookups against the directory layer alone
+    int dir = tree_lookup("/many");
+    inode_t *di = get_inode(dir);
+    unsigned long seed = 88172645463325252ul;
+    int lookups = files * 10;
+    start = bench_now();
+    for (int ii = 0; ii < lookups; ++ii) {
+        snprintf(path, sizeof(path), "file%lu", bench_rand(&seed) % files);
+        inode_rdlock(dir);
+        directory_lookup(di, path);
+        inode_unlock(dir);
+    }
+    bench_report("directory_lookup", 0, lookups, bench_now() - start);
+
+    start = bench_now();
+    for (int ii = 0; ii < files; ++ii) {
+        snprintf(path, sizeof(path), "/many/file%d", ii);
+        storage_unlink(path);
+    }
+    bench_report("unlink", 0, files, bench_now() - start);
+
+    storage_rmdir("/many");
+}
+
+/**
+ * Time resolving a path BENCH_DEPTH directories deep.
+ *
+ * @param rounds Lookups to time.
+ */
+static void bench_deep(int rounds) {
+    char path[BENCH_DEPTH * 8 + 16] = "";
+    for (int ii = 0; ii < BENCH_DEPTH; ++ii) {
+        size_t len = strlen(path);
+        snprintf(path + len, sizeof(path) - len, "/d%d", ii);
+        storage_mknod(path, S_IFDIR | 0755);
+    }
+    strcat(path, "/leaf");
+    storage_mknod(path, S_IFREG | 0644);
+
+    struct stat st;
+    double start = bench_now();
+    for (int ii = 0; ii < rounds; ++ii) {
+        storage_stat(path, &st);
+    }
+    bench_report("deep_stat", 0, rounds, bench_now() - start);
+
+    start = bench_now();
+    for (int ii = 0; ii < rounds; ++ii) {
+        tree_lookup(path);
+    }
+    bench_report("tree_lookup_deep", 0, rounds, bench_now() - start);
+
+    // Renaming the top directory drops every cached path below it
+    char moved[sizeof(path) + 1];
+    snprintf(moved, sizeof(moved), "/d0x%s", path + 3);
+    int renames = rounds / 10;
+    start = bench_now();
+    for (int ii = 0; ii < renames; ++ii) {
+        storage_rename(ii % 2 ? "/d0x" : "/d0", ii % 2 ? "/d0" : "/d0x");
+        storage_stat(ii % 2 ? path : moved, &st);
+    }
+    bench_report("rename_stat", 0, renames, bench_now() - start);
+    if (renames % 2) {
+        storage_rename("/d0x", "/d0");
+    }
+}
+
+/**
+ * Time sequential and random I/O on one file, through an open handle.
+ *
+ * @param span Bytes in the file.
+ */
+static void bench_io(long span) {
+    static const long sizes[] = {4096, 65536, 1 << 20};
+    char *buf = malloc(1 << 20);
+    memset(buf, 0xa5, 1 << 20);
+
+    for (size_t ss = 0; ss < sizeof(sizes) / sizeof(sizes[0]); ++ss) {
+        long size = sizes[ss];
+        long ops = span / size;
+
+        storage_mknod("/seq", S_IFREG | 0644);
+        int fh = storage_open("/seq", O_RDWR);
+
+        double start = bench_now();
+        for (long ii = 0; ii < ops; ++ii) {
+            storage_write_fh(fh, buf, size, ii * size);
+        }
+        bench_report("seq_write", size, ops, bench_now() - start);
+
+        start = bench_now();
+        for (long ii = 0; ii < ops; ++ii) {
+            storage_read_fh(fh, buf, size, ii * size);
+        }
+        bench_report("seq_read", size, ops, bench_now() - start);
+
+        // Overwriting finds every block already mapped
+        start = bench_now();
+        for (long ii = 0; ii < ops; ++ii) {
+            storage_write_fh(fh, buf, size, ii * size);
+        }
+        bench_report("seq_overwrite", size, ops, bench_now() - start);
+
+        storage_release_fh(fh);
+        storage_unlink("/seq");
+    }
+
+    // Random 4K transfers within a file the size of the span
+    storage_mknod("/rand", S_IFREG | 0644);
+    int fh = storage_open("/rand", O_RDWR);
+    for (long off = 0; off < span; off += 1 << 20) {
+        storage_write_fh(fh, buf, 1 << 20, off);
+    }
+
+    unsigned long seed = 2463534242ul;
+    long ops = span / 4096;
+    double start = bench_now();
+    for (long ii = 0; ii < ops; ++ii) {
+        storage_write_fh(fh, buf, 4096, (bench_rand(&seed) % ops) * 4096);
+    }
+    bench_report("rand_write", 4096, ops, bench_now() - start);
+
+    start = bench_now();
+    for (long ii = 0; ii < ops; ++ii) {
+        storage_read_fh(fh, buf, 4096, (bench_rand(&seed) % ops) * 4096);
+    }
+    bench_report("rand_read", 4096, ops, bench_now() - start);
+
+    // Small appends made durable one at a time
+    int syncs = 200;
+    start = bench_now();
+    for (int ii = 0; ii < syncs; ++ii) {
+        storage_write_fh(fh, buf, 4096, span + ii * 4096L);
+        storage_sync_fh(fh, 1);
+    }
+    bench_report("write_fsync", 4096, syncs, bench_now() - start);
+
+    // Copies of the whole file: a clone shares its blocks, a copy between
+    // offsets that don't line up moves every byte
+    int inum = tree_lookup("/rand");
+    storage_mknod("/copy", S_IFREG | 0644);
+    int copy = tree_lookup("/copy");
+    int copies = 4;
+    start = bench_now();
+    for (int ii = 0; ii < copies; ++ii) {
+        storage_clone_inum(inum, copy);
+    }
+    bench_report("clone", span, copies, bench_now() - start);
+
+    start = bench_now();
+    for (int ii = 0; ii < copies; ++ii) {
+        storage_copy_range_inum(inum, 1, copy, 0, span);
+    }
+    bench_report("copy_range_unaligned", span, copies, bench_now() - start);
+    storage_unlink("/copy");
+
+    // The block map of the whole file, through the inode layer
+    inode_t *node = get_inode(inum);
+    int blocks = bytes_to_blocks(span);
+    int bnums[64];
+
+    start = bench_now();
+    inode_rdlock(inum);
+    for (int ii = 0; ii < blocks; ++ii) {
+        inode_get_bnum(node, ii);
+    }
+    inode_unlock(inum);
+    bench_report("inode_get_bnum", 0, blocks, bench_now() - start);
+
+    start = bench_now();
+    long runs = 0;
+    inode_rdlock(inum);
+    for (int ii = 0; ii < blocks;) {
+        int got = inode_map_range(node, ii, blocks - ii < 64 ? blocks - ii : 64, bnums);
+        ii += got > 0 ? got : 1;
+        ++runs;
+    }
+    inode_unlock(inum);
+    bench_report("inode_map_range", 0, runs, bench_now() - start);
+
+    storage_release_fh(fh);
+    storage_unlink("/rand");
+    free(buf);
+}
+
+/**
+ * Time the bitmap kernels over the live block bitmap.
+ *
+ * Leaves a scattered file in place first, so searches have something to
+ * skip over.
+ */
+static void bench_bitmap() {
+    char *buf = calloc(1, BLOCK_SIZE);
+    char path[32];
+    for (int ii = 0; ii < 256; ++ii) {
+        snprintf(path, sizeof(path), "/frag%d", ii);
+        storage_mknod(path, S_IFREG | 0644);
+        storage_write(path, buf, BLOCK_SIZE * (1 + ii % 4), 0);
+    }
+    for (int ii = 0; ii < 256; ii += 2) {
+        snprintf(path, sizeof(path), "/frag%d", ii);
+        storage_unlink(path);
+    }
+    free(buf);
+
+    void *bbm = get_blocks_bitmap();
+    int rounds = 2000;
+    volatile int sink = 0;
+
+    double start = bench_now();
+    for (int ii = 0; ii < rounds; ++ii) {
+        sink += bitmap_find_zero(bbm, 1 + ii % 64, BLOCK_COUNT);
+    }
+    bench_report("bitmap_find_zero", 0, rounds, bench_now() - start);
+
+    start = bench_now();
+    for (int ii = 0; ii < rounds; ++ii) {
+        sink += bitmap_find_zero_run(bbm, 1, BLOCK_COUNT, 64);
+    }
+    bench_report("bitmap_find_zero_run", 0, rounds, bench_now() - start);
+
+    start = bench_now();
+    for (int ii = 0; ii < rounds; ++ii) {
+        sink += bitmap_count(bbm, 0, BLOCK_COUNT);
+    }
+    bench_report("bitmap_count", 0, rounds, bench_now() - start);
+}
+
+/**
+ * Print usage and exit.
+ *
+ * @param prog Program name.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s size] [-j blocks] [-n files] [-l label] image\n", prog);
+    exit(2);
+}
+
+/**
+ * Main entry point for the benchmarks.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ *
+ * @return 0 on success, 1 if the image couldn't be created.
+ */
+int main(int argc, char *argv[]) {
+    long size = BENCH_DEFAULT_SIZE;
+    long journal = -1;
+    int files = BENCH_DEFAULT_FILES;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:j:n:l:")) != -1) {
+        switch (opt) {
+        case 's':
+            size = strtol(optarg, NULL, 10) << 20;
+            break;
+        case 'j':
+            journal = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            files = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            bench_label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || size <= 0 || files <= 0) {
+        usage(argv[0]);
+    }
+    const char *image = argv[optind];
+
+    long block_count = (size / STORAGE_DEFAULT_BLOCK_SIZE) & ~7L;
+    if (journal < 0) {
+        journal = block_count / 64 > STORAGE_DEFAULT_JOURNAL_BLOCKS
+            ? block_count / 64 : STORAGE_DEFAULT_JOURNAL_BLOCKS;
+    }
+    int inodes = files + 1024;
+    if (storage_mkfs(image, STORAGE_DEFAULT_BLOCK_SIZE, block_count, inodes,
+                     STORAGE_DEFAULT_INODE_SIZE, journal) < 0) {
+        fprintf(stderr, "%s: can't create a %ld block image\n", argv[0], block_count);
+        return 1;
+    }
+    storage_init(image);
+
+    // Leave room for the file data the other benchmarks keep around
+    long span = size / 4 < BENCH_MAX_SPAN ? size / 4 : BENCH_MAX_SPAN;
+
+    bench_files(files);
+    bench_deep(files * 10);
+    bench_io(span);
+    bench_bitmap();
+    return 0;
+}
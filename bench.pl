@@ -0,0 +1,193 @@
+#!/usr/bin/perl
+#
+# Mounted benchmarks: times file operations through the kernel against a
+# running nufs or nufs_ll, and prints one JSON object per result, in the
+# same shape as nufs_bench:
+#
+# {"suite":"mount","label":"","front_end":"nufs","bench":"seq_read",
+#  "size":65536,"ops":1024,"seconds":0.05,"ns_per_op":48828.1,"mb_per_s":1280.00}
+#
+# Usage: perl bench.pl [-f nufs|nufs_ll] [-s size_mb] [-n files] [-l label]
+#
+# Formats bench.nufs and mounts it on mnt/. Files are remounted between
+# writing and reading them, so reads come from NUFS rather than the
+# kernel's page cache. The statistics in /.nufs/stats at the end of the
+# run are saved to bench.stats.
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Fcntl qw(O_RDONLY O_RDWR O_WRONLY O_CREAT SEEK_SET);
+use Getopt::Std;
+use Time::HiRes qw(time sleep);
+
+my %opts;
+getopts("f:s:n:l:", \%opts) or die "usage: $0 [-f front_end] [-s size_mb] [-n files] [-l label]\n";
+my $front = $opts{f} // "nufs";
+my $size_mb = $opts{s} // 256;
+my $files = $opts{n} // 2000;
+my $label = $opts{l} // "";
+
+my $image = "bench.nufs";
+my $depth = 16;
+
+# Bytes moved by the sequential and random I/O benchmarks
+my $span = ($size_mb / 4 < 64 ? $size_mb / 4 : 64) << 20;
+
+sub report {
+    my ($name, $size, $ops, $seconds) = @_;
+    my $mb_per_s = $seconds > 0 ? $size * $ops / $seconds / (1 << 20) : 0;
+    printf("{\"suite\":\"mount\",\"label\":\"%s\",\"front_end\":\"%s\",\"bench\":\"%s\","
+           . "\"size\":%d,\"ops\":%d,\"seconds\":%.6f,\"ns_per_op\":%.1f,\"mb_per_s\":%.2f}\n",
+           $label, $front, $name, $size, $ops, $seconds,
+           $ops > 0 ? $seconds * 1e9 / $ops : 0, $mb_per_s);
+    STDOUT->flush();
+}
+
+sub mount {
+    system("mkdir -p mnt");
+    system("(./$front -f mnt $image 2>&1) >> bench.log &");
+
+    # The control file shows up once the mount is serving requests
+    for (1 .. 100) {
+        return if -e "mnt/.nufs/stats";
+        sleep 0.05;
+    }
+    die "$front didn't mount $image\n";
+}
+
+sub unmount {
+    system("(fusermount -u mnt 2>&1) >> bench.log");
+    for (1 .. 100) {
+        return unless -e "mnt/.nufs/stats";
+        sleep 0.05;
+    }
+}
+
+sub remount {
+    unmount();
+    mount();
+}
+
+sub write_file {
+    my ($path, $size, $buf, @offsets) = @_;
+    sysopen(my $fh, $path, O_WRONLY | O_CREAT) or die "$path: $!\n";
+    for my $off (@offsets) {
+        sysseek($fh, $off, SEEK_SET);
+        syswrite($fh, $buf, $size) == $size or die "$path: short write\n";
+    }
+    close($fh);
+}
+
+sub read_file {
+    my ($path, $size, @offsets) = @_;
+    sysopen(my $fh, $path, O_RDONLY) or die "$path: $!\n";
+    my $buf;
+    for my $off (@offsets) {
+        sysseek($fh, $off, SEEK_SET);
+        sysread($fh, $buf, $size);
+    }
+    close($fh);
+}
+
+sub bench_io {
+    for my $size (4096, 65536, 1 << 20) {
+        my $buf = "\xa5" x $size;
+        my @offsets = map { $_ * $size } 0 .. $span / $size - 1;
+
+        my $start = time();
+        write_file("mnt/seq", $size, $buf, @offsets);
+        report("seq_write", $size, scalar(@offsets), time() - $start);
+
+        remount();
+        $start = time();
+        read_file("mnt/seq", $size, @offsets);
+        report("seq_read", $size, scalar(@offsets), time() - $start);
+
+        unlink("mnt/seq");
+    }
+
+    # Random 4K transfers within a file the size of the span
+    my $buf = "\x5a" x (1 << 20);
+    write_file("mnt/rand", 1 << 20, $buf, map { $_ << 20 } 0 .. ($span >> 20) - 1);
+    my $blocks = $span / 4096;
+    srand(1);
+    my @offsets = map { int(rand($blocks)) * 4096 } 1 .. $blocks;
+
+    my $start = time();
+    write_file("mnt/rand", 4096, substr($buf, 0, 4096), @offsets);
+    report("rand_write", 4096, scalar(@offsets), time() - $start);
+
+    remount();
+    @offsets = map { int(rand($blocks)) * 4096 } 1 .. $blocks;
+    $start = time();
+    read_file("mnt/rand", 4096, @offsets);
+    report("rand_read", 4096, scalar(@offsets), time() - $start);
+
+    unlink("mnt/rand");
+}
+
+sub bench_files {
+    mkdir("mnt/many");
+
+    my $start = time();
+    for my $ii (0 .. $files - 1) {
+        open(my $fh, ">", "mnt/many/file$ii") or die "create: $!\n";
+        close($fh);
+    }
+    report("create", 0, $files, time() - $start);
+
+    remount();
+    $start = time();
+    for my $ii (0 .. $files - 1) {
+        stat("mnt/many/file$ii");
+    }
+    report("stat", 0, $files, time() - $start);
+
+    my $rounds = 20;
+    my $entries = 0;
+    $start = time();
+    for (1 .. $rounds) {
+        opendir(my $dh, "mnt/many") or die "opendir: $!\n";
+        $entries++ while defined(readdir($dh));
+        closedir($dh);
+    }
+    report("readdir", 0, $entries, time() - $start);
+
+    $start = time();
+    for my $ii (0 .. $files - 1) {
+        unlink("mnt/many/file$ii");
+    }
+    report("unlink", 0, $files, time() - $start);
+
+    rmdir("mnt/many");
+}
+
+sub bench_deep {
+    my $path = "mnt";
+    for my $ii (0 .. $depth - 1) {
+        $path .= "/d$ii";
+        mkdir($path) or die "mkdir $path: $!\n";
+    }
+    $path .= "/leaf";
+    open(my $fh, ">", $path) or die "create: $!\n";
+    close($fh);
+
+    remount();
+    my $rounds = $files * 10;
+    my $start = time();
+    for (1 .. $rounds) {
+        stat($path);
+    }
+    report("deep_stat", 0, $rounds, time() - $start);
+}
+
+system("rm -f $image bench.log bench.stats");
+system("./mkfs.nufs -s ${size_mb}M $image >> bench.log") == 0 or die "mkfs.nufs failed\n";
+mount();
+
+bench_io();
+bench_files();
+bench_deep();
+
+system("cp mnt/.nufs/stats bench.stats");
+unmount();
@@ -0,0 +1,243 @@
+/**
+ * @file dcache.c
+ * @brief Implementation of the dentry and path caches.
+ *
+ * Both caches are fixed-size, direct-mapped hash tables, so they never
+ * allocate and a lookup is a single hash plus one string compare. One
+ * mutex guards both; it is never held while taking another lock.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "directory.h"
+
+/**
+ * Cached (parent, name) -> inum mapping.
+ */
+typedef struct dentry {
+    int valid;                   // slot holds a mapping
+    int parent;                  // directory inode number
+    int inum;                    // child inode number, DCACHE_NEGATIVE if absent
+    char name[DIR_NAME_LENGTH];  // entry name
+} dentry_t;
+
+/**
+ * Cached path -> inum mapping.
+ *
+ * An entry is only live while its generation matches path_gen.
+ */
+typedef struct pentry {
+    unsigned gen;                    // path_gen at insert time
+    int inum;                        // inode number of the path
+    char path[PCACHE_PATH_LENGTH];   // absolute path
+} pentry_t;
+
+static dentry_t dentries[DCACHE_SIZE];
+static pentry_t pentries[PCACHE_SIZE];
+
+// Bumped to invalidate every path entry at once. Starts at 1 so that
+// zeroed slots are never live.
+static unsigned path_gen = 1;
+
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * FNV-1a hash of a string, seeded with the given value.
+ *
+ * @param seed Initial hash state.
+ * @param text Null-terminated string to hash.
+ *
+ * @return 32-bit hash.
+ */
+static uint32_t dcache_hash(uint32_t seed, const char *text) {
+    uint32_t hash = 2166136261u ^ seed;
+    for (const char *cc = text; *cc != '\0'; ++cc) {
+        hash ^= (uint8_t)*cc;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Find the dentry slot a (parent, name) pair maps to.
+ *
+ * @param parent Directory inode number.
+ * @param name Entry name.
+ *
+ * @return Pointer to the slot.
+ */
+static dentry_t *dcache_slot(int parent, const char *name) {
+    uint32_t hash = dcache_hash((uint32_t)parent * 2654435761u, name);
+    return &dentries[hash % DCACHE_SIZE];
+}
+
+/**
+ * Reset both caches.
+ */
+void dcache_init() {
+    pthread_mutex_lock(&dcache_lock);
+    memset(dentries, 0, sizeof(dentries));
+    memset(pentries, 0, sizeof(pentries));
+    path_gen = 1;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Look up a name in the dentry cache.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name within that directory.
+ *
+ * @return Cached child inode number, DCACHE_NEGATIVE if the name is
+ *         cached as absent, or -1 on a miss.
+ */
+int dcache_lookup(int parent, const char *name) {
+    int inum = -1;
+
+    pthread_mutex_lock(&dcache_lock);
+    dentry_t *de = dcache_slot(parent, name);
+    if (de->valid && de->parent == parent && strcmp(de->name, name) == 0) {
+        inum = de->inum;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+
+    return inum;
+}
+
+/**
+ * Record a (parent, name) -> inum mapping.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name within that directory.
+ * @param inum Inode number the name resolves to.
+ */
+void dcache_insert(int parent, const char *name, int inum) {
+    if (strlen(name) >= DIR_NAME_LENGTH) {
+        return;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    dentry_t *de = dcache_slot(parent, name);
+    de->valid = 1;
+    de->parent = parent;
+    de->inum = inum;
+    strcpy(de->name, name);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Record that a directory has no entry by a name.
+ *
+ * Misses are cheap to find again and often come in storms of probes for
+ * names that never appear, so one never takes a positive entry's slot.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name missing from that directory.
+ */
+void dcache_insert_negative(int parent, const char *name) {
+    if (strlen(name) >= DIR_NAME_LENGTH) {
+        return;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    dentry_t *de = dcache_slot(parent, name);
+    if (!de->valid || de->inum == DCACHE_NEGATIVE) {
+        de->valid = 1;
+        de->parent = parent;
+        de->inum = DCACHE_NEGATIVE;
+        strcpy(de->name, name);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Drop the mapping for a (parent, name) pair and flush the path cache.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name within that directory.
+ */
+void dcache_remove(int parent, const char *name) {
+    pthread_mutex_lock(&dcache_lock);
+    dentry_t *de = dcache_slot(parent, name);
+    if (de->valid && de->parent == parent && strcmp(de->name, name) == 0) {
+        de->valid = 0;
+    }
+
+    // Any cached path through this name is now stale
+    path_gen++;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Drop every cached entry whose parent is the given directory.
+ *
+ * @param parent Inode number of the directory being released.
+ */
+void dcache_purge(int parent) {
+    pthread_mutex_lock(&dcache_lock);
+    for (int ii = 0; ii < DCACHE_SIZE; ++ii) {
+        if (dentries[ii].valid && dentries[ii].parent == parent) {
+            dentries[ii].valid = 0;
+        }
+    }
+    path_gen++;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/**
+ * Look up a full path in the path cache.
+ *
+ * @param path Absolute path.
+ *
+ * @return Cached inode number, or -1 on a miss.
+ */
+int dcache_path_lookup(const char *path) {
+    int inum = -1;
+
+    pthread_mutex_lock(&dcache_lock);
+    pentry_t *pe = &pentries[dcache_hash(0, path) % PCACHE_SIZE];
+    if (pe->gen == path_gen && strcmp(pe->path, path) == 0) {
+        inum = pe->inum;
+    }
+    pthread_mutex_unlock(&dcache_lock);
+
+    return inum;
+}
+
+/**
+ * Get the current path cache generation.
+ *
+ * @return Value to pass to dcache_path_insert().
+ */
+unsigned dcache_path_gen() {
+    pthread_mutex_lock(&dcache_lock);
+    unsigned gen = path_gen;
+    pthread_mutex_unlock(&dcache_lock);
+
+    return gen;
+}
+
+/**
+ * Record a full path -> inum mapping, unless a name was removed since
+ * the walk that produced it began.
+ *
+ * @param path Absolute path.
+ * @param inum Inode number the path resolves to.
+ * @param gen dcache_path_gen() from before the path was resolved.
+ */
+void dcache_path_insert(const char *path, int inum, unsigned gen) {
+    if (strlen(path) >= PCACHE_PATH_LENGTH) {
+        return;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    if (gen == path_gen) {
+        pentry_t *pe = &pentries[dcache_hash(0, path) % PCACHE_SIZE];
+        pe->gen = path_gen;
+        pe->inum = inum;
+        strcpy(pe->path, path);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
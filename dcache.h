@@ -0,0 +1,123 @@
+/**
+ * @file dcache.h
+ * @brief In-memory dentry and path caches for the NUFS filesystem.
+ *
+ * Caches the results of name resolution so repeated lookups of the same
+ * paths do not rescan directory blocks. Two tables are kept:
+ *
+ * Dentry cache: (parent inum, name) -> child inum, or known absent
+ * Path cache: full absolute path -> inum
+ *
+ * Assumptions:
+ * Both tables are direct-mapped, a colliding insert evicts the old entry,
+ * except that a negative entry never evicts a positive one
+ * Dentries are kept exact by directory_put() and directory_delete()
+ * Path entries are dropped wholesale whenever any name is removed
+ * All functions are safe to call from several threads
+ */
+#ifndef DCACHE_H
+#define DCACHE_H
+
+// Number of slots in the dentry cache
+#define DCACHE_SIZE 4096
+
+// Number of slots in the full-path cache
+#define PCACHE_SIZE 1024
+
+// Longest path the full-path cache will hold, including the null
+#define PCACHE_PATH_LENGTH 256
+
+// dcache_lookup() result for a name cached as not in its directory
+#define DCACHE_NEGATIVE (-2)
+
+/**
+ * Reset both caches.
+ *
+ * Should be called whenever a disk image is (re)loaded.
+ */
+void dcache_init();
+
+/**
+ * Look up a name in the dentry cache.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name within that directory.
+ *
+ * @return Cached child inode number, DCACHE_NEGATIVE if the name is
+ *         cached as absent, or -1 on a miss.
+ */
+int dcache_lookup(int parent, const char *name);
+
+/**
+ * Record a (parent, name) -> inum mapping.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name within that directory.
+ * @param inum Inode number the name resolves to.
+ */
+void dcache_insert(int parent, const char *name, int inum);
+
+/**
+ * Record that a directory has no entry by a name.
+ *
+ * Only call with the directory locked, after finding the name missing
+ * from it. directory_put() of the name replaces the entry.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name missing from that directory.
+ */
+void dcache_insert_negative(int parent, const char *name);
+
+/**
+ * Drop the mapping for a (parent, name) pair, if cached.
+ *
+ * Also invalidates the full-path cache, since any cached path running
+ * through the removed name is now stale.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Entry name within that directory.
+ */
+void dcache_remove(int parent, const char *name);
+
+/**
+ * Drop every cached entry whose parent is the given directory.
+ *
+ * Used when a directory inode is freed so its number can be reused.
+ *
+ * @param parent Inode number of the directory being released.
+ */
+void dcache_purge(int parent);
+
+/**
+ * Look up a full path in the path cache.
+ *
+ * @param path Absolute path.
+ *
+ * @return Cached inode number, or -1 on a miss.
+ */
+int dcache_path_lookup(const char *path);
+
+/**
+ * Get the current path cache generation.
+ *
+ * The generation changes whenever a name is removed. Take it before
+ * resolving a path and hand it to dcache_path_insert(), so that a walk
+ * racing with a removal doesn't cache a stale result.
+ *
+ * @return Current generation.
+ */
+unsigned dcache_path_gen();
+
+/**
+ * Record a full path -> inum mapping.
+ *
+ * Paths longer than PCACHE_PATH_LENGTH - 1 are not cached, and neither
+ * is anything if the generation has moved on from gen.
+ *
+ * @param path Absolute path.
+ * @param inum Inode number the path resolves to.
+ * @param gen dcache_path_gen() from before the path was resolved.
+ */
+void dcache_path_insert(const char *path, int inum, unsigned gen);
+
+#endif
@@ -4,12 +4,19 @@
  *
  * Manages directories as special files containing directory entries.
  * Each directory entry is 64 bytes, mapping a filename to an inode number.
+ *
+ * Callers hold the directory inode's lock around the directory_*
+ * functions that take an inode; the path-based functions take the locks
+ * they need themselves.
  */
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 
 #include "directory.h"
+#include "dcache.h"
+#include "stats.h"
+#include "trace.h"
 #include "helpers/blocks.h"
 #include "helpers/bitmap.h"
 
@@ -23,25 +30,26 @@ void directory_init() {
     // Check if root directory already exists 
     void *ibm = get_inode_bitmap();
     if (bitmap_get(ibm, 0)) {
-        printf("+ directory_init: root already exists\n");
+        TRACE(TRACE_INFO, "directory_init: root already exists");
         return;
     }
     
     // Allocate inode 0 for root
     int root_inum = alloc_inode();
     if (root_inum != 0) {
-        printf("! directory_init: expected inode 0, got %d\n", root_inum);
+        TRACE(TRACE_ERROR, "directory_init: expected inode 0, got %d", root_inum);
     }
     
     // Set up root directory inode
     inode_t *root = get_inode(0);
     root->mode = 040755;  // rwxr-xr-x
     root->size = 0;
+    inode_dirty(root);
     
     // Allocate initial block for directory entries
-    grow_inode(root, BLOCK_SIZE);
+    grow_inode(root, BLOCK_SIZE, 1);
     
-    printf("+ directory_init: created root directory\n");
+    TRACE(TRACE_INFO, "directory_init: created root directory");
 }
 
 /**
@@ -82,7 +90,7 @@ dirent_t *directory_get_entry(inode_t *di, int index) {
  *
  * @return Maximum number of directory entries.
  */
-static int directory_max_entries(inode_t *di) {
+int directory_max_entries(inode_t *di) {
     int num_blocks = bytes_to_blocks(di->size);
     if (di->size == 0) {
         num_blocks = 0;
@@ -91,41 +99,320 @@ static int directory_max_entries(inode_t *di) {
 }
 
 /**
- * Look up a name in a directory.
+ * Hash a directory entry name for the on-disk index.
+ *
+ * FNV-1a, 32 bit. The value is stored on disk, so it must not change.
+ *
+ * @param name Null-terminated entry name.
+ *
+ * @return Hash of the name.
+ */
+static uint32_t directory_name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *cc = name; *cc != '\0'; ++cc) {
+        hash ^= (uint8_t)*cc;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Get the hash index root of a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return Pointer to the index root, or NULL if the directory is unindexed.
+ */
+static dir_index_t *directory_index_root(inode_t *di) {
+    if (di->index <= 0) {
+        return NULL;
+    }
+    
+    dir_index_t *idx = (dir_index_t *)blocks_get_block(di->index);
+    if (idx->magic != DIR_INDEX_MAGIC) {
+        return NULL;
+    }
+    return idx;
+}
+
+/**
+ * Get a bucket of a hash index.
+ *
+ * @param idx Pointer to the index root.
+ * @param bucket Bucket number, less than npages * DIR_BUCKETS_PER_PAGE.
+ *
+ * @return Pointer to the bucket.
+ */
+static dir_bucket_t *directory_index_bucket(dir_index_t *idx, uint32_t bucket) {
+    dir_bucket_t *page = (dir_bucket_t *)blocks_get_block(
+        idx->pages[bucket / DIR_BUCKETS_PER_PAGE]);
+    return &page[bucket % DIR_BUCKETS_PER_PAGE];
+}
+
+/**
+ * Find the bucket holding a name.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param idx Pointer to the directory's index root.
+ * @param name Name to search for.
+ *
+ * @return Pointer to the matching bucket, or NULL if not found.
+ */
+static dir_bucket_t *directory_index_find(inode_t *di, dir_index_t *idx,
+                                          const char *name) {
+    uint32_t hash = directory_name_hash(name);
+    uint32_t nbuckets = idx->npages * DIR_BUCKETS_PER_PAGE;
+    
+    for (uint32_t ii = 0; ii < nbuckets; ++ii) {
+        dir_bucket_t *bucket = directory_index_bucket(idx, (hash + ii) & (nbuckets - 1));
+        if (bucket->slot == 0) {
+            STATS_ADD(STATS_DIR_SCANNED, ii + 1);
+            return NULL;  // Hit an empty bucket, name is not present
+        }
+        if (bucket->slot == DIR_BUCKET_TOMB || bucket->hash != hash) {
+            continue;
+        }
+        
+        dirent_t *entry = directory_get_entry(di, bucket->slot - 1);
+        if (entry != NULL && entry->inum != 0 && strcmp(entry->name, name) == 0) {
+            STATS_ADD(STATS_DIR_SCANNED, ii + 1);
+            return bucket;
+        }
+    }
+    
+    STATS_ADD(STATS_DIR_SCANNED, nbuckets);
+    return NULL;
+}
+
+/**
+ * Add a (hash, slot) pair to a hash index.
+ *
+ * The caller is responsible for keeping the load factor below one.
+ *
+ * @param idx Pointer to the index root.
+ * @param hash Name hash of the entry.
+ * @param slot Dirent index of the entry.
+ */
+static void directory_index_insert(dir_index_t *idx, uint32_t hash, int slot) {
+    uint32_t nbuckets = idx->npages * DIR_BUCKETS_PER_PAGE;
+    
+    for (uint32_t ii = 0; ii < nbuckets; ++ii) {
+        dir_bucket_t *bucket = directory_index_bucket(idx, (hash + ii) & (nbuckets - 1));
+        if (bucket->slot == 0 || bucket->slot == DIR_BUCKET_TOMB) {
+            if (bucket->slot == 0) {
+                idx->used++;
+            }
+            bucket->hash = hash;
+            bucket->slot = slot + 1;
+            idx->count++;
+            blocks_dirty(bucket, sizeof(dir_bucket_t));
+            blocks_dirty(idx, sizeof(dir_index_t));
+            return;
+        }
+    }
+}
+
+/**
+ * Release a directory's hash index.
+ *
+ * @param di Pointer to the directory's inode.
+ */
+void directory_drop_index(inode_t *di) {
+    if (di == NULL || di->index <= 0) {
+        return;
+    }
+    
+    dir_index_t *idx = directory_index_root(di);
+    if (idx != NULL) {
+        for (uint32_t ii = 0; ii < idx->npages; ++ii) {
+            free_block(idx->pages[ii]);
+        }
+    }
+    free_block(di->index);
+    di->index = 0;
+    inode_dirty(di);
+}
+
+/**
+ * Write a directory's inode, dirent blocks and hash index back to disk.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param wait Nonzero to wait for the writes, 0 to only start them.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+int directory_sync(inode_t *di, int wait) {
+    int rv = inode_sync(di, 1, wait);
+    
+    dir_index_t *idx = directory_index_root(di);
+    if (idx != NULL) {
+        rv |= blocks_sync(idx, BLOCK_SIZE, wait);
+        for (uint32_t ii = 0; ii < idx->npages; ++ii) {
+            rv |= blocks_sync(blocks_get_block(idx->pages[ii]), BLOCK_SIZE, wait);
+        }
+    }
+    
+    return rv < 0 ? -1 : 0;
+}
+
+/**
+ * (Re)build a directory's hash index with the given number of pages.
+ *
+ * Reuses the existing root block if there is one. If blocks run out the
+ * index is dropped and the directory falls back to linear scans.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param npages Number of bucket pages, a power of two.
+ *
+ * @return 0 on success, -1 if the index could not be built.
+ */
+static int directory_index_build(inode_t *di, uint32_t npages) {
+    dir_index_t *idx = directory_index_root(di);
+    uint32_t free_hint = 0;
+    
+    if (idx != NULL) {
+        free_hint = idx->free_hint;
+        for (uint32_t ii = 0; ii < idx->npages; ++ii) {
+            free_block(idx->pages[ii]);
+        }
+    } else {
+        di->index = alloc_block();
+        if (di->index < 0) {
+            di->index = 0;
+            return -1;
+        }
+        inode_dirty(di);
+        idx = (dir_index_t *)blocks_get_block(di->index);
+    }
+    
+    memset(idx, 0, BLOCK_SIZE);
+    blocks_dirty(idx, BLOCK_SIZE);
+    idx->magic = DIR_INDEX_MAGIC;
+    idx->free_hint = free_hint;
+    
+    for (uint32_t ii = 0; ii < npages; ++ii) {
+        int bnum = alloc_block();
+        if (bnum < 0) {
+            directory_drop_index(di);
+            return -1;
+        }
+        memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+        blocks_dirty(blocks_get_block(bnum), BLOCK_SIZE);
+        idx->pages[ii] = bnum;
+        idx->npages++;
+    }
+    
+    int max_entries = directory_max_entries(di);
+    for (int ii = 0; ii < max_entries; ++ii) {
+        dirent_t *entry = directory_get_entry(di, ii);
+        if (entry == NULL) {
+            break;
+        }
+        if (entry->inum != 0 && entry->name[0] != '\0') {
+            directory_index_insert(idx, directory_name_hash(entry->name), ii);
+        }
+    }
+    
+    TRACE(TRACE_DEBUG, "directory_index_build: %u pages, %u entries", idx->npages, idx->count);
+    return 0;
+}
+
+/**
+ * Keep a directory's hash index below a 3/4 load factor.
  *
- * Iterates through all directory entries looking for a matching name.
+ * Doubles the table when live entries fill it, or rehashes in place when
+ * most of the load is tombstones.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param idx Pointer to the directory's index root.
+ */
+static void directory_index_balance(inode_t *di, dir_index_t *idx) {
+    uint32_t nbuckets = idx->npages * DIR_BUCKETS_PER_PAGE;
+    if (idx->used * 4 < nbuckets * 3) {
+        return;
+    }
+    
+    uint32_t npages = idx->npages;
+    if (idx->count * 2 >= idx->used) {
+        npages *= 2;
+    }
+    if (npages > DIR_INDEX_MAX_PAGES) {
+        // Too large to index, scan instead
+        directory_drop_index(di);
+        return;
+    }
+    
+    directory_index_build(di, npages);
+}
+
+/**
+ * Look up a name in a directory, reporting the slot it's in.
+ *
+ * Uses the hash index when the directory has one, otherwise iterates
+ * through all directory entries looking for a matching name.
  *
  * @param di Pointer to the directory's inode.
  * @param name Name to search for.
+ * @param slot Receives the entry's slot if found.
  *
  * @return Inode number if found, -1 if not found.
  */
-int directory_lookup(inode_t *di, const char *name) {
+int directory_lookup_slot(inode_t *di, const char *name, int *slot) {
     if (di == NULL || name == NULL || strlen(name) == 0) {
         return -1;
     }
     
+    STATS_ADD(STATS_DIR_LOOKUPS, 1);
+    dir_index_t *idx = directory_index_root(di);
+    if (idx != NULL) {
+        dir_bucket_t *bucket = directory_index_find(di, idx, name);
+        if (bucket == NULL) {
+            return -1;
+        }
+        *slot = bucket->slot - 1;
+        return directory_get_entry(di, *slot)->inum;
+    }
+    
     int max_entries = directory_max_entries(di);
     
-    for (int ii = 0; ii < max_entries; ++ii) {
+    int ii;
+    for (ii = 0; ii < max_entries; ++ii) {
         dirent_t *entry = directory_get_entry(di, ii);
         if (entry == NULL) {
             break;
         }
         
         if (entry->inum != 0 && strcmp(entry->name, name) == 0) {
+            STATS_ADD(STATS_DIR_SCANNED, ii + 1);
+            *slot = ii;
             return entry->inum;
         }
     }
     
+    STATS_ADD(STATS_DIR_SCANNED, ii);
     return -1;  
 }
 
+/**
+ * Look up a name in a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name to search for.
+ *
+ * @return Inode number if found, -1 if not found.
+ */
+int directory_lookup(inode_t *di, const char *name) {
+    int slot;
+    return directory_lookup_slot(di, name, &slot);
+}
+
 /**
  * Add an entry to a directory.
  *
  * Finds an empty slot (inum == 0 or empty name) and adds the new entry.
- * Grows the directory if no empty slots are available.
+ * Indexed directories start the search at the index's free-slot hint
+ * instead of slot 0. Grows the directory if no empty slots are available,
+ * and builds an index once the directory spans more than one block.
  *
  * @param di Pointer to the directory's inode.
  * @param name Name for the new entry.
@@ -139,58 +426,120 @@ int directory_put(inode_t *di, const char *name, int inum) {
     }
     
     if (strlen(name) >= DIR_NAME_LENGTH) {
-        printf("! directory_put: name too long: %s\n", name);
+        TRACE(TRACE_ERROR, "directory_put: name too long: %s", name);
         return -1;
     }
     
+    dir_index_t *idx = directory_index_root(di);
     int max_entries = directory_max_entries(di);
+    int slot = -1;
+    dirent_t *entry = NULL;
     
     // Look for an empty slot
-    for (int ii = 0; ii < max_entries; ++ii) {
-        dirent_t *entry = directory_get_entry(di, ii);
+    for (int ii = idx ? (int)idx->free_hint : 0; ii < max_entries; ++ii) {
+        entry = directory_get_entry(di, ii);
         if (entry == NULL) {
             break;
         }
         
         // Check if this slot is empty
         if (entry->inum == 0 || entry->name[0] == '\0') {
-            strncpy(entry->name, name, DIR_NAME_LENGTH - 1);
-            entry->name[DIR_NAME_LENGTH - 1] = '\0';
-            entry->inum = inum;
-            printf("+ directory_put: added %s -> %d at slot %d\n", name, inum, ii);
-            return 0;
+            slot = ii;
+            break;
         }
     }
     
-    // No empty slot found, need to grow the directory
-    int old_size = di->size;
-    int new_size = old_size + BLOCK_SIZE;
-    
-    if (grow_inode(di, new_size) < 0) {
-        printf("! directory_put: failed to grow directory\n");
-        return -1;
-    }
-    
-    // Add entry in the newly allocated space
-    int new_entry_index = max_entries;
-    dirent_t *entry = directory_get_entry(di, new_entry_index);
-    if (entry == NULL) {
-        printf("! directory_put: failed to get new entry\n");
-        return -1;
+    if (slot < 0) {
+        // No empty slot found, need to grow the directory
+        int old_size = di->size;
+        int new_size = old_size + BLOCK_SIZE;
+        
+        if (grow_inode(di, new_size, 1) < 0) {
+            TRACE(TRACE_ERROR, "directory_put: failed to grow directory");
+            return -1;
+        }
+        
+        // Add entry in the newly allocated space
+        slot = max_entries;
+        entry = directory_get_entry(di, slot);
+        if (entry == NULL) {
+            TRACE(TRACE_ERROR, "directory_put: failed to get new entry");
+            return -1;
+        }
     }
     
     strncpy(entry->name, name, DIR_NAME_LENGTH - 1);
     entry->name[DIR_NAME_LENGTH - 1] = '\0';
     entry->inum = inum;
-    printf("+ directory_put: added %s -> %d at slot %d (grew dir)\n", name, inum, new_entry_index);
+    blocks_dirty(entry, sizeof(dirent_t));
+    dcache_insert(inode_get_inum(di), name, inum);
+    TRACE_EVENT(TRACE_DIR_PUT, inode_get_inum(di), inum, slot);
+    
+    if (idx != NULL) {
+        idx->free_hint = slot + 1;
+        blocks_dirty(idx, sizeof(dir_index_t));
+        directory_index_insert(idx, directory_name_hash(entry->name), slot);
+        directory_index_balance(di, idx);
+    } else if (directory_max_entries(di) > (int)DIR_ENTRIES_PER_BLOCK) {
+        if (directory_index_build(di, 1) == 0) {
+            directory_index_root(di)->free_hint = slot + 1;
+            blocks_dirty(directory_index_root(di), sizeof(dir_index_t));
+        }
+    }
     
     return 0;
 }
 
+/**
+ * Take the entry in a slot out of a directory's hash index, if any.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot of a live entry.
+ */
+static void directory_index_remove(inode_t *di, int slot) {
+    dir_index_t *idx = directory_index_root(di);
+    if (idx == NULL) {
+        return;
+    }
+    
+    dir_bucket_t *bucket = directory_index_find(di, idx, directory_get_entry(di, slot)->name);
+    if (bucket != NULL && bucket->slot == (uint32_t)slot + 1) {
+        bucket->slot = DIR_BUCKET_TOMB;
+        idx->count--;
+        blocks_dirty(bucket, sizeof(dir_bucket_t));
+    }
+    if ((uint32_t)slot < idx->free_hint) {
+        idx->free_hint = slot;
+    }
+    blocks_dirty(idx, sizeof(dir_index_t));
+}
+
+/**
+ * Delete the entry in a slot from a directory.
+ *
+ * Clears the entry, leaving its name cached as absent.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot of a live entry, from directory_lookup_slot().
+ */
+void directory_delete_at(inode_t *di, int slot) {
+    dirent_t *entry = directory_get_entry(di, slot);
+    char name[DIR_NAME_LENGTH];
+    strcpy(name, entry->name);
+    
+    directory_index_remove(di, slot);
+    TRACE_EVENT(TRACE_DIR_DELETE, inode_get_inum(di), entry->inum, 0);
+    memset(entry, 0, sizeof(dirent_t));
+    blocks_dirty(entry, sizeof(dirent_t));
+    dcache_remove(inode_get_inum(di), name);
+    dcache_insert_negative(inode_get_inum(di), name);
+}
+
 /**
  * Delete an entry from a directory.
  *
- * Finds the entry with the given name and clears it.
+ * Finds the entry with the given name and clears it, leaving the name
+ * cached as absent.
  *
  * @param di Pointer to the directory's inode.
  * @param name Name of the entry to delete.
@@ -198,27 +547,181 @@ int directory_put(inode_t *di, const char *name, int inum) {
  * @return 0 on success, -1 if entry not found.
  */
 int directory_delete(inode_t *di, const char *name) {
-    if (di == NULL || name == NULL || strlen(name) == 0) {
+    int slot;
+    if (directory_lookup_slot(di, name, &slot) < 0) {
+        return -1;  // Not found
+    }
+    
+    directory_delete_at(di, slot);
+    return 0;
+}
+
+/**
+ * Point the entry in a slot at another inode.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot of a live entry, from directory_lookup_slot().
+ * @param inum Inode number the name now refers to.
+ */
+void directory_replace_at(inode_t *di, int slot, int inum) {
+    dirent_t *entry = directory_get_entry(di, slot);
+    entry->inum = inum;
+    blocks_dirty(entry, sizeof(dirent_t));
+    
+    // Paths through the name led to the old inode
+    dcache_remove(inode_get_inum(di), entry->name);
+    dcache_insert(inode_get_inum(di), entry->name, inum);
+    TRACE_EVENT(TRACE_DIR_PUT, inode_get_inum(di), inum, slot);
+}
+
+/**
+ * Give the entry in a slot a new name, in place.
+ *
+ * The caller has checked that the directory has no entry by the name.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot of a live entry, from directory_lookup_slot().
+ * @param name New name.
+ *
+ * @return 0 on success, -1 if the name is too long.
+ */
+int directory_rename_at(inode_t *di, int slot, const char *name) {
+    if (strlen(name) == 0 || strlen(name) >= DIR_NAME_LENGTH) {
         return -1;
     }
     
+    dirent_t *entry = directory_get_entry(di, slot);
+    char old_name[DIR_NAME_LENGTH];
+    strcpy(old_name, entry->name);
+    
+    directory_index_remove(di, slot);
+    strcpy(entry->name, name);
+    blocks_dirty(entry, sizeof(dirent_t));
+    
+    dir_index_t *idx = directory_index_root(di);
+    if (idx != NULL) {
+        directory_index_insert(idx, directory_name_hash(entry->name), slot);
+        directory_index_balance(di, idx);
+    }
+    
+    dcache_remove(inode_get_inum(di), old_name);
+    dcache_insert_negative(inode_get_inum(di), old_name);
+    dcache_insert(inode_get_inum(di), name, entry->inum);
+    TRACE_EVENT(TRACE_DIR_PUT, inode_get_inum(di), entry->inum, slot);
+    return 0;
+}
+
+/**
+ * Count the live entries of a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return Number of entries.
+ */
+static int directory_count(inode_t *di) {
+    dir_index_t *idx = directory_index_root(di);
+    if (idx != NULL) {
+        return idx->count;
+    }
+    
+    int count = 0;
+    dir_iter_t it;
+    directory_iter_init(&it, di, 0);
+    while (directory_next(&it)) {
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Check whether a directory has enough empty slots to compact.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return 1 if its live entries would fit in half its blocks, 0 if not.
+ */
+int directory_sparse(inode_t *di) {
+    int blocks = directory_max_entries(di) / DIR_ENTRIES_PER_BLOCK;
+    if (blocks <= 1) {
+        return 0;
+    }
+    
+    int needed = (directory_count(di) + DIR_ENTRIES_PER_BLOCK - 1) / DIR_ENTRIES_PER_BLOCK;
+    return (needed < 1 ? 1 : needed) * 2 <= blocks;
+}
+
+/**
+ * Move the entries of a directory down into its empty slots.
+ *
+ * Fills holes from the lowest up with entries from the highest slots
+ * down, repointing their index buckets, then frees the dirent blocks
+ * left empty at the end. The index is dropped once the directory is
+ * back to one block, and rebuilt smaller if it is oversized.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return Number of blocks released.
+ */
+int directory_compact(inode_t *di) {
+    dir_index_t *idx = directory_index_root(di);
     int max_entries = directory_max_entries(di);
+    int lo = 0;
+    int hi = max_entries - 1;
+    int moved = 0;
     
-    for (int ii = 0; ii < max_entries; ++ii) {
-        dirent_t *entry = directory_get_entry(di, ii);
-        if (entry == NULL) {
+    while (1) {
+        // Lowest hole and highest live entry
+        dirent_t *hole = NULL;
+        while (lo < hi && (hole = directory_get_entry(di, lo))->inum != 0) {
+            lo++;
+        }
+        dirent_t *entry = NULL;
+        while (hi >= 0 && (entry = directory_get_entry(di, hi))->inum == 0) {
+            hi--;
+        }
+        if (lo >= hi) {
             break;
         }
         
-        // Check if this entry matches
-        if (entry->inum != 0 && strcmp(entry->name, name) == 0) {
-            printf("+ directory_delete: removed %s (was -> %d)\n", name, entry->inum);
-            memset(entry, 0, sizeof(dirent_t));
-            return 0;
+        if (idx != NULL) {
+            dir_bucket_t *bucket = directory_index_find(di, idx, entry->name);
+            if (bucket != NULL && bucket->slot == (uint32_t)hi + 1) {
+                bucket->slot = lo + 1;
+                blocks_dirty(bucket, sizeof(dir_bucket_t));
+            }
         }
+        *hole = *entry;
+        memset(entry, 0, sizeof(dirent_t));
+        blocks_dirty(hole, sizeof(dirent_t));
+        blocks_dirty(entry, sizeof(dirent_t));
+        moved++;
+    }
+    
+    // hi is now the highest live slot, -1 if there is none
+    int old_blocks = max_entries / DIR_ENTRIES_PER_BLOCK;
+    int blocks = hi < 0 ? 1 : hi / DIR_ENTRIES_PER_BLOCK + 1;
+    if (blocks < old_blocks) {
+        shrink_inode(di, blocks * BLOCK_SIZE);
     }
     
-    return -1;  // Not found
+    if (idx != NULL && blocks <= 1) {
+        directory_drop_index(di);
+    } else if (idx != NULL) {
+        idx->free_hint = hi + 1;  // Every slot below is live
+        blocks_dirty(idx, sizeof(dir_index_t));
+        
+        // Smallest table that holds the entries below the load limit
+        uint32_t npages = 1;
+        while (npages < idx->npages && (idx->count + 1) * 4 >= npages * DIR_BUCKETS_PER_PAGE * 3) {
+            npages *= 2;
+        }
+        if (npages < idx->npages) {
+            directory_index_build(di, npages);
+        }
+    }
+    
+    TRACE_EVENT(TRACE_DIR_COMPACT, inode_get_inum(di), moved, old_blocks - blocks);
+    return old_blocks > blocks ? old_blocks - blocks : 0;
 }
 
 /**
@@ -247,10 +750,64 @@ void print_directory(inode_t *dd) {
     }
 }
 
+/**
+ * Start iterating over the components of a path.
+ *
+ * @param it Iterator to set up.
+ * @param path Path to walk.
+ */
+void path_iter_init(path_iter_t *it, const char *path) {
+    it->next = path;
+    it->name = path;
+    it->len = 0;
+}
+
+/**
+ * Advance to the next path component.
+ *
+ * @param it Iterator set up by path_iter_init().
+ *
+ * @return 1 if there was another component, 0 at the end of the path.
+ */
+int path_next(path_iter_t *it) {
+    const char *cc = it->next;
+    while (*cc == '/') {
+        cc++;
+    }
+    if (*cc == '\0') {
+        it->next = cc;
+        return 0;
+    }
+    
+    it->name = cc;
+    while (*cc != '/' && *cc != '\0') {
+        cc++;
+    }
+    it->len = cc - it->name;
+    it->next = cc;
+    return 1;
+}
+
+/**
+ * Check whether the current component is the path's last.
+ *
+ * @param it Iterator on a component.
+ *
+ * @return 1 if it is, 0 otherwise.
+ */
+int path_is_last(const path_iter_t *it) {
+    const char *cc = it->next;
+    while (*cc == '/') {
+        cc++;
+    }
+    return *cc == '\0';
+}
+
 /**
  * Extract the filename from a path.
  *
- * Returns a pointer to the last component of the path.
+ * Returns a pointer to the last component of the path, or to the end
+ * of a path with none.
  *
  * @param path Absolute path.
  *
@@ -261,103 +818,139 @@ const char *get_basename(const char *path) {
         return NULL;
     }
     
-    const char *last_slash = strrchr(path, '/');
-    if (last_slash == NULL) {
-        return path;
+    path_iter_t it;
+    path_iter_init(&it, path);
+    const char *base = path + strlen(path);
+    while (path_next(&it)) {
+        base = it.name;
     }
-    
-    return last_slash + 1;
+    return base;
 }
 
 /**
- * Look up a path and return the inode number.
+ * Walk the directory tree from the root along a path.
  *
- * Parses the path and traverses the directory tree from root.
+ * Each component is resolved through the dentry cache before falling
+ * back to a directory scan. A name the scan doesn't find is cached as
+ * absent, so asking again for a path that doesn't exist costs no scan.
+ * Components are looked up from a copy on the stack, so nothing is
+ * allocated.
  *
- * @param path Absolute path starting with '/'.
+ * @param path Absolute path.
+ * @param parent_only Nonzero to stop before the last component.
  *
- * @return Inode number if found, -1 if not found.
+ * @return Inode number reached, or -1 if a component is missing or
+ *         isn't a directory.
  */
-int tree_lookup(const char *path) {
-    if (path == NULL || path[0] != '/') {
-        return -1;
-    }
-    
-    // Root directory
-    if (strcmp(path, "/") == 0) {
-        return 0;
-    }
-    
-    // Split path into components
-    slist_t *components = slist_explode(path + 1, '/');  // Skip leading '/'
-    
+static int tree_walk(const char *path, int parent_only) {
     int current_inum = 0;  // Start at root
+    char name[DIR_NAME_LENGTH];
     
-    for (slist_t *curr = components; curr != NULL; curr = curr->next) {
-        // Skip empty components 
-        if (strlen(curr->data) == 0) {
-            continue;
+    path_iter_t it;
+    path_iter_init(&it, path);
+    while (path_next(&it)) {
+        if (parent_only && path_is_last(&it)) {
+            break;
+        }
+        if (it.len >= DIR_NAME_LENGTH) {
+            return -1;  // No entry has a name this long
         }
+        memcpy(name, it.name, it.len);
+        name[it.len] = '\0';
         
         inode_t *current_dir = get_inode(current_inum);
         if (current_dir == NULL) {
-            slist_free(components);
             return -1;
         }
         
+        // Hold the directory shared while reading it, so the entry can't
+        // be removed between the scan and caching it
+        inode_rdlock(current_inum);
+        
         // Make sure current node is a directory
         if ((current_dir->mode & 0040000) == 0) {
-            slist_free(components);
+            inode_unlock(current_inum);
             return -1;  // Not a directory
         }
         
         // Look up the next component
-        int next_inum = directory_lookup(current_dir, curr->data);
+        int next_inum = dcache_lookup(current_inum, name);
+        if (next_inum == DCACHE_NEGATIVE) {
+            STATS_ADD(STATS_DIR_NEGATIVE, 1);
+            inode_unlock(current_inum);
+            return -1;  // Known not to exist
+        }
         if (next_inum < 0) {
-            slist_free(components);
-            return -1;  // Not found
+            next_inum = directory_lookup(current_dir, name);
+            if (next_inum < 0) {
+                dcache_insert_negative(current_inum, name);
+                inode_unlock(current_inum);
+                return -1;  // Not found
+            }
+            dcache_insert(current_inum, name, next_inum);
         }
         
+        inode_unlock(current_inum);
         current_inum = next_inum;
+        STATS_ADD(STATS_PATH_COMPONENTS, 1);
     }
     
-    slist_free(components);
     return current_inum;
 }
 
 /**
- * Get the parent directory's inode number for a path.
+ * Look up a path and return the inode number.
  *
- * Traverses to the parent directory of the given path.
+ * The full-path cache is consulted first, then the tree is walked with
+ * tree_walk().
  *
- * @param path Absolute path to a file or directory.
+ * @param path Absolute path starting with '/'.
  *
- * @return Inode number of the parent directory, or -1 if not found.
+ * @return Inode number if found, -1 if not found.
  */
-int tree_lookup_parent(const char *path) {
+int tree_lookup(const char *path) {
     if (path == NULL || path[0] != '/') {
         return -1;
     }
     
-    // Root's parent is itself, otherwise invalid
+    STATS_ADD(STATS_PATH_LOOKUPS, 1);
+    
+    // Root directory
     if (strcmp(path, "/") == 0) {
         return 0;
     }
     
-    // Find the last slash
-    const char *last_slash = strrchr(path, '/');
-    if (last_slash == path) {
-        // Path is like "/foo", parent is root
-        return 0;
+    int cached = dcache_path_lookup(path);
+    if (cached >= 0) {
+        STATS_ADD(STATS_PATH_CACHED, 1);
+        return cached;
     }
+    unsigned gen = dcache_path_gen();
     
-    // Create parent path
-    int parent_len = last_slash - path;
-    char parent_path[parent_len + 1];
-    strncpy(parent_path, path, parent_len);
-    parent_path[parent_len] = '\0';
+    int inum = tree_walk(path, 0);
+    if (inum >= 0) {
+        dcache_path_insert(path, inum, gen);
+    }
+    return inum;
+}
+
+/**
+ * Get the parent directory's inode number for a path.
+ *
+ * Walks the path in place up to its last component, without copying
+ * out the parent's path.
+ *
+ * @param path Absolute path to a file or directory.
+ *
+ * @return Inode number of the parent directory, or -1 if not found.
+ */
+int tree_lookup_parent(const char *path) {
+    if (path == NULL || path[0] != '/') {
+        return -1;
+    }
     
-    return tree_lookup(parent_path);
+    STATS_ADD(STATS_PATH_LOOKUPS, 1);
+    return tree_walk(path, 1);
 }
 
 /**
@@ -387,19 +980,74 @@ slist_t *directory_list(const char *path) {
     }
     
     slist_t *result = NULL;
-    int max_entries = directory_max_entries(dir);
+    inode_rdlock(dir_inum);
+    dir_iter_t it;
+    directory_iter_init(&it, dir, 0);
+    while (directory_next(&it)) {
+        result = slist_cons(it.name, result);
+    }
+    inode_unlock(dir_inum);
     
-    for (int ii = 0; ii < max_entries; ++ii) {
-        dirent_t *entry = directory_get_entry(dir, ii);
-        if (entry == NULL) {
-            break;
+    return result;
+}
+
+/**
+ * Start iterating over a directory.
+ *
+ * @param it Iterator to set up.
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot to start from, 0 for the beginning.
+ */
+void directory_iter_init(dir_iter_t *it, inode_t *di, int slot) {
+    it->dir = di;
+    it->slot = slot < 0 ? 0 : slot;
+    it->max = directory_max_entries(di);
+    it->block = NULL;
+    it->name = NULL;
+    it->inum = -1;
+    it->node = NULL;
+}
+
+/**
+ * Advance to the next live entry.
+ *
+ * @param it Iterator set up by directory_iter_init().
+ *
+ * @return 1 if an entry was found, 0 at the end of the directory.
+ */
+int directory_next(dir_iter_t *it) {
+    while (it->slot < it->max) {
+        // Map each dirent block once, on reaching its first slot
+        int in_block = it->slot % DIR_ENTRIES_PER_BLOCK;
+        if (it->block == NULL || in_block == 0) {
+            it->block = directory_get_entry(it->dir, it->slot - in_block);
+            if (it->block == NULL) {
+                return 0;
+            }
         }
         
+        dirent_t *entry = &it->block[in_block];
+        it->slot++;
         if (entry->inum != 0 && entry->name[0] != '\0') {
-            result = slist_cons(entry->name, result);
+            it->name = entry->name;
+            it->inum = entry->inum;
+            it->node = get_inode(entry->inum);
+            return 1;
         }
     }
-    
-    return result;
+    return 0;
+}
+
+/**
+ * Check whether a directory has no entries.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return 1 if empty, 0 otherwise.
+ */
+int directory_empty(inode_t *di) {
+    dir_iter_t it;
+    directory_iter_init(&it, di, 0);
+    return !directory_next(&it);
 }
 
@@ -10,10 +10,13 @@
  * Filenames can be up to 47 characters 
  * Inode 0 is always the root directory
  * Empty directory slots have inum = 0 and empty name
+ * Directories larger than one block get a hash index (see dir_index_t)
  */
 #ifndef DIRECTORY_H
 #define DIRECTORY_H
 
+#include <stdint.h>
+
 #include "inode.h"
 #include "helpers/slist.h"
 
@@ -40,6 +43,111 @@ typedef struct dirent {
 // Number of directory entries per block 
 #define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dirent_t))
 
+// Marks the root block of a directory hash index ("INDX")
+#define DIR_INDEX_MAGIC 0x58444e49
+
+// Bucket slot value for a deleted entry
+#define DIR_BUCKET_TOMB 0xffffffffu
+
+/**
+ * Hash index bucket.
+ *
+ * Fields:
+ * - hash: Name hash of the entry
+ * - slot: Dirent index + 1, 0 if the bucket is empty, DIR_BUCKET_TOMB if
+ *         the entry was deleted
+ */
+typedef struct dir_bucket {
+    uint32_t hash;
+    uint32_t slot;
+} dir_bucket_t;
+
+/**
+ * Directory hash index root block.
+ *
+ * Stored in the block named by the directory inode's index field. The
+ * index is an open-addressed hash table of dir_bucket_t spread across
+ * npages bucket blocks, kept alongside the existing dirent blocks. It
+ * never holds names itself, so a bucket hit is confirmed against the
+ * dirent it points at.
+ *
+ * Fields:
+ * - magic: DIR_INDEX_MAGIC
+ * - npages: Number of bucket pages (a power of two)
+ * - count: Live entries in the table
+ * - used: Live plus deleted buckets, used to decide when to rehash
+ * - free_hint: Lowest dirent slot that may be empty
+ * - pages: Block numbers of the bucket pages
+ */
+typedef struct dir_index {
+    uint32_t magic;
+    uint32_t npages;
+    uint32_t count;
+    uint32_t used;
+    uint32_t free_hint;
+    uint32_t _reserved[3];
+    int pages[];
+} dir_index_t;
+
+// Number of buckets per bucket page
+#define DIR_BUCKETS_PER_PAGE (BLOCK_SIZE / sizeof(dir_bucket_t))
+
+// Upper bound on bucket pages, the largest power of two that fits the root
+#define DIR_INDEX_MAX_PAGES 512
+
+/**
+ * Single-pass directory iterator.
+ *
+ * Walks a directory's dirent blocks in slot order, mapping each block
+ * once. Slot numbers are stable while an entry exists, so a listing can
+ * stop and later resume from the slot after the last entry it returned,
+ * as long as directory_compact() doesn't run in between.
+ *
+ * Fields:
+ * - dir: Directory being listed
+ * - slot: Next slot to examine; after directory_next(), the one after
+ *         the current entry
+ * - max: Number of slots the directory had when the walk started
+ * - block: Dirents of the block holding slot, NULL until mapped
+ * - name, inum, node: Current entry
+ */
+typedef struct dir_iter {
+    inode_t *dir;
+    int slot;
+    int max;
+    dirent_t *block;
+    const char *name;
+    int inum;
+    inode_t *node;
+} dir_iter_t;
+
+/**
+ * Iterator over the components of a path, in place.
+ *
+ * Never allocates or copies: each component is handed out as a pointer
+ * into the path and a length. Runs of slashes separate components, and
+ * leading and trailing slashes are ignored.
+ *
+ * Fields:
+ * - next: Rest of the path after the current component
+ * - name: Current component, not null-terminated
+ * - len: Length of the current component
+ */
+typedef struct path_iter {
+    const char *next;
+    const char *name;
+    int len;
+} path_iter_t;
+
+/**
+ * Calculate the number of entry slots a directory has.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return Number of dirent slots backed by the directory's blocks.
+ */
+int directory_max_entries(inode_t *di);
+
 /**
  * Initialize the root directory.
  *
@@ -60,6 +168,20 @@ void directory_init();
  */
 int directory_lookup(inode_t *di, const char *name);
 
+/**
+ * Look up a name in a directory, reporting the slot it's in.
+ *
+ * The slot stays the entry's while the caller holds the directory's
+ * lock, for the _at functions below.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param name Name to search for.
+ * @param slot Receives the entry's slot if found.
+ *
+ * @return Inode number if found, -1 if not found.
+ */
+int directory_lookup_slot(inode_t *di, const char *name, int *slot);
+
 /**
  * Add an entry to a directory.
  *
@@ -84,6 +206,85 @@ int directory_put(inode_t *di, const char *name, int inum);
  */
 int directory_delete(inode_t *di, const char *name);
 
+/**
+ * Delete the entry in a slot from a directory.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot of a live entry, from directory_lookup_slot().
+ */
+void directory_delete_at(inode_t *di, int slot);
+
+/**
+ * Point the entry in a slot at another inode, keeping its name.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot of a live entry, from directory_lookup_slot().
+ * @param inum Inode number the name now refers to.
+ */
+void directory_replace_at(inode_t *di, int slot, int inum);
+
+/**
+ * Give the entry in a slot a new name, in place.
+ *
+ * The directory must have no entry by the new name.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot of a live entry, from directory_lookup_slot().
+ * @param name New name.
+ *
+ * @return 0 on success, -1 if the name is empty or too long.
+ */
+int directory_rename_at(inode_t *di, int slot, const char *name);
+
+/**
+ * Check whether a directory has enough empty slots to compact.
+ *
+ * True once the directory spans more than one block and its live
+ * entries would fit in half of them.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return 1 if it does, 0 if not.
+ */
+int directory_sparse(inode_t *di);
+
+/**
+ * Pack a directory's entries into its lowest slots and free the rest.
+ *
+ * Moves entries to other slots, so a listing resuming from a slot taken
+ * before the compaction can miss or repeat entries; callers only compact
+ * directories nobody is listing. Names keep their inode numbers, so the
+ * dentry and path caches stay valid.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return Number of dirent blocks released.
+ */
+int directory_compact(inode_t *di);
+
+/**
+ * Release a directory's hash index.
+ *
+ * Frees the index root and bucket pages and clears the inode's index
+ * field. Dirent blocks are untouched, so lookups fall back to a scan.
+ *
+ * @param di Pointer to the directory's inode.
+ */
+void directory_drop_index(inode_t *di);
+
+/**
+ * Write a directory's inode, dirent blocks and hash index back to disk.
+ *
+ * Does nothing on a journaled image (see blocks_sync()). The caller
+ * holds the directory's lock.
+ *
+ * @param di Pointer to the directory's inode.
+ * @param wait Nonzero to wait for the writes, 0 to only start them.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+int directory_sync(inode_t *di, int wait);
+
 /**
  * List all entries in a directory.
  *
@@ -96,6 +297,38 @@ int directory_delete(inode_t *di, const char *name);
  */
 slist_t *directory_list(const char *path);
 
+/**
+ * Start iterating over a directory.
+ *
+ * The caller holds the directory's lock for as long as it uses the
+ * iterator, or at least while calling directory_next() and reading the
+ * current entry's name.
+ *
+ * @param it Iterator to set up.
+ * @param di Pointer to the directory's inode.
+ * @param slot Slot to start from, 0 for the beginning.
+ */
+void directory_iter_init(dir_iter_t *it, inode_t *di, int slot);
+
+/**
+ * Advance to the next live entry.
+ *
+ * @param it Iterator set up by directory_iter_init().
+ *
+ * @return 1 with it->name, it->inum and it->node set to the entry, or 0
+ *         once the directory is exhausted.
+ */
+int directory_next(dir_iter_t *it);
+
+/**
+ * Check whether a directory has no entries.
+ *
+ * @param di Pointer to the directory's inode.
+ *
+ * @return 1 if empty, 0 otherwise.
+ */
+int directory_empty(inode_t *di);
+
 /**
  * Print directory contents for debugging.
  *
@@ -103,6 +336,33 @@ slist_t *directory_list(const char *path);
  */
 void print_directory(inode_t *dd);
 
+/**
+ * Start iterating over the components of a path.
+ *
+ * @param it Iterator to set up.
+ * @param path Path to walk, which must outlive the iterator.
+ */
+void path_iter_init(path_iter_t *it, const char *path);
+
+/**
+ * Advance to the next path component.
+ *
+ * @param it Iterator set up by path_iter_init().
+ *
+ * @return 1 with it->name and it->len set to the component, or 0 once
+ *         the path is exhausted.
+ */
+int path_next(path_iter_t *it);
+
+/**
+ * Check whether the current component is the path's last.
+ *
+ * @param it Iterator on a component.
+ *
+ * @return 1 if nothing but slashes follows it, 0 otherwise.
+ */
+int path_is_last(const path_iter_t *it);
+
 /**
  * Look up a path and return the inode number.
  *
@@ -128,7 +388,8 @@ int tree_lookup_parent(const char *path);
  * Extract the filename from a path.
  *
  * Returns a pointer to the last component of the path.
- * The returned pointer points into the original path string.
+ * The returned pointer points into the original path string, which
+ * shouldn't end in a slash, so that the component is null-terminated.
  *
  * @param path Absolute path.
  *
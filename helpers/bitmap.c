@@ -4,8 +4,16 @@
  *
  * Bitmap implementation.
  */
+#include <endian.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "bitmap.h"
 
@@ -13,6 +21,9 @@
 #define byte_index(n) ((n) / 8)
 #define bit_index(n) ((n) % 8)
 
+// Word w covers bits [64 * w, 64 * w + 64).
+#define word_index(n) ((n) / 64)
+
 // Get the given bit from the bitmap.
 int bitmap_get(void *bm, int i) {
   uint8_t *base = (uint8_t *) bm;
@@ -47,3 +58,163 @@ void bitmap_print(void *bm, int size) {
     }
   }
 }
+
+// Load 64-bit word w of a bitmap that is nbytes long, so that bit i of the
+// result is bit 64 * w + i of the bitmap. Bytes past the end read as 0.
+static uint64_t load_word(const uint8_t *base, int w, int nbytes) {
+  uint64_t word = 0;
+  int len = nbytes - w * 8;
+
+  memcpy(&word, base + w * 8, len < 8 ? len : 8);
+  return le64toh(word);
+}
+
+// Skip whole words equal to fill (all zeros or all ones), starting at
+// word w. Never reads or skips past word last, which the caller masks.
+// Returns the first word that may differ.
+static int skip_words(const uint8_t *base, int w, int last, uint64_t fill) {
+#if defined(__AVX2__)
+  const __m256i pattern = _mm256_set1_epi64x((long long) fill);
+  while (w + 4 <= last) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (base + w * 8));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern)) != -1) {
+      break;
+    }
+    w += 4;
+  }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const uint8x16_t pattern = vdupq_n_u8((uint8_t) fill);
+  while (w + 2 <= last) {
+    uint8x16_t v = vld1q_u8(base + w * 8);
+    if (vminvq_u8(vceqq_u8(v, pattern)) != 0xff) {
+      break;
+    }
+    w += 2;
+  }
+#endif
+
+  while (w < last && load_word(base, w, 8 * (w + 1)) == fill) {
+    ++w;
+  }
+  return w;
+}
+
+// Count the set bits in whole words [*w, last), advancing *w. Leaves at
+// least the last word for the caller so it can mask the tail.
+static int count_words(const uint8_t *base, int *w, int last) {
+  int count = 0;
+
+#if defined(__AVX2__)
+  // Per-nibble popcount lookup, summed per 64-bit lane
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low = _mm256_set1_epi8(0x0f);
+  __m256i acc = _mm256_setzero_si256();
+  while (*w + 4 <= last) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (base + *w * 8));
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    *w += 4;
+  }
+  count += _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+           _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  while (*w + 2 <= last) {
+    count += vaddlvq_u8(vcntq_u8(vld1q_u8(base + *w * 8)));
+    *w += 2;
+  }
+#endif
+
+  while (*w < last) {
+    count += __builtin_popcountll(load_word(base, *w, 8 * (*w + 1)));
+    ++*w;
+  }
+  return count;
+}
+
+// Find the first bit in [from, to) equal to v.
+static int find_bit(const uint8_t *base, int from, int to, int v) {
+  if (from < 0) {
+    from = 0;
+  }
+  if (from >= to) {
+    return -1;
+  }
+
+  int nbytes = byte_index(to - 1) + 1;
+  int w = word_index(from);
+  int last = word_index(to - 1);
+
+  // flip so that the bits we look for are ones, and drop those below from
+  uint64_t flip = v ? 0 : ~0ULL;
+  uint64_t word = (load_word(base, w, nbytes) ^ flip) & (~0ULL << (from % 64));
+
+  while (word == 0) {
+    if (w == last) {
+      return -1;
+    }
+    w = skip_words(base, w + 1, last, flip);
+    word = load_word(base, w, nbytes) ^ flip;
+  }
+
+  int bit = w * 64 + __builtin_ctzll(word);
+  return bit < to ? bit : -1;
+}
+
+// Find the first zero bit in [from, to).
+int bitmap_find_zero(void *bm, int from, int to) {
+  return find_bit((const uint8_t *) bm, from, to, 0);
+}
+
+// Find the start of the first run of n zero bits in [from, to).
+int bitmap_find_zero_run(void *bm, int from, int to, int n) {
+  const uint8_t *base = (const uint8_t *) bm;
+
+  int start = find_bit(base, from, to, 0);
+  while (start >= 0) {
+    // the run ends at the next set bit
+    int end = find_bit(base, start, to, 1);
+    if (end < 0) {
+      end = to;
+    }
+    if (end - start >= n) {
+      return start;
+    }
+    start = find_bit(base, end, to, 0);
+  }
+
+  return -1;
+}
+
+// Count the set bits in [from, to).
+int bitmap_count(void *bm, int from, int to) {
+  const uint8_t *base = (const uint8_t *) bm;
+
+  if (from < 0) {
+    from = 0;
+  }
+  if (from >= to) {
+    return 0;
+  }
+
+  int nbytes = byte_index(to - 1) + 1;
+  int w = word_index(from);
+  int last = word_index(to - 1);
+
+  uint64_t word = load_word(base, w, nbytes) & (~0ULL << (from % 64));
+  int count = 0;
+  while (w < last) {
+    count += __builtin_popcountll(word);
+    ++w;
+    count += count_words(base, &w, last);
+    word = load_word(base, w, nbytes);
+  }
+
+  // drop the bits at and past to
+  int tail = to - last * 64;
+  if (tail < 64) {
+    word &= (1ULL << tail) - 1;
+  }
+  return count + __builtin_popcountll(word);
+}
@@ -34,4 +34,41 @@ void bitmap_put(void *bm, int i, int v);
  */
 void bitmap_print(void *bm, int size);
 
+/**
+ * Find the first zero bit in a range of the bitmap.
+ *
+ * Scans 64 bits at a time, and 256 (AVX2) or 128 (NEON) bits at a time
+ * over runs of full words when built with those extensions.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param from First bit index to consider.
+ * @param to One past the last bit index to consider.
+ *
+ * @return Index of the first zero bit in [from, to), or -1 if none.
+ */
+int bitmap_find_zero(void *bm, int from, int to);
+
+/**
+ * Find the first run of n consecutive zero bits in a range of the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param from First bit index to consider.
+ * @param to One past the last bit index to consider.
+ * @param n Length of the run wanted.
+ *
+ * @return Index of the first bit of the run, or -1 if none fits.
+ */
+int bitmap_find_zero_run(void *bm, int from, int to, int n);
+
+/**
+ * Count the set bits in a range of the bitmap.
+ *
+ * @param bm Pointer to the start of the bitmap.
+ * @param from First bit index to count.
+ * @param to One past the last bit index to count.
+ *
+ * @return Number of ones in [from, to); the zeros are (to - from) minus this.
+ */
+int bitmap_count(void *bm, int from, int to);
+
 #endif
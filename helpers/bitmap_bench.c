@@ -0,0 +1,139 @@
+/**
+ * @file bitmap_bench.c
+ *
+ * Micro-benchmark for the bitmap search kernels.
+ *
+ * Compares bitmap_find_zero, bitmap_find_zero_run and bitmap_count against
+ * bit-at-a-time loops over bitmap_get, and checks that both agree. Build
+ * with -O2 (add -mavx2 or -march=native for the vector paths):
+ *
+ *   gcc -O2 -o bitmap_bench bitmap_bench.c bitmap.c
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bitmap.h"
+
+#define ROUNDS 200
+
+// Wall-clock time in nanoseconds.
+static double now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Bit-at-a-time reference for bitmap_find_zero.
+static int naive_find_zero(void *bm, int from, int to) {
+  for (int ii = from; ii < to; ++ii) {
+    if (!bitmap_get(bm, ii)) {
+      return ii;
+    }
+  }
+  return -1;
+}
+
+// Bit-at-a-time reference for bitmap_find_zero_run.
+static int naive_find_zero_run(void *bm, int from, int to, int n) {
+  int len = 0;
+  for (int ii = from; ii < to; ++ii) {
+    len = bitmap_get(bm, ii) ? 0 : len + 1;
+    if (len == n) {
+      return ii - n + 1;
+    }
+  }
+  return -1;
+}
+
+// Bit-at-a-time reference for bitmap_count.
+static int naive_count(void *bm, int from, int to) {
+  int count = 0;
+  for (int ii = from; ii < to; ++ii) {
+    count += bitmap_get(bm, ii);
+  }
+  return count;
+}
+
+// Fill a bitmap of the given size: all ones except for a free tail, with
+// one free bit in every 4096 so searches have to look at every word.
+static void fill(uint8_t *bm, int bits) {
+  for (int ii = 0; ii < bits; ++ii) {
+    bitmap_put(bm, ii, ii >= bits - 64 || ii % 4096 == 4095 ? 0 : 1);
+  }
+}
+
+// Check the kernels against the references on random bitmaps and ranges.
+static int check(int trials) {
+  uint8_t bm[256];
+  int bad = 0;
+
+  for (int tt = 0; tt < trials; ++tt) {
+    int density = rand() % 100;
+    for (int ii = 0; ii < 2048; ++ii) {
+      bitmap_put(bm, ii, rand() % 100 < density);
+    }
+
+    int from = rand() % 2048;
+    int to = from + rand() % (2049 - from);
+    int n = 1 + rand() % 80;
+
+    bad += bitmap_find_zero(bm, from, to) != naive_find_zero(bm, from, to);
+    bad += bitmap_find_zero_run(bm, from, to, n) != naive_find_zero_run(bm, from, to, n);
+    bad += bitmap_count(bm, from, to) != naive_count(bm, from, to);
+  }
+
+  return bad;
+}
+
+int main(int argc, char **argv) {
+  int bad = check(20000);
+  printf("check: %s\n", bad ? "FAILED" : "ok");
+
+  printf("%10s %12s %12s %12s %12s %12s %12s\n", "bits", "zero(bit)",
+         "zero(word)", "run(bit)", "run(word)", "count(bit)", "count(word)");
+
+  for (int bits = 256; bits <= (1 << 22); bits *= 8) {
+    uint8_t *bm = calloc(bits / 8, 1);
+    fill(bm, bits);
+
+    double t[6];
+    volatile int sink = 0;
+
+    double start = now_ns();
+    for (int rr = 0; rr < ROUNDS; ++rr) sink += naive_find_zero(bm, rr % 64, bits);
+    t[0] = now_ns() - start;
+
+    start = now_ns();
+    for (int rr = 0; rr < ROUNDS; ++rr) sink += bitmap_find_zero(bm, rr % 64, bits);
+    t[1] = now_ns() - start;
+
+    start = now_ns();
+    for (int rr = 0; rr < ROUNDS; ++rr) sink += naive_find_zero_run(bm, 0, bits, 32);
+    t[2] = now_ns() - start;
+
+    start = now_ns();
+    for (int rr = 0; rr < ROUNDS; ++rr) sink += bitmap_find_zero_run(bm, 0, bits, 32);
+    t[3] = now_ns() - start;
+
+    start = now_ns();
+    for (int rr = 0; rr < ROUNDS; ++rr) sink += naive_count(bm, 0, bits);
+    t[4] = now_ns() - start;
+
+    start = now_ns();
+    for (int rr = 0; rr < ROUNDS; ++rr) sink += bitmap_count(bm, 0, bits);
+    t[5] = now_ns() - start;
+
+    // nanoseconds per call
+    printf("%10d", bits);
+    for (int ii = 0; ii < 6; ++ii) {
+      printf(" %12.0f", t[ii] / ROUNDS);
+    }
+    printf("\n");
+
+    free(bm);
+  }
+
+  return bad != 0;
+}
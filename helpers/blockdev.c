@@ -0,0 +1,335 @@
+/**
+ * @file blockdev.c
+ *
+ * Implementation of the block backends and batched transfers.
+ *
+ * io_uring is driven through its system calls, without liburing. One
+ * ring is shared by all threads; a batch holds it while it's submitted
+ * and reaped, so batches don't interleave. A process that forks gets a
+ * ring of its own the next time it submits.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#define HAVE_URING 1
+#include <linux/io_uring.h>
+#endif
+
+#include "blockdev.h"
+
+// Map the image file into memory.
+static void *mmap_attach(int fd, size_t size, int private) {
+  void *base = mmap(0, size, PROT_READ | PROT_WRITE, private ? MAP_PRIVATE : MAP_SHARED,
+                    fd, 0);
+  return base == MAP_FAILED ? NULL : base;
+}
+
+// Reserve anonymous memory for a buffer cache. Pages are only backed
+// once a block is read into them.
+static void *cache_attach(int fd, size_t size, int private) {
+  void *base = mmap(0, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return base == MAP_FAILED ? NULL : base;
+}
+
+// Release memory from either attach function.
+static void unmap_detach(void *base, size_t size) { munmap(base, size); }
+
+// Have the kernel fault in part of a mapped image ahead of use.
+static void mmap_prefetch(int fd, void *base, off_t off, size_t len) {
+  long page = sysconf(_SC_PAGESIZE);
+  off_t start = off & ~(off_t) (page - 1);
+  madvise((char *) base + start, len + (off - start), MADV_WILLNEED);
+}
+
+// Have the kernel read part of the image into its page cache, so that
+// loading it into the buffer cache later is a copy.
+static void cache_prefetch(int fd, void *base, off_t off, size_t len) {
+  posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+}
+
+// O_DIRECT transfers skip the page cache, so the direct backend has no
+// prefetch of its own
+const blockdev_t blockdev_mmap = {"mmap", 0, 0, mmap_attach, unmap_detach, mmap_prefetch};
+const blockdev_t blockdev_cache = {"cache", 0, 1, cache_attach, unmap_detach, cache_prefetch};
+const blockdev_t blockdev_direct = {"direct", O_DIRECT, 1, cache_attach, unmap_detach, NULL};
+
+// Get the backend named in NUFS_BACKEND.
+const blockdev_t *blockdev_from_env() {
+  static const blockdev_t *const backends[] = {&blockdev_mmap, &blockdev_cache,
+                                               &blockdev_direct};
+
+  const char *name = getenv("NUFS_BACKEND");
+  if (name == NULL || *name == '\0') {
+    return &blockdev_mmap;
+  }
+  for (size_t ii = 0; ii < sizeof(backends) / sizeof(backends[0]); ++ii) {
+    if (strcmp(name, backends[ii]->name) == 0) {
+      return backends[ii];
+    }
+  }
+
+  fprintf(stderr, "blockdev: unknown backend %s, using mmap\n", name);
+  return &blockdev_mmap;
+}
+
+// Allocate a zeroed buffer that any backend can transfer.
+void *blockdev_buffer(size_t len) {
+  void *buf = NULL;
+  if (posix_memalign(&buf, BLOCKDEV_ALIGN, len) != 0) {
+    return NULL;
+  }
+  memset(buf, 0, len);
+  return buf;
+}
+
+// Finish one transfer with pread or pwrite, starting done bytes in.
+// Reading past the end of the image gives zeros.
+static int rw_sync(int fd, blockdev_io_t *io, size_t done, int write) {
+  while (done < io->len) {
+    char *buf = (char *) io->buf + done;
+    ssize_t got = write ? pwrite(fd, buf, io->len - done, io->off + done)
+                        : pread(fd, buf, io->len - done, io->off + done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0 || (got == 0 && write)) {
+      return -1;
+    }
+    if (got == 0) {
+      memset(buf, 0, io->len - done);
+      break;
+    }
+    done += got;
+  }
+  return 0;
+}
+
+#ifdef HAVE_URING
+
+// The shared submission and completion rings
+typedef struct ring {
+  int fd;
+  pid_t pid;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len, sqes_len;
+} ring_t;
+
+static ring_t ring = {.fd = -1};
+
+// 1 if the ring is set up for this process, -1 if io_uring is off or
+// unavailable, 0 until the first batch finds out
+static int ring_state = 0;
+
+// Guards the ring, held for a whole batch
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Drop a ring, such as one inherited from the parent process.
+static void ring_teardown() {
+  if (ring.sqes != NULL) {
+    munmap(ring.sqes, ring.sqes_len);
+  }
+  if (ring.cq_ptr != NULL && ring.cq_ptr != ring.sq_ptr) {
+    munmap(ring.cq_ptr, ring.cq_len);
+  }
+  if (ring.sq_ptr != NULL) {
+    munmap(ring.sq_ptr, ring.sq_len);
+  }
+  if (ring.fd >= 0) {
+    close(ring.fd);
+  }
+  memset(&ring, 0, sizeof(ring));
+  ring.fd = -1;
+}
+
+// Set up a ring for this process. Returns 0 on success.
+static int ring_setup() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, BLOCKDEV_BATCH, &params);
+  if (fd < 0) {
+    return -1;
+  }
+
+  ring.fd = fd;
+  ring.pid = getpid();
+  ring.sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring.cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  // newer kernels map both rings with one call
+  int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single && ring.cq_len > ring.sq_len) {
+    ring.sq_len = ring.cq_len;
+  }
+  ring.sq_ptr = mmap(0, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQ_RING);
+  if (ring.sq_ptr == MAP_FAILED) {
+    ring.sq_ptr = NULL;
+    return -1;
+  }
+  if (single) {
+    ring.cq_ptr = ring.sq_ptr;
+  } else {
+    ring.cq_ptr = mmap(0, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_CQ_RING);
+    if (ring.cq_ptr == MAP_FAILED) {
+      ring.cq_ptr = NULL;
+      return -1;
+    }
+  }
+  ring.sqes = mmap(0, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    ring.sqes = NULL;
+    return -1;
+  }
+
+  char *sq = ring.sq_ptr;
+  char *cq = ring.cq_ptr;
+  ring.sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring.cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return 0;
+}
+
+// Make the ring usable from this process. Returns 0 if it is. The caller
+// holds ring_lock.
+static int ring_ready() {
+  if (ring_state == 0) {
+    const char *env = getenv("NUFS_URING");
+    ring_state = env != NULL && strcmp(env, "0") == 0 ? -1 : 1;
+  }
+  if (ring_state < 0) {
+    return -1;
+  }
+  if (ring.fd >= 0 && ring.pid == getpid()) {
+    return 0;
+  }
+
+  ring_teardown();
+  if (ring_setup() != 0) {
+    ring_teardown();
+    ring_state = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// Queue up to BLOCKDEV_BATCH transfers, wait for all of them and finish
+// any that came back short. Returns the number done, or -1 on an I/O
+// error. The caller holds ring_lock.
+static int ring_batch(int fd, blockdev_io_t *ios, int count, int write) {
+  struct iovec iov[BLOCKDEV_BATCH];
+  ssize_t res[BLOCKDEV_BATCH];
+  if (count > BLOCKDEV_BATCH) {
+    count = BLOCKDEV_BATCH;
+  }
+
+  unsigned tail = *ring.sq_tail;
+  unsigned mask = *ring.sq_mask;
+  for (int ii = 0; ii < count; ++ii) {
+    unsigned idx = tail & mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    iov[ii].iov_base = ios[ii].buf;
+    iov[ii].iov_len = ios[ii].len;
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) &iov[ii];
+    sqe->len = 1;
+    sqe->off = ios[ii].off;
+    sqe->user_data = ii;
+    ring.sq_array[idx] = idx;
+    res[ii] = -1;
+    tail++;
+  }
+  __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+  // one call submits the batch and waits for it; interrupted waits resume
+  int submit = count;
+  int left = count;
+  while (left > 0) {
+    int rv = syscall(__NR_io_uring_enter, ring.fd, submit, left, IORING_ENTER_GETEVENTS,
+                     NULL, 0);
+    if (rv < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      // the ring is in an unknown state; stop using it and let the
+      // caller redo the batch synchronously
+      ring_teardown();
+      ring_state = -1;
+      return 0;
+    }
+    if (rv > 0) {
+      submit -= rv;
+    }
+
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      if (cqe->user_data < (uint64_t) count) {
+        res[cqe->user_data] = cqe->res;
+        left--;
+      }
+      head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  // short or failed transfers are finished synchronously, which also
+  // reports their real error
+  int rv = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    if (res[ii] < (ssize_t) ios[ii].len) {
+      rv |= rw_sync(fd, &ios[ii], res[ii] > 0 ? res[ii] : 0, write);
+    }
+  }
+  return rv == 0 ? count : -1;
+}
+
+#endif
+
+// Read or write a batch of transfers and wait for all of them.
+int blockdev_rw(int fd, blockdev_io_t *ios, int count, int write) {
+  int rv = 0;
+
+#ifdef HAVE_URING
+  // a single transfer gains nothing from the ring
+  if (count > 1) {
+    pthread_mutex_lock(&ring_lock);
+    while (count > 0 && ring_ready() == 0) {
+      int done = ring_batch(fd, ios, count, write);
+      if (done < 0) {
+        pthread_mutex_unlock(&ring_lock);
+        return -1;
+      }
+      ios += done;
+      count -= done;
+    }
+    pthread_mutex_unlock(&ring_lock);
+  }
+#endif
+
+  for (int ii = 0; ii < count; ++ii) {
+    rv |= rw_sync(fd, &ios[ii], 0, write);
+  }
+  return rv;
+}
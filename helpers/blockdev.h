@@ -0,0 +1,113 @@
+/**
+ * @file blockdev.h
+ *
+ * Backends that move blocks between a disk image and memory.
+ *
+ * The block layer keeps the whole image addressable in memory and hands
+ * out pointers into it. A backend decides what that memory is:
+ *
+ * mmap: the image file itself, mapped (the default). The page cache does
+ *       all reading and writing.
+ * cache: a private buffer cache. Blocks are read in with pread the first
+ *        time they're used and written back with pwrite, only when the
+ *        journal or an fsync says so.
+ * direct: the buffer cache, with the image opened O_DIRECT so that
+ *         transfers skip the page cache. Meant for NVMe drives and raw
+ *         block devices that the buffer cache already covers.
+ *
+ * Transfers are issued in batches. Where the kernel has io_uring, a
+ * whole batch is queued with one system call and waited for with the
+ * same call; otherwise each transfer is its own pread or pwrite.
+ *
+ * The backend is picked from the environment when an image is mounted:
+ *
+ * NUFS_BACKEND=mmap|cache|direct (default: mmap)
+ * NUFS_URING=0 turns io_uring off
+ *
+ * Assumptions:
+ * Buffer cache backends keep every block they've read, until unmount
+ * Transfers to a direct image use buffers from blockdev_buffer(), and
+ * offsets and lengths that are multiples of BLOCKDEV_ALIGN
+ */
+#ifndef BLOCKDEV_H
+#define BLOCKDEV_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Alignment O_DIRECT transfers need, in bytes
+#define BLOCKDEV_ALIGN 4096
+
+// Most transfers queued with one system call
+#define BLOCKDEV_BATCH 64
+
+/**
+ * A block backend.
+ *
+ * Fields:
+ * - name: As given in NUFS_BACKEND
+ * - open_flags: Added to the flags the image is opened with
+ * - cached: Nonzero if memory is filled by reading blocks in, and only
+ *           reaches the image when written back
+ * - attach: Get memory for an image of size bytes, NULL on failure. A
+ *           mapping backend maps the file, privately if asked to.
+ * - detach: Release memory from attach()
+ * - prefetch: Start reading len bytes at off in the background, so that
+ *             touching them later doesn't wait for the disk. NULL if the
+ *             backend can't, and the caller should read them in itself.
+ */
+typedef struct blockdev {
+  const char *name;
+  int open_flags;
+  int cached;
+  void *(*attach)(int fd, size_t size, int private);
+  void (*detach)(void *base, size_t size);
+  void (*prefetch)(int fd, void *base, off_t off, size_t len);
+} blockdev_t;
+
+/**
+ * One transfer between memory and the image.
+ */
+typedef struct blockdev_io {
+  void *buf;  // memory to read into or write from
+  size_t len; // bytes
+  off_t off;  // byte offset in the image
+} blockdev_io_t;
+
+extern const blockdev_t blockdev_mmap;
+extern const blockdev_t blockdev_cache;
+extern const blockdev_t blockdev_direct;
+
+/**
+ * Get the backend named in NUFS_BACKEND.
+ *
+ * @return The backend, blockdev_mmap if the variable is unset or names
+ *         no backend.
+ */
+const blockdev_t *blockdev_from_env();
+
+/**
+ * Read or write a batch of transfers and wait for all of them.
+ *
+ * Short transfers are retried until complete. Safe to call from several
+ * threads.
+ *
+ * @param fd Image file descriptor.
+ * @param ios Transfers, in any order.
+ * @param count Number of transfers.
+ * @param write Nonzero to write the buffers, 0 to read into them.
+ *
+ * @return 0 if every transfer completed, -1 on an I/O error.
+ */
+int blockdev_rw(int fd, blockdev_io_t *ios, int count, int write);
+
+/**
+ * Allocate a zeroed buffer that any backend can transfer.
+ *
+ * @param len Length in bytes.
+ *
+ * @return Buffer aligned to BLOCKDEV_ALIGN, released with free().
+ */
+void *blockdev_buffer(size_t len);
+
+#endif
@@ -10,26 +10,94 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "bitmap.h"
+#include "blockdev.h"
 #include "blocks.h"
 
-const int BLOCK_COUNT = 256; // we split the "disk" into 256 blocks
-const int BLOCK_SIZE = 4096; // = 4K
-const int NUFS_SIZE = BLOCK_SIZE * BLOCK_COUNT; // = 1MB
+// Geometry of the mounted image, set by blocks_init(). The defaults are
+// the legacy layout: a 1MB image split into 256 blocks of 4K.
+int BLOCK_COUNT = 256;
+int BLOCK_SIZE = 4096;
+long NUFS_SIZE = 4096L * 256;
 
-const int BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
+int BLOCK_BITMAP_SIZE = 256 / 8;
 // Note: assumes block count is divisible by 8
 
+// Legacy images keep both bitmaps in block 0 and the inode table in block 1
+#define LEGACY_BLOCK_COUNT 256
+#define LEGACY_BLOCK_SIZE 4096
+#define LEGACY_INODE_COUNT 128
+
+// Blocks covered by one entry of the free-count summary
+#define GROUP_BLOCKS 64
+
 static int blocks_fd = -1;
 static void *blocks_base = 0;
 
+// Backend of the mounted image. Unless the memory is a shared mapping of
+// the file, changes only reach it when written back.
+static const blockdev_t *dev = &blockdev_mmap;
+static int journaled = 0;
+static int shared = 0;
+
+// Blocks read into a buffer cache so far, one bit each, NULL for mapping
+// backends. Bits are only set, under load_lock.
+static uint8_t *loaded = 0;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Superblock of the mounted image (magic 0 for a legacy image)
+static nufs_super_t super;
+
+// Free blocks per group of GROUP_BLOCKS, built on the first allocation so
+// that blocks reserved directly in the bitmap at init are counted
+static int *group_free = 0;
+static int group_count = 0;
+
+// Next-fit cursor: where allocations without a goal start searching
+static int alloc_cursor = 1;
+
+// Guards the block bitmap, the group summary and the cursor
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Free blocks in the bitmap, the total of the group summary, and how many
+// of them are reserved; both guarded by alloc_lock
+static int free_total = 0;
+static int reserved = 0;
+
+// Reserved blocks this thread's allocations may take
+static __thread int reserved_claim = 0;
+
+// Blocks changed since the journal last took them, or since they were
+// written back from an unjournaled buffer cache, one bit each. Both are
+// NULL when the memory is a shared mapping.
+static uint8_t *dirty_meta = 0;
+static uint8_t *dirty_data = 0;
+static int dirty_meta_count = 0;
+
+// With a journal, blocks freed since the last commit stay allocated until
+// it releases them, so their old owner's metadata never points at new
+// data. Those handed out anyway when the disk is full have their data
+// journaled instead (reclaimed). Guarded by alloc_lock, NULL unjournaled.
+static uint8_t *freed = 0;
+static uint8_t *reclaimed = 0;
+static int freed_count = 0;
+
+// Owners of each block beyond the first, in the image; NULL on images
+// without reference counts. Changed under alloc_lock.
+static uint16_t *refcounts = 0;
+
+// Allocator activity, read without the lock by blocks_stats()
+static blocks_stats_t stats;
+
 // Get the number of blocks needed to store the given number of bytes.
 int bytes_to_blocks(int bytes) {
   int quo = bytes / BLOCK_SIZE;
@@ -41,64 +109,940 @@ int bytes_to_blocks(int bytes) {
   }
 }
 
+// Blocks needed to hold the given number of bytes at a given block size.
+static uint32_t blocks_for(uint64_t bytes, uint32_t block_size) {
+  return (uint32_t) ((bytes + block_size - 1) / block_size);
+}
+
+// Check that a superblock describes a layout we can mount.
+static int super_valid(const nufs_super_t *sb) {
+  uint64_t bs = sb->block_size;
+
+  if (sb->magic != NUFS_MAGIC || sb->version < 1 || sb->version > NUFS_VERSION) {
+    return 0;
+  }
+  if (sb->version == 1 && (sb->journal_start != 0 || sb->journal_blocks != 0)) {
+    return 0;
+  }
+  if (sb->version >= 3 && (sb->inode_size == 0 || (sb->inode_size & (sb->inode_size - 1)) != 0 ||
+                           sb->inode_size > sb->block_size)) {
+    return 0;
+  }
+  if (bs < NUFS_MIN_BLOCK_SIZE || bs > NUFS_MAX_BLOCK_SIZE || (bs & (bs - 1)) != 0) {
+    return 0;
+  }
+  if (sb->block_count % 8 != 0 || sb->block_count > INT32_MAX || sb->inode_count == 0) {
+    return 0;
+  }
+
+  // two bytes of reference count per block follow the inode table
+  uint64_t meta_end = (uint64_t) sb->itable_start + sb->itable_blocks;
+  if (sb->version >= 5) {
+    if (sb->refcount_start != meta_end ||
+        (uint64_t) sb->refcount_blocks * bs < (uint64_t) sb->block_count * sizeof(uint16_t)) {
+      return 0;
+    }
+    meta_end += sb->refcount_blocks;
+  } else if (sb->refcount_start != 0 || sb->refcount_blocks != 0) {
+    return 0;
+  }
+
+  // the journal, if any, sits between the metadata and the data
+  if (sb->journal_blocks != 0 &&
+      (sb->journal_start != meta_end || sb->journal_blocks < NUFS_MIN_JOURNAL_BLOCKS)) {
+    return 0;
+  }
+
+  // the regions must be in order, large enough and inside the image
+  return sb->bbm_start == 1 &&
+         (uint64_t) sb->bbm_blocks * bs * 8 >= sb->block_count &&
+         sb->ibm_start == sb->bbm_start + sb->bbm_blocks &&
+         (uint64_t) sb->ibm_blocks * bs * 8 >= sb->inode_count &&
+         sb->itable_start == sb->ibm_start + sb->ibm_blocks &&
+         (uint64_t) sb->itable_blocks * bs >= (uint64_t) sb->inode_count * sb->inode_size &&
+         sb->data_start == meta_end + sb->journal_blocks &&
+         sb->data_start < sb->block_count;
+}
+
+// Get the size in bytes of the block device open as fd, 0 if unknown.
+static uint64_t device_size(int fd) {
+  off_t size = lseek(fd, 0, SEEK_END);
+  return size > 0 ? (uint64_t) size : 0;
+}
+
+// Zero the first count blocks of a (device) image.
+static int zero_blocks(int fd, int block_size, uint32_t count) {
+  char *zeros = calloc(1, block_size);
+  int rv = 0;
+  for (uint32_t ii = 0; ii < count && rv == 0; ++ii) {
+    blockdev_io_t io = {zeros, (size_t) block_size, (off_t) block_size * ii};
+    rv = blockdev_rw(fd, &io, 1, 1);
+  }
+  free(zeros);
+  return rv;
+}
+
+// Write a fresh, empty filesystem layout to the given image.
+int blocks_format(const char *image_path, int block_size, int block_count,
+                  int inode_count, int inode_size, int journal_blocks) {
+  nufs_super_t sb;
+  memset(&sb, 0, sizeof(sb));
+
+  sb.magic = NUFS_MAGIC;
+  sb.version = NUFS_VERSION;
+  sb.block_size = block_size;
+  sb.block_count = block_count;
+  sb.inode_count = inode_count;
+  sb.inode_size = inode_size;
+
+  sb.bbm_start = 1;
+  sb.bbm_blocks = blocks_for(((uint64_t) block_count + 7) / 8, block_size);
+  sb.ibm_start = sb.bbm_start + sb.bbm_blocks;
+  sb.ibm_blocks = blocks_for(((uint64_t) inode_count + 7) / 8, block_size);
+  sb.itable_start = sb.ibm_start + sb.ibm_blocks;
+  sb.itable_blocks = blocks_for((uint64_t) inode_count * inode_size, block_size);
+  sb.refcount_start = sb.itable_start + sb.itable_blocks;
+  sb.refcount_blocks = blocks_for((uint64_t) block_count * sizeof(uint16_t), block_size);
+  sb.journal_start = journal_blocks > 0 ? sb.refcount_start + sb.refcount_blocks : 0;
+  sb.journal_blocks = journal_blocks > 0 ? journal_blocks : 0;
+  sb.data_start = sb.refcount_start + sb.refcount_blocks + sb.journal_blocks;
+
+  if (block_size < 0 || block_count < 0 || inode_count < 0 || !super_valid(&sb)) {
+    return -1;
+  }
+
+  // a buffer cache still holding this image must not write its blocks
+  // over the new layout later
+  blocks_flush();
+
+  int fd = open(image_path, O_CREAT | O_RDWR, 0644);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  // dropping the old contents leaves a sparse, all-zero image; a device
+  // can't be truncated, so only its metadata is zeroed
+  long size = (long) block_size * block_count;
+  if (S_ISBLK(st.st_mode)) {
+    if (device_size(fd) < (uint64_t) size || zero_blocks(fd, block_size, sb.data_start) != 0) {
+      close(fd);
+      return -1;
+    }
+  } else if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  // the superblock sits at the start of block 0
+  uint8_t *base = mmap(0, (size_t) block_size * sb.data_start, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  memcpy(base, &sb, sizeof(sb));
+
+  // mark the superblock, both bitmaps, the inode table and the reference
+  // counts as used
+  uint8_t *bbm = base + (size_t) block_size * sb.bbm_start;
+  for (uint32_t ii = 0; ii < sb.data_start; ++ii) {
+    bitmap_put(bbm, ii, 1);
+  }
+
+  munmap(base, (size_t) block_size * sb.data_start);
+  close(fd);
+  return 0;
+}
+
+// Check whether a block is in the buffer cache.
+static int is_loaded(int bnum) {
+  return (__atomic_load_n(&loaded[bnum / 8], __ATOMIC_ACQUIRE) >> (bnum % 8)) & 1;
+}
+
+// Read a batch of runs into the buffer cache and mark them loaded. The
+// caller holds load_lock.
+static void read_in(blockdev_io_t *ios, int count) {
+  int rv = blockdev_rw(blocks_fd, ios, count, 0);
+  assert(rv == 0);
+
+  for (int ii = 0; ii < count; ++ii) {
+    int first = ios[ii].off / BLOCK_SIZE;
+    int last = first + ios[ii].len / BLOCK_SIZE;
+    for (int bnum = first; bnum < last; ++bnum) {
+      __atomic_fetch_or(&loaded[bnum / 8], 1 << (bnum % 8), __ATOMIC_RELEASE);
+    }
+  }
+}
+
+// Read the blocks of a range that aren't in the buffer cache yet, each
+// run of them as one transfer.
+static void load_blocks(int bnum, int count) {
+  int end = bnum + count < BLOCK_COUNT ? bnum + count : BLOCK_COUNT;
+  int ii = bnum;
+  while (ii < end && is_loaded(ii)) {
+    ii++;
+  }
+  if (ii >= end) {
+    return;
+  }
+
+  pthread_mutex_lock(&load_lock);
+  blockdev_io_t ios[BLOCKDEV_BATCH];
+  int n = 0;
+  while (ii < end) {
+    if (is_loaded(ii)) {
+      ii++;
+      continue;
+    }
+
+    int first = ii;
+    while (ii < end && !is_loaded(ii)) {
+      ii++;
+    }
+    ios[n].buf = (uint8_t *) blocks_base + (size_t) BLOCK_SIZE * first;
+    ios[n].len = (size_t) BLOCK_SIZE * (ii - first);
+    ios[n].off = (off_t) BLOCK_SIZE * first;
+    if (++n == BLOCKDEV_BATCH) {
+      read_in(ios, n);
+      n = 0;
+    }
+  }
+  if (n > 0) {
+    read_in(ios, n);
+  }
+  pthread_mutex_unlock(&load_lock);
+}
+
+// Clear a block's dirty bits, returning 1 if either was set.
+static int take_dirty(int bnum) {
+  uint8_t bit = 1 << (bnum % 8);
+  int meta = __atomic_fetch_and(&dirty_meta[bnum / 8], ~bit, __ATOMIC_ACQ_REL) & bit;
+  int data = __atomic_fetch_and(&dirty_data[bnum / 8], ~bit, __ATOMIC_ACQ_REL) & bit;
+  if (meta) {
+    __atomic_sub_fetch(&dirty_meta_count, 1, __ATOMIC_RELAXED);
+  }
+  return meta || data;
+}
+
+// Copy blocks that other threads may be changing. Like page cache
+// writeback of a shared mapping, the copy can be torn; a block changed
+// meanwhile is marked dirty again and written once more.
+__attribute__((no_sanitize_thread)) static void snapshot(uint64_t *dst,
+                                                         const uint64_t *src, size_t len) {
+  for (size_t ii = 0; ii < len / sizeof(uint64_t); ++ii) {
+    dst[ii] = src[ii];
+  }
+}
+
+// Write a batch of runs from the buffer cache, through a copy. Runs that
+// fail are marked dirty again.
+static int write_out(blockdev_io_t *ios, int count) {
+  size_t total = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    total += ios[ii].len;
+  }
+
+  blockdev_io_t copies[BLOCKDEV_BATCH];
+  char *copy = blockdev_buffer(total);
+  size_t at = 0;
+  for (int ii = 0; ii < count; ++ii) {
+    snapshot((uint64_t *) (copy + at), ios[ii].buf, ios[ii].len);
+    copies[ii] = ios[ii];
+    copies[ii].buf = copy + at;
+    at += ios[ii].len;
+  }
+  int rv = blockdev_rw(blocks_fd, copies, count, 1);
+  free(copy);
+  if (rv == 0) {
+    return 0;
+  }
+
+  for (int ii = 0; ii < count; ++ii) {
+    int first = ios[ii].off / BLOCK_SIZE;
+    int last = first + ios[ii].len / BLOCK_SIZE;
+    for (int bnum = first; bnum < last; ++bnum) {
+      __atomic_fetch_or(&dirty_data[bnum / 8], 1 << (bnum % 8), __ATOMIC_RELAXED);
+    }
+  }
+  return -1;
+}
+
+// Write the dirty blocks in [first, last] back from an unjournaled buffer
+// cache. Their marks are cleared first, so a block changed meanwhile is
+// marked again.
+static int write_back(int first, int last) {
+  blockdev_io_t ios[BLOCKDEV_BATCH];
+  int n = 0;
+  int rv = 0;
+
+  if (last >= BLOCK_COUNT) {
+    last = BLOCK_COUNT - 1;
+  }
+  int bnum = first;
+  while (bnum <= last) {
+    // whole clean bytes are skipped without looking at their bits
+    if (bnum % 8 == 0 && __atomic_load_n(&dirty_meta[bnum / 8], __ATOMIC_RELAXED) == 0 &&
+        __atomic_load_n(&dirty_data[bnum / 8], __ATOMIC_RELAXED) == 0) {
+      bnum += 8;
+      continue;
+    }
+    if (!take_dirty(bnum)) {
+      bnum++;
+      continue;
+    }
+
+    int start = bnum++;
+    while (bnum <= last && take_dirty(bnum)) {
+      bnum++;
+    }
+    ios[n].buf = (uint8_t *) blocks_base + (size_t) BLOCK_SIZE * start;
+    ios[n].len = (size_t) BLOCK_SIZE * (bnum - start);
+    ios[n].off = (off_t) BLOCK_SIZE * start;
+    if (++n == BLOCKDEV_BATCH) {
+      rv |= write_out(ios, n);
+      n = 0;
+    }
+  }
+  if (n > 0) {
+    rv |= write_out(ios, n);
+  }
+  return rv;
+}
+
+// Write back everything an unjournaled buffer cache holds.
+int blocks_flush() {
+  if (blocks_base == 0 || journaled || shared) {
+    return 0;
+  }
+
+  int rv = write_back(0, BLOCK_COUNT - 1);
+  if (rv == 0) {
+    rv = fdatasync(blocks_fd);
+  }
+  return rv == 0 ? 0 : -1;
+}
+
+// Write back at exit, which is when FUSE unmounts.
+static void flush_at_exit() { blocks_flush(); }
+
 // Load and initialize the given disk image.
 void blocks_init(const char *image_path) {
+  static int registered = 0;
+
+  // let go of the previously mounted image, if any
+  if (blocks_base != 0) {
+    blocks_free();
+  }
+
   blocks_fd = open(image_path, O_CREAT | O_RDWR, 0644);
   assert(blocks_fd != -1);
 
-  // make sure the disk image is exactly 1MB
-  int rv = ftruncate(blocks_fd, NUFS_SIZE);
+  // block 0 starts with the superblock, unless this is a legacy image. The
+  // first legacy byte always has bit 0 set (block 0 is in use), while the
+  // first byte of the magic is even, so the two can't be confused.
+  memset(&super, 0, sizeof(super));
+  ssize_t got = pread(blocks_fd, &super, sizeof(super), 0);
+  int legacy = got != sizeof(super) || super.magic != NUFS_MAGIC;
+  if (legacy) {
+    memset(&super, 0, sizeof(super));
+    super.block_size = LEGACY_BLOCK_SIZE;
+    super.block_count = LEGACY_BLOCK_COUNT;
+    super.inode_count = LEGACY_INODE_COUNT;
+    super.itable_start = 1;
+    super.itable_blocks = 1;
+    super.data_start = 2;
+  } else {
+    assert(super_valid(&super));
+  }
+
+  BLOCK_SIZE = super.block_size;
+  BLOCK_COUNT = super.block_count;
+  NUFS_SIZE = (long) BLOCK_SIZE * BLOCK_COUNT;
+  BLOCK_BITMAP_SIZE = BLOCK_COUNT / 8;
+
+  // make sure the disk image is exactly the size the geometry says; a
+  // block device just has to be large enough
+  struct stat st;
+  int rv = fstat(blocks_fd, &st);
   assert(rv == 0);
+  if (S_ISBLK(st.st_mode)) {
+    assert(device_size(blocks_fd) >= (uint64_t) NUFS_SIZE);
+  } else {
+    rv = ftruncate(blocks_fd, NUFS_SIZE);
+    assert(rv == 0);
+  }
+
+  // the superblock was read through a plain descriptor, since O_DIRECT
+  // only takes aligned buffers; some file systems don't take it at all
+  dev = blockdev_from_env();
+  if (dev->open_flags != 0) {
+    int fd = open(image_path, O_RDWR | dev->open_flags);
+    if (fd == -1) {
+      fprintf(stderr, "blocks: can't open %s for %s I/O, using cache\n", image_path,
+              dev->name);
+      dev = &blockdev_cache;
+    } else {
+      close(blocks_fd);
+      blocks_fd = fd;
+    }
+  }
+
+  // with a journal, changes stay private until the journal writes them
+  // back; a buffer cache always keeps them until they're written back
+  journaled = super.journal_blocks != 0;
+  shared = !journaled && !dev->cached;
+  blocks_base = dev->attach(blocks_fd, NUFS_SIZE, journaled);
+  assert(blocks_base != 0);
 
-  // map the image to memory
-  blocks_base =
-      mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, blocks_fd, 0);
-  assert(blocks_base != MAP_FAILED);
+  free(dirty_meta);
+  free(dirty_data);
+  free(freed);
+  free(reclaimed);
+  free(loaded);
+  dirty_meta = shared ? 0 : calloc(BLOCK_BITMAP_SIZE, 1);
+  dirty_data = shared ? 0 : calloc(BLOCK_BITMAP_SIZE, 1);
+  freed = journaled ? calloc(BLOCK_BITMAP_SIZE, 1) : 0;
+  reclaimed = journaled ? calloc(BLOCK_BITMAP_SIZE, 1) : 0;
+  loaded = dev->cached ? calloc(BLOCK_BITMAP_SIZE, 1) : 0;
+  dirty_meta_count = 0;
+
+  // the bitmaps, inode table and reference counts are used through
+  // pointers that span blocks, so a buffer cache reads them in up front
+  if (loaded != 0) {
+    load_blocks(0, journaled ? super.journal_start : super.data_start);
+  }
+  if (!registered) {
+    atexit(flush_at_exit);
+    registered = 1;
+  }
 
-  // block 0 stores the block bitmap and the inode bitmap
+  // block 0 stores the superblock (or, legacy, both bitmaps)
   void *bbm = get_blocks_bitmap();
   bitmap_put(bbm, 0, 1);
+  refcounts = super.refcount_blocks != 0 ? blocks_get_block(super.refcount_start) : 0;
+
+  // the allocator state belongs to the previous image, if any
+  free(group_free);
+  group_free = 0;
+  alloc_cursor = super.data_start;
+  reserved = 0;
+  reserved_claim = 0;
+  freed_count = 0;
 }
 
 // Close the disk image.
 void blocks_free() {
-  int rv = munmap(blocks_base, NUFS_SIZE);
-  assert(rv == 0);
+  blocks_flush();
+  dev->detach(blocks_base, NUFS_SIZE);
+  blocks_base = 0;
+  close(blocks_fd);
+  blocks_fd = -1;
+
+  free(group_free);
+  group_free = 0;
+}
+
+// Get the file descriptor of the mounted image.
+int blocks_file() { return blocks_fd; }
+
+// Set a block's bit in a dirty bitmap. Returns 1 if it wasn't set.
+static int mark_dirty(uint8_t *bm, int bnum) {
+  uint8_t bit = 1 << (bnum % 8);
+  return (__atomic_fetch_or(&bm[bnum / 8], bit, __ATOMIC_RELAXED) & bit) == 0;
+}
+
+// Record that a range of metadata changed.
+void blocks_dirty(const void *ptr, size_t len) {
+  if (dirty_meta == 0 || len == 0) {
+    return;
+  }
+
+  size_t start = (const uint8_t *) ptr - (const uint8_t *) blocks_base;
+  int first = start / BLOCK_SIZE;
+  int last = (start + len - 1) / BLOCK_SIZE;
+  for (int bnum = first; bnum <= last && bnum < BLOCK_COUNT; ++bnum) {
+    if (mark_dirty(dirty_meta, bnum)) {
+      __atomic_add_fetch(&dirty_meta_count, 1, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Record that file data blocks changed.
+void blocks_dirty_data(int bnum, int count) {
+  if (dirty_data == 0) {
+    return;
+  }
+
+  for (int ii = bnum; ii < bnum + count && ii < BLOCK_COUNT; ++ii) {
+    if (reclaimed != 0 &&
+        (__atomic_load_n(&reclaimed[ii / 8], __ATOMIC_RELAXED) >> (ii % 8)) & 1) {
+      blocks_dirty(blocks_get_block(ii), BLOCK_SIZE);
+    } else {
+      mark_dirty(dirty_data, ii);
+    }
+  }
+}
+
+// Count the metadata blocks marked dirty.
+int blocks_dirty_count() {
+  return __atomic_load_n(&dirty_meta_count, __ATOMIC_RELAXED);
+}
+
+// Find the next set bit at or after from in a per-block bitmap.
+// Returns -1 if there is none.
+static int next_set(uint8_t *bm, int from) {
+  // whole zero bytes are skipped without looking at their bits
+  for (int ii = from; ii < BLOCK_COUNT;) {
+    if (ii % 8 == 0 && bm[ii / 8] == 0) {
+      ii += 8;
+    } else if (bitmap_get(bm, ii)) {
+      return ii;
+    } else {
+      ii++;
+    }
+  }
+  return -1;
+}
+
+// Find the next dirty block at or after from.
+int blocks_next_dirty(int from, int meta) {
+  uint8_t *bm = meta ? dirty_meta : dirty_data;
+  if (bm == 0 || from < 0) {
+    return -1;
+  }
+  return next_set(bm, from);
+}
+
+// Clear a block's dirty marks.
+void blocks_clean(int bnum) {
+  if (dirty_meta == 0) {
+    return;
+  }
+
+  if (bitmap_get(dirty_meta, bnum)) {
+    bitmap_put(dirty_meta, bnum, 0);
+    __atomic_sub_fetch(&dirty_meta_count, 1, __ATOMIC_RELAXED);
+  }
+  bitmap_put(dirty_data, bnum, 0);
 }
 
+// Write a range of the image's memory back to disk.
+int blocks_sync(const void *ptr, size_t len, int wait) {
+  if (journaled || len == 0) {
+    return 0;
+  }
+
+  if (shared) {
+    // msync wants page boundaries, which may be coarser than blocks
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) ptr & ~(page - 1);
+    uintptr_t end = ((uintptr_t) ptr + len + page - 1) & ~(page - 1);
+    return msync((void *) start, end - start, wait ? MS_SYNC : MS_ASYNC);
+  }
+
+  size_t start = (const uint8_t *) ptr - (const uint8_t *) blocks_base;
+  int rv = write_back(start / BLOCK_SIZE, (start + len - 1) / BLOCK_SIZE);
+  if (rv == 0 && wait) {
+    rv = fdatasync(blocks_fd);
+  }
+  return rv == 0 ? 0 : -1;
+}
+
+// Get the geometry of the mounted image.
+const nufs_super_t *blocks_super() { return &super; }
+
 // Get the given block, returning a pointer to its start.
-void *blocks_get_block(int bnum) { return blocks_base + BLOCK_SIZE * bnum; }
+void *blocks_get_block(int bnum) { return blocks_get_blocks(bnum, 1); }
+
+// Get a run of consecutive blocks, returning a pointer to the first.
+void *blocks_get_blocks(int bnum, int count) {
+  if (loaded != 0) {
+    load_blocks(bnum, count);
+  }
+  return (uint8_t *) blocks_base + (size_t) BLOCK_SIZE * bnum;
+}
+
+// Start reading a run of blocks that will be wanted soon.
+void blocks_prefetch(int bnum, int count) {
+  int end = bnum + count < BLOCK_COUNT ? bnum + count : BLOCK_COUNT;
+  if (loaded != 0) {
+    // only the part of the run the buffer cache is missing
+    while (bnum < end && is_loaded(bnum)) {
+      bnum++;
+    }
+    while (end > bnum && is_loaded(end - 1)) {
+      end--;
+    }
+  }
+  if (bnum >= end) {
+    return;
+  }
+
+  __atomic_add_fetch(&stats.prefetched, end - bnum, __ATOMIC_RELAXED);
+  if (dev->prefetch != NULL) {
+    dev->prefetch(blocks_fd, blocks_base, (off_t) BLOCK_SIZE * bnum,
+                  (size_t) BLOCK_SIZE * (end - bnum));
+  } else {
+    load_blocks(bnum, end - bnum);
+  }
+}
+
+// Check whether a run is best read straight from the image file.
+int blocks_file_backed(int bnum, int count) {
+  if ((dev->open_flags & O_DIRECT) != 0) {
+    return 0;
+  }
+
+  for (int ii = bnum; ii < bnum + count && ii < BLOCK_COUNT; ++ii) {
+    uint8_t bit = 1 << (ii % 8);
+    if (dirty_data != 0 && (__atomic_load_n(&dirty_data[ii / 8], __ATOMIC_RELAXED) & bit)) {
+      return 0;
+    }
+    if (dirty_meta != 0 && (__atomic_load_n(&dirty_meta[ii / 8], __ATOMIC_RELAXED) & bit)) {
+      return 0;
+    }
+    if (loaded != 0 && is_loaded(ii)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Mark blocks about to be overwritten whole as in the buffer cache.
+void blocks_fresh(int bnum, int count) {
+  if (loaded == 0) {
+    return;
+  }
+
+  // a load of a neighbouring run may be covering them right now; taking
+  // the lock lets it finish before their new contents are written
+  pthread_mutex_lock(&load_lock);
+  for (int ii = bnum; ii < bnum + count && ii < BLOCK_COUNT; ++ii) {
+    __atomic_fetch_or(&loaded[ii / 8], 1 << (ii % 8), __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&load_lock);
+}
 
 // Return a pointer to the beginning of the block bitmap.
 // The size is BLOCK_BITMAP_SIZE bytes.
-void *get_blocks_bitmap() { return blocks_get_block(0); }
+void *get_blocks_bitmap() {
+  // legacy images keep it at the start of block 0
+  return blocks_get_block(super.bbm_start);
+}
 
 // Return a pointer to the beginning of the inode table bitmap.
 void *get_inode_bitmap() {
-  uint8_t *block = blocks_get_block(0);
+  if (super.magic == NUFS_MAGIC) {
+    return blocks_get_block(super.ibm_start);
+  }
 
-  // The inode bitmap is stored immediately after the block bitmap
+  // Legacy: the inode bitmap is stored immediately after the block bitmap
+  uint8_t *block = blocks_get_block(0);
   return (void *) (block + BLOCK_BITMAP_SIZE);
 }
 
-// Allocate a new block and return its index.
-int alloc_block() {
+// Return a pointer to the beginning of the inode table.
+void *get_inode_table() { return blocks_get_block(super.itable_start); }
+
+// Count the free blocks in each group from the bitmap.
+static void build_group_summary() {
   void *bbm = get_blocks_bitmap();
 
-  for (int ii = 1; ii < BLOCK_COUNT; ++ii) {
-    if (!bitmap_get(bbm, ii)) {
-      bitmap_put(bbm, ii, 1);
-      printf("+ alloc_block() -> %d\n", ii);
-      return ii;
+  group_count = (BLOCK_COUNT + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+  group_free = calloc(group_count, sizeof(int));
+  assert(group_free != 0);
+
+  free_total = 0;
+  for (int gg = 0; gg < group_count; ++gg) {
+    int from = gg * GROUP_BLOCKS;
+    int to = from + GROUP_BLOCKS < BLOCK_COUNT ? from + GROUP_BLOCKS : BLOCK_COUNT;
+    group_free[gg] = (to - from) - bitmap_count(bbm, from, to);
+    free_total += group_free[gg];
+  }
+}
+
+// Find the first free block in [from, to), skipping full groups, and
+// add the bits looked at to *probed. Returns -1 if there is none.
+static int find_free_block(int from, int to, uint64_t *probed) {
+  void *bbm = get_blocks_bitmap();
+
+  int ii = from;
+  while (ii < to) {
+    int group_end = (ii / GROUP_BLOCKS + 1) * GROUP_BLOCKS;
+    if (group_end > to) {
+      group_end = to;
     }
+
+    if (group_free[ii / GROUP_BLOCKS] != 0) {
+      int found = bitmap_find_zero(bbm, ii, group_end);
+      if (found >= 0) {
+        *probed += found - ii + 1;
+        return found;
+      }
+      *probed += group_end - ii;
+    }
+    ii = group_end;
   }
 
   return -1;
 }
 
+// Find the start of the first run of n free blocks in [from, to), and
+// add the bits looked at to *probed. Returns -1 if there is none.
+//
+// Only stretches of groups with at least min(n, GROUP_BLOCKS) free blocks
+// are searched, so on a fragmented image a failed search costs a pass
+// over the group summary, not the bitmap. Runs that lean on a sparser
+// group are missed; the caller then takes free blocks in order instead.
+static int find_free_run(int from, int to, int n, uint64_t *probed) {
+  void *bbm = get_blocks_bitmap();
+  int want = n < GROUP_BLOCKS ? n : GROUP_BLOCKS;
+
+  int ii = from;
+  while (ii < to) {
+    while (ii < to && group_free[ii / GROUP_BLOCKS] < want) {
+      ii = (ii / GROUP_BLOCKS + 1) * GROUP_BLOCKS;
+    }
+    int end = ii;
+    while (end < to && group_free[end / GROUP_BLOCKS] >= want) {
+      end = (end / GROUP_BLOCKS + 1) * GROUP_BLOCKS;
+    }
+    if (end > to) {
+      end = to;
+    }
+
+    if (end - ii >= n) {
+      int found = bitmap_find_zero_run(bbm, ii, end, n);
+      if (found >= 0) {
+        *probed += found + n - ii;
+        return found;
+      }
+      *probed += end - ii;
+    }
+    ii = end;
+  }
+
+  return -1;
+}
+
+// Allocate up to n blocks, preferring one contiguous run at the goal.
+int alloc_blocks(int n, int goal, int *out) {
+  void *bbm = get_blocks_bitmap();
+
+  pthread_mutex_lock(&alloc_lock);
+  if (group_free == 0) {
+    build_group_summary();
+  }
+  if (goal <= 0 || goal >= BLOCK_COUNT) {
+    goal = alloc_cursor;
+  }
+
+  // look for a run long enough after the goal, then before it; failing
+  // that, take whatever is free in order from the goal
+  uint64_t probed = 0;
+  int bnum = find_free_run(goal, BLOCK_COUNT, n, &probed);
+  if (bnum < 0) {
+    bnum = find_free_run(1, goal, n, &probed);
+  }
+  if (bnum < 0) {
+    bnum = goal;
+  }
+
+  int got = 0;
+  while (got < n) {
+    // reserved blocks are only for the threads that claimed them
+    int found = -1;
+    if (free_total - reserved + reserved_claim > 0) {
+      found = find_free_block(bnum, BLOCK_COUNT, &probed);
+      if (found < 0) {
+        found = find_free_block(1, bnum, &probed);
+      }
+    }
+    if (found < 0 && freed != 0) {
+      // the disk is full but for blocks the running transaction freed;
+      // they're still marked in the bitmap, so just change hands
+      found = next_set(freed, 1);
+      if (found >= 0) {
+        bitmap_put(freed, found, 0);
+        freed_count--;
+        mark_dirty(reclaimed, found);
+        out[got++] = found;
+        continue;
+      }
+    }
+    if (found < 0) {
+      break;
+    }
+
+    bitmap_put(bbm, found, 1);
+    blocks_dirty((uint8_t *) bbm + found / 8, 1);
+    group_free[found / GROUP_BLOCKS]--;
+    free_total--;
+    if (reserved_claim > 0) {
+      reserved_claim--;
+      reserved--;
+    }
+    out[got++] = found;
+    bnum = found + 1 < BLOCK_COUNT ? found + 1 : 1;
+  }
+
+  if (got > 0) {
+    alloc_cursor = bnum;
+  }
+  __atomic_add_fetch(&stats.allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.allocated, got, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&stats.probed, probed, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&alloc_lock);
+  return got;
+}
+
+// Allocate a new block and return its index.
+int alloc_block() {
+  int bnum;
+  if (alloc_blocks(1, 0, &bnum) < 1) {
+    return -1;
+  }
+  return bnum;
+}
+
 // Deallocate the block with the given index.
 void free_block(int bnum) {
-  printf("+ free_block(%d)\n", bnum);
   void *bbm = get_blocks_bitmap();
-  bitmap_put(bbm, bnum, 0);
+  if (bnum <= 0 || bnum >= BLOCK_COUNT) {
+    return;
+  }
+
+  pthread_mutex_lock(&alloc_lock);
+  if (refcounts != 0 && refcounts[bnum] != 0) {
+    // another file still has the block
+    __atomic_store_n(&refcounts[bnum], refcounts[bnum] - 1, __ATOMIC_RELAXED);
+    blocks_dirty(&refcounts[bnum], sizeof(uint16_t));
+    pthread_mutex_unlock(&alloc_lock);
+    return;
+  }
+  if (bitmap_get(bbm, bnum)) {
+    __atomic_add_fetch(&stats.freed, 1, __ATOMIC_RELAXED);
+  }
+  if (freed != 0) {
+    if (bitmap_get(bbm, bnum) && !bitmap_get(freed, bnum)) {
+      bitmap_put(freed, bnum, 1);
+      freed_count++;
+    }
+  } else if (bitmap_get(bbm, bnum)) {
+    bitmap_put(bbm, bnum, 0);
+    blocks_dirty((uint8_t *) bbm + bnum / 8, 1);
+    if (group_free != 0) {
+      group_free[bnum / GROUP_BLOCKS]++;
+      free_total++;
+    }
+  }
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Take another reference to an allocated block. Returns 0 on success, -1
+// without reference counts or once the count is full.
+int blocks_ref(int bnum) {
+  if (refcounts == 0 || bnum <= 0 || bnum >= BLOCK_COUNT) {
+    return -1;
+  }
+
+  int rv = -1;
+  pthread_mutex_lock(&alloc_lock);
+  if (refcounts[bnum] != UINT16_MAX) {
+    __atomic_store_n(&refcounts[bnum], refcounts[bnum] + 1, __ATOMIC_RELAXED);
+    blocks_dirty(&refcounts[bnum], sizeof(uint16_t));
+    __atomic_add_fetch(&stats.shared, 1, __ATOMIC_RELAXED);
+    rv = 0;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return rv;
+}
+
+// Check whether a block has more than one owner.
+int blocks_shared(int bnum) {
+  if (refcounts == 0 || bnum <= 0 || bnum >= BLOCK_COUNT) {
+    return 0;
+  }
+  return __atomic_load_n(&refcounts[bnum], __ATOMIC_RELAXED) != 0;
+}
+
+// Set aside free blocks for a later allocation. Returns 0 on success, -1
+// if not that many blocks are free.
+int blocks_reserve(int count) {
+  pthread_mutex_lock(&alloc_lock);
+  if (group_free == 0) {
+    build_group_summary();
+  }
+  int rv = -1;
+  if (free_total - reserved >= count) {
+    reserved += count;
+    rv = 0;
+  }
+  pthread_mutex_unlock(&alloc_lock);
+  return rv;
+}
+
+// Give back blocks set aside with blocks_reserve().
+void blocks_unreserve(int count) {
+  pthread_mutex_lock(&alloc_lock);
+  reserved -= count;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Let this thread's allocations take reserved blocks, giving back what
+// it was allowed before and didn't take.
+void blocks_use_reserved(int count) {
+  pthread_mutex_lock(&alloc_lock);
+  reserved -= reserved_claim;
+  reserved_claim = count;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Release the blocks freed since the last commit. Runs while no
+// operation is, so nothing else is looking at the bitmaps.
+void blocks_release_freed() {
+  void *bbm = get_blocks_bitmap();
+  if (freed == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&alloc_lock);
+  for (int bnum = next_set(freed, 0); bnum >= 0; bnum = next_set(freed, bnum + 1)) {
+    bitmap_put(bbm, bnum, 0);
+    blocks_dirty((uint8_t *) bbm + bnum / 8, 1);
+    if (group_free != 0) {
+      group_free[bnum / GROUP_BLOCKS]++;
+      free_total++;
+    }
+  }
+  memset(freed, 0, BLOCK_BITMAP_SIZE);
+  memset(reclaimed, 0, BLOCK_BITMAP_SIZE);
+  freed_count = 0;
+  pthread_mutex_unlock(&alloc_lock);
+}
+
+// Count the blocks free for new data, including those the running
+// transaction freed and not those set aside for held back appends.
+int blocks_free_count() {
+  pthread_mutex_lock(&alloc_lock);
+  if (group_free == 0) {
+    build_group_summary();
+  }
+  int count = free_total - reserved + freed_count;
+  pthread_mutex_unlock(&alloc_lock);
+  return count > 0 ? count : 0;
+}
+
+// Get the allocator's activity counters.
+void blocks_stats(blocks_stats_t *out) {
+  out->allocs = __atomic_load_n(&stats.allocs, __ATOMIC_RELAXED);
+  out->allocated = __atomic_load_n(&stats.allocated, __ATOMIC_RELAXED);
+  out->freed = __atomic_load_n(&stats.freed, __ATOMIC_RELAXED);
+  out->probed = __atomic_load_n(&stats.probed, __ATOMIC_RELAXED);
+  out->shared = __atomic_load_n(&stats.shared, __ATOMIC_RELAXED);
+  out->prefetched = __atomic_load_n(&stats.prefetched, __ATOMIC_RELAXED);
 }
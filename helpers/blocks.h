@@ -4,18 +4,86 @@
  *
  * A block-based abstraction over a disk image file.
  *
- * The disk image is mmapped, so block data is accessed using pointers.
+ * The whole disk image is addressable in memory, so block data is
+ * accessed using pointers. How that memory is backed is up to the backend
+ * picked in NUFS_BACKEND (see blockdev.h): by default the image is
+ * mmapped, while buffer cache backends read blocks in on first use.
+ *
+ * Images made by blocks_format() start with a superblock giving the block
+ * size, block count and inode count, followed by the block bitmap, the
+ * inode bitmap, the inode table, the block reference counts and an
+ * optional journal, each as many blocks as it needs. Images without a superblock are mounted in the
+ * legacy layout: 256 4K blocks, both bitmaps in block 0 and the inode
+ * table in block 1.
+ *
+ * Journaled images are mapped privately, so changes only reach the file
+ * when the journal writes them. Their block changes are tracked with
+ * blocks_dirty() and blocks_dirty_data() for the journal to pick up. The
+ * same marks tell an unjournaled buffer cache what blocks_sync() and
+ * blocks_flush() have to write back.
+ *
+ * Images may be regular files or block devices. A device isn't resized;
+ * it only has to hold the image.
  */
 #ifndef BLOCKS_H
 #define BLOCKS_H
 
+#include <stdint.h>
 #include <stdio.h>
 
-extern const int BLOCK_COUNT; // we split the "disk" into blocks (default = 256)
-extern const int BLOCK_SIZE;  // default = 4K
-extern const int NUFS_SIZE;   // default = 1MB
+extern int BLOCK_COUNT; // we split the "disk" into blocks (legacy = 256)
+extern int BLOCK_SIZE;  // legacy = 4K
+extern long NUFS_SIZE;  // legacy = 1MB
+
+extern int BLOCK_BITMAP_SIZE; // legacy = 256 / 8 = 32
+
+#define NUFS_MAGIC 0x5346554e // "NUFS" on disk
+#define NUFS_VERSION 5 // version 1 images have no journal fields, version 2
+                       // ones always have inode records of the bare fields,
+                       // versions before 4 have the 48-byte inode layout,
+                       // versions before 5 have no block reference counts
+
+#define NUFS_MIN_BLOCK_SIZE 4096
+#define NUFS_MAX_BLOCK_SIZE 65536
+
+#define NUFS_MIN_JOURNAL_BLOCKS 8
+
+/**
+ * On-disk superblock, stored at the start of block 0.
+ *
+ * Region starts and lengths are in blocks.
+ */
+typedef struct nufs_super {
+  uint32_t magic;         // NUFS_MAGIC, 0 when mounted in legacy mode
+  uint32_t version;       // NUFS_VERSION
+  uint32_t block_size;    // bytes per block, a power of two
+  uint32_t block_count;   // blocks in the image, a multiple of 8
+  uint32_t inode_count;   // inodes in the inode table
+  uint32_t inode_size;    // bytes per inode record at format time
+  uint32_t bbm_start;     // block bitmap
+  uint32_t bbm_blocks;
+  uint32_t ibm_start;     // inode bitmap
+  uint32_t ibm_blocks;
+  uint32_t itable_start;  // inode table
+  uint32_t itable_blocks;
+  uint32_t data_start;    // first block not used by metadata
+  uint32_t journal_start; // metadata journal, right before the data
+  uint32_t journal_blocks; // 0 for an unjournaled image
+  uint32_t refcount_start; // block reference counts, right before the journal
+  uint32_t refcount_blocks; // 0 before version 5
+} nufs_super_t;
 
-extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
+/**
+ * Block allocator and prefetch activity, counted from process start.
+ */
+typedef struct blocks_stats {
+  uint64_t allocs;    // alloc_blocks() calls
+  uint64_t allocated; // blocks handed out
+  uint64_t freed;     // blocks freed
+  uint64_t probed;    // block bitmap bits examined while allocating
+  uint64_t shared;    // references taken by blocks_ref()
+  uint64_t prefetched; // blocks blocks_prefetch() started reading
+} blocks_stats_t;
 
 /** 
  * Compute the number of blocks needed to store the given number of bytes.
@@ -26,18 +94,134 @@ extern const int BLOCK_BITMAP_SIZE; // default = 256 / 8 = 32
  */
 int bytes_to_blocks(int bytes);
 
+/**
+ * Write an empty filesystem layout with the given geometry to an image.
+ *
+ * Any previous contents of the image are discarded. The image is sparse,
+ * so large images only take space as blocks are written.
+ *
+ * @param image_path Path to the disk image file.
+ * @param block_size Bytes per block, a power of two from 4K to 64K.
+ * @param block_count Blocks in the image, a multiple of 8.
+ * @param inode_count Inodes in the inode table.
+ * @param inode_size Bytes per inode.
+ * @param journal_blocks Blocks to reserve for the journal, 0 for none.
+ *
+ * @return 0 on success, -1 if the geometry is invalid or the image
+ *         couldn't be written.
+ */
+int blocks_format(const char *image_path, int block_size, int block_count,
+                  int inode_count, int inode_size, int journal_blocks);
+
 /**
  * Load and initialize the given disk image.
  *
+ * Reads the geometry from the superblock and sets BLOCK_SIZE, BLOCK_COUNT
+ * and friends to match, falling back to the legacy layout for images
+ * without one.
+ *
  * @param image_path Path to the disk image file.
  */
 void blocks_init(const char *image_path);
 
+/**
+ * Get the geometry of the mounted image.
+ *
+ * @return The superblock, with magic 0 for a legacy image.
+ */
+const nufs_super_t *blocks_super();
+
 /**
  * Close the disk image.
+ *
+ * Writes back an unjournaled buffer cache first. blocks_init() closes
+ * the previous image itself.
  */
 void blocks_free();
 
+/**
+ * Write back everything an unjournaled buffer cache holds, and flush it.
+ *
+ * Does nothing for mapped or journaled images. Also runs at exit, and
+ * before blocks_format() so that old blocks can't land on a new layout.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+int blocks_flush();
+
+/**
+ * Get the file descriptor of the mounted image.
+ *
+ * @return The descriptor, for writing blocks back to a journaled image.
+ *         With the direct backend it's opened O_DIRECT, so transfers
+ *         need buffers from blockdev_buffer().
+ */
+int blocks_file();
+
+/**
+ * Record that a range of metadata changed.
+ *
+ * Marks every block the range touches. Does nothing if the image's memory
+ * is a shared mapping. Safe to call from several threads.
+ *
+ * @param ptr Start of the range, inside the mapped image.
+ * @param len Length of the range in bytes.
+ */
+void blocks_dirty(const void *ptr, size_t len);
+
+/**
+ * Record that file data blocks changed.
+ *
+ * Does nothing if the image's memory is a shared mapping. Safe to call
+ * from several threads.
+ *
+ * @param bnum First block number.
+ * @param count Number of consecutive blocks.
+ */
+void blocks_dirty_data(int bnum, int count);
+
+/**
+ * Count the metadata blocks marked dirty.
+ *
+ * @return Number of blocks marked by blocks_dirty() and not yet cleaned.
+ */
+int blocks_dirty_count();
+
+/**
+ * Find the next dirty block.
+ *
+ * @param from First block number to look at.
+ * @param meta Nonzero for metadata blocks, 0 for data blocks.
+ *
+ * @return Block number, or -1 if there are no more.
+ */
+int blocks_next_dirty(int from, int meta);
+
+/**
+ * Clear a block's dirty marks, both metadata and data.
+ *
+ * Not safe against concurrent marking; the journal only calls it while
+ * no operation is running.
+ *
+ * @param bnum Block number.
+ */
+void blocks_clean(int bnum);
+
+/**
+ * Write a range of the image's memory back to disk.
+ *
+ * Covers every page the range touches in a mapping, or every dirty
+ * block in a buffer cache. Does nothing on a journaled image, whose
+ * changes only reach the disk through the journal.
+ *
+ * @param ptr Start of the range, inside the mapped image.
+ * @param len Length of the range in bytes.
+ * @param wait Nonzero to wait for the writes, 0 to only start them.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+int blocks_sync(const void *ptr, size_t len, int wait);
+
 /**
  * Get the block with the given index, returning a pointer to its start.
  *
@@ -47,6 +231,61 @@ void blocks_free();
  */
 void *blocks_get_block(int bnum);
 
+/**
+ * Get a run of consecutive blocks, returning a pointer to the first.
+ *
+ * Use this instead of blocks_get_block() to access more than one block
+ * through a pointer: a buffer cache only reads in the blocks asked for,
+ * and reads the whole run as one transfer.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ *
+ * @return Pointer to the beginning of the first block in memory.
+ */
+void *blocks_get_blocks(int bnum, int count);
+
+/**
+ * Start reading a run of blocks that will be wanted soon.
+ *
+ * Where the backend can, the read goes on in the background and this
+ * returns at once; the direct backend reads them into its buffer cache
+ * before returning, as one transfer. Blocks a buffer cache already holds
+ * are skipped. Only a hint: the blocks still have to be got with
+ * blocks_get_blocks().
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ */
+void blocks_prefetch(int bnum, int count);
+
+/**
+ * Check whether a run is best read straight from the image file.
+ *
+ * True when reading blocks_file() at the run's offset gives its current
+ * contents, and a buffer cache doesn't already hold any of it: the run
+ * has no changes waiting to be written back, and the image isn't open
+ * O_DIRECT. The answer holds until the run is next written.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ *
+ * @return 1 if it is, 0 if the run has to be read through memory.
+ */
+int blocks_file_backed(int bnum, int count);
+
+/**
+ * Declare that a run of blocks is about to be overwritten whole.
+ *
+ * A buffer cache then skips reading them in: their old contents are
+ * never looked at. Call it instead of blocks_get_blocks() for blocks
+ * just allocated, before writing every byte of them.
+ *
+ * @param bnum First block number.
+ * @param count Number of blocks.
+ */
+void blocks_fresh(int bnum, int count);
+
 /**
  * Return a pointer to the beginning of the block bitmap.
  *
@@ -61,20 +300,145 @@ void *get_blocks_bitmap();
  */
 void *get_inode_bitmap();
 
+/**
+ * Return a pointer to the beginning of the inode table.
+ *
+ * The table spans blocks_super()->itable_blocks consecutive blocks.
+ *
+ * @return A pointer to the first inode.
+ */
+void *get_inode_table();
+
 /**
  * Allocate a new block and return its number.
  *
- * Grabs the first unused block and marks it as allocated.
+ * Grabs the next unused block after the allocation cursor and marks it
+ * as allocated.
  *
- * @return The index of the newly allocated block.
+ * @return The index of the newly allocated block, or -1 if the disk is full.
  */
 int alloc_block();
 
+/**
+ * Allocate up to n blocks, preferring one contiguous run near a goal.
+ *
+ * Looks for n consecutive free blocks starting at or after the goal (such
+ * as the block after a file's last block), wrapping around once. If no
+ * run is long enough, hands out free blocks in order from the goal.
+ * Blocks are written to out in allocation order. Safe to call from
+ * several threads, as is free_block(). Blocks freed in the running
+ * journal transaction are only handed out when nothing else is free.
+ *
+ * @param n Number of blocks wanted.
+ * @param goal Preferred first block, or 0 to continue from the cursor.
+ * @param out Array of at least n entries receiving the block numbers.
+ *
+ * @return Number of blocks allocated, less than n only if the disk is full.
+ */
+int alloc_blocks(int n, int goal, int *out);
+
 /**
  * Deallocate the block with the given number.
  *
+ * On a journaled image the block stays allocated until the next
+ * blocks_release_freed(), unless alloc_blocks() runs out of free blocks
+ * first.
+ *
+ * A block shared by several files (see blocks_ref()) only loses one
+ * owner, and stays allocated until the last one frees it.
+ *
  * @param bnun The block number to deallocate.
  */
 void free_block(int bnum);
 
+/**
+ * Take another reference to an allocated block, for a file that shares it.
+ *
+ * Each reference is given back with free_block(). The counts live in the
+ * image, so they change with the metadata that records the sharing.
+ *
+ * @param bnum Block number.
+ *
+ * @return 0 on success, -1 if the image has no reference counts (before
+ *         version 5) or the block has as many owners as they can count.
+ */
+int blocks_ref(int bnum);
+
+/**
+ * Check whether a block has more than one owner.
+ *
+ * A file that writes a shared block has to give itself a copy first.
+ * Safe to call without locks: a block only becomes shared through a file
+ * that owns it, and stays shared until one of the others lets it go.
+ *
+ * @param bnum Block number.
+ *
+ * @return 1 if the block is shared, 0 otherwise.
+ */
+int blocks_shared(int bnum);
+
+/**
+ * Set aside free blocks for a later allocation.
+ *
+ * Reserved blocks are kept from every allocation except those of a
+ * thread that claimed them with blocks_use_reserved(), so writes held
+ * back in memory can fail with ENOSPC when they are made, not when they
+ * are flushed.
+ *
+ * @param count Number of blocks.
+ *
+ * @return 0 on success, -1 if not that many blocks are free.
+ */
+int blocks_reserve(int count);
+
+/**
+ * Give back blocks set aside with blocks_reserve().
+ *
+ * @param count Number of blocks.
+ */
+void blocks_unreserve(int count);
+
+/**
+ * Let this thread's allocations use reserved blocks.
+ *
+ * Whatever the thread was allowed by its previous call and didn't
+ * allocate is given back first, so a call with 0 ends the claim.
+ *
+ * @param count Number of reserved blocks the thread may allocate.
+ */
+void blocks_use_reserved(int count);
+
+/**
+ * Release the blocks freed since the last call.
+ *
+ * Called by the journal while it snapshots a transaction, so that the
+ * transaction commits the frees together with the metadata that stopped
+ * using the blocks. A freed block reused before then has its data
+ * journaled, not just written in place: a crash can't leave its old
+ * owner pointing at new data. Does nothing unless the image is journaled.
+ */
+void blocks_release_freed();
+
+/**
+ * Count the blocks free for new data.
+ *
+ * Blocks freed in the running journal transaction count as free, blocks
+ * set aside with blocks_reserve() don't. The allocator keeps the count up
+ * to date as it goes, so only the first call after blocks_init() reads
+ * the bitmap. Safe to call from several threads.
+ *
+ * @return Number of free blocks.
+ */
+int blocks_free_count();
+
+/**
+ * Get the allocator's activity counters.
+ *
+ * Safe to call from several threads; the counters are read one by one,
+ * not as a consistent snapshot.
+ *
+ * @param out Receives the counters.
+ */
+void blocks_stats(blocks_stats_t *out);
+
 #endif
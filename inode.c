@@ -2,19 +2,91 @@
  * @file inode.c
  * @brief Implementation of inode manipulation routines.
  *
- * Manages the inode table stored in block 1 of the filesystem.
- * Provides allocation, deallocation, and block management for inodes.
+ * Manages the inode table, which spans the blocks the superblock gives it
+ * (block 1 on legacy images). Provides allocation, deallocation, and block management for inodes.
+ * Each record is the inode's fields followed by room for a small file's
+ * data, as large as the superblock's inode size allows.
+ *
+ * Images before version 4 hold the fields in an older layout. Their
+ * inodes are converted into an array in memory at mount, and
+ * inode_dirty() writes each change back to the record.
  */
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "inode.h"
+#include "trace.h"
 #include "helpers/blocks.h"
 #include "helpers/bitmap.h"
 
-// Block number where the inode table is stored
-#define INODE_TABLE_BLOCK 1
+// Number of usable inodes, set by inode_init()
+int INODE_COUNT = 0;
+
+// Bytes of file data an inode record holds, set by inode_init()
+int INODE_INLINE_SIZE = 0;
+
+// Bytes per inode record in the table: the fields, then inline data
+static int inode_record_size = sizeof(inode_t);
+
+/**
+ * Inode fields as images before version 4 store them.
+ */
+typedef struct inode_old {
+    int32_t refs;
+    int32_t mode;
+    int32_t size;
+    int32_t block;
+    int32_t indirect;
+    int32_t index;
+    int64_t atime;          // seconds since the epoch
+    int64_t mtime;
+    int32_t uid;
+    int32_t gid;
+} inode_old_t;
+
+// Inodes of an image in the old layout, NULL when get_inode() points
+// straight into the table
+static inode_t *inode_incore = NULL;
+
+// One reader/writer lock per inode, sized by inode_init()
+static pthread_rwlock_t *inode_locks = NULL;
+static int inode_lock_count = 0;
+
+/**
+ * Disk blocks of a file's logical blocks, remembered as its pointer
+ * tables are walked. An entry holds the disk block plus one, 1 for a
+ * hole, or 0 where the tables haven't been looked at yet.
+ */
+typedef struct inode_map {
+    int count;          // entries, logical blocks from 0 up
+    uint32_t bnum[];
+} inode_map_t;
+
+// Block map per inode, NULL until the file's pointer tables are first
+// walked. Holders of the inode's read lock fill entries in with atomic
+// stores; only the write lock's holder changes them or frees the map.
+static inode_map_t **inode_maps = NULL;
+
+// Guards the inode bitmap and the count of free inodes in it
+static pthread_mutex_t inode_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static int inode_free = 0;
+
+// Block numbers held by one pointer table
+#define PTRS_PER_BLOCK (BLOCK_SIZE / (int)sizeof(int))
+
+// Data slots in the indirect table, the last slot chains to the
+// double-indirect table
+#define INDIRECT_SLOTS (PTRS_PER_BLOCK - 1)
+
+// Most blocks grow_inode() requests from the allocator at once
+#define GROW_BATCH 64
+
+// Logical blocks a file can map
+#define INODE_MAX_BLOCKS (1 + INDIRECT_SLOTS + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
 
 /**
  * Print inode information for debugging.
@@ -26,15 +98,28 @@ void print_inode(inode_t *node) {
         printf("inode: NULL\n");
         return;
     }
-    printf("inode: refs=%d, mode=%o, size=%d, block=%d, indirect=%d\n",
-           node->refs, node->mode, node->size, node->block, node->indirect);
+    printf("inode: refs=%d, mode=%o, size=%d, block=%d, indirect=%d, index=%d, "
+           "generation=%u\n", node->refs, node->mode, node->size, node->block,
+           node->indirect, node->index, node->generation);
+}
+
+/**
+ * Get an inode's record in the inode table.
+ *
+ * @param inum Inode number, in range.
+ *
+ * @return Pointer to the start of the record.
+ */
+static char *inode_record(int inum) {
+    return (char *)get_inode_table() + (size_t)inum * inode_record_size;
 }
 
 /**
  * Get a pointer to the inode with the given inode number.
  *
- * The inode table is stored in block 1. Each inode is accessed
- * by calculating its offset within that block.
+ * The inode table is stored in consecutive blocks. Each inode is
+ * accessed by calculating its offset from the start of the table, or
+ * found in memory for an image in the old layout.
  *
  * @param inum Inode number 
  *
@@ -45,8 +130,123 @@ inode_t *get_inode(int inum) {
         return NULL;
     }
     
-    inode_t *inode_table = (inode_t *)blocks_get_block(INODE_TABLE_BLOCK);
-    return &inode_table[inum];
+    if (inode_incore != NULL) {
+        return &inode_incore[inum];
+    }
+    return (inode_t *)inode_record(inum);
+}
+
+/**
+ * Get the inode number of an inode in the inode table.
+ *
+ * Computed from the pointer's offset within the inode table.
+ *
+ * @param node Pointer returned by get_inode().
+ *
+ * @return The inode number, or -1 if node is not in the inode table.
+ */
+int inode_get_inum(inode_t *node) {
+    if (node == NULL) {
+        return -1;
+    }
+
+    if (inode_incore != NULL) {
+        long inum = node - inode_incore;
+        return inum >= 0 && inum < INODE_COUNT ? (int)inum : -1;
+    }
+    
+    char *inode_table = get_inode_table();
+    long offset = (char *)node - inode_table;
+    if (offset < 0 || offset % inode_record_size != 0 ||
+        offset / inode_record_size >= INODE_COUNT) {
+        return -1;
+    }
+    return (int)(offset / inode_record_size);
+}
+
+/**
+ * Record that an inode's fields changed.
+ *
+ * An inode of an old layout image is written back to its record here.
+ * Readers store the access time under a shared lock and may get here
+ * together, so its fields are copied with atomic loads and stores.
+ *
+ * @param node Pointer returned by get_inode().
+ */
+void inode_dirty(inode_t *node) {
+    if (inode_incore == NULL) {
+        blocks_dirty(node, sizeof(inode_t));
+        return;
+    }
+    
+    inode_old_t *old = (inode_old_t *)inode_record(node - inode_incore);
+    __atomic_store_n(&old->refs, node->refs, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->mode, __atomic_load_n(&node->mode, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&old->size, node->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->block, node->block, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->indirect, node->indirect, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->index, node->index, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->atime,
+                     __atomic_load_n(&node->atime, __ATOMIC_RELAXED) / 1000000000,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&old->mtime, node->mtime / 1000000000, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->uid, (int32_t)node->uid, __ATOMIC_RELAXED);
+    __atomic_store_n(&old->gid, (int32_t)node->gid, __ATOMIC_RELAXED);
+    blocks_dirty(old, sizeof(inode_old_t));
+}
+
+/**
+ * Record that a block pointer changed, in the inode or a pointer table.
+ *
+ * @param node Pointer to the inode the slot maps blocks of.
+ * @param slot Pointer returned by inode_bnum_slot() or a table slot.
+ */
+static void inode_dirty_slot(inode_t *node, int *slot) {
+    if (slot == &node->block || slot == &node->indirect) {
+        inode_dirty(node);
+    } else {
+        blocks_dirty(slot, sizeof(int));
+    }
+}
+
+/**
+ * Get the current time as inode timestamps hold it.
+ *
+ * @return Nanoseconds since the epoch.
+ */
+int64_t inode_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Get the file data an inode record holds.
+ *
+ * The area follows the fields; it holds INODE_INLINE_SIZE bytes.
+ *
+ * @param node Pointer returned by get_inode().
+ *
+ * @return Pointer to the inline data.
+ */
+char *inode_inline_data(inode_t *node) {
+    if (inode_incore != NULL) {
+        return inode_record(node - inode_incore) + sizeof(inode_old_t);
+    }
+    return (char *)(node + 1);
+}
+
+/**
+ * Check whether a file keeps its data in its inode record.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return 1 for a regular file small enough and without blocks, 0 otherwise.
+ */
+int inode_is_inline(inode_t *node) {
+    return S_ISREG(node->mode) && node->size <= INODE_INLINE_SIZE && node->block == 0 &&
+           node->indirect == 0;
 }
 
 /**
@@ -57,85 +257,376 @@ inode_t *get_inode(int inum) {
 int alloc_inode() {
     void *ibm = get_inode_bitmap();
     
-    // Find first free inode
-    for (int ii = 0; ii < INODE_COUNT; ++ii) {
-        if (!bitmap_get(ibm, ii)) {
-            // Mark as used
-            bitmap_put(ibm, ii, 1);
-            
-            // Initialize the inode
-            inode_t *node = get_inode(ii);
-            memset(node, 0, sizeof(inode_t));
-            node->refs = 1;
-            node->mode = 0;
-            node->size = 0;
-            node->block = 0;
-            node->indirect = 0;
-            node->uid = getuid();
-            node->gid = getgid();
-            node->atime = time(NULL);
-            node->mtime = time(NULL);
-            
-            printf("+ alloc_inode() -> %d\n", ii);
-            return ii;
-        }
+    // Find first free inode and mark it used
+    pthread_mutex_lock(&inode_alloc_lock);
+    int ii = bitmap_find_zero(ibm, 0, INODE_COUNT);
+    if (ii >= 0) {
+        bitmap_put(ibm, ii, 1);
+        blocks_dirty((char *)ibm + ii / 8, 1);
+        inode_free--;
     }
+    pthread_mutex_unlock(&inode_alloc_lock);
+    
+    if (ii < 0) {
+        return -1;  // No free inodes
+    }
+    
+    // Initialize the inode. Stale lookups may still hold its number, so
+    // this happens under its lock; storage_is_dir() reads the mode
+    // without it, so that's stored atomically.
+    inode_wrlock(ii);
+    inode_t *node = get_inode(ii);
+    node->refs = 1;
+    __atomic_store_n(&node->mode, 0, __ATOMIC_RELAXED);
+    node->size = 0;
+    node->block = 0;
+    node->indirect = 0;
+    node->index = 0;
+    node->uid = getuid();
+    node->gid = getgid();
+    node->atime = inode_now();
+    node->mtime = node->atime;
+    node->generation++;  // Told apart from the number's previous owner
+    memset(node->extent, 0, sizeof(node->extent));
+    inode_dirty(node);
     
-    return -1;  // No free inodes
+    // Inline bytes past a file's size always read as zeros
+    memset(inode_inline_data(node), 0, INODE_INLINE_SIZE);
+    blocks_dirty(inode_inline_data(node), INODE_INLINE_SIZE);
+    inode_unlock(ii);
+    
+    TRACE_EVENT(TRACE_ALLOC_INODE, ii, 0, 0);
+    return ii;
 }
 
 /**
- * Free an inode and all its associated data blocks.
+ * Allocate a zeroed block for a pointer table, if the slot is empty.
  *
- * Releases the direct block and all indirect blocks, then clears
- * the inode bitmap entry.
+ * @param node Pointer to the inode the table maps blocks of.
+ * @param slot Where the table's block number is (or will be) stored.
+ * @param alloc Whether a missing table may be allocated.
  *
- * @param inum Inode number to free.
+ * @return 0 if the slot now holds a table, -1 otherwise.
  */
-void free_inode(int inum) {
-    if (inum < 0 || inum >= INODE_COUNT) {
-        return;
+static int inode_ensure_table(inode_t *node, int *slot, int alloc) {
+    if (*slot != 0) {
+        return 0;
+    }
+    if (!alloc) {
+        return -1;
     }
     
-    printf("+ free_inode(%d)\n", inum);
+    int bnum = alloc_block();
+    if (bnum < 0) {
+        return -1;
+    }
+    memset(blocks_get_block(bnum), 0, BLOCK_SIZE);
+    blocks_dirty(blocks_get_block(bnum), BLOCK_SIZE);
+    *slot = bnum;
+    inode_dirty_slot(node, slot);
+    return 0;
+}
+
+/**
+ * Find the pointer slot that holds a logical block's disk block number.
+ *
+ * Block 0 lives in the direct pointer, blocks 1 to INDIRECT_SLOTS in the
+ * indirect table, and the rest under the double-indirect table hanging
+ * off the indirect table's last slot.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Logical block number within the file.
+ * @param alloc Whether missing pointer tables may be allocated.
+ *
+ * @return Pointer to the slot, or NULL if a table on the way is missing
+ *         (or could not be allocated) or file_bnum is past the maximum.
+ */
+static int *inode_bnum_slot(inode_t *node, int file_bnum, int alloc) {
+    if (file_bnum == 0) {
+        return &node->block;
+    }
+    if (file_bnum >= INODE_MAX_BLOCKS) {
+        return NULL;
+    }
     
-    inode_t *node = get_inode(inum);
+    if (inode_ensure_table(node, &node->indirect, alloc) < 0) {
+        return NULL;
+    }
+    int *indirect_table = (int *)blocks_get_block(node->indirect);
     
-    // Free the direct block if allocated
-    if (node->block != 0) {
-        free_block(node->block);
+    int index = file_bnum - 1;  // Offset by 1 since block 0 is direct
+    if (index < INDIRECT_SLOTS) {
+        return &indirect_table[index];
     }
     
-    // Free indirect blocks if allocated
-    if (node->indirect != 0) {
-        int *indirect_table = (int *)blocks_get_block(node->indirect);
-        int num_indirect = bytes_to_blocks(node->size) - 1;
-        
-        // Free each block pointed to by the indirect table
-        for (int ii = 0; ii < num_indirect && ii < BLOCK_SIZE / (int)sizeof(int); ++ii) {
+    // Past the indirect table, go through the double-indirect table
+    index -= INDIRECT_SLOTS;
+    if (inode_ensure_table(node, &indirect_table[INDIRECT_SLOTS], alloc) < 0) {
+        return NULL;
+    }
+    int *double_table = (int *)blocks_get_block(indirect_table[INDIRECT_SLOTS]);
+    
+    int *table_slot = &double_table[index / PTRS_PER_BLOCK];
+    if (inode_ensure_table(node, table_slot, alloc) < 0) {
+        return NULL;
+    }
+    int *table = (int *)blocks_get_block(*table_slot);
+    return &table[index % PTRS_PER_BLOCK];
+}
+
+/**
+ * Check whether a logical block sits in the first slot of its table.
+ *
+ * @param file_bnum Logical block number within the file.
+ *
+ * @return 1 if the block's slot does not directly follow the previous
+ *         block's slot in memory, 0 otherwise.
+ */
+static int inode_table_start(int file_bnum) {
+    if (file_bnum <= 1) {
+        return 1;
+    }
+    int index = file_bnum - 1 - INDIRECT_SLOTS;
+    return index >= 0 && index % PTRS_PER_BLOCK == 0;
+}
+
+/**
+ * Get an inode's block map, making one if the file has pointer tables.
+ *
+ * Files mapping one block only have the direct pointer and get none. A
+ * new map has room for the file to double before it has to be replaced.
+ * Readers may race to make it; the first one in wins.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return The map, or NULL if the file has none.
+ */
+static inode_map_t *inode_map(inode_t *node) {
+    if (node->indirect == 0 || inode_maps == NULL) {
+        return NULL;
+    }
+    
+    int inum = inode_get_inum(node);
+    inode_map_t *map = __atomic_load_n(&inode_maps[inum], __ATOMIC_ACQUIRE);
+    if (map != NULL) {
+        return map;
+    }
+    
+    long count = 2L * bytes_to_blocks(node->size) + 2;
+    count = count < INODE_MAX_BLOCKS ? count : INODE_MAX_BLOCKS;
+    map = calloc(1, sizeof(inode_map_t) + count * sizeof(uint32_t));
+    if (map == NULL) {
+        return NULL;
+    }
+    map->count = (int)count;
+    
+    inode_map_t *none = NULL;
+    if (!__atomic_compare_exchange_n(&inode_maps[inum], &none, map, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        free(map);
+        return none;
+    }
+    return map;
+}
 
-            if (indirect_table[ii] != 0) {
-                free_block(indirect_table[ii]);
+/**
+ * Drop an inode's block map.
+ *
+ * The caller holds the inode's write lock.
+ *
+ * @param inum Inode number.
+ */
+static void inode_map_drop(int inum) {
+    if (inode_maps != NULL && inum >= 0) {
+        free(inode_maps[inum]);
+        __atomic_store_n(&inode_maps[inum], NULL, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Fill in the block map entries of logical blocks [from, to).
+ *
+ * Walks the pointer tables once per table, as inode_map_range() would.
+ *
+ * @param node Pointer to the inode.
+ * @param map Its block map; to is at most map->count.
+ * @param from First logical block.
+ * @param to One past the last.
+ */
+static void inode_map_fill(inode_t *node, inode_map_t *map, int from, int to) {
+    int *slot = NULL;
+    for (int ii = from; ii < to; ++ii) {
+        if (ii == from || inode_table_start(ii)) {
+            slot = inode_bnum_slot(node, ii, 0);
+        } else if (slot != NULL) {
+            slot++;
+        }
+        uint32_t entry = (slot != NULL && *slot > 0) ? (uint32_t)*slot + 1 : 1;
+        __atomic_store_n(&map->bnum[ii], entry, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Record a new disk block for a logical block in the inode's block map.
+ *
+ * The caller holds the inode's write lock. A file grown past its map
+ * drops it, the next reader makes a larger one.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum Logical block number within the file.
+ * @param bnum Its disk block, 0 for a hole.
+ */
+static void inode_map_set(inode_t *node, int file_bnum, int bnum) {
+    int inum = inode_get_inum(node);
+    inode_map_t *map = inode_maps != NULL ? inode_maps[inum] : NULL;
+    if (map == NULL) {
+        return;
+    }
+    
+    if (file_bnum >= map->count) {
+        inode_map_drop(inum);
+    } else {
+        __atomic_store_n(&map->bnum[file_bnum], bnum > 0 ? (uint32_t)bnum + 1 : 1,
+                         __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Forget the block map entries from a logical block on.
+ *
+ * The caller holds the inode's write lock.
+ *
+ * @param node Pointer to the inode.
+ * @param from First logical block to forget.
+ */
+static void inode_map_forget(inode_t *node, int from) {
+    int inum = inode_get_inum(node);
+    inode_map_t *map = inode_maps != NULL ? inode_maps[inum] : NULL;
+    if (map == NULL) {
+        return;
+    }
+    
+    if (from <= 0) {
+        inode_map_drop(inum);
+    } else if (from < map->count) {
+        memset(&map->bnum[from], 0, (size_t)(map->count - from) * sizeof(uint32_t));
+    }
+}
+
+/**
+ * Free pointer tables that no logical block below nblocks needs.
+ *
+ * @param node Pointer to the inode.
+ * @param nblocks Number of logical blocks still in use.
+ */
+static void inode_free_tables(inode_t *node, int nblocks) {
+    if (node->indirect == 0) {
+        return;
+    }
+    
+    int *indirect_table = (int *)blocks_get_block(node->indirect);
+    int double_bnum = indirect_table[INDIRECT_SLOTS];
+    if (double_bnum != 0) {
+        int *double_table = (int *)blocks_get_block(double_bnum);
+        
+        // Second-level tables from this index on are unused
+        int keep = 0;
+        if (nblocks > 1 + INDIRECT_SLOTS) {
+            keep = (nblocks - 1 - INDIRECT_SLOTS + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+        }
+        
+        for (int ii = keep; ii < PTRS_PER_BLOCK; ++ii) {
+            if (double_table[ii] != 0) {
+                free_block(double_table[ii]);
+                double_table[ii] = 0;
+                blocks_dirty(&double_table[ii], sizeof(int));
             }
         }
         
-        // Free the indirect block itself
+        if (keep == 0) {
+            free_block(double_bnum);
+            indirect_table[INDIRECT_SLOTS] = 0;
+            blocks_dirty(&indirect_table[INDIRECT_SLOTS], sizeof(int));
+        }
+    }
+    
+    // If we're down to 0 or 1 blocks, free the indirect block
+    if (nblocks <= 1) {
         free_block(node->indirect);
+        node->indirect = 0;
+        inode_dirty(node);
+    }
+}
+
+/**
+ * Free the data blocks for logical blocks [from, to), last first.
+ *
+ * @param node Pointer to the inode.
+ * @param from First logical block to free.
+ * @param to One past the last logical block to free.
+ */
+static void inode_free_range(inode_t *node, int from, int to) {
+    for (int ii = to - 1; ii >= from; --ii) {
+        int *slot = inode_bnum_slot(node, ii, 0);
+        if (slot != NULL && *slot != 0) {
+            free_block(*slot);
+            *slot = 0;
+            inode_dirty_slot(node, slot);
+        }
+    }
+    inode_free_tables(node, from);
+    inode_map_forget(node, from);
+}
+
+/**
+ * Free an inode and all its associated data blocks.
+ *
+ * Releases the direct block, the data blocks and all pointer tables,
+ * then clears the inode bitmap entry.
+ *
+ * @param inum Inode number to free.
+ */
+void free_inode(int inum) {
+    if (inum < 0 || inum >= INODE_COUNT) {
+        return;
     }
     
-    // Clear the inode
-    memset(node, 0, sizeof(inode_t));
+    TRACE_EVENT(TRACE_FREE_INODE, inum, 0, 0);
+    
+    inode_t *node = get_inode(inum);
+    
+    // Free every mapped block along with the pointer tables
+    inode_free_range(node, 0, bytes_to_blocks(node->size));
+    
+    // Clear the inode; storage_is_dir() reads the mode without its lock
+    __atomic_store_n(&node->mode, 0, __ATOMIC_RELAXED);
+    node->refs = 0;
+    node->size = 0;
+    node->block = 0;
+    node->indirect = 0;
+    node->index = 0;
+    node->atime = 0;
+    node->mtime = 0;
+    node->uid = 0;
+    node->gid = 0;
+    inode_dirty(node);  // The generation carries over to the next owner
     
     // Mark as free in bitmap
     void *ibm = get_inode_bitmap();
+    pthread_mutex_lock(&inode_alloc_lock);
+    if (bitmap_get(ibm, inum)) {
+        inode_free++;
+    }
     bitmap_put(ibm, inum, 0);
+    blocks_dirty((char *)ibm + inum / 8, 1);
+    pthread_mutex_unlock(&inode_alloc_lock);
 }
 
 /**
  * Get the block number for a given file block index.
  *
  * Block 0 is stored in the direct pointer. Blocks 1+ are stored
- * in the indirect block table.
+ * in the indirect block table, or under the double-indirect table.
  *
  * @param node Pointer to the inode.
  * @param file_bnum Logical block number within the file.
@@ -147,83 +638,564 @@ int inode_get_bnum(inode_t *node, int file_bnum) {
         return -1;
     }
     
-    // First block is the direct pointer
-    if (file_bnum == 0) {
-        return node->block;
+    // Random access comes back to the same blocks, answer from the map
+    inode_map_t *map = file_bnum > 0 ? inode_map(node) : NULL;
+    if (map != NULL && file_bnum < map->count) {
+        uint32_t entry = __atomic_load_n(&map->bnum[file_bnum], __ATOMIC_RELAXED);
+        if (entry == 0) {
+            inode_map_fill(node, map, file_bnum, file_bnum + 1);
+            entry = __atomic_load_n(&map->bnum[file_bnum], __ATOMIC_RELAXED);
+        }
+        return entry > 1 ? (int)(entry - 1) : -1;
     }
     
-    // Subsequent blocks are in the indirect table
-    if (node->indirect == 0) {
-        return -1; 
+    int *slot = inode_bnum_slot(node, file_bnum, 0);
+    if (slot == NULL) {
+        return -1;
     }
     
-    int *indirect_table = (int *)blocks_get_block(node->indirect);
-    int indirect_index = file_bnum - 1;  // Offset by 1 since block 0 is direct
+    return *slot;
+}
+
+/**
+ * Map a run of logical blocks to a contiguous run of disk blocks.
+ *
+ * Walks the pointer tables once per table rather than once per block,
+ * extending the run for as long as the disk blocks stay consecutive.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum First logical block of the run.
+ * @param count Most blocks the caller wants mapped.
+ * @param bnum Set to the disk block of file_bnum, 0 for a hole.
+ *
+ * @return Length of the run in blocks, or 0 past the largest file.
+ */
+int inode_map_range(inode_t *node, int file_bnum, int count, int *bnum) {
+    if (node == NULL || file_bnum < 0 || count <= 0) {
+        return 0;
+    }
     
-    if (indirect_index >= BLOCK_SIZE / (int)sizeof(int)) {
-        return -1;  
+    if (file_bnum >= INODE_MAX_BLOCKS) {
+        return 0;
+    }
+    
+    // The map resolves the whole range once, later calls only read it
+    inode_map_t *map = inode_map(node);
+    if (map != NULL && file_bnum < map->count) {
+        int end = count < map->count - file_bnum ? file_bnum + count : map->count;
+        uint32_t first = 0;
+        int run = 0;
+        while (file_bnum + run < end) {
+            int next = file_bnum + run;
+            uint32_t entry = __atomic_load_n(&map->bnum[next], __ATOMIC_RELAXED);
+            if (entry == 0) {
+                inode_map_fill(node, map, next, end);
+                entry = __atomic_load_n(&map->bnum[next], __ATOMIC_RELAXED);
+            }
+            if (run == 0) {
+                first = entry;
+            } else if (entry != (first == 1 ? 1 : first + run)) {
+                break;
+            }
+            run++;
+        }
+        *bnum = (int)first - 1;
+        return run;
+    }
+    
+    // A missing table is a hole as long as the blocks it would map
+    int *slot = inode_bnum_slot(node, file_bnum, 0);
+    int first = slot != NULL ? *slot : 0;
+    int run = 1;
+    while (run < count && file_bnum + run < INODE_MAX_BLOCKS) {
+        int next = file_bnum + run;
+        
+        // Slots within a table are adjacent, so only re-walk at table edges
+        if (inode_table_start(next)) {
+            slot = inode_bnum_slot(node, next, 0);
+        } else if (slot != NULL) {
+            slot++;
+        }
+        
+        // Holes extend a hole run, data extends a consecutive run
+        int expect = (first == 0) ? 0 : first + run;
+        if ((slot != NULL ? *slot : 0) != expect) {
+            break;
+        }
+        run++;
     }
     
-    return indirect_table[indirect_index];
+    *bnum = first;
+    return run;
 }
 
 /**
- * Grow an inode to accommodate the given size.
+ * Write an inode and its pointer tables back to disk.
  *
  * @param node Pointer to the inode.
- * @param size New size in bytes.
+ * @param data Whether to write every data block of the file too.
+ * @param wait Nonzero to wait for the writes, 0 to only start them.
  *
- * @return 0 on success, -1 on failure.
+ * @return 0 on success, -1 on an I/O error.
  */
-int grow_inode(inode_t *node, int size) {
-    if (node == NULL) {
-        return -1;
+int inode_sync(inode_t *node, int data, int wait) {
+    int rv = blocks_sync(inode_record(inode_get_inum(node)), inode_record_size, wait);
+    
+    if (node->indirect != 0) {
+        int *indirect_table = (int *)blocks_get_block(node->indirect);
+        rv |= blocks_sync(indirect_table, BLOCK_SIZE, wait);
+        
+        int double_bnum = indirect_table[INDIRECT_SLOTS];
+        if (double_bnum != 0) {
+            int *double_table = (int *)blocks_get_block(double_bnum);
+            rv |= blocks_sync(double_table, BLOCK_SIZE, wait);
+            for (int ii = 0; ii < PTRS_PER_BLOCK; ++ii) {
+                if (double_table[ii] != 0) {
+                    rv |= blocks_sync(blocks_get_block(double_table[ii]), BLOCK_SIZE, wait);
+                }
+            }
+        }
     }
     
-    int current_blocks = bytes_to_blocks(node->size);
-    int target_blocks = bytes_to_blocks(size);
+    // One msync per physically contiguous run
+    int nblocks = bytes_to_blocks(node->size);
+    for (int ii = 0; data && ii < nblocks;) {
+        int bnum;
+        int run = inode_map_range(node, ii, nblocks - ii, &bnum);
+        if (run <= 0) {
+            break;
+        }
+        if (bnum > 0) {
+            rv |= blocks_sync(blocks_get_block(bnum), (size_t)run * BLOCK_SIZE, wait);
+        }
+        ii += run;
+    }
     
-    // Size 0 needs 0 blocks
-    if (size == 0) {
-        target_blocks = 0;
+    return rv < 0 ? -1 : 0;
+}
+
+/**
+ * Count the pointer tables that blocks [first, last) need and that don't
+ * exist yet.
+ *
+ * @param node Pointer to the inode.
+ * @param first First logical block.
+ * @param last One past the last logical block.
+ *
+ * @return Number of missing tables.
+ */
+static int inode_tables_missing(inode_t *node, int first, int last) {
+    if (last <= 1) {
+        return 0;
+    }
+    
+    int missing = 0;
+    int *indirect_table = NULL;
+    if (node->indirect != 0) {
+        indirect_table = (int *)blocks_get_block(node->indirect);
+    } else {
+        missing++;
+    }
+    if (last <= 1 + INDIRECT_SLOTS) {
+        return missing;
     }
+    
+    int *double_table = NULL;
+    if (indirect_table != NULL && indirect_table[INDIRECT_SLOTS] != 0) {
+        double_table = (int *)blocks_get_block(indirect_table[INDIRECT_SLOTS]);
+    } else {
+        missing++;
+    }
+    
+    // Second-level tables covering the part of the range past the indirect one
+    int from = first > 1 + INDIRECT_SLOTS ? first : 1 + INDIRECT_SLOTS;
+    int table_first = (from - 1 - INDIRECT_SLOTS) / PTRS_PER_BLOCK;
+    int table_last = (last - 2 - INDIRECT_SLOTS) / PTRS_PER_BLOCK;
+    for (int ii = table_first; ii <= table_last; ++ii) {
+        if (double_table == NULL || double_table[ii] == 0) {
+            missing++;
+        }
+    }
+    return missing;
+}
+
+/**
+ * Count the blocks inode_alloc_range() would allocate for a range.
+ *
+ * @param node Pointer to the inode.
+ * @param from Start of the range in bytes.
+ * @param to End of the range in bytes.
+ *
+ * @return Data blocks for holes and copies of shared blocks, plus pointer
+ *         tables; 0 if the range is backed by blocks of the file's own.
+ */
+int inode_blocks_needed(inode_t *node, int from, int to) {
+    if (node == NULL || to <= from) {
+        return 0;
+    }
+    
+    // Past the inline data, its bytes move to block 0 as well
+    if (inode_is_inline(node)) {
+        if (to <= INODE_INLINE_SIZE) {
+            return 0;
+        }
+        if (node->size > 0) {
+            from = 0;
+        }
+    }
+    
+    int first = from / BLOCK_SIZE;
+    int last = (to - 1) / BLOCK_SIZE + 1;
+    int needed = 0;
+    for (int ii = first; ii < last;) {
+        int bnum;
+        int run = inode_map_range(node, ii, last - ii, &bnum);
+        if (run <= 0) {
+            break;
+        }
+        if (bnum == 0) {
+            needed += run;
+        } else {
+            for (int jj = 0; jj < run; ++jj) {
+                needed += blocks_shared(bnum + jj);
+            }
+        }
+        ii += run;
+    }
+    
+    return needed > 0 ? needed + inode_tables_missing(node, first, last) : 0;
+}
+
+/**
+ * Count the blocks an inode uses, pointer tables included.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return Number of blocks.
+ */
+int inode_blocks_used(inode_t *node) {
+    int used = node->block != 0;
+    if (node->indirect == 0) {
+        return used;
+    }
+    
+    int *indirect_table = (int *)blocks_get_block(node->indirect);
+    used++;
+    for (int ii = 0; ii < INDIRECT_SLOTS; ++ii) {
+        used += indirect_table[ii] != 0;
+    }
+    if (indirect_table[INDIRECT_SLOTS] == 0) {
+        return used;
+    }
+    
+    int *double_table = (int *)blocks_get_block(indirect_table[INDIRECT_SLOTS]);
+    used++;
+    for (int ii = 0; ii < PTRS_PER_BLOCK; ++ii) {
+        if (double_table[ii] != 0) {
+            int *table = (int *)blocks_get_block(double_table[ii]);
+            used++;
+            for (int jj = 0; jj < PTRS_PER_BLOCK; ++jj) {
+                used += table[jj] != 0;
+            }
+        }
+    }
+    return used;
+}
+
+/**
+ * Move a file's inline data out to a block of its own.
+ *
+ * Called before the file grows past what its inode record holds. The
+ * inline area is left zeroed.
+ *
+ * @param node Pointer to an inode for which inode_is_inline() holds.
+ *
+ * @return 0 on success, -1 if no block could be allocated.
+ */
+static int inode_spill(inode_t *node) {
     if (node->size == 0) {
-        current_blocks = 0;
+        return 0;
     }
     
-    printf("+ grow_inode: %d blocks -> %d blocks\n", current_blocks, target_blocks);
+    int bnum = alloc_block();
+    if (bnum < 0) {
+        return -1;
+    }
+    char *data = inode_inline_data(node);
+    char *block = blocks_get_block(bnum);
+    memcpy(block, data, node->size);
+    memset(block + node->size, 0, BLOCK_SIZE - node->size);
+    blocks_dirty_data(bnum, 1);
+    node->block = bnum;
+    inode_dirty(node);
+    inode_map_set(node, 0, bnum);
     
-    // Allocate blocks as needed
-    for (int ii = current_blocks; ii < target_blocks; ++ii) {
-        int new_block = alloc_block();
-        if (new_block < 0) {
-            return -1;  // No free 
+    memset(data, 0, node->size);
+    blocks_dirty(data, node->size);
+    return 0;
+}
+
+/**
+ * Give a file copies of its own of the shared blocks in a mapped run.
+ *
+ * A copy is placed after the block before it where possible, and takes
+ * the old block's contents unless the caller overwrites all of it.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum First logical block of the run.
+ * @param bnum Disk block of file_bnum; the rest follow it on disk.
+ * @param count Number of blocks in the run.
+ * @param from Start of the byte range the caller writes.
+ * @param to End of that range.
+ * @param overwrite Nonzero if the caller writes every byte of the range.
+ *
+ * @return Number of blocks from the start of the run that are the file's
+ *         own now: count, less once the disk is full.
+ */
+static int inode_unshare(inode_t *node, int file_bnum, int bnum, int count, int from, int to,
+                         int overwrite) {
+    for (int ii = 0; ii < count; ++ii) {
+        int old = bnum + ii;
+        if (!blocks_shared(old)) {
+            continue;
         }
         
-        // Zero out the new block
-        memset(blocks_get_block(new_block), 0, BLOCK_SIZE);
-        
-        if (ii == 0) {
-            // First block goes in direct pointer
-            node->block = new_block;
+        int goal = file_bnum + ii > 0 ? inode_get_bnum(node, file_bnum + ii - 1) : 0;
+        int copy;
+        if (alloc_blocks(1, goal > 0 ? goal + 1 : 0, &copy) < 1) {
+            return ii;
+        }
+        long start = (long)(file_bnum + ii) * BLOCK_SIZE;
+        if (overwrite && start >= from && start + BLOCK_SIZE <= to) {
+            blocks_fresh(copy, 1);
         } else {
-            // Need indirect block for additional blocks
-            if (node->indirect == 0) {
-                node->indirect = alloc_block();
-                if (node->indirect < 0) {
-                    free_block(new_block);
-                    return -1;
+            memcpy(blocks_get_block(copy), blocks_get_block(old), BLOCK_SIZE);
+        }
+        blocks_dirty_data(copy, 1);
+        
+        int *slot = inode_bnum_slot(node, file_bnum + ii, 0);
+        *slot = copy;
+        inode_dirty_slot(node, slot);
+        inode_map_set(node, file_bnum + ii, copy);
+        free_block(old);  // Only drops this file's reference
+    }
+    return count;
+}
+
+/**
+ * Give the holes in a byte range their own blocks.
+ *
+ * Holes are filled in order, each run of them from one allocation placed
+ * after the block before it. New blocks are zeroed unless the caller
+ * overwrites all of them. Blocks the file shares with others are
+ * replaced by copies, so writing the range leaves the others alone.
+ *
+ * @param node Pointer to the inode.
+ * @param from Start of the range in bytes.
+ * @param to End of the range in bytes.
+ * @param overwrite Nonzero if the caller writes every byte of the range.
+ *
+ * @return End of the part of the range starting at from that is backed:
+ *         to on success, less once the disk is full.
+ */
+int inode_alloc_range(inode_t *node, int from, int to, int overwrite) {
+    if (node == NULL || to <= from) {
+        return from;
+    }
+    
+    // The inode record backs what fits in it
+    if (inode_is_inline(node)) {
+        if (to <= INODE_INLINE_SIZE) {
+            return to;
+        }
+        if (inode_spill(node) < 0) {
+            return from;
+        }
+    }
+    
+    int first = from / BLOCK_SIZE;
+    int last = (to - 1) / BLOCK_SIZE + 1;
+    int ii = first;
+    while (ii < last) {
+        // Skip blocks that are there already and not shared
+        int bnum;
+        int run = inode_map_range(node, ii, last - ii, &bnum);
+        if (run <= 0) {
+            break;  // Past the largest file
+        }
+        if (bnum != 0) {
+            int own = inode_unshare(node, ii, bnum, run, from, to, overwrite);
+            ii += own;
+            if (own < run) {
+                goto full;
+            }
+            continue;
+        }
+        
+        // Place the run right after the block before it when possible
+        int goal = 0;
+        if (ii > 0) {
+            int prev = inode_get_bnum(node, ii - 1);
+            goal = prev > 0 ? prev + 1 : 0;
+        }
+        
+        int hole_end = ii + run;
+        while (ii < hole_end) {
+            int batch[GROW_BATCH];
+            int want = hole_end - ii < GROW_BATCH ? hole_end - ii : GROW_BATCH;
+            int got = alloc_blocks(want, goal, batch);
+            
+            for (int jj = 0; jj < got; ++jj, ++ii) {
+                int *slot = inode_bnum_slot(node, ii, 1);
+                if (slot == NULL) {
+                    for (int kk = jj; kk < got; ++kk) {
+                        free_block(batch[kk]);
+                    }
+                    goto full;
                 }
-                memset(blocks_get_block(node->indirect), 0, BLOCK_SIZE);
+                
+                // Zero out the new block, unless the caller overwrites all of it
+                if (overwrite && (long)ii * BLOCK_SIZE >= from &&
+                    (long)(ii + 1) * BLOCK_SIZE <= to) {
+                    blocks_fresh(batch[jj], 1);
+                } else {
+                    memset(blocks_get_block(batch[jj]), 0, BLOCK_SIZE);
+                }
+                blocks_dirty_data(batch[jj], 1);
+                *slot = batch[jj];
+                inode_dirty_slot(node, slot);
+                inode_map_set(node, ii, batch[jj]);
             }
             
-            int *indirect_table = (int *)blocks_get_block(node->indirect);
-            indirect_table[ii - 1] = new_block;
+            if (got < want) {
+                goto full;
+            }
+            goal = batch[got - 1] + 1;
+        }
+    }
+    return to;
+    
+full:
+    // Everything before block ii is backed
+    if ((long)ii * BLOCK_SIZE <= from) {
+        return from;
+    }
+    return (long)ii * BLOCK_SIZE < to ? ii * BLOCK_SIZE : to;
+}
+
+/**
+ * Map another file's blocks into a range of this one, sharing them.
+ *
+ * @param node Pointer to the inode to map blocks into.
+ * @param file_bnum First logical block of node to replace.
+ * @param src Pointer to the inode to share blocks of.
+ * @param src_bnum First logical block of src to share.
+ * @param count Number of blocks.
+ *
+ * @return Number of blocks mapped: count, less once the disk is full.
+ */
+int inode_share_range(inode_t *node, int file_bnum, inode_t *src, int src_bnum, int count) {
+    if (inode_is_inline(node) && inode_spill(node) < 0) {
+        return 0;
+    }
+    
+    for (int ii = 0; ii < count; ++ii) {
+        int bnum = inode_get_bnum(src, src_bnum + ii);
+        int *slot = inode_bnum_slot(node, file_bnum + ii, bnum > 0);
+        if (slot == NULL) {
+            if (bnum > 0) {
+                return ii;  // No room for a pointer table
+            }
+            continue;  // Without a table the block is a hole already
+        }
+        bnum = bnum > 0 ? bnum : 0;
+        if (*slot == bnum) {
+            continue;
+        }
+        
+        // A block whose count is full is copied instead
+        if (bnum != 0 && blocks_ref(bnum) < 0) {
+            int copy = alloc_block();
+            if (copy < 0) {
+                return ii;
+            }
+            memcpy(blocks_get_block(copy), blocks_get_block(bnum), BLOCK_SIZE);
+            blocks_dirty_data(copy, 1);
+            bnum = copy;
+        }
+        
+        if (*slot != 0) {
+            free_block(*slot);
+        }
+        *slot = bnum;
+        inode_dirty_slot(node, slot);
+        inode_map_set(node, file_bnum + ii, bnum);
+    }
+    return count;
+}
+
+/**
+ * Grow an inode to accommodate the given size.
+ *
+ * @param node Pointer to the inode.
+ * @param size New size in bytes.
+ * @param alloc Nonzero to allocate zeroed blocks for the new bytes.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int grow_inode(inode_t *node, int size, int alloc) {
+    if (node == NULL || bytes_to_blocks(size) > INODE_MAX_BLOCKS) {
+        return -1;
+    }
+    if (size <= node->size) {
+        return 0;
+    }
+    
+    // Bytes past the inline data's end are zeros already
+    if (inode_is_inline(node)) {
+        if (size <= INODE_INLINE_SIZE) {
+            node->size = size;
+            node->mtime = inode_now();
+            inode_dirty(node);
+            return 0;
+        }
+        if (inode_spill(node) < 0) {
+            return -1;
+        }
+    }
+    
+    int current_blocks = node->size == 0 ? 0 : bytes_to_blocks(node->size);
+    TRACE_EVENT(TRACE_GROW, inode_get_inum(node), current_blocks, bytes_to_blocks(size));
+    
+    if (alloc && inode_alloc_range(node, node->size, size, 0) < size) {
+        // Blocks past the old end belonged to nothing before
+        inode_free_range(node, current_blocks, bytes_to_blocks(size));
+        return -1;
+    }
+    
+    // The old last block may hold bytes a shrink left past its end
+    int tail = node->size % BLOCK_SIZE;
+    if (tail != 0) {
+        int bnum = inode_get_bnum(node, node->size / BLOCK_SIZE);
+        if (bnum > 0 && blocks_shared(bnum)) {
+            // The zeros go into a copy the other owners don't see
+            if (inode_alloc_range(node, node->size, node->size + 1, 0) <= node->size) {
+                inode_free_range(node, current_blocks, bytes_to_blocks(size));
+                return -1;
+            }
+            bnum = inode_get_bnum(node, node->size / BLOCK_SIZE);
+        }
+        if (bnum > 0) {
+            int end = size - node->size < BLOCK_SIZE - tail ? tail + size - node->size
+                                                           : BLOCK_SIZE;
+            memset((char *)blocks_get_block(bnum) + tail, 0, end - tail);
+            blocks_dirty_data(bnum, 1);
         }
     }
     
     node->size = size;
-    node->mtime = time(NULL);
+    node->mtime = inode_now();
+    inode_dirty(node);
     
     return 0;
 }
@@ -254,51 +1226,161 @@ int shrink_inode(inode_t *node, int size) {
         current_blocks = 0;
     }
     
-    printf("+ shrink_inode: %d blocks -> %d blocks\n", current_blocks, target_blocks);
+    TRACE_EVENT(TRACE_SHRINK, inode_get_inum(node), current_blocks, target_blocks);
     
-    // Free blocks from the end
-    for (int ii = current_blocks - 1; ii >= target_blocks; --ii) {
-        if (ii == 0) {
-            // Free direct block
-            if (node->block != 0) {
-                free_block(node->block);
-                node->block = 0;
-            }
-        } else {
-            // Free from indirect table
-            if (node->indirect != 0) {
-                int *indirect_table = (int *)blocks_get_block(node->indirect);
-                if (indirect_table[ii - 1] != 0) {
-                    free_block(indirect_table[ii - 1]);
-                    indirect_table[ii - 1] = 0;
-                }
-            }
-        }
+    // Cut inline data is zeroed, so growing again reads zeros
+    if (inode_is_inline(node) && size < node->size) {
+        char *data = inode_inline_data(node);
+        memset(data + size, 0, node->size - size);
+        blocks_dirty(data + size, node->size - size);
     }
     
-    // If we're down to 0 or 1 blocks, free the indirect block
-    if (target_blocks <= 1 && node->indirect != 0) {
-        free_block(node->indirect);
-        node->indirect = 0;
-    }
+    // Free blocks from the end, then any tables left empty
+    inode_free_range(node, target_blocks, current_blocks);
     
     node->size = size;
-    node->mtime = time(NULL);
+    node->mtime = inode_now();
+    inode_dirty(node);
     
     return 0;
 }
 
+/**
+ * Check whether an inode number is allocated.
+ *
+ * @param inum Inode number.
+ *
+ * @return 1 if the inode is in use, 0 otherwise.
+ */
+int inode_allocated(int inum) {
+    if (inum < 0 || inum >= INODE_COUNT) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&inode_alloc_lock);
+    int used = bitmap_get(get_inode_bitmap(), inum);
+    pthread_mutex_unlock(&inode_alloc_lock);
+    
+    return used;
+}
+
+/**
+ * Count the free inodes.
+ *
+ * @return Inodes alloc_inode() can still hand out.
+ */
+int inode_free_count() {
+    pthread_mutex_lock(&inode_alloc_lock);
+    int count = inode_free;
+    pthread_mutex_unlock(&inode_alloc_lock);
+    
+    return count;
+}
+
+/**
+ * Lock an inode for reading.
+ *
+ * @param inum Inode number, ignored if out of range.
+ */
+void inode_rdlock(int inum) {
+    if (inum >= 0 && inum < inode_lock_count) {
+        pthread_rwlock_rdlock(&inode_locks[inum]);
+    }
+}
+
+/**
+ * Lock an inode for writing.
+ *
+ * @param inum Inode number, ignored if out of range.
+ */
+void inode_wrlock(int inum) {
+    if (inum >= 0 && inum < inode_lock_count) {
+        pthread_rwlock_wrlock(&inode_locks[inum]);
+    }
+}
+
+/**
+ * Release a lock taken with inode_rdlock() or inode_wrlock().
+ *
+ * @param inum Inode number, ignored if out of range.
+ */
+void inode_unlock(int inum) {
+    if (inum >= 0 && inum < inode_lock_count) {
+        pthread_rwlock_unlock(&inode_locks[inum]);
+    }
+}
+
 /**
  * Initialize the inode table.
  *
- * Marks block 1 as used for the inode table. This should be called
- * during filesystem initialization.
+ * Marks the inode table blocks as used and sets INODE_COUNT from the
+ * superblock. This should be called during filesystem initialization.
  */
 void inode_init() {
-    // Mark block 1 as used for inode table
+    const nufs_super_t *sb = blocks_super();
+    
+    // Mark the inode table blocks as used
     void *bbm = get_blocks_bitmap();
-    bitmap_put(bbm, INODE_TABLE_BLOCK, 1);
+    for (uint32_t ii = 0; ii < sb->itable_blocks; ++ii) {
+        bitmap_put(bbm, sb->itable_start + ii, 1);
+    }
+    uint32_t first = sb->itable_start / 8;
+    uint32_t last = (sb->itable_start + sb->itable_blocks - 1) / 8;
+    blocks_dirty((char *)bbm + first, last - first + 1);
+    
+    // Records larger than the fields carry inline data; legacy and
+    // version 2 images have none
+    int fields = sb->version >= 4 ? (int)sizeof(inode_t) : (int)sizeof(inode_old_t);
+    inode_record_size = sb->inode_size > (uint32_t)fields ? (int)sb->inode_size : fields;
+    INODE_INLINE_SIZE = inode_record_size - fields;
+    
+    // Only use inodes that fit in the table. Legacy images claim 128 but
+    // their one-block table holds fewer, the rest would overlap block 2.
+    long fit = (long)sb->itable_blocks * BLOCK_SIZE / inode_record_size;
+    INODE_COUNT = sb->inode_count < fit ? (int)sb->inode_count : (int)fit;
+    
+    // Count the free ones once; alloc_inode() and free_inode() keep it
+    pthread_mutex_lock(&inode_alloc_lock);
+    inode_free = INODE_COUNT - bitmap_count(get_inode_bitmap(), 0, INODE_COUNT);
+    pthread_mutex_unlock(&inode_alloc_lock);
+    
+    // Fresh locks and block maps for the new table
+    for (int ii = 0; ii < inode_lock_count; ++ii) {
+        pthread_rwlock_destroy(&inode_locks[ii]);
+        free(inode_maps[ii]);
+    }
+    free(inode_maps);
+    inode_maps = calloc(INODE_COUNT, sizeof(inode_map_t *));
+    free(inode_locks);
+    inode_locks = malloc(INODE_COUNT * sizeof(pthread_rwlock_t));
+    inode_lock_count = INODE_COUNT;
+    for (int ii = 0; ii < inode_lock_count; ++ii) {
+        pthread_rwlock_init(&inode_locks[ii], NULL);
+    }
+    
+    // Bring the inodes of an old layout image into memory
+    free(inode_incore);
+    inode_incore = NULL;
+    if (sb->version < 4) {
+        inode_incore = calloc(INODE_COUNT, sizeof(inode_t));
+        for (int ii = 0; ii < INODE_COUNT; ++ii) {
+            inode_old_t *old = (inode_old_t *)inode_record(ii);
+            inode_t *node = &inode_incore[ii];
+            node->refs = old->refs;
+            node->mode = old->mode;
+            node->size = old->size;
+            node->block = old->block;
+            node->indirect = old->indirect;
+            node->index = old->index;
+            node->atime = old->atime * 1000000000;
+            node->mtime = old->mtime * 1000000000;
+            node->uid = old->uid;
+            node->gid = old->gid;
+        }
+    }
     
-    printf("+ inode_init: block %d reserved for inode table\n", INODE_TABLE_BLOCK);
+    TRACE(TRACE_INFO, "inode_init: blocks %u-%u hold %d inodes with %d bytes inline",
+          sb->itable_start, sb->itable_start + sb->itable_blocks - 1, INODE_COUNT,
+          INODE_INLINE_SIZE);
 }
 
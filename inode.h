@@ -7,34 +7,72 @@
  * block pointers for a single file or directory.
  *
  * Assumptions:
- * Block 1 is reserved for the inode table
- * Maximum of 128 inodes
+ * The inode table spans the blocks the superblock reserves for it
+ * (block 1 on legacy images)
+ * The inode count comes from the superblock, capped to what the table holds
+ * alloc_inode() and free_inode() are thread-safe; everything else that
+ * touches an inode expects the caller to hold that inode's lock
  * Inode 0 is always the root directory
+ * Logical block 0 is the direct block, the indirect table maps the next
+ * 1023 blocks and its last slot points to a double-indirect table
+ * A zero block pointer, or a missing table, is a hole that reads as zeros
+ * Nothing is mapped past a file's size
+ * A regular file of at most INODE_INLINE_SIZE bytes without blocks keeps
+ * its data in its inode record, zero-filled past the size; it moves to
+ * blocks once it grows larger
+ * Data blocks may be shared by clones of a file; a file writing one gets
+ * a copy of its own first
+ * Files with pointer tables keep a map of their logical to disk blocks in
+ * memory, filled in as lookups walk the tables; only the functions here
+ * change a file's blocks, and they keep the map in step
  */
 #ifndef INODE_H
 #define INODE_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <time.h>
 
-#define INODE_COUNT 128
+// Number of usable inodes, set by inode_init()
+extern int INODE_COUNT;
+
+// Bytes of file data an inode record holds, set by inode_init()
+// (0 on images whose records are only the fields)
+extern int INODE_INLINE_SIZE;
+
+// Most links an inode can have
+#define INODE_MAX_LINKS INT16_MAX
 
 /**
  * Inode structure representing a file or directory.
  *
+ * This is the on-disk layout of images since version 4: 64 bytes with
+ * no padding, one cache line of the table. Everything stat reports is in
+ * the first 32 bytes. Older images keep a 48-byte layout that inode.c
+ * converts to and from this one.
  */
 typedef struct inode {
-    int refs;           // reference count 
-    int mode;           // permission & type
-    int size;           // file size in bytes
-    int block;          // direct block pointer 
-    int indirect;       // indirect block pointer 
-    time_t atime;       // last access time
-    time_t mtime;       // last modification time
-    int uid;            // owner user ID
-    int gid;            // owner group ID
+    // Read by every getattr
+    uint16_t mode;          // permission & type
+    int16_t refs;           // reference count
+    int32_t size;           // file size in bytes
+    uint32_t uid;           // owner user ID
+    uint32_t gid;           // owner group ID
+    int64_t atime;          // last access time, ns since the epoch
+    int64_t mtime;          // last modification time, ns since the epoch
+    
+    // Read when the file's data or entries are
+    int32_t block;          // direct block pointer
+    int32_t indirect;       // indirect block pointer (last slot: double-indirect)
+    int32_t index;          // directory hash index block (0 = unindexed)
+    uint32_t generation;    // incremented each time the number is reused
+    uint32_t extent[4];     // reserved for an extent tree root, zero
 } inode_t;
 
+_Static_assert(sizeof(inode_t) == 64, "inode_t is one cache line");
+_Static_assert(offsetof(inode_t, block) == 32, "stat fields fill the first 32 bytes");
+
 /**
  * Print inode information for debugging.
  *
@@ -52,6 +90,54 @@ void print_inode(inode_t *node);
  */
 inode_t *get_inode(int inum);
 
+/**
+ * Get the inode number of an inode in the inode table.
+ *
+ * Inverse of get_inode().
+ *
+ * @param node Pointer returned by get_inode().
+ *
+ * @return The inode number, or -1 if node is not in the inode table.
+ */
+int inode_get_inum(inode_t *node);
+
+/**
+ * Record that an inode's fields changed, for the journal.
+ *
+ * Called after every change made directly to an inode_t.
+ *
+ * @param node Pointer returned by get_inode().
+ */
+void inode_dirty(inode_t *node);
+
+/**
+ * Get the current time as inode timestamps hold it.
+ *
+ * @return Nanoseconds since the epoch.
+ */
+int64_t inode_now();
+
+/**
+ * Get the file data an inode record holds.
+ *
+ * Writes to it are recorded with blocks_dirty().
+ *
+ * @param node Pointer returned by get_inode().
+ *
+ * @return Pointer to INODE_INLINE_SIZE bytes following the fields.
+ */
+char *inode_inline_data(inode_t *node);
+
+/**
+ * Check whether a file keeps its data in its inode record.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return 1 if the file's bytes are inode_inline_data(), 0 if they are
+ *         in blocks.
+ */
+int inode_is_inline(inode_t *node);
+
 /**
  * Allocate a new inode.
  *
@@ -76,15 +162,86 @@ void free_inode(int inum);
 /**
  * Grow an inode to accommodate the given size.
  *
- * Allocates additional blocks as needed to store 'size' bytes.
- * Updates the inode's size field.
+ * Updates the inode's size field. Files are sparse: unless asked to,
+ * this allocates nothing, and the new bytes read as zeros until written.
+ * Inline data the new size doesn't fit in the record moves to a block.
  *
  * @param node Pointer to the inode to grow.
  * @param size New size in bytes.
+ * @param alloc Nonzero to allocate zeroed blocks for the new bytes, as
+ *              directories need.
+ *
+ * @return 0 on success, -1 if the size is past the largest file or
+ *         blocks couldn't be allocated.
+ */
+int grow_inode(inode_t *node, int size, int alloc);
+
+/**
+ * Give the holes in a byte range their own blocks.
+ *
+ * New blocks are zeroed, except those lying wholly inside the range when
+ * the caller is about to overwrite it under the same lock. The size
+ * field isn't changed. A range inside an inline file's record needs no
+ * blocks; one past it moves the inline data to block 0 first. Blocks the
+ * file shares with others are swapped for copies of its own, so the
+ * range can be written in place.
+ *
+ * @param node Pointer to the inode.
+ * @param from Start of the range in bytes.
+ * @param to End of the range in bytes.
+ * @param overwrite Nonzero if the caller writes every byte of the range.
+ *
+ * @return End of the part of the range starting at from that is backed:
+ *         to on success, less once the disk is full.
+ */
+int inode_alloc_range(inode_t *node, int from, int to, int overwrite);
+
+/**
+ * Count the blocks inode_alloc_range() would allocate for a range.
+ *
+ * Includes the pointer tables, so reserving this many blocks up front
+ * guarantees the allocation succeeds.
  *
- * @return 0 on success, -1 if blocks couldn't be allocated.
+ * @param node Pointer to the inode.
+ * @param from Start of the range in bytes.
+ * @param to End of the range in bytes.
+ *
+ * @return Number of blocks, 0 if the range is backed already.
  */
-int grow_inode(inode_t *node, int size);
+int inode_blocks_needed(inode_t *node, int from, int to);
+
+/**
+ * Map another file's blocks into a range of this one, sharing them.
+ *
+ * Logical blocks [file_bnum, file_bnum + count) end up with src's blocks
+ * from src_bnum on, holes included, and whatever they held before is
+ * freed. Each shared block gains a reference; one that can't take any
+ * more (or an image without reference counts) gets copied instead. An
+ * inline file moves its data to block 0 first. The size field isn't
+ * changed. The caller holds both inodes' write locks.
+ *
+ * @param node Pointer to the inode to map blocks into.
+ * @param file_bnum First logical block of node to replace.
+ * @param src Pointer to the inode to share blocks of, not inline; may be
+ *            node if the ranges don't overlap.
+ * @param src_bnum First logical block of src to share.
+ * @param count Number of blocks.
+ *
+ * @return Number of blocks mapped from the start of the range: count,
+ *         less once the disk is full.
+ */
+int inode_share_range(inode_t *node, int file_bnum, inode_t *src, int src_bnum, int count);
+
+/**
+ * Count the blocks an inode uses, pointer tables included.
+ *
+ * Holes take none, so this is what st_blocks reports.
+ *
+ * @param node Pointer to the inode.
+ *
+ * @return Number of blocks.
+ */
+int inode_blocks_used(inode_t *node);
 
 /**
  * Shrink an inode to the given size.
@@ -102,7 +259,8 @@ int shrink_inode(inode_t *node, int size);
  * Get the block number for a given file block index.
  *
  * Translates a logical block number within a file to
- * the actual disk block number where the data is stored.
+ * the actual disk block number where the data is stored. Blocks looked
+ * up before are answered from the file's block map.
  *
  * @param node Pointer to the inode.
  * @param file_bnum Logical block number within the file.
@@ -111,11 +269,90 @@ int shrink_inode(inode_t *node, int size);
  */
 int inode_get_bnum(inode_t *node, int file_bnum);
 
+/**
+ * Map a run of logical blocks to a contiguous run of disk blocks.
+ *
+ * Lets callers copy a whole physically contiguous run with one memcpy
+ * instead of resolving and copying one block at a time. The first call
+ * over a range walks the pointer tables for all of it and keeps the
+ * answers in the file's block map, later ones only read the map.
+ *
+ * @param node Pointer to the inode.
+ * @param file_bnum First logical block of the run.
+ * @param count Most blocks to map.
+ * @param bnum Set to the disk block backing file_bnum, or 0 for a hole.
+ *
+ * @return Number of blocks starting at file_bnum backed by consecutive
+ *         disk blocks from *bnum on (or all holes), 0 past the largest
+ *         file.
+ */
+int inode_map_range(inode_t *node, int file_bnum, int count, int *bnum);
+
+/**
+ * Write an inode and its pointer tables back to disk.
+ *
+ * Does nothing on a journaled image (see blocks_sync()). The caller
+ * holds the inode's lock.
+ *
+ * @param node Pointer to the inode.
+ * @param data Whether to write every data block of the file too.
+ * @param wait Nonzero to wait for the writes, 0 to only start them.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+int inode_sync(inode_t *node, int data, int wait);
+
+/**
+ * Check whether an inode number is allocated.
+ *
+ * Reads the inode bitmap under the allocator's lock, so it is safe while
+ * other threads allocate and free inodes.
+ *
+ * @param inum Inode number.
+ *
+ * @return 1 if the inode is in use, 0 otherwise.
+ */
+int inode_allocated(int inum);
+
+/**
+ * Count the free inodes.
+ *
+ * The count is kept up to date by alloc_inode() and free_inode(), so
+ * this doesn't look at the bitmap.
+ *
+ * @return Inodes alloc_inode() can still hand out.
+ */
+int inode_free_count();
+
+/**
+ * Lock an inode for reading.
+ *
+ * Any number of readers may hold an inode's lock at once. Lock order is
+ * defined by the storage layer (see storage.c).
+ *
+ * @param inum Inode number, ignored if out of range.
+ */
+void inode_rdlock(int inum);
+
+/**
+ * Lock an inode for writing, excluding all other holders.
+ *
+ * @param inum Inode number, ignored if out of range.
+ */
+void inode_wrlock(int inum);
+
+/**
+ * Release a lock taken with inode_rdlock() or inode_wrlock().
+ *
+ * @param inum Inode number, ignored if out of range.
+ */
+void inode_unlock(int inum);
+
 /**
  * Initialize the inode table.
  *
- * Marks block 1 as used for the inode table. Should be called
- * during filesystem initialization after blocks_init().
+ * Marks the inode table blocks as used and sets INODE_COUNT. Should be
+ * called during filesystem initialization after blocks_init().
  */
 void inode_init();
 
@@ -0,0 +1,607 @@
+/**
+ * @file journal.c
+ * @brief Implementation of the write-ahead metadata journal.
+ *
+ * Operations only count themselves in and out of the running transaction
+ * (journal_begin/journal_end); the block layer records what they change.
+ * Commits are serialized by commit_lock and done by whichever thread
+ * asks for one: the background committer, or a journal_sync() caller.
+ *
+ * The journal is strictly linear: transactions are appended from block 1
+ * and a checkpoint empties it. A block that is in the journal and then
+ * reused for file data forces a checkpoint before the data's transaction
+ * commits, so a replay can never overwrite newer data with old metadata.
+ * Blocks freed by a transaction aren't reused until it commits, for the
+ * same reason (see blocks_release_freed()).
+ *
+ * Home writes are queued in batches through the block backend, and all
+ * buffers come from blockdev_buffer() so that O_DIRECT images take them.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "trace.h"
+#include "helpers/bitmap.h"
+#include "helpers/blockdev.h"
+#include "helpers/blocks.h"
+
+// Whether the mounted image has a journal
+static int active = 0;
+
+// Journal region and image file
+static int jfd = -1;
+static uint32_t jstart = 0;
+static uint32_t jblocks = 0;
+
+// Most metadata blocks one transaction can hold, and the size at which
+// the committer is woken early
+static int max_txn = 0;
+static int commit_threshold = 0;
+
+// Sequence number of the running transaction, and the newest durable one
+static uint64_t next_seq = 1;
+static uint64_t durable_seq = 0;
+
+// Journal block the next transaction goes in; the log starts at block 1
+static uint32_t head = 1;
+
+// Home blocks with images in the journal since the last checkpoint
+static uint8_t *journaled = NULL;
+
+// Guards the barrier and committer state below
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t barrier_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t commit_wake = PTHREAD_COND_INITIALIZER;
+
+// Operations inside the running transaction, and whether a commit is
+// waiting for them to finish
+static int updates = 0;
+static int closing = 0;
+
+// Nesting depth of journal_begin() on this thread
+static __thread int depth = 0;
+
+// Background committer; started lazily so that it belongs to the process
+// that serves requests, even after FUSE daemonizes
+static pthread_t committer;
+static pid_t committer_pid = 0;
+static int stopping = 0;
+
+// Serializes commits, held across their I/O
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Home writes waiting to be submitted together.
+ */
+typedef struct journal_batch {
+    blockdev_io_t ios[BLOCKDEV_BATCH];
+    int count;
+    int rv;
+} journal_batch_t;
+
+/**
+ * Checksum a range of whole 64-bit words.
+ *
+ * @param data Start of the range.
+ * @param len Length in bytes, a multiple of 8.
+ *
+ * @return 64-bit checksum.
+ */
+static uint64_t journal_checksum(const void *data, size_t len) {
+    const uint64_t *words = data;
+    uint64_t sum = 0x9e3779b97f4a7c15ull;
+    for (size_t ii = 0; ii < len / 8; ++ii) {
+        sum = (sum ^ words[ii]) * 0x100000001b3ull;
+    }
+    return sum;
+}
+
+/**
+ * Write a buffer to the image, retrying short writes.
+ *
+ * @param buf Data to write.
+ * @param len Length in bytes.
+ * @param bnum Block number to write at.
+ *
+ * @return 0 on success, -1 on an I/O error.
+ */
+static int journal_pwrite(const void *buf, size_t len, uint32_t bnum) {
+    blockdev_io_t io = {(void *)buf, len, (off_t)bnum * BLOCK_SIZE};
+    if (blockdev_rw(jfd, &io, 1, 1) != 0) {
+        TRACE(TRACE_ERROR, "journal: write at block %u failed", bnum);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read from the image.
+ *
+ * @param buf Destination.
+ * @param len Length in bytes.
+ * @param bnum Block number to read at.
+ *
+ * @return 0 if everything was read, -1 otherwise.
+ */
+static int journal_pread(void *buf, size_t len, uint32_t bnum) {
+    blockdev_io_t io = {buf, len, (off_t)bnum * BLOCK_SIZE};
+    return blockdev_rw(jfd, &io, 1, 0);
+}
+
+/**
+ * Submit the writes queued in a batch.
+ *
+ * @param batch Batch to empty.
+ */
+static void journal_batch_flush(journal_batch_t *batch) {
+    if (batch->count > 0 && blockdev_rw(jfd, batch->ios, batch->count, 1) != 0) {
+        TRACE(TRACE_ERROR, "journal: %d home writes failed", batch->count);
+        batch->rv = -1;
+    }
+    batch->count = 0;
+}
+
+/**
+ * Queue one block's home write, merged with the previous one when both
+ * the memory and the home locations follow on.
+ *
+ * @param batch Batch to add to; submitted when full.
+ * @param buf Block contents.
+ * @param bnum Home block number.
+ */
+static void journal_batch_add(journal_batch_t *batch, void *buf, uint32_t bnum) {
+    off_t off = (off_t)bnum * BLOCK_SIZE;
+    if (batch->count > 0) {
+        blockdev_io_t *last = &batch->ios[batch->count - 1];
+        if ((char *)last->buf + last->len == buf && last->off + (off_t)last->len == off) {
+            last->len += BLOCK_SIZE;
+            return;
+        }
+    }
+
+    if (batch->count == BLOCKDEV_BATCH) {
+        journal_batch_flush(batch);
+    }
+    batch->ios[batch->count].buf = buf;
+    batch->ios[batch->count].len = BLOCK_SIZE;
+    batch->ios[batch->count].off = off;
+    batch->count++;
+}
+
+/**
+ * Write the journal header.
+ *
+ * @param seq First transaction a replay should look for.
+ * @param pos Journal block where it would be.
+ */
+static void journal_write_header(uint64_t seq, uint32_t pos) {
+    journal_block_t *hdr = blockdev_buffer(BLOCK_SIZE);
+    hdr->magic = JOURNAL_MAGIC;
+    hdr->kind = JOURNAL_HEADER;
+    hdr->seq = seq;
+    hdr->pos = pos;
+    journal_pwrite(hdr, BLOCK_SIZE, jstart);
+    free(hdr);
+}
+
+/**
+ * Empty the journal.
+ *
+ * Flushes the home writes of every committed transaction, then points the
+ * header past them. The header itself becomes durable with the next
+ * flush; until then a replay only rewrites images already at home.
+ *
+ * @param seq First transaction that isn't at home yet.
+ */
+static void journal_checkpoint(uint64_t seq) {
+    fdatasync(jfd);
+    journal_write_header(seq, 1);
+    memset(journaled, 0, BLOCK_BITMAP_SIZE);
+    head = 1;
+}
+
+/**
+ * Commit the running transaction, or as much of its metadata as fits.
+ *
+ * The caller holds commit_lock. Metadata past max_txn blocks stays
+ * dirty for journal_commit() to commit next.
+ *
+ * @param seq_out Receives the transaction's sequence number.
+ *
+ * @return Dirty metadata blocks that didn't fit.
+ */
+static int journal_commit_txn(uint64_t *seq_out) {
+    // Close the transaction: wait for running operations, hold off new ones
+    pthread_mutex_lock(&journal_lock);
+    closing = 1;
+    while (updates > 0) {
+        pthread_cond_wait(&barrier_cond, &journal_lock);
+    }
+    uint64_t seq = next_seq++;
+
+    // Copy out the changed metadata, behind a descriptor block; the
+    // transaction's frees only take effect with it
+    blocks_release_freed();
+    int count = blocks_dirty_count();
+    int left = 0;
+    if (count > max_txn) {
+        TRACE(TRACE_ERROR, "journal: %d dirty blocks, splitting transaction %llu",
+              count, (unsigned long long)seq);
+        left = count - max_txn;
+        count = max_txn;
+    }
+    char *txn = blockdev_buffer((size_t)(count + 2) * BLOCK_SIZE);
+    journal_block_t *desc = (journal_block_t *)txn;
+    int bnum = -1;
+    for (int ii = 0; ii < count; ++ii) {
+        bnum = blocks_next_dirty(bnum + 1, 1);
+        memcpy(txn + (size_t)(ii + 1) * BLOCK_SIZE, blocks_get_block(bnum), BLOCK_SIZE);
+        desc->blocks[ii] = bnum;
+        blocks_clean(bnum);
+    }
+
+    // Old metadata images of blocks now holding data must never be
+    // replayed, so the journal is emptied before the data overwrites them
+    int reused = 0;
+    for (bnum = blocks_next_dirty(0, 0); bnum >= 0; bnum = blocks_next_dirty(bnum + 1, 0)) {
+        reused |= bitmap_get(journaled, bnum);
+    }
+    if (reused) {
+        journal_checkpoint(seq);
+        fdatasync(jfd);
+    }
+
+    // Data goes home before the metadata that points at it commits
+    journal_batch_t batch = {.count = 0, .rv = 0};
+    int data = 0;
+    for (bnum = blocks_next_dirty(0, 0); bnum >= 0; bnum = blocks_next_dirty(bnum + 1, 0)) {
+        journal_batch_add(&batch, blocks_get_block(bnum), bnum);
+        blocks_clean(bnum);
+        data++;
+    }
+    journal_batch_flush(&batch);
+
+    closing = 0;
+    pthread_cond_broadcast(&barrier_cond);
+    pthread_mutex_unlock(&journal_lock);
+
+    if (count > 0) {
+        // The data must be on disk before a commit block can point at it,
+        // and a checkpoint flushes it on the way
+        if (head + count + 2 > jblocks) {
+            journal_checkpoint(seq);
+        } else if (data > 0) {
+            fdatasync(jfd);
+        }
+
+        desc->magic = JOURNAL_MAGIC;
+        desc->kind = JOURNAL_DESCRIPTOR;
+        desc->seq = seq;
+        desc->count = count;
+
+        journal_block_t *commit = (journal_block_t *)(txn + (size_t)(count + 1) * BLOCK_SIZE);
+        commit->magic = JOURNAL_MAGIC;
+        commit->kind = JOURNAL_COMMIT;
+        commit->seq = seq;
+        commit->count = count;
+        commit->checksum = journal_checksum(txn, (size_t)(count + 1) * BLOCK_SIZE);
+
+        // One sequential write and a flush make the transaction durable
+        journal_pwrite(txn, (size_t)(count + 2) * BLOCK_SIZE, jstart + head);
+    }
+    if (count > 0 || data > 0) {
+        fdatasync(jfd);
+    }
+
+    // Committed images can now go home; they're flushed at the checkpoint
+    for (int ii = 0; ii < count; ++ii) {
+        journal_batch_add(&batch, txn + (size_t)(ii + 1) * BLOCK_SIZE, desc->blocks[ii]);
+        bitmap_put(journaled, desc->blocks[ii], 1);
+    }
+    journal_batch_flush(&batch);
+    if (count > 0) {
+        head += count + 2;
+    }
+    free(txn);
+
+    TRACE_EVENT(TRACE_COMMIT, seq, count, data);
+    *seq_out = seq;
+    return left;
+}
+
+/**
+ * Commit the running transaction. The caller holds commit_lock.
+ *
+ * A transaction too large for the journal goes in as several, and only
+ * counts as durable once the last of them is.
+ */
+static void journal_commit() {
+    uint64_t seq;
+    while (journal_commit_txn(&seq) > 0) {
+        // Commit what didn't fit
+    }
+    __atomic_store_n(&durable_seq, seq, __ATOMIC_RELEASE);
+}
+
+/**
+ * Background committer: commits every JOURNAL_COMMIT_MS, or sooner when
+ * the running transaction grows large.
+ *
+ * @param arg Unused.
+ *
+ * @return NULL.
+ */
+static void *journal_committer(void *arg) {
+    pthread_mutex_lock(&journal_lock);
+    while (!stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += JOURNAL_COMMIT_MS / 1000;
+        ts.tv_nsec += (JOURNAL_COMMIT_MS % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        if (blocks_dirty_count() < commit_threshold) {
+            pthread_cond_timedwait(&commit_wake, &journal_lock, &ts);
+        }
+        if (stopping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&journal_lock);
+        if (blocks_dirty_count() > 0 || blocks_next_dirty(0, 0) >= 0) {
+            pthread_mutex_lock(&commit_lock);
+            journal_commit();
+            pthread_mutex_unlock(&commit_lock);
+        }
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return NULL;
+}
+
+/**
+ * Replay committed transactions, oldest first.
+ *
+ * Each image is copied both into the mapped image, which may already
+ * hold a private copy of its block, and to its home location. Sequence
+ * numbers only grow, but commits without metadata leave gaps; anything
+ * older than the last transaction replayed is left over from before a
+ * checkpoint and ends the log.
+ *
+ * @param seq First transaction to look for.
+ * @param pos Journal block to look for it in.
+ *
+ * @return Sequence number after the last transaction replayed.
+ */
+static uint64_t journal_replay(uint64_t seq, uint32_t pos) {
+    char *txn = blockdev_buffer((size_t)(max_txn + 2) * BLOCK_SIZE);
+    journal_block_t *desc = (journal_block_t *)txn;
+    journal_batch_t batch = {.count = 0, .rv = 0};
+
+    while (pos < jblocks && journal_pread(txn, BLOCK_SIZE, jstart + pos) == 0) {
+        if (desc->magic != JOURNAL_MAGIC || desc->kind != JOURNAL_DESCRIPTOR ||
+            desc->seq < seq || desc->count > (uint32_t)max_txn ||
+            pos + desc->count + 2 > jblocks) {
+            break;
+        }
+
+        // Only a transaction whose commit block made it is replayed
+        uint32_t count = desc->count;
+        journal_block_t *commit = (journal_block_t *)(txn + (size_t)(count + 1) * BLOCK_SIZE);
+        if (journal_pread(txn + BLOCK_SIZE, (size_t)(count + 1) * BLOCK_SIZE,
+                          jstart + pos + 1) != 0 ||
+            commit->magic != JOURNAL_MAGIC || commit->kind != JOURNAL_COMMIT ||
+            commit->seq != desc->seq ||
+            commit->checksum != journal_checksum(txn, (size_t)(count + 1) * BLOCK_SIZE)) {
+            break;
+        }
+
+        for (uint32_t ii = 0; ii < count; ++ii) {
+            char *image = txn + (size_t)(ii + 1) * BLOCK_SIZE;
+            if (desc->blocks[ii] < (uint32_t)BLOCK_COUNT) {
+                memcpy(blocks_get_block(desc->blocks[ii]), image, BLOCK_SIZE);
+                journal_batch_add(&batch, image, desc->blocks[ii]);
+            }
+        }
+        journal_batch_flush(&batch);
+        TRACE(TRACE_INFO, "journal: replayed transaction %llu, %u blocks",
+              (unsigned long long)desc->seq, count);
+
+        pos += count + 2;
+        seq = desc->seq + 1;
+    }
+
+    free(txn);
+    return seq;
+}
+
+/**
+ * Open the mounted image's journal and replay committed transactions.
+ */
+void journal_open() {
+    static int registered = 0;
+
+    const nufs_super_t *sb = blocks_super();
+    if (sb->journal_blocks == 0) {
+        return;
+    }
+
+    jfd = blocks_file();
+    jstart = sb->journal_start;
+    jblocks = sb->journal_blocks;
+    max_txn = jblocks - 3;
+    int per_desc = (BLOCK_SIZE - sizeof(journal_block_t)) / sizeof(uint32_t);
+    if (max_txn > per_desc) {
+        max_txn = per_desc;
+    }
+    commit_threshold = max_txn / 2;
+    journaled = calloc(BLOCK_BITMAP_SIZE, 1);
+
+    // A fresh image has an all-zero header: nothing to replay
+    journal_block_t *hdr = blockdev_buffer(BLOCK_SIZE);
+    uint64_t seq = 1;
+    uint32_t pos = 1;
+    if (journal_pread(hdr, BLOCK_SIZE, jstart) == 0 && hdr->magic == JOURNAL_MAGIC &&
+        hdr->kind == JOURNAL_HEADER) {
+        seq = hdr->seq;
+        pos = hdr->pos > 0 ? hdr->pos : 1;
+    }
+    free(hdr);
+
+    uint64_t end = journal_replay(seq, pos);
+    if (end != seq) {
+        fdatasync(jfd);
+    }
+
+    // Start over with an empty journal
+    journal_write_header(end, 1);
+    fdatasync(jfd);
+    next_seq = end;
+    durable_seq = end - 1;
+    head = 1;
+    stopping = 0;
+    active = 1;
+
+    if (!registered) {
+        atexit(journal_close);
+        registered = 1;
+    }
+}
+
+/**
+ * Commit everything and close the journal.
+ */
+void journal_close() {
+    if (!active) {
+        return;
+    }
+
+    // Stop the committer, if this process started one
+    pthread_mutex_lock(&journal_lock);
+    stopping = 1;
+    pthread_cond_signal(&commit_wake);
+    int running = committer_pid == getpid();
+    committer_pid = 0;
+    pthread_mutex_unlock(&journal_lock);
+    if (running) {
+        pthread_join(committer, NULL);
+    }
+
+    // Nothing else runs now, so this leaves nothing dirty
+    pthread_mutex_lock(&commit_lock);
+    journal_commit();
+    journal_checkpoint(next_seq);
+    fdatasync(jfd);
+    pthread_mutex_unlock(&commit_lock);
+
+    active = 0;
+    free(journaled);
+    journaled = NULL;
+}
+
+/**
+ * Start an operation.
+ */
+void journal_begin() {
+    if (!active || depth++ > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if (committer_pid != getpid() && !stopping) {
+        committer_pid = getpid();
+        pthread_create(&committer, NULL, journal_committer, NULL);
+    }
+
+    // Keep transactions small enough for the journal: once the running
+    // one is past the threshold, new operations wait for it to commit
+    while (closing || blocks_dirty_count() >= commit_threshold) {
+        if (!closing) {
+            pthread_cond_signal(&commit_wake);
+        }
+        pthread_cond_wait(&barrier_cond, &journal_lock);
+    }
+    updates++;
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * Finish an operation started by journal_begin().
+ */
+void journal_end() {
+    if (!active || --depth > 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    updates--;
+    if (closing && updates == 0) {
+        pthread_cond_broadcast(&barrier_cond);
+    }
+    if (blocks_dirty_count() >= commit_threshold) {
+        pthread_cond_signal(&commit_wake);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * Get the sequence number of the running transaction.
+ *
+ * @return Sequence number, 0 without a journal.
+ */
+uint64_t journal_seq() {
+    if (!active) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    uint64_t seq = next_seq;
+    pthread_mutex_unlock(&journal_lock);
+    return seq;
+}
+
+/**
+ * Count the metadata blocks the running transaction can still take.
+ *
+ * @return Blocks left before it outgrows the journal, INT_MAX without
+ *         a journal.
+ */
+int journal_room() {
+    if (!active) {
+        return INT_MAX;
+    }
+    return max_txn - blocks_dirty_count();
+}
+
+/**
+ * Wait until a transaction is durable, committing it if need be.
+ *
+ * @param seq Sequence number from journal_seq().
+ */
+void journal_wait(uint64_t seq) {
+    if (!active || __atomic_load_n(&durable_seq, __ATOMIC_ACQUIRE) >= seq) {
+        return;
+    }
+
+    // Whoever gets the lock first commits for everyone waiting
+    pthread_mutex_lock(&commit_lock);
+    if (__atomic_load_n(&durable_seq, __ATOMIC_ACQUIRE) < seq) {
+        journal_commit();
+    }
+    pthread_mutex_unlock(&commit_lock);
+}
+
+/**
+ * Commit every finished operation and wait until it's durable.
+ */
+void journal_sync() {
+    journal_wait(journal_seq());
+}
@@ -0,0 +1,143 @@
+/**
+ * @file journal.h
+ * @brief Write-ahead metadata journal for the NUFS filesystem.
+ *
+ * Makes every storage operation atomic across crashes on images that
+ * reserve a journal region. Operations run between journal_begin() and
+ * journal_end() and mark the blocks they change (blocks_dirty()). Many
+ * operations are grouped into one transaction, which is committed when
+ * JOURNAL_COMMIT_MS pass, when it grows large, or on journal_sync():
+ *
+ * 1. New operations wait while the running ones finish
+ * 2. Changed metadata blocks are copied out, and changed data blocks are
+ *    written to their home locations (ordered mode)
+ * 3. Operations resume; the data is flushed, then the copies are written
+ *    to the journal as one sequential write, followed by a second flush
+ * 4. The copies are written to their home locations
+ *
+ * Home writes are only flushed when the journal fills up (a checkpoint),
+ * after which it starts over from its first block. storage_init() replays
+ * every committed transaction still in the journal.
+ *
+ * Journal layout, in blocks from the start of the region:
+ *
+ * 0: header, naming the first transaction to replay and where it is
+ * 1...: transactions, each a descriptor block listing home block numbers,
+ *       one image per listed block, and a commit block with a checksum
+ *
+ * Assumptions:
+ * Data blocks are not journaled, only written and flushed before the
+ * metadata that points at them is committed
+ * A transaction larger than the journal is committed as several, which
+ * lose atomicity between them; operations that could dirty that much
+ * metadata split their work over several transactions instead
+ * All functions do nothing for images without a journal
+ */
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+// Longest a change waits before it's committed
+#define JOURNAL_COMMIT_MS 1000
+
+#define JOURNAL_MAGIC 0x4c4e524a  // "JRNL" on disk
+
+// Journal block kinds
+#define JOURNAL_HEADER 1
+#define JOURNAL_DESCRIPTOR 2
+#define JOURNAL_COMMIT 3
+
+/**
+ * Start of every journal block.
+ *
+ * Fields:
+ * - magic: JOURNAL_MAGIC
+ * - kind: JOURNAL_HEADER, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+ * - seq: Transaction sequence number; for the header, the first one to
+ *        replay
+ * - count: Home blocks in the transaction (descriptor and commit)
+ * - pos: Header only, journal block holding the seq descriptor
+ * - checksum: Commit only, journal_checksum() of descriptor and images
+ * - blocks: Descriptor only, home block numbers of the images
+ */
+typedef struct journal_block {
+    uint32_t magic;
+    uint32_t kind;
+    uint64_t seq;
+    uint32_t count;
+    uint32_t pos;
+    uint64_t checksum;
+    uint32_t blocks[];
+} journal_block_t;
+
+/**
+ * Open the mounted image's journal and replay committed transactions.
+ *
+ * Call after blocks_init() and before anything reads metadata.
+ */
+void journal_open();
+
+/**
+ * Commit everything and close the journal.
+ *
+ * Leaves the journal empty, so the next mount has nothing to replay.
+ * Also runs at exit.
+ */
+void journal_close();
+
+/**
+ * Start an operation.
+ *
+ * Waits while a commit is taking its snapshot, and while the running
+ * transaction is too large to take more. Must be called before taking
+ * any inode lock. Nests, so an operation may call others.
+ */
+void journal_begin();
+
+/**
+ * Finish an operation started by journal_begin().
+ */
+void journal_end();
+
+/**
+ * Get the sequence number of the running transaction.
+ *
+ * Between journal_begin() and journal_end(), that's the transaction the
+ * operation's changes commit with.
+ *
+ * @return Sequence number, 0 for images without a journal.
+ */
+uint64_t journal_seq();
+
+/**
+ * Count the metadata blocks the running transaction can still take.
+ *
+ * An operation that dirties metadata a step at a time checks this
+ * between steps, and ends its transaction for a new one once it runs
+ * low.
+ *
+ * @return Blocks left before the transaction outgrows the journal,
+ *         INT_MAX for images without a journal.
+ */
+int journal_room();
+
+/**
+ * Wait until a transaction is durable, committing it if need be.
+ *
+ * Returns at once if it already is. Concurrent callers share one
+ * commit. Must not be called between journal_begin() and journal_end().
+ *
+ * @param seq Sequence number from journal_seq().
+ */
+void journal_wait(uint64_t seq);
+
+/**
+ * Commit every finished operation and wait until it's durable.
+ *
+ * Concurrent callers share one commit. Must not be called between
+ * journal_begin() and journal_end().
+ */
+void journal_sync();
+
+#endif
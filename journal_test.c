@@ -0,0 +1,207 @@
+/**
+ * @file journal_test.c
+ * @brief In-process crash and replay test of the metadata journal.
+ *
+ * Usage: journal_test [image]
+ *
+ * A child process formats an image with the smallest journal, and fills
+ * a file it then deletes, so that later writes reuse its blocks. It then
+ * writes a file in one call large enough to dirty more metadata than one
+ * transaction holds, clones it, and syncs both, which must leave nothing
+ * uncommitted. It either dies without closing the journal, as in a
+ * crash, or exits normally. A second child mounts what is left and
+ * checks that both files hold what was written, not the deleted file's
+ * data.
+ *
+ * Journaled images are mapped privately, so nothing the child didn't
+ * write out survives it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "helpers/blocks.h"
+
+// Image geometry: 256MB of 4K blocks and the smallest journal
+#define JTEST_BLOCK_SIZE 4096
+#define JTEST_BLOCKS 65536
+#define JTEST_INODES 1024
+#define JTEST_INODE_SIZE 256
+#define JTEST_JOURNAL 8
+
+// Size of the test file, which takes 16 pointer tables
+#define JTEST_FILE_SIZE (64L << 20)
+
+// Size and fill byte of the file deleted first
+#define JTEST_OLD_SIZE (16L << 20)
+#define JTEST_OLD_FILL 0xa5
+
+// Bytes checked per call
+#define JTEST_CHUNK (1L << 20)
+
+/**
+ * Fill part of the test file with its expected contents.
+ *
+ * @param buf Buffer of size bytes.
+ * @param size Bytes to fill, a multiple of sizeof(long).
+ * @param offset Byte offset of the part in the file.
+ */
+static void jtest_pattern(char *buf, long size, long offset) {
+    for (long ii = 0; ii < size; ii += sizeof(long)) {
+        long word = (offset + ii) * 2654435761L;
+        memcpy(buf + ii, &word, sizeof(long));
+    }
+}
+
+/**
+ * Format the image, write, delete, write and clone files and sync, then
+ * exit.
+ *
+ * @param image Path to the disk image.
+ * @param crash Nonzero to exit without closing the journal.
+ */
+static void jtest_child(const char *image, int crash) {
+    if (storage_mkfs(image, JTEST_BLOCK_SIZE, JTEST_BLOCKS, JTEST_INODES, JTEST_INODE_SIZE,
+                     JTEST_JOURNAL) < 0) {
+        _exit(2);
+    }
+    storage_init(image);
+    if (storage_mknod("/a", 0100644) < 0 || storage_mknod("/b", 0100644) < 0) {
+        _exit(2);
+    }
+
+    char *buf = malloc(JTEST_FILE_SIZE);
+    memset(buf, JTEST_OLD_FILL, JTEST_OLD_SIZE);
+    if (storage_mknod("/old", 0100644) < 0 ||
+        storage_write("/old", buf, JTEST_OLD_SIZE, 0) != JTEST_OLD_SIZE ||
+        storage_sync("/old", 1) < 0 || storage_unlink("/old") < 0) {
+        _exit(2);
+    }
+    storage_sync("/", 1);
+
+    jtest_pattern(buf, JTEST_FILE_SIZE, 0);
+    if (storage_write("/a", buf, JTEST_FILE_SIZE, 0) != JTEST_FILE_SIZE) {
+        _exit(2);
+    }
+    free(buf);
+    if (storage_clone_inum(storage_lookup(0, "a"), storage_lookup(0, "b")) < 0) {
+        _exit(2);
+    }
+
+    // No other operation runs, so a sync leaves no metadata uncommitted
+    if (storage_sync("/a", 1) < 0 || storage_sync("/b", 1) < 0) {
+        _exit(2);
+    }
+    if (blocks_dirty_count() > 0) {
+        printf("sync left %d dirty blocks\n", blocks_dirty_count());
+        fflush(stdout);
+        _exit(2);
+    }
+
+    // exit() closes the journal, _exit() leaves it as a crash would
+    if (crash) {
+        _exit(0);
+    }
+    exit(0);
+}
+
+/**
+ * Check that a file of the remounted image holds the pattern.
+ *
+ * @param path Absolute path to the file.
+ *
+ * @return 0 if it does, -1 if not.
+ */
+static int jtest_check(const char *path) {
+    struct stat st;
+    if (storage_stat(path, &st) < 0 || st.st_size != JTEST_FILE_SIZE) {
+        printf("%s: wrong size\n", path);
+        return -1;
+    }
+
+    char *want = malloc(JTEST_CHUNK);
+    char *got = malloc(JTEST_CHUNK);
+    int rv = 0;
+    for (long off = 0; off < JTEST_FILE_SIZE && rv == 0; off += JTEST_CHUNK) {
+        jtest_pattern(want, JTEST_CHUNK, off);
+        if (storage_read(path, got, JTEST_CHUNK, off) != JTEST_CHUNK ||
+            memcmp(want, got, JTEST_CHUNK) != 0) {
+            printf("%s: wrong data at %ld\n", path, off);
+            rv = -1;
+        }
+    }
+    free(want);
+    free(got);
+    return rv;
+}
+
+/**
+ * Run a step of the test in a child process.
+ *
+ * Every mount happens in a child, since forking a process whose journal
+ * committer is running could copy its locks held.
+ *
+ * @param image Path to the disk image.
+ * @param step 0 to remount and check, 1 to write and crash, 2 to write
+ *             and exit.
+ *
+ * @return 0 if the child succeeded, -1 if not.
+ */
+static int jtest_fork(const char *image, int step) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (step > 0) {
+            jtest_child(image, step == 1);
+        }
+        storage_init(image);
+        exit(jtest_check("/a") < 0 || jtest_check("/b") < 0);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Run one case and check the image it leaves.
+ *
+ * @param image Path to the disk image.
+ * @param crash Nonzero to have the child die without closing.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int jtest_run(const char *image, int crash) {
+    int rv = jtest_fork(image, crash ? 1 : 2);
+    if (rv < 0) {
+        printf("%s: child failed\n", crash ? "crash" : "exit");
+    } else {
+        rv = jtest_fork(image, 0);
+    }
+    printf("%s %s\n", rv == 0 ? "ok" : "FAIL", crash ? "crash" : "exit");
+    return rv;
+}
+
+/**
+ * Main entry point.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ *
+ * @return 0 if every case passed, 1 otherwise.
+ */
+int main(int argc, char *argv[]) {
+    const char *image = argc > 1 ? argv[1] : "journal_test.nufs";
+
+    int rv = jtest_run(image, 1);
+    rv |= jtest_run(image, 0);
+    unlink(image);
+    return rv == 0 ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/**
+ * @file mkfs.c
+ * @brief Create a NUFS disk image with a chosen geometry.
+ *
+ * Usage: mkfs.nufs [-s size] [-b block_size] [-i inodes] [-I inode_size]
+ *                  [-j blocks] image
+ *
+ * Sizes take an optional K, M or G suffix. Without -i, one inode is
+ * made per MKFS_BYTES_PER_INODE bytes of image. Without -j, one journal
+ * block is reserved per MKFS_BLOCKS_PER_JOURNAL_BLOCK blocks, within
+ * limits; -j 0 makes an image without a journal. -I sets the bytes per
+ * inode record, STORAGE_DEFAULT_INODE_SIZE by default; files that fit in
+ * what the inode's fields leave of it take no data block.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "storage.h"
+#include "helpers/blocks.h"
+
+// Default image size: the legacy 1MB
+#define MKFS_DEFAULT_SIZE (1L << 20)
+
+// Image bytes per inode when -i isn't given
+#define MKFS_BYTES_PER_INODE 8192
+
+// Journal size when -j isn't given
+#define MKFS_BLOCKS_PER_JOURNAL_BLOCK 64
+#define MKFS_MAX_JOURNAL_BLOCKS 4096
+
+/**
+ * Parse a size with an optional K, M or G suffix.
+ *
+ * @param text Size to parse.
+ *
+ * @return Size in bytes, or -1 if the text isn't a valid size.
+ */
+static long parse_size(const char *text) {
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value <= 0) {
+        return -1;
+    }
+
+    switch (*end) {
+    case 'G': case 'g':
+        value <<= 10;
+        // fall through
+    case 'M': case 'm':
+        value <<= 10;
+        // fall through
+    case 'K': case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+
+    return *end == '\0' ? value : -1;
+}
+
+/**
+ * Print usage and exit.
+ *
+ * @param prog Program name.
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s size] [-b block_size] [-i inodes] [-I inode_size] "
+            "[-j blocks] image\n", prog);
+    exit(2);
+}
+
+/**
+ * Main entry point for mkfs.
+ *
+ * Formats the image, then mounts it once to create the root directory.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ *
+ * @return 0 on success, 1 if the image couldn't be created.
+ */
+int main(int argc, char *argv[]) {
+    long size = MKFS_DEFAULT_SIZE;
+    long block_size = STORAGE_DEFAULT_BLOCK_SIZE;
+    long inodes = -1;
+    long inode_size = STORAGE_DEFAULT_INODE_SIZE;
+    long journal = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:i:I:j:")) != -1) {
+        switch (opt) {
+        case 's':
+            size = parse_size(optarg);
+            break;
+        case 'b':
+            block_size = parse_size(optarg);
+            break;
+        case 'i':
+            inodes = parse_size(optarg);
+            break;
+        case 'I':
+            inode_size = parse_size(optarg);
+            break;
+        case 'j':
+            // Zero is allowed here, unlike for the other sizes
+            journal = strcmp(optarg, "0") == 0 ? 0 : parse_size(optarg);
+            if (journal < 0) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || size <= 0 || block_size <= 0 || inodes == 0 ||
+        inode_size <= 0) {
+        usage(argv[0]);
+    }
+    const char *image = argv[optind];
+
+    // Round the block count down to a whole byte of bitmap
+    long block_count = (size / block_size) & ~7L;
+    if (inodes < 0) {
+        inodes = size / MKFS_BYTES_PER_INODE;
+        if (inodes < STORAGE_DEFAULT_INODE_COUNT) {
+            inodes = STORAGE_DEFAULT_INODE_COUNT;
+        }
+    }
+    if (journal < 0) {
+        journal = block_count / MKFS_BLOCKS_PER_JOURNAL_BLOCK;
+        if (journal < STORAGE_DEFAULT_JOURNAL_BLOCKS) {
+            journal = STORAGE_DEFAULT_JOURNAL_BLOCKS;
+        }
+        if (journal > MKFS_MAX_JOURNAL_BLOCKS) {
+            journal = MKFS_MAX_JOURNAL_BLOCKS;
+        }
+    }
+    if (block_count > 0x7fffffffL || inodes > 0x7fffffffL || inode_size > 0x7fffffffL ||
+        journal > 0x7fffffffL) {
+        fprintf(stderr, "%s: image too large\n", argv[0]);
+        return 1;
+    }
+
+    if (storage_mkfs(image, block_size, block_count, inodes, inode_size, journal) < 0) {
+        fprintf(stderr, "%s: can't create a %ld x %ld image with %ld inodes of %ld bytes "
+                "and %ld journal blocks\n", argv[0], block_count, block_size, inodes,
+                inode_size, journal);
+        return 1;
+    }
+
+    // Mounting once creates the root directory
+    storage_init(image);
+
+    const nufs_super_t *sb = blocks_super();
+    printf("%s: %u blocks of %u bytes, %u inodes of %u bytes, %u journal blocks, "
+           "data from block %u\n", image, sb->block_count, sb->block_size, sb->inode_count,
+           sb->inode_size, sb->journal_blocks, sb->data_start);
+    return 0;
+}
@@ -8,12 +8,19 @@
  * File renaming and moving between directories
  * Hard links
  * File truncation and timestamps
+ * A read-only control file, /.nufs/stats, with per-operation statistics
  *
- * The filesystem stores data in a 1MB disk image file with 256 4KB blocks.
+ * The filesystem stores data in a disk image whose geometry is read from
+ * its superblock. A missing image is created with the default 1MB of 4KB
+ * blocks; mkfs.nufs makes larger ones.
  */
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -22,8 +29,33 @@
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+#include "nufs_ioctl.h"
+#include "stats.h"
 #include "storage.h"
-#include "helpers/slist.h"
+#include "trace.h"
+
+// File handle of an open control file, never a storage handle
+#define NUFS_STATS_FH ((uint64_t)-1)
+
+/**
+ * Check if a path names the control file or its directory.
+ *
+ * @param path Path to check.
+ *
+ * @return S_IFDIR for the directory, S_IFREG for the file, 0 otherwise.
+ */
+static int nufs_stats_path(const char *path) {
+    if (path == NULL) {
+        return 0;
+    }
+    if (strcmp(path, STATS_DIR) == 0) {
+        return S_IFDIR;
+    }
+    if (strcmp(path, STATS_FILE) == 0) {
+        return S_IFREG;
+    }
+    return 0;
+}
 
 /**
  * Check if a file exists and is accessible.
@@ -36,12 +68,18 @@
  * @return 0 if accessible, -ENOENT if not found.
  */
 int nufs_access(const char *path, int mask) {
+    uint64_t start = stats_clock();
     int rv = 0;
     struct stat st;
     
-    rv = storage_stat(path, &st);
+    if (nufs_stats_path(path) != 0) {
+        rv = (mask & W_OK) ? -EACCES : 0;
+    } else {
+        rv = storage_stat(path, &st);
+    }
     
-    printf("access(%s, %04o) -> %d\n", path, mask, rv);
+    stats_op(STATS_ACCESS, start, rv);
+    TRACE(TRACE_DEBUG, "access(%s, %04o) -> %d", path, mask, rv);
     return rv;
 }
 
@@ -56,65 +94,109 @@ int nufs_access(const char *path, int mask) {
  * @return 0 on success, -ENOENT if not found.
  */
 int nufs_getattr(const char *path, struct stat *st) {
-    int rv = storage_stat(path, st);
+    uint64_t start = stats_clock();
+    int rv = 0;
+    int type = nufs_stats_path(path);
+    if (type != 0) {
+        stats_stat(type, st);
+    } else {
+        rv = storage_stat(path, st);
+    }
     
-    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", 
-           path, rv, st->st_mode, st->st_size);
+    stats_op(STATS_GETATTR, start, rv);
+    TRACE(TRACE_DEBUG, "getattr(%s) -> (%d) {mode: %04o, size: %ld}",
+          path, rv, st->st_mode, st->st_size);
     return rv;
 }
 
+/**
+ * Context passed through storage_readdir() to nufs_readdir_fill().
+ */
+typedef struct nufs_readdir_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+} nufs_readdir_ctx_t;
+
+/**
+ * Add one directory entry to a readdir reply.
+ *
+ * @param ctx nufs_readdir_ctx_t for the reply.
+ * @param name Entry name.
+ * @param st Entry attributes.
+ * @param next Slot to resume from after this entry.
+ *
+ * @return Nonzero once the reply buffer is full.
+ */
+static int nufs_readdir_fill(void *ctx, const char *name, const struct stat *st, int next) {
+    nufs_readdir_ctx_t *rc = ctx;
+    
+    // Offsets count . and .. before the first slot
+    return rc->filler(rc->buf, name, st, next + 2);
+}
+
 /**
  * List the contents of a directory.
  *
  * Implementation for: man 2 readdir
  *
+ * Entries are listed straight from the directory with their attributes,
+ * and offsets are dirent slot numbers shifted past "." and "..", so a
+ * large directory is returned one buffer at a time.
+ *
  * @param path Path to the directory.
  * @param buf Buffer for directory entries.
  * @param filler Callback function to add entries.
- * @param offset Offset in directory.
+ * @param offset Offset of the last entry already returned.
  * @param fi File info.
  *
  * @return 0 on success.
  */
 int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
     struct stat st;
     int rv;
     
     // Add . entry, current directory
-    rv = storage_stat(path, &st);
+    int type = nufs_stats_path(path);
+    if (type == S_IFDIR) {
+        stats_stat(type, &st);
+        rv = 0;
+    } else {
+        rv = type != 0 ? -ENOTDIR : storage_stat(path, &st);
+    }
     if (rv < 0) {
-        printf("readdir(%s) -> %d (dir not found)\n", path, rv);
+        stats_op(STATS_READDIR, start, rv);
+        TRACE(TRACE_DEBUG, "readdir(%s) -> %d (dir not found)", path, rv);
         return rv;
     }
-    filler(buf, ".", &st, 0);
+    if (offset < 1 && filler(buf, ".", &st, 1) != 0) {
+        stats_op(STATS_READDIR, start, 0);
+        return 0;
+    }
     
     // Add .. entry, parent directiory
-    filler(buf, "..", NULL, 0);
-    
-    // Get list of directory entries
-    slist_t *entries = storage_list(path);
+    if (offset < 2 && filler(buf, "..", NULL, 2) != 0) {
+        stats_op(STATS_READDIR, start, 0);
+        return 0;
+    }
     
-    // Add each entry
-    for (slist_t *curr = entries; curr != NULL; curr = curr->next) {
-        // Build full path for stat
-        char full_path[256];
-        if (strcmp(path, "/") == 0) {
-            snprintf(full_path, sizeof(full_path), "/%s", curr->data);
-        } else {
-            snprintf(full_path, sizeof(full_path), "%s/%s", path, curr->data);
-        }
-        
-        rv = storage_stat(full_path, &st);
-        if (rv == 0) {
-            filler(buf, curr->data, &st, 0);
+    if (type == S_IFDIR) {
+        // The control directory only holds the control file
+        stats_stat(S_IFREG, &st);
+        if (offset < 3) {
+            filler(buf, STATS_FILE_NAME, &st, 3);
         }
+    } else {
+        // Add each entry, resuming after the last one returned
+        nufs_readdir_ctx_t ctx = { buf, filler };
+        rv = storage_readdir_inum(st.st_ino, offset < 2 ? 0 : offset - 2,
+                                  nufs_readdir_fill, &ctx);
     }
     
-    slist_free(entries);
-    
-    printf("readdir(%s) -> 0\n", path);
-    return 0;
+    stats_op(STATS_READDIR, start, rv);
+    TRACE(TRACE_DEBUG, "readdir(%s, @%ld) -> %d", path, (long)offset, rv);
+    return rv;
 }
 
 /**
@@ -129,8 +211,10 @@ int nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
  * @return 0 on success, negative error on fail.
  */
 int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
-    int rv = storage_mknod(path, mode);
-    printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(path) != 0 ? -EEXIST : storage_mknod(path, mode);
+    stats_op(STATS_MKNOD, start, rv);
+    TRACE(TRACE_DEBUG, "mknod(%s, %04o) -> %d", path, mode, rv);
     return rv;
 }
 
@@ -145,8 +229,10 @@ int nufs_mknod(const char *path, mode_t mode, dev_t rdev) {
  * @return 0 on success, negative error on fail.
  */
 int nufs_mkdir(const char *path, mode_t mode) {
-    int rv = storage_mknod(path, mode | S_IFDIR);
-    printf("mkdir(%s) -> %d\n", path, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(path) != 0 ? -EEXIST : storage_mknod(path, mode | S_IFDIR);
+    stats_op(STATS_MKDIR, start, rv);
+    TRACE(TRACE_DEBUG, "mkdir(%s) -> %d", path, rv);
     return rv;
 }
 
@@ -160,8 +246,10 @@ int nufs_mkdir(const char *path, mode_t mode) {
  * @return 0 on success, negative error on fail.
  */
 int nufs_unlink(const char *path) {
-    int rv = storage_unlink(path);
-    printf("unlink(%s) -> %d\n", path, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(path) != 0 ? -EPERM : storage_unlink(path);
+    stats_op(STATS_UNLINK, start, rv);
+    TRACE(TRACE_DEBUG, "unlink(%s) -> %d", path, rv);
     return rv;
 }
 
@@ -176,8 +264,11 @@ int nufs_unlink(const char *path) {
  * @return 0 on success, negative error on fail.
  */
 int nufs_link(const char *from, const char *to) {
-    int rv = storage_link(from, to);
-    printf("link(%s => %s) -> %d\n", from, to, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(from) != 0 || nufs_stats_path(to) != 0
+        ? -EPERM : storage_link(from, to);
+    stats_op(STATS_LINK, start, rv);
+    TRACE(TRACE_DEBUG, "link(%s => %s) -> %d", from, to, rv);
     return rv;
 }
 
@@ -192,16 +283,11 @@ int nufs_link(const char *from, const char *to) {
  * @return 0 on success, -ENOTEMPTY if not empty, other errors.
  */
 int nufs_rmdir(const char *path) {
-    // Check if directory is empty
-    slist_t *entries = storage_list(path);
-    if (entries != NULL) {
-        slist_free(entries);
-        printf("rmdir(%s) -> -ENOTEMPTY\n", path);
-        return -ENOTEMPTY;
-    }
-    
-    int rv = storage_unlink(path);
-    printf("rmdir(%s) -> %d\n", path, rv);
+    // The emptiness check is done under the directory's lock
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(path) != 0 ? -EPERM : storage_rmdir(path);
+    stats_op(STATS_RMDIR, start, rv);
+    TRACE(TRACE_DEBUG, "rmdir(%s) -> %d", path, rv);
     return rv;
 }
 
@@ -216,8 +302,11 @@ int nufs_rmdir(const char *path) {
  * @return 0 on success, negative error on fail.
  */
 int nufs_rename(const char *from, const char *to) {
-    int rv = storage_rename(from, to);
-    printf("rename(%s => %s) -> %d\n", from, to, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(from) != 0 || nufs_stats_path(to) != 0
+        ? -EBUSY : storage_rename(from, to);
+    stats_op(STATS_RENAME, start, rv);
+    TRACE(TRACE_DEBUG, "rename(%s => %s) -> %d", from, to, rv);
     return rv;
 }
 
@@ -232,8 +321,10 @@ int nufs_rename(const char *from, const char *to) {
  * @return 0 on success, negative error on fail.
  */
 int nufs_chmod(const char *path, mode_t mode) {
-    int rv = storage_chmod(path, mode);
-    printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(path) != 0 ? -EPERM : storage_chmod(path, mode);
+    stats_op(STATS_CHMOD, start, rv);
+    TRACE(TRACE_DEBUG, "chmod(%s, %04o) -> %d", path, mode, rv);
     return rv;
 }
 
@@ -248,16 +339,62 @@ int nufs_chmod(const char *path, mode_t mode) {
  * @return 0 on success, negative error on fail.
  */
 int nufs_truncate(const char *path, off_t size) {
-    int rv = storage_truncate(path, size);
-    printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(path) != 0 ? -EPERM : storage_truncate(path, size);
+    stats_op(STATS_TRUNCATE, start, rv);
+    TRACE(TRACE_DEBUG, "truncate(%s, %ld bytes) -> %d", path, size, rv);
+    return rv;
+}
+
+/**
+ * Truncate an open file to the specified size.
+ *
+ * Implementation for: man 2 ftruncate
+ *
+ * @param path Path to the file, may be NULL.
+ * @param size New size in bytes.
+ * @param fi File info holding the handle from open.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = fi->fh == NUFS_STATS_FH ? -EINVAL : storage_truncate_fh(fi->fh, size);
+    stats_op(STATS_TRUNCATE, start, rv);
+    TRACE(TRACE_DEBUG, "ftruncate(fh %lu, %ld bytes) -> %d", (unsigned long)fi->fh, size, rv);
+    return rv;
+}
+
+/**
+ * Get attributes of an open file.
+ *
+ * Implementation for: man 2 fstat
+ *
+ * @param path Path to the file, may be NULL.
+ * @param st Stat structure to fill with attributes.
+ * @param fi File info holding the handle from open.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int nufs_fgetattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = 0;
+    if (fi->fh == NUFS_STATS_FH) {
+        stats_stat(S_IFREG, st);
+    } else {
+        rv = storage_stat_fh(fi->fh, st);
+    }
+    stats_op(STATS_GETATTR, start, rv);
+    TRACE(TRACE_DEBUG, "fgetattr(fh %lu) -> %d", (unsigned long)fi->fh, rv);
     return rv;
 }
 
 /**
  * Open a file.
  *
- * FUSE doesn't require maintaining state for open files,
- * so this just checks if the file exists.
+ * Resolves the path once and stores the storage handle in fi->fh, so
+ * read, write and release skip path resolution. The control file gets
+ * NUFS_STATS_FH instead.
  *
  * @param path Path to the file.
  * @param fi File info.
@@ -265,9 +402,147 @@ int nufs_truncate(const char *path, off_t size) {
  * @return 0 if file exists, -ENOENT otherwise.
  */
 int nufs_open(const char *path, struct fuse_file_info *fi) {
-    struct stat st;
-    int rv = storage_stat(path, &st);
-    printf("open(%s) -> %d\n", path, rv);
+    uint64_t start = stats_clock();
+    int rv;
+    int type = nufs_stats_path(path);
+    if (type != 0) {
+        // The text changes on every read, so keep it out of the page cache
+        rv = type == S_IFDIR ? -EISDIR : (fi->flags & O_ACCMODE) != O_RDONLY ? -EACCES : 0;
+        fi->fh = NUFS_STATS_FH;
+        fi->direct_io = 1;
+    } else {
+        rv = storage_open(path, fi->flags);
+        if (rv >= 0) {
+            fi->fh = rv;
+            rv = 0;
+        }
+    }
+    stats_op(STATS_OPEN, start, rv);
+    TRACE(TRACE_DEBUG, "open(%s) -> %d", path, rv);
+    return rv;
+}
+
+/**
+ * Open a directory for listing.
+ *
+ * Stores the directory's inode number in fi->fh, so releasedir can end
+ * the listing after the path is gone. The control directory gets
+ * NUFS_STATS_FH instead.
+ *
+ * @param path Path to the directory.
+ * @param fi File info.
+ *
+ * @return 0 on success, -ENOENT or -ENOTDIR.
+ */
+int nufs_opendir(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv;
+    int type = nufs_stats_path(path);
+    if (type != 0) {
+        rv = type == S_IFDIR ? 0 : -ENOTDIR;
+        fi->fh = NUFS_STATS_FH;
+    } else {
+        rv = storage_opendir(path);
+        if (rv >= 0) {
+            fi->fh = rv;
+            rv = 0;
+        }
+    }
+    stats_op(STATS_OPENDIR, start, rv);
+    TRACE(TRACE_DEBUG, "opendir(%s) -> %d", path, rv);
+    return rv;
+}
+
+/**
+ * Release an open directory.
+ *
+ * @param path Path to the directory, may be NULL.
+ * @param fi File info holding the inode number from opendir.
+ *
+ * @return 0.
+ */
+int nufs_releasedir(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    if (fi->fh != NUFS_STATS_FH) {
+        storage_releasedir_inum(fi->fh);
+    }
+    stats_op(STATS_RELEASEDIR, start, 0);
+    TRACE(TRACE_DEBUG, "releasedir(%lu) -> 0", (unsigned long)fi->fh);
+    return 0;
+}
+
+/**
+ * Release an open file.
+ *
+ * Called once the last file descriptor for an open is closed.
+ *
+ * @param path Path to the file, may be NULL.
+ * @param fi File info holding the handle from open.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int nufs_release(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = fi->fh == NUFS_STATS_FH ? 0 : storage_release_fh(fi->fh);
+    stats_op(STATS_RELEASE, start, rv);
+    TRACE(TRACE_DEBUG, "release(fh %lu) -> %d", (unsigned long)fi->fh, rv);
+    return rv;
+}
+
+/**
+ * Flush an open file on close.
+ *
+ * Called for every close of a file descriptor. Starts writing the file's
+ * changes back without waiting for them; fsync is what waits.
+ *
+ * @param path Path to the file, may be NULL.
+ * @param fi File info holding the handle from open.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int nufs_flush(const char *path, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = fi->fh == NUFS_STATS_FH ? 0 : storage_sync_fh(fi->fh, 0);
+    stats_op(STATS_FLUSH, start, rv);
+    TRACE(TRACE_DEBUG, "flush(fh %lu) -> %d", (unsigned long)fi->fh, rv);
+    return rv;
+}
+
+/**
+ * Make an open file's changes durable.
+ *
+ * Implementation for: man 2 fsync
+ *
+ * @param path Path to the file, may be NULL.
+ * @param datasync Nonzero for fdatasync; the inode is written either way.
+ * @param fi File info holding the handle from open.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int nufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = fi->fh == NUFS_STATS_FH ? 0 : storage_sync_fh(fi->fh, 1);
+    stats_op(STATS_FSYNC, start, rv);
+    TRACE(TRACE_DEBUG, "fsync(fh %lu, %d) -> %d", (unsigned long)fi->fh, datasync, rv);
+    return rv;
+}
+
+/**
+ * Make a directory's entries durable.
+ *
+ * Implementation for: man 2 fsync, on a directory
+ *
+ * @param path Path to the directory, NULL if it was removed.
+ * @param datasync Nonzero for fdatasync; the inode is written either way.
+ * @param fi File info.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int nufs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = path == NULL ? -ENOENT : nufs_stats_path(path) != 0 ? 0 : storage_sync(path, 1);
+    stats_op(STATS_FSYNCDIR, start, rv);
+    TRACE(TRACE_DEBUG, "fsyncdir(%s, %d) -> %d", path, datasync, rv);
     return rv;
 }
 
@@ -276,18 +551,21 @@ int nufs_open(const char *path, struct fuse_file_info *fi) {
  *
  * Implementation for: man 2 read
  *
- * @param path Path to the file.
+ * @param path Path to the file, may be NULL.
  * @param buf Buffer to read into.
  * @param size Maximum bytes to read.
  * @param offset Byte offset to start reading from.
- * @param fi File info.
+ * @param fi File info holding the handle from open.
  *
  * @return Number of bytes read, or negative error code.
  */
 int nufs_read(const char *path, char *buf, size_t size, off_t offset,
               struct fuse_file_info *fi) {
-    int rv = storage_read(path, buf, size, offset);
-    printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    uint64_t start = stats_clock();
+    int rv = fi->fh == NUFS_STATS_FH ? stats_read(buf, size, offset)
+                                     : storage_read_fh(fi->fh, buf, size, offset);
+    stats_op(STATS_READ, start, rv);
+    TRACE(TRACE_DEBUG, "read(fh %lu, %ld bytes, @+%ld) -> %d", (unsigned long)fi->fh, size, offset, rv);
     return rv;
 }
 
@@ -296,18 +574,156 @@ int nufs_read(const char *path, char *buf, size_t size, off_t offset,
  *
  * Implementation for: man 2 write
  *
- * @param path Path to the file.
+ * @param path Path to the file, may be NULL.
  * @param buf Buffer containing data to write.
  * @param size Number of bytes to write.
  * @param offset Byte offset to start writing at.
- * @param fi File info.
+ * @param fi File info holding the handle from open.
  *
  * @return Number of bytes written, or negative error code.
  */
 int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-    int rv = storage_write(path, buf, size, offset);
-    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    uint64_t start = stats_clock();
+    int rv = fi->fh == NUFS_STATS_FH ? -EBADF : storage_write_fh(fi->fh, buf, size, offset);
+    stats_op(STATS_WRITE, start, rv);
+    TRACE(TRACE_DEBUG, "write(fh %lu, %ld bytes, @+%ld) -> %d", (unsigned long)fi->fh, size, offset, rv);
+    return rv;
+}
+
+/**
+ * Free buffers of a read_buf reply, as FUSE would.
+ *
+ * @param bufv Buffers, may be NULL.
+ */
+static void nufs_free_bufvec(struct fuse_bufvec *bufv) {
+    if (bufv != NULL) {
+        for (size_t ii = 0; ii < bufv->count; ++ii) {
+            free(bufv->buf[ii].mem);
+        }
+        free(bufv);
+    }
+}
+
+/**
+ * Read data from a file without copying it out of the image.
+ *
+ * Implementation for: man 2 read, when FUSE takes the reply as buffers
+ *
+ * Runs of blocks go back as ranges of the image file, which the kernel
+ * can splice into the reply. FUSE only sends the reply after the file
+ * is unlocked, and frees every buffer in memory, so pieces in memory
+ * are copied to buffers of their own first. So this is only zero-copy
+ * on a journaled image, and only for blocks not held in memory: without
+ * a journal, with O_DIRECT, or for blocks that are dirty or cached,
+ * the data is copied once, as nufs_read would. The low-level front end
+ * replies under the lock and skips that copy.
+ *
+ * @param path Path to the file, may be NULL.
+ * @param bufp Receives the buffers, which FUSE frees.
+ * @param size Maximum bytes to read.
+ * @param offset Byte offset to start reading from.
+ * @param fi File info holding the handle from open.
+ *
+ * @return 0 on success, or negative error code.
+ */
+int nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                  struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int count = fi->fh == NUFS_STATS_FH ? 1 : STORAGE_IOV_MAX(size);
+    struct fuse_bufvec *bufv = calloc(1, sizeof(*bufv) + count * sizeof(struct fuse_buf));
+    storage_iov_t *iov = calloc(count, sizeof(*iov));
+    int rv = -ENOMEM;
+    
+    if (bufv == NULL || iov == NULL) {
+        // Nothing to do but report it
+    } else if (fi->fh == NUFS_STATS_FH) {
+        bufv->count = 1;
+        bufv->buf[0].mem = malloc(size);
+        if (bufv->buf[0].mem != NULL) {
+            rv = stats_read(bufv->buf[0].mem, size, offset);
+            bufv->buf[0].size = rv > 0 ? rv : 0;
+        }
+    } else {
+        rv = storage_read_iov_fh(fi->fh, size, offset, iov, &count, STORAGE_IOV_UNLOCKED);
+        if (rv >= 0) {
+            for (int ii = 0; ii < count && rv >= 0; ++ii) {
+                struct fuse_buf *buf = &bufv->buf[bufv->count++];
+                buf->size = iov[ii].len;
+                if (iov[ii].data == NULL) {
+                    buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+                    buf->fd = iov[ii].fd;
+                    buf->pos = iov[ii].pos;
+                } else if ((buf->mem = malloc(iov[ii].len)) != NULL) {
+                    memcpy(buf->mem, iov[ii].data, iov[ii].len);
+                } else {
+                    rv = -ENOMEM;
+                }
+            }
+            storage_read_iov_end(fi->fh);
+        }
+    }
+    free(iov);
+    
+    if (rv >= 0) {
+        *bufp = bufv;
+    } else {
+        nufs_free_bufvec(bufv);
+    }
+    stats_op(STATS_READ, start, rv);
+    TRACE(TRACE_DEBUG, "read_buf(fh %lu, %ld bytes, @+%ld) -> %d", (unsigned long)fi->fh, size,
+          offset, rv);
+    return rv < 0 ? rv : 0;
+}
+
+/**
+ * Write data to a file straight from the buffers FUSE received it in.
+ *
+ * Implementation for: man 2 write, when FUSE passes the data as buffers
+ *
+ * Buffers in memory are written where they are, without gathering them
+ * into one first. Data still in a pipe is read out through a buffer.
+ *
+ * @param path Path to the file, may be NULL.
+ * @param bufv The data.
+ * @param offset Byte offset to start writing at.
+ * @param fi File info holding the handle from open.
+ *
+ * @return Number of bytes written, or negative error code.
+ */
+int nufs_write_buf(const char *path, struct fuse_bufvec *bufv, off_t offset,
+                   struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    size_t size = fuse_buf_size(bufv);
+    size_t done = 0;
+    int rv = fi->fh == NUFS_STATS_FH ? -EBADF : 0;
+    
+    for (size_t ii = bufv->idx; ii < bufv->count && rv >= 0; ++ii) {
+        struct fuse_bufvec src = { 1, 0, 0, { bufv->buf[ii] } };
+        size_t skip = ii == bufv->idx ? bufv->off : 0;
+        size_t len = src.buf[0].size - skip;
+        char *mem = src.buf[0].mem;
+        if ((src.buf[0].flags & FUSE_BUF_IS_FD) != 0) {
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+            dst.buf[0].mem = mem = malloc(len);
+            src.off = skip;
+            ssize_t got = mem == NULL ? -ENOMEM : fuse_buf_copy(&dst, &src, 0);
+            rv = got < 0 ? (int)got : storage_write_fh(fi->fh, mem, got, offset + done);
+            free(mem);
+        } else {
+            rv = storage_write_fh(fi->fh, mem + skip, len, offset + done);
+        }
+        done += rv > 0 ? rv : 0;
+        if (rv >= 0 && (size_t)rv < len) {
+            break;  // Out of space, report the bytes written so far
+        }
+    }
+    
+    // A failure after some data went in still reports that data
+    rv = done > 0 ? (int)done : rv;
+    stats_op(STATS_WRITE, start, rv);
+    TRACE(TRACE_DEBUG, "write_buf(fh %lu, %ld bytes, @+%ld) -> %d", (unsigned long)fi->fh, size,
+          offset, rv);
     return rv;
 }
 
@@ -322,24 +738,105 @@ int nufs_write(const char *path, const char *buf, size_t size, off_t offset,
  * @return 0 on success, negative error on fail.
  */
 int nufs_utimens(const char *path, const struct timespec ts[2]) {
-    int rv = storage_set_time(path, ts);
-    printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n", 
-           path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
+    uint64_t start = stats_clock();
+    int rv = nufs_stats_path(path) != 0 ? -EPERM : storage_set_time(path, ts);
+    stats_op(STATS_UTIMENS, start, rv);
+    TRACE(TRACE_DEBUG, "utimens(%s, [%ld, %ld; %ld %ld]) -> %d",
+          path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
     return rv;
 }
 
 /**
  * Handle ioctl requests.
  *
- * @return -1
+ * Serves the commands in nufs_ioctl.h on open files.
+ *
+ * @param path Path to the file.
+ * @param cmd ioctl command.
+ * @param arg Argument as the caller passed it.
+ * @param fi Open file info.
+ * @param flags FUSE_IOCTL_* flags.
+ * @param data Buffer the command's argument is copied in and out of.
+ *
+ * @return 0 on success, -ENOTTY for unknown commands, or the error of
+ *         the command.
  */
 int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
                unsigned int flags, void *data) {
-    int rv = -1;
-    printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+    uint64_t start = stats_clock();
+    int rv = -ENOTTY;
+    unsigned int command = cmd;
+    nufs_ioc_copy_t *copy = data;
+    if ((flags & FUSE_IOCTL_DIR) != 0 || fi->fh == NUFS_STATS_FH) {
+        rv = -ENOTTY;  // Only regular files take commands
+    } else if (command == NUFS_IOC_SEEK_DATA || command == NUFS_IOC_SEEK_HOLE) {
+        int whence = command == NUFS_IOC_SEEK_DATA ? SEEK_DATA : SEEK_HOLE;
+        off_t pos = storage_seek_fh(fi->fh, *(int64_t *)data, whence);
+        if (pos >= 0) {
+            *(int64_t *)data = pos;
+            rv = 0;
+        } else {
+            rv = (int)pos;
+        }
+    } else if (command == NUFS_IOC_CLONE) {
+        copy->src[NUFS_IOC_PATH_MAX - 1] = '\0';
+        rv = storage_clone_fh(copy->src, fi->fh);
+    } else if (command == NUFS_IOC_COPY_RANGE && copy->length < 0) {
+        rv = -EINVAL;
+    } else if (command == NUFS_IOC_COPY_RANGE) {
+        copy->src[NUFS_IOC_PATH_MAX - 1] = '\0';
+        rv = storage_copy_range_fh(copy->src, copy->src_offset, fi->fh, copy->dst_offset,
+                                   copy->length);
+        if (rv >= 0) {
+            copy->length = rv;
+            rv = 0;
+        }
+    }
+    stats_op(STATS_IOCTL, start, rv);
+    TRACE(TRACE_DEBUG, "ioctl(%s, %d, ...) -> %d", path, cmd, rv);
     return rv;
 }
 
+/**
+ * Get filesystem statistics.
+ *
+ * Implementation for: man 2 statfs
+ *
+ * @param path Path to any file on the filesystem, unused.
+ * @param st Statistics structure to fill.
+ *
+ * @return 0.
+ */
+int nufs_statfs(const char *path, struct statvfs *st) {
+    uint64_t start = stats_clock();
+    int rv = storage_statfs(st);
+    stats_op(STATS_STATFS, start, rv);
+    TRACE(TRACE_DEBUG, "statfs(%s) -> (%d) {bfree: %lu, ffree: %lu}",
+          path, rv, (unsigned long)st->f_bfree, (unsigned long)st->f_ffree);
+    return rv;
+}
+
+/**
+ * Set up the connection with the kernel.
+ *
+ * Asks for read-ahead as large as the storage layer's own, so that a
+ * stream's reads reach NUFS in large, early pieces. The kernel keeps the
+ * smaller of this and what it offered. max_read is left unlimited.
+ * Where the kernel can, replies are spliced, so file ranges read_buf
+ * hands back move from the image to the kernel without a pass through
+ * user memory.
+ *
+ * @param conn Connection parameters, adjusted in place.
+ *
+ * @return NULL, no private data is kept.
+ */
+void *nufs_init(struct fuse_conn_info *conn) {
+    conn->max_readahead = STORAGE_READAHEAD_MAX;
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    TRACE(TRACE_DEBUG, "init(max_readahead %u)", conn->max_readahead);
+    return NULL;
+}
+
 /**
  * Initialize FUSE operations structure.
  *
@@ -349,9 +846,12 @@ int nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
  */
 void nufs_init_ops(struct fuse_operations *ops) {
     memset(ops, 0, sizeof(struct fuse_operations));
+    ops->init = nufs_init;
     ops->access = nufs_access;
     ops->getattr = nufs_getattr;
     ops->readdir = nufs_readdir;
+    ops->opendir = nufs_opendir;
+    ops->releasedir = nufs_releasedir;
     ops->mknod = nufs_mknod;
     ops->mkdir = nufs_mkdir;
     ops->link = nufs_link;
@@ -360,15 +860,46 @@ void nufs_init_ops(struct fuse_operations *ops) {
     ops->rename = nufs_rename;
     ops->chmod = nufs_chmod;
     ops->truncate = nufs_truncate;
+    ops->ftruncate = nufs_ftruncate;
+    ops->fgetattr = nufs_fgetattr;
     ops->open = nufs_open;
+    ops->release = nufs_release;
+    ops->flush = nufs_flush;
+    ops->fsync = nufs_fsync;
+    ops->fsyncdir = nufs_fsyncdir;
     ops->read = nufs_read;
     ops->write = nufs_write;
+    ops->read_buf = nufs_read_buf;
+    ops->write_buf = nufs_write_buf;
     ops->utimens = nufs_utimens;
     ops->ioctl = nufs_ioctl;
+    ops->statfs = nufs_statfs;
+    
+    // Handle-based callbacks keep working after the path is unlinked
+    ops->flag_nullpath_ok = 1;
 }
 
 struct fuse_operations nufs_ops;
 
+/**
+ * Take the storage layer's mount options out of the FUSE arguments.
+ *
+ * noatime is passed on as well, so the kernel shows it for the mount.
+ *
+ * @param data Unused.
+ * @param arg The option, or another argument.
+ * @param key FUSE_OPT_KEY_OPT for options and unknown flags.
+ * @param outargs Arguments kept, unused.
+ *
+ * @return 0 to drop the argument, 1 to keep it.
+ */
+static int nufs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    if (key == FUSE_OPT_KEY_OPT && storage_option(arg) == 0) {
+        return strcmp(arg, "noatime") == 0;
+    }
+    return 1;
+}
+
 /**
  * Main entry point for the NUFS filesystem.
  *
@@ -376,13 +907,15 @@ struct fuse_operations nufs_ops;
  *
  * Usage: ./nufs [fuse_options] <mount_point> <disk_image>
  *
+ * Besides FUSE's own, -o takes the options of storage_option().
+ *
  * @param argc Argument count.
  * @param argv Argument vector.
  *
  * @return Exit code from fuse_main.
  */
 int main(int argc, char *argv[]) {
-    assert(argc > 2 && argc < 6);
+    assert(argc > 2);
     
     // Last argument is the disk image path
     const char *disk_image = argv[--argc];
@@ -394,6 +927,12 @@ int main(int argc, char *argv[]) {
     // Set up FUSE operations
     nufs_init_ops(&nufs_ops);
     
-    // Start FUSE
-    return fuse_main(argc, argv, &nufs_ops, NULL);
+    // Start FUSE, with the storage layer's options applied
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, NULL, NULL, nufs_opt_proc) == -1) {
+        return 1;
+    }
+    int rv = fuse_main(args.argc, args.argv, &nufs_ops, NULL);
+    fuse_opt_free_args(&args);
+    return rv;
 }
@@ -0,0 +1,71 @@
+/**
+ * @file nufs_ioctl.h
+ * @brief ioctl commands served by the NUFS front ends.
+ *
+ * FUSE 2.9 doesn't pass lseek(2) on to the filesystem, so the kernel
+ * answers SEEK_DATA and SEEK_HOLE as if files had no holes. Tools that
+ * want to skip the holes of a sparse file ask NUFS directly instead:
+ *
+ * int64_t pos = offset;
+ * if (ioctl(fd, NUFS_IOC_SEEK_DATA, &pos) == 0) {
+ *     // pos is the first data at or after offset
+ * }
+ *
+ * Errors are those of lseek(2): ENXIO past the end of the file, or when
+ * only a hole follows for NUFS_IOC_SEEK_DATA.
+ *
+ * Neither is there copy_file_range(2) or FICLONE, and FUSE can't hand the
+ * filesystem a descriptor the caller has open. Copies name their source
+ * by its path from the root of the mount, and go to the file the ioctl
+ * is on:
+ *
+ * nufs_ioc_copy_t copy = {.src_offset = 0, .dst_offset = 0, .length = len};
+ * strcpy(copy.src, "/dir/file");
+ * if (ioctl(fd, NUFS_IOC_COPY_RANGE, &copy) == 0) {
+ *     // copy.length bytes were copied
+ * }
+ *
+ * Blocks at the same offset within a block in both files are shared, not
+ * copied, until either file writes them. NUFS_IOC_CLONE replaces the
+ * whole file with the source, sharing every block (the offsets and length
+ * are ignored); it fails with EOPNOTSUPP on images too old to share
+ * blocks. Both fail with EBADF on a descriptor not open for writing,
+ * EISDIR for directories, and EINVAL for other files that aren't
+ * regular or ranges that overlap within one file.
+ *
+ * This header only depends on the system headers, so tools can include
+ * it on its own.
+ */
+#ifndef NUFS_IOCTL_H
+#define NUFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+// ioctl type byte of every NUFS command
+#define NUFS_IOC_MAGIC 'N'
+
+// Replace an offset with the next data or hole at or after it
+#define NUFS_IOC_SEEK_DATA _IOWR(NUFS_IOC_MAGIC, 1, int64_t)
+#define NUFS_IOC_SEEK_HOLE _IOWR(NUFS_IOC_MAGIC, 2, int64_t)
+
+// Longest source path a copy takes, NUL included
+#define NUFS_IOC_PATH_MAX 4096
+
+/**
+ * Argument of NUFS_IOC_COPY_RANGE and NUFS_IOC_CLONE.
+ */
+typedef struct nufs_ioc_copy {
+    int64_t src_offset;           // first byte of the source to copy
+    int64_t dst_offset;           // where it goes in the file
+    int64_t length;               // bytes to copy, replaced by bytes copied
+    char src[NUFS_IOC_PATH_MAX];  // source path from the root of the mount
+} nufs_ioc_copy_t;
+
+// Copy a range from another file, sharing the blocks that line up
+#define NUFS_IOC_COPY_RANGE _IOWR(NUFS_IOC_MAGIC, 3, nufs_ioc_copy_t)
+
+// Replace the file with a clone of another
+#define NUFS_IOC_CLONE _IOW(NUFS_IOC_MAGIC, 4, nufs_ioc_copy_t)
+
+#endif
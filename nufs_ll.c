@@ -0,0 +1,969 @@
+/**
+ * @file nufs_ll.c
+ * @brief NUFS front end built on the FUSE low-level API.
+ *
+ * An alternative to nufs.c that works on inode numbers instead of paths.
+ * The kernel sends node IDs, which map directly to NUFS inode numbers, so
+ * no operation here calls tree_lookup(). Path resolution happens one
+ * component at a time through lookup, which the kernel caches.
+ *
+ * Node IDs are inode numbers plus one, since FUSE reserves 1 for the root
+ * and NUFS keeps the root in inode 0. Every entry handed to the kernel
+ * pins its inode until the matching forget, so an unlinked file that is
+ * still open keeps its data.
+ *
+ * The control directory /.nufs and its file stats get node IDs past any
+ * inode number. They're never pinned, forgetting them does nothing.
+ *
+ * Uses the same disk image format as nufs.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse_lowlevel.h>
+
+#include "nufs_ioctl.h"
+#include "stats.h"
+#include "storage.h"
+#include "inode.h"
+
+// How long the kernel may cache attributes and names, in seconds
+#define NUFS_LL_TIMEOUT 1.0
+
+// Channel of the mount, for telling the kernel to drop cached pages
+static struct fuse_chan *nufs_ll_chan = NULL;
+
+// Node IDs of the control directory and file
+#define NUFS_LL_STATS_DIR ((fuse_ino_t)-2)
+#define NUFS_LL_STATS_FILE ((fuse_ino_t)-3)
+
+/**
+ * Convert a FUSE node ID to a NUFS inode number.
+ *
+ * @param ino FUSE node ID.
+ *
+ * @return Inode number.
+ */
+static int ino_to_inum(fuse_ino_t ino) { return (int)ino - 1; }
+
+/**
+ * Convert a NUFS inode number to a FUSE node ID.
+ *
+ * @param inum Inode number.
+ *
+ * @return FUSE node ID.
+ */
+static fuse_ino_t inum_to_ino(int inum) { return (fuse_ino_t)inum + 1; }
+
+/**
+ * Check if a node ID is the control file or its directory.
+ *
+ * @param ino FUSE node ID.
+ *
+ * @return S_IFDIR for the directory, S_IFREG for the file, 0 otherwise.
+ */
+static int nufs_ll_stats_ino(fuse_ino_t ino) {
+    if (ino == NUFS_LL_STATS_DIR) {
+        return S_IFDIR;
+    }
+    if (ino == NUFS_LL_STATS_FILE) {
+        return S_IFREG;
+    }
+    return 0;
+}
+
+/**
+ * Check if a name in a directory is, or is inside, the control directory.
+ *
+ * @param parent Node ID of the directory.
+ * @param name Name in it.
+ *
+ * @return Nonzero if creating, removing or renaming it must be refused.
+ */
+static int nufs_ll_stats_name(fuse_ino_t parent, const char *name) {
+    return parent == NUFS_LL_STATS_DIR ||
+           (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0);
+}
+
+/**
+ * Reply to a request with a directory entry for the given inode.
+ *
+ * Pins the inode, the kernel will drop the reference with forget.
+ *
+ * @param req FUSE request.
+ * @param inum Inode number of the entry.
+ * @param fi Open file info for create, or NULL for a plain entry reply.
+ *
+ * @return 0 if the entry was sent, negative error if the error was or
+ *         the request was interrupted before the entry got to the kernel.
+ */
+static int nufs_ll_reply_entry(fuse_req_t req, int inum,
+                               struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    
+    int rv = storage_stat_inum(inum, &e.attr);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return rv;
+    }
+    
+    e.ino = inum_to_ino(inum);
+    e.generation = storage_generation_inum(inum);
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = NUFS_LL_TIMEOUT;
+    e.entry_timeout = NUFS_LL_TIMEOUT;
+    
+    storage_pin(inum);
+    rv = fi != NULL ? fuse_reply_create(req, &e, fi) : fuse_reply_entry(req, &e);
+    if (rv < 0) {
+        // No forget will come for an entry the kernel never saw
+        storage_unpin(inum, 1);
+    }
+    return rv;
+}
+
+/**
+ * Reply to a lookup with the control file or its directory.
+ *
+ * @param req FUSE request.
+ * @param ino NUFS_LL_STATS_DIR or NUFS_LL_STATS_FILE.
+ */
+static void nufs_ll_reply_stats_entry(fuse_req_t req, fuse_ino_t ino) {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    
+    stats_stat(nufs_ll_stats_ino(ino), &e.attr);
+    e.ino = ino;
+    e.attr.st_ino = ino;
+    e.attr_timeout = NUFS_LL_TIMEOUT;
+    e.entry_timeout = NUFS_LL_TIMEOUT;
+    fuse_reply_entry(req, &e);
+}
+
+/**
+ * Look up a directory entry by name.
+ *
+ * @param req FUSE request.
+ * @param parent Node ID of the directory.
+ * @param name Name to look up.
+ */
+static void nufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    uint64_t start = stats_clock();
+    int rv = 0;
+    
+    if (parent == FUSE_ROOT_ID && strcmp(name, STATS_DIR_NAME) == 0) {
+        nufs_ll_reply_stats_entry(req, NUFS_LL_STATS_DIR);
+    } else if (parent == NUFS_LL_STATS_DIR) {
+        if (strcmp(name, STATS_FILE_NAME) == 0) {
+            nufs_ll_reply_stats_entry(req, NUFS_LL_STATS_FILE);
+        } else {
+            rv = -ENOENT;
+            fuse_reply_err(req, ENOENT);
+        }
+    } else {
+        int inum = storage_lookup(ino_to_inum(parent), name);
+        if (inum < 0) {
+            rv = inum;
+            fuse_reply_err(req, -inum);
+        } else {
+            rv = nufs_ll_reply_entry(req, inum, NULL);
+        }
+    }
+    stats_op(STATS_LOOKUP, start, rv);
+}
+
+/**
+ * Drop lookup references held by the kernel.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID being forgotten.
+ * @param nlookup Number of lookups to forget.
+ */
+static void nufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    uint64_t start = stats_clock();
+    storage_unpin(ino_to_inum(ino), nlookup);
+    stats_op(STATS_FORGET, start, 0);
+    fuse_reply_none(req);
+}
+
+/**
+ * Drop lookup references for several nodes at once.
+ *
+ * @param req FUSE request.
+ * @param count Number of entries in forgets.
+ * @param forgets Node IDs and lookup counts to forget.
+ */
+static void nufs_ll_forget_multi(fuse_req_t req, size_t count,
+                                 struct fuse_forget_data *forgets) {
+    uint64_t start = stats_clock();
+    for (size_t ii = 0; ii < count; ++ii) {
+        storage_unpin(ino_to_inum(forgets[ii].ino), forgets[ii].nlookup);
+    }
+    stats_op(STATS_FORGET, start, 0);
+    fuse_reply_none(req);
+}
+
+/**
+ * Get file attributes.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param fi Open file info, unused.
+ */
+static void nufs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    struct stat st;
+    int rv = 0;
+    int type = nufs_ll_stats_ino(ino);
+    if (type != 0) {
+        stats_stat(type, &st);
+    } else {
+        rv = storage_stat_inum(ino_to_inum(ino), &st);
+    }
+    stats_op(STATS_GETATTR, start, rv);
+    
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, NUFS_LL_TIMEOUT);
+}
+
+/**
+ * Change file attributes: mode, size and timestamps.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param attr New attribute values.
+ * @param to_set Bitmask of FUSE_SET_ATTR_* naming the values to apply.
+ * @param fi Open file info, unused.
+ */
+static void nufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int inum = ino_to_inum(ino);
+    struct stat st;
+    int rv = nufs_ll_stats_ino(ino) != 0 ? -EPERM : storage_stat_inum(inum, &st);
+    
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE)) {
+        rv = storage_chmod_inum(inum, attr->st_mode);
+    }
+    
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+        rv = storage_truncate_inum(inum, attr->st_size);
+    }
+    
+    if (rv == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+        struct timespec ts[2];
+        clock_gettime(CLOCK_REALTIME, &ts[0]);
+        ts[1] = ts[0];
+        
+        if (!(to_set & FUSE_SET_ATTR_ATIME)) {
+            ts[0] = st.st_atim;
+        } else if (!(to_set & FUSE_SET_ATTR_ATIME_NOW)) {
+            ts[0] = attr->st_atim;
+        }
+        if (!(to_set & FUSE_SET_ATTR_MTIME)) {
+            ts[1] = st.st_mtim;
+        } else if (!(to_set & FUSE_SET_ATTR_MTIME_NOW)) {
+            ts[1] = attr->st_mtim;
+        }
+        rv = storage_set_time_inum(inum, ts);
+    }
+    stats_op(STATS_SETATTR, start, rv);
+    
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    nufs_ll_getattr(req, ino, fi);
+}
+
+/**
+ * Create a filesystem object.
+ *
+ * @param req FUSE request.
+ * @param parent Node ID of the directory.
+ * @param name Name of the new object.
+ * @param mode File type and permissions.
+ * @param rdev Device number, unused.
+ */
+static void nufs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+    uint64_t start = stats_clock();
+    int inum = nufs_ll_stats_name(parent, name) ? -EEXIST
+                                                : storage_mknod_at(ino_to_inum(parent), name, mode);
+    int rv = inum;
+    if (inum < 0) {
+        fuse_reply_err(req, -inum);
+    } else {
+        rv = nufs_ll_reply_entry(req, inum, NULL);
+    }
+    stats_op(S_ISDIR(mode) ? STATS_MKDIR : STATS_MKNOD, start, rv);
+}
+
+/**
+ * Create a new directory.
+ *
+ * @param req FUSE request.
+ * @param parent Node ID of the parent directory.
+ * @param name Name of the new directory.
+ * @param mode Directory permissions.
+ */
+static void nufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode) {
+    nufs_ll_mknod(req, parent, name, mode | S_IFDIR, 0);
+}
+
+/**
+ * Create and open a regular file.
+ *
+ * @param req FUSE request.
+ * @param parent Node ID of the directory.
+ * @param name Name of the new file.
+ * @param mode File permissions.
+ * @param fi Open file info.
+ */
+static void nufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int inum = nufs_ll_stats_name(parent, name) ? -EEXIST
+                                                : storage_mknod_at(ino_to_inum(parent), name, mode);
+    int rv = inum < 0 ? inum : storage_open_inum(inum, fi->flags);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fi->fh = rv;
+        rv = nufs_ll_reply_entry(req, inum, fi);
+        if (rv < 0) {
+            storage_release_fh(fi->fh);
+        }
+    }
+    stats_op(STATS_CREATE, start, rv);
+}
+
+/**
+ * Delete a file.
+ *
+ * @param req FUSE request.
+ * @param parent Node ID of the directory.
+ * @param name Name to delete.
+ */
+static void nufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    uint64_t start = stats_clock();
+    int rv = nufs_ll_stats_name(parent, name) ? -EPERM
+                                              : storage_unlink_at(ino_to_inum(parent), name);
+    stats_op(STATS_UNLINK, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Remove a directory.
+ *
+ * Only succeeds if the directory is empty.
+ *
+ * @param req FUSE request.
+ * @param parent Node ID of the parent directory.
+ * @param name Name of the directory to remove.
+ */
+static void nufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    uint64_t start = stats_clock();
+    int rv = nufs_ll_stats_name(parent, name) ? -EPERM
+                                              : storage_rmdir_at(ino_to_inum(parent), name);
+    stats_op(STATS_RMDIR, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Rename or move a directory entry.
+ *
+ * @param req FUSE request.
+ * @param parent Node ID of the current directory.
+ * @param name Current name.
+ * @param newparent Node ID of the new directory.
+ * @param newname New name.
+ */
+static void nufs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname) {
+    uint64_t start = stats_clock();
+    int rv = -EBUSY;
+    if (!nufs_ll_stats_name(parent, name) && !nufs_ll_stats_name(newparent, newname)) {
+        rv = storage_rename_at(ino_to_inum(parent), name, ino_to_inum(newparent), newname);
+    }
+    stats_op(STATS_RENAME, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Create a hard link.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID of the existing file.
+ * @param newparent Node ID of the directory for the link.
+ * @param newname Name of the link.
+ */
+static void nufs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname) {
+    uint64_t start = stats_clock();
+    int rv = -EPERM;
+    if (nufs_ll_stats_ino(ino) == 0 && !nufs_ll_stats_name(newparent, newname)) {
+        rv = storage_link_at(ino_to_inum(ino), ino_to_inum(newparent), newname);
+    }
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        rv = nufs_ll_reply_entry(req, ino_to_inum(ino), NULL);
+    }
+    stats_op(STATS_LINK, start, rv);
+}
+
+/**
+ * Open a file.
+ *
+ * Stores a storage handle in fi->fh, which follows the open's reads for
+ * read-ahead. The control file is opened with direct_io, since its text
+ * changes on every read.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param fi Open file info.
+ */
+static void nufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = 0;
+    if (ino == NUFS_LL_STATS_FILE) {
+        rv = (fi->flags & O_ACCMODE) != O_RDONLY ? -EACCES : 0;
+        fi->direct_io = 1;
+    } else {
+        rv = storage_open_inum(ino_to_inum(ino), fi->flags);
+        if (rv >= 0) {
+            fi->fh = rv;
+            rv = 0;
+        }
+    }
+    stats_op(STATS_OPEN, start, rv);
+    
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * Open a directory for listing.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param fi Open directory info.
+ */
+static void nufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = 0;
+    if (ino == NUFS_LL_STATS_FILE) {
+        rv = -ENOTDIR;
+    } else if (ino != NUFS_LL_STATS_DIR) {
+        rv = storage_opendir_inum(ino_to_inum(ino));
+    }
+    stats_op(STATS_OPENDIR, start, rv);
+    
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    fuse_reply_open(req, fi);
+}
+
+/**
+ * Release an open directory.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param fi Open directory info.
+ */
+static void nufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    if (nufs_ll_stats_ino(ino) == 0) {
+        storage_releasedir_inum(ino_to_inum(ino));
+    }
+    stats_op(STATS_RELEASEDIR, start, 0);
+    fuse_reply_err(req, 0);
+}
+
+/**
+ * Release an open file.
+ *
+ * Called once the last file descriptor for an open is closed.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param fi Open file info holding the handle from open.
+ */
+static void nufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = nufs_ll_stats_ino(ino) != 0 ? 0 : storage_release_fh(fi->fh);
+    stats_op(STATS_RELEASE, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Flush an open file on close.
+ *
+ * Starts writing the file's changes back without waiting for them.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param fi Open file info.
+ */
+static void nufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = nufs_ll_stats_ino(ino) != 0 ? 0 : storage_sync_inum(ino_to_inum(ino), 0);
+    stats_op(STATS_FLUSH, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Make a file's changes durable.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param datasync Nonzero for fdatasync; the inode is written either way.
+ * @param fi Open file info.
+ */
+static void nufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                          struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = nufs_ll_stats_ino(ino) != 0 ? 0 : storage_sync_inum(ino_to_inum(ino), 1);
+    stats_op(STATS_FSYNC, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Make a directory's entries durable.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param datasync Nonzero for fdatasync; the inode is written either way.
+ * @param fi Open directory info.
+ */
+static void nufs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                             struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = nufs_ll_stats_ino(ino) != 0 ? 0 : storage_sync_inum(ino_to_inum(ino), 1);
+    stats_op(STATS_FSYNCDIR, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Read data from a file.
+ *
+ * File data goes back without being copied: the reply is sent while the
+ * file is still locked, straight from the storage layer's pieces, with
+ * runs of blocks as ranges of the image file for the kernel to splice.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param size Maximum bytes to read.
+ * @param off Byte offset to start reading from.
+ * @param fi Open file info.
+ */
+static void nufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                         struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int count = ino == NUFS_LL_STATS_FILE ? 1 : STORAGE_IOV_MAX(size);
+    struct fuse_bufvec *bufv = calloc(1, sizeof(*bufv) + count * sizeof(struct fuse_buf));
+    storage_iov_t *iov = calloc(count, sizeof(*iov));
+    char *buf = ino == NUFS_LL_STATS_FILE ? malloc(size) : NULL;
+    if (bufv == NULL || iov == NULL || (ino == NUFS_LL_STATS_FILE && buf == NULL)) {
+        stats_op(STATS_READ, start, -ENOMEM);
+        fuse_reply_err(req, ENOMEM);
+        free(bufv);
+        free(iov);
+        free(buf);
+        return;
+    }
+    
+    int rv;
+    if (ino == NUFS_LL_STATS_FILE) {
+        rv = stats_read(buf, size, off);
+        if (rv >= 0) {
+            fuse_reply_buf(req, buf, rv);
+        }
+    } else {
+        rv = storage_read_iov_fh(fi->fh, size, off, iov, &count, 0);
+        if (rv >= 0) {
+            for (int ii = 0; ii < count; ++ii) {
+                struct fuse_buf *piece = &bufv->buf[bufv->count++];
+                piece->size = iov[ii].len;
+                if (iov[ii].data == NULL) {
+                    piece->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+                    piece->fd = iov[ii].fd;
+                    piece->pos = iov[ii].pos;
+                } else {
+                    piece->mem = (void *)iov[ii].data;
+                }
+            }
+            fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+            storage_read_iov_end(fi->fh);
+        }
+    }
+    stats_op(STATS_READ, start, rv);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    }
+    free(bufv);
+    free(iov);
+    free(buf);
+}
+
+/**
+ * Write data to a file.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param buf Data to write.
+ * @param size Number of bytes to write.
+ * @param off Byte offset to start writing at.
+ * @param fi Open file info.
+ */
+static void nufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t off, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    int rv = nufs_ll_stats_ino(ino) != 0 ? -EBADF
+                                         : storage_write_inum(ino_to_inum(ino), buf, size, off);
+    stats_op(STATS_WRITE, start, rv);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_write(req, rv);
+    }
+}
+
+/**
+ * Reply buffer being filled by nufs_ll_readdir().
+ */
+typedef struct nufs_ll_dirbuf {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+} nufs_ll_dirbuf_t;
+
+/**
+ * Add one directory entry to a readdir reply.
+ *
+ * @param ctx nufs_ll_dirbuf_t for the reply.
+ * @param name Entry name.
+ * @param st Entry attributes.
+ * @param next Slot to resume from after this entry.
+ *
+ * @return Nonzero once an entry doesn't fit.
+ */
+static int nufs_ll_readdir_fill(void *ctx, const char *name, const struct stat *st,
+                                int next) {
+    nufs_ll_dirbuf_t *db = ctx;
+    
+    struct stat entry = *st;
+    entry.st_ino = inum_to_ino(st->st_ino);
+    size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used,
+                                   name, &entry, next + 2);
+    if (len > db->size - db->used) {
+        return 1;  // Entry did not fit, it goes in the next buffer
+    }
+    db->used += len;
+    return 0;
+}
+
+/**
+ * List the contents of a directory.
+ *
+ * Offsets are dirent slot numbers shifted past "." and "..", so a listing
+ * resumes exactly where the previous buffer ended.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID of the directory.
+ * @param size Size of the reply buffer.
+ * @param off Offset cookie of the last entry already returned.
+ * @param fi Open directory info.
+ */
+static void nufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t off, struct fuse_file_info *fi) {
+    uint64_t start = stats_clock();
+    nufs_ll_dirbuf_t db = { req, malloc(size), size, 0 };
+    if (db.buf == NULL) {
+        stats_op(STATS_READDIR, start, -ENOMEM);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    
+    // The kernel always offers at least a page, so . and .. fit
+    st.st_ino = ino;
+    st.st_mode = S_IFDIR;
+    if (off < 1) {
+        db.used += fuse_add_direntry(req, db.buf + db.used, size - db.used, ".", &st, 1);
+    }
+    if (off < 2) {
+        db.used += fuse_add_direntry(req, db.buf + db.used, size - db.used, "..", &st, 2);
+    }
+    
+    int rv = 0;
+    if (ino == NUFS_LL_STATS_DIR) {
+        // The control directory only holds the control file
+        stats_stat(S_IFREG, &st);
+        st.st_ino = NUFS_LL_STATS_FILE;
+        if (off < 3) {
+            db.used += fuse_add_direntry(req, db.buf + db.used, size - db.used,
+                                         STATS_FILE_NAME, &st, 3);
+        }
+    } else {
+        rv = storage_readdir_inum(ino_to_inum(ino), off < 2 ? 0 : off - 2,
+                                  nufs_ll_readdir_fill, &db);
+    }
+    stats_op(STATS_READDIR, start, rv);
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_buf(req, db.buf, db.used);
+    }
+    free(db.buf);
+}
+
+/**
+ * Check if a file exists and is accessible.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param mask Access mode to check.
+ */
+static void nufs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask) {
+    uint64_t start = stats_clock();
+    int rv;
+    if (nufs_ll_stats_ino(ino) != 0) {
+        rv = (mask & W_OK) ? -EACCES : 0;
+    } else {
+        rv = get_inode(ino_to_inum(ino)) == NULL ? -ENOENT : 0;
+    }
+    stats_op(STATS_ACCESS, start, rv);
+    fuse_reply_err(req, -rv);
+}
+
+/**
+ * Handle ioctl requests.
+ *
+ * Serves the commands in nufs_ioctl.h on open files.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID.
+ * @param cmd ioctl command.
+ * @param arg Argument as the caller passed it.
+ * @param fi Open file info.
+ * @param flags FUSE_IOCTL_* flags.
+ * @param in_buf The command's argument.
+ * @param in_bufsz Size of in_buf.
+ * @param out_bufsz Bytes the caller takes back.
+ */
+static void nufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+                          struct fuse_file_info *fi, unsigned flags, const void *in_buf,
+                          size_t in_bufsz, size_t out_bufsz) {
+    uint64_t start = stats_clock();
+    int rv = -ENOTTY;
+    unsigned int command = cmd;
+    int64_t pos = 0;
+    nufs_ioc_copy_t copy;
+    const void *out = &pos;
+    size_t out_size = sizeof(pos);
+    if ((flags & FUSE_IOCTL_DIR) != 0 || nufs_ll_stats_ino(ino) != 0) {
+        rv = -ENOTTY;  // Only regular files take commands
+    } else if ((command == NUFS_IOC_SEEK_DATA || command == NUFS_IOC_SEEK_HOLE) &&
+               in_bufsz >= sizeof(pos) && out_bufsz >= sizeof(pos)) {
+        int whence = command == NUFS_IOC_SEEK_DATA ? SEEK_DATA : SEEK_HOLE;
+        memcpy(&pos, in_buf, sizeof(pos));
+        off_t found = storage_seek_inum(ino_to_inum(ino), pos, whence);
+        rv = found < 0 ? (int)found : 0;
+        pos = found;
+    } else if ((command == NUFS_IOC_CLONE || command == NUFS_IOC_COPY_RANGE) &&
+               in_bufsz >= sizeof(copy)) {
+        memcpy(&copy, in_buf, sizeof(copy));
+        copy.src[NUFS_IOC_PATH_MAX - 1] = '\0';
+        out = &copy;
+        out_size = out_bufsz >= sizeof(copy) ? sizeof(copy) : 0;
+        
+        if (command == NUFS_IOC_CLONE) {
+            rv = storage_clone_fh(copy.src, fi->fh);
+        } else if (copy.length < 0) {
+            rv = -EINVAL;
+        } else {
+            rv = storage_copy_range_fh(copy.src, copy.src_offset, fi->fh, copy.dst_offset,
+                                       copy.length);
+            if (rv >= 0) {
+                copy.length = rv;
+                rv = 0;
+            }
+        }
+        
+        // The kernel may have cached what the file held before
+        if (rv == 0) {
+            fuse_lowlevel_notify_inval_inode(nufs_ll_chan, ino, 0, 0);
+        }
+    }
+    stats_op(STATS_IOCTL, start, rv);
+    
+    if (rv < 0) {
+        fuse_reply_err(req, -rv);
+    } else {
+        fuse_reply_ioctl(req, 0, out, out_size);
+    }
+}
+
+/**
+ * Get filesystem statistics.
+ *
+ * @param req FUSE request.
+ * @param ino Node ID, unused.
+ */
+static void nufs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+    uint64_t start = stats_clock();
+    struct statvfs st;
+    int rv = storage_statfs(&st);
+    stats_op(STATS_STATFS, start, rv);
+    fuse_reply_statfs(req, &st);
+}
+
+/**
+ * Set up the connection with the kernel.
+ *
+ * Asks for read-ahead as large as the storage layer's own; the kernel
+ * keeps the smaller of this and what it offered. Where the kernel can,
+ * read replies are spliced from the image file.
+ *
+ * @param userdata Unused.
+ * @param conn Connection parameters, adjusted in place.
+ */
+static void nufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    conn->max_readahead = STORAGE_READAHEAD_MAX;
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+}
+
+/**
+ * Take the storage layer's mount options out of the FUSE arguments.
+ *
+ * noatime is passed on as well, so the kernel shows it for the mount.
+ *
+ * @param data Unused.
+ * @param arg The option, or another argument.
+ * @param key FUSE_OPT_KEY_OPT for options and unknown flags.
+ * @param outargs Arguments kept, unused.
+ *
+ * @return 0 to drop the argument, 1 to keep it.
+ */
+static int nufs_ll_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+    if (key == FUSE_OPT_KEY_OPT && storage_option(arg) == 0) {
+        return strcmp(arg, "noatime") == 0;
+    }
+    return 1;
+}
+
+// Low-level FUSE callbacks
+static struct fuse_lowlevel_ops nufs_ll_ops = {
+    .init = nufs_ll_init,
+    .lookup = nufs_ll_lookup,
+    .forget = nufs_ll_forget,
+    .forget_multi = nufs_ll_forget_multi,
+    .getattr = nufs_ll_getattr,
+    .setattr = nufs_ll_setattr,
+    .mknod = nufs_ll_mknod,
+    .mkdir = nufs_ll_mkdir,
+    .create = nufs_ll_create,
+    .unlink = nufs_ll_unlink,
+    .rmdir = nufs_ll_rmdir,
+    .rename = nufs_ll_rename,
+    .link = nufs_ll_link,
+    .open = nufs_ll_open,
+    .release = nufs_ll_release,
+    .flush = nufs_ll_flush,
+    .fsync = nufs_ll_fsync,
+    .fsyncdir = nufs_ll_fsyncdir,
+    .opendir = nufs_ll_opendir,
+    .releasedir = nufs_ll_releasedir,
+    .read = nufs_ll_read,
+    .write = nufs_ll_write,
+    .readdir = nufs_ll_readdir,
+    .access = nufs_ll_access,
+    .ioctl = nufs_ll_ioctl,
+    .statfs = nufs_ll_statfs,
+};
+
+/**
+ * Main entry point for the low-level NUFS front end.
+ *
+ * Usage: ./nufs_ll [fuse_options] <mount_point> <disk_image>
+ *
+ * Besides FUSE's own, -o takes the options of storage_option().
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ *
+ * @return 0 on a clean unmount, 1 on error.
+ */
+int main(int argc, char *argv[]) {
+    assert(argc > 2);
+    
+    // Last argument is the disk image path
+    const char *disk_image = argv[--argc];
+    printf("mounting %s as data file\n", disk_image);
+    
+    storage_init(disk_image);
+    
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = NULL;
+    int multithreaded = 0;
+    int foreground = 0;
+    int rv = 1;
+    
+    if (fuse_opt_parse(&args, NULL, NULL, nufs_ll_opt_proc) == -1 ||
+        fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
+    
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    nufs_ll_chan = ch;
+    if (ch != NULL) {
+        struct fuse_session *se =
+            fuse_lowlevel_new(&args, &nufs_ll_ops, sizeof(nufs_ll_ops), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                
+                // Multithreaded unless started with -s
+                rv = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    return rv ? 1 : 0;
+}
@@ -0,0 +1,267 @@
+/**
+ * @file stats.c
+ * @brief Implementation of operation counters and latency histograms.
+ *
+ * Each operation has its own cache line of counters, so threads serving
+ * different operations don't contend. The text is only produced when
+ * the control file is read.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "helpers/blocks.h"
+
+uint64_t stats_counters[STATS_COUNTER_COUNT];
+
+/**
+ * Counters of one operation.
+ */
+typedef struct stats_op_rec {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+} __attribute__((aligned(64))) stats_op_rec_t;
+
+static stats_op_rec_t stats_ops[STATS_OP_COUNT];
+
+// Printable names, indexed by stats_op_t
+static const char *stats_op_names[STATS_OP_COUNT] = {
+    [STATS_ACCESS] = "access",
+    [STATS_GETATTR] = "getattr",
+    [STATS_SETATTR] = "setattr",
+    [STATS_LOOKUP] = "lookup",
+    [STATS_FORGET] = "forget",
+    [STATS_READDIR] = "readdir",
+    [STATS_OPENDIR] = "opendir",
+    [STATS_RELEASEDIR] = "releasedir",
+    [STATS_MKNOD] = "mknod",
+    [STATS_MKDIR] = "mkdir",
+    [STATS_CREATE] = "create",
+    [STATS_UNLINK] = "unlink",
+    [STATS_RMDIR] = "rmdir",
+    [STATS_RENAME] = "rename",
+    [STATS_LINK] = "link",
+    [STATS_CHMOD] = "chmod",
+    [STATS_TRUNCATE] = "truncate",
+    [STATS_UTIMENS] = "utimens",
+    [STATS_OPEN] = "open",
+    [STATS_RELEASE] = "release",
+    [STATS_FLUSH] = "flush",
+    [STATS_FSYNC] = "fsync",
+    [STATS_FSYNCDIR] = "fsyncdir",
+    [STATS_READ] = "read",
+    [STATS_WRITE] = "write",
+    [STATS_IOCTL] = "ioctl",
+    [STATS_STATFS] = "statfs",
+};
+
+// Metric names and help, indexed by stats_counter_t
+static const char *stats_counter_names[STATS_COUNTER_COUNT][2] = {
+    [STATS_PATH_LOOKUPS] = {"nufs_path_lookups_total", "Paths resolved"},
+    [STATS_PATH_CACHED] = {"nufs_path_cached_total", "Paths found in the full-path cache"},
+    [STATS_PATH_COMPONENTS] = {"nufs_path_components_total",
+                               "Path components resolved walking the tree"},
+    [STATS_DIR_LOOKUPS] = {"nufs_dir_lookups_total", "Names looked up in a directory"},
+    [STATS_DIR_SCANNED] = {"nufs_dir_scanned_total",
+                           "Directory entries or index buckets examined by lookups"},
+    [STATS_DIR_NEGATIVE] = {"nufs_dir_negative_total",
+                            "Names found missing in the dentry cache without a lookup"},
+};
+
+/**
+ * Get the time an operation starts at.
+ *
+ * @return CLOCK_MONOTONIC time in ns.
+ */
+uint64_t stats_clock() {
+    if (!STATS_ENABLED) {
+        return 0;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Record a finished operation.
+ *
+ * @param op Operation.
+ * @param start Time from stats_clock() when it started.
+ * @param rv Its result.
+ */
+void stats_op(stats_op_t op, uint64_t start, int rv) {
+    if (!STATS_ENABLED) {
+        return;
+    }
+
+    stats_op_rec_t *rec = &stats_ops[op];
+    uint64_t ns = stats_clock() - start;
+
+    // Bucket i holds latencies below 2^(i + shift) ns
+    int bucket = 0;
+    if (ns >= (1u << STATS_BUCKET_SHIFT)) {
+        bucket = 64 - __builtin_clzll(ns) - STATS_BUCKET_SHIFT;
+        if (bucket >= STATS_BUCKETS) {
+            bucket = STATS_BUCKETS - 1;
+        }
+    }
+
+    __atomic_add_fetch(&rec->calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&rec->ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&rec->buckets[bucket], 1, __ATOMIC_RELAXED);
+    if (rv < 0) {
+        __atomic_add_fetch(&rec->errors, 1, __ATOMIC_RELAXED);
+    } else if (op == STATS_READ || op == STATS_WRITE) {
+        __atomic_add_fetch(&rec->bytes, rv, __ATOMIC_RELAXED);
+    }
+
+    uint64_t max = __atomic_load_n(&rec->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&rec->max_ns, &max, ns, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Write one counter sample with its help and type lines.
+ *
+ * @param out Destination.
+ * @param name Metric name.
+ * @param help Description.
+ * @param value Current value.
+ */
+static void stats_print_counter(FILE *out, const char *name, const char *help,
+                                uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+            (unsigned long long)value);
+}
+
+/**
+ * Write every metric as text.
+ *
+ * @param out Destination.
+ */
+static void stats_print(FILE *out) {
+    fprintf(out, "# HELP nufs_op_seconds Latency of FUSE operations\n"
+                 "# TYPE nufs_op_seconds histogram\n");
+    for (int op = 0; op < STATS_OP_COUNT; ++op) {
+        stats_op_rec_t *rec = &stats_ops[op];
+        uint64_t calls = __atomic_load_n(&rec->calls, __ATOMIC_RELAXED);
+        if (calls == 0) {
+            continue;
+        }
+
+        // Buckets are cumulative; the count is their total, so the
+        // histogram stays consistent while operations keep finishing
+        uint64_t seen = 0;
+        for (int ii = 0; ii < STATS_BUCKETS - 1; ++ii) {
+            seen += __atomic_load_n(&rec->buckets[ii], __ATOMIC_RELAXED);
+            fprintf(out, "nufs_op_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                    stats_op_names[op], (double)(1ull << (ii + STATS_BUCKET_SHIFT)) / 1e9,
+                    (unsigned long long)seen);
+        }
+        seen += __atomic_load_n(&rec->buckets[STATS_BUCKETS - 1], __ATOMIC_RELAXED);
+        fprintf(out, "nufs_op_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                stats_op_names[op], (unsigned long long)seen);
+        fprintf(out, "nufs_op_seconds_sum{op=\"%s\"} %.9f\n", stats_op_names[op],
+                __atomic_load_n(&rec->ns, __ATOMIC_RELAXED) / 1e9);
+        fprintf(out, "nufs_op_seconds_count{op=\"%s\"} %llu\n", stats_op_names[op],
+                (unsigned long long)seen);
+    }
+
+    fprintf(out, "# HELP nufs_op_seconds_max Slowest call of each operation\n"
+                 "# TYPE nufs_op_seconds_max gauge\n");
+    for (int op = 0; op < STATS_OP_COUNT; ++op) {
+        if (__atomic_load_n(&stats_ops[op].calls, __ATOMIC_RELAXED) != 0) {
+            fprintf(out, "nufs_op_seconds_max{op=\"%s\"} %.9f\n", stats_op_names[op],
+                    __atomic_load_n(&stats_ops[op].max_ns, __ATOMIC_RELAXED) / 1e9);
+        }
+    }
+
+    fprintf(out, "# HELP nufs_op_errors_total Operations that returned an error\n"
+                 "# TYPE nufs_op_errors_total counter\n");
+    for (int op = 0; op < STATS_OP_COUNT; ++op) {
+        if (__atomic_load_n(&stats_ops[op].calls, __ATOMIC_RELAXED) != 0) {
+            fprintf(out, "nufs_op_errors_total{op=\"%s\"} %llu\n", stats_op_names[op],
+                    (unsigned long long)__atomic_load_n(&stats_ops[op].errors,
+                                                       __ATOMIC_RELAXED));
+        }
+    }
+
+    fprintf(out, "# HELP nufs_op_bytes_total Bytes moved by reads and writes\n"
+                 "# TYPE nufs_op_bytes_total counter\n");
+    for (int op = STATS_READ; op <= STATS_WRITE; ++op) {
+        fprintf(out, "nufs_op_bytes_total{op=\"%s\"} %llu\n", stats_op_names[op],
+                (unsigned long long)__atomic_load_n(&stats_ops[op].bytes, __ATOMIC_RELAXED));
+    }
+
+    for (int ii = 0; ii < STATS_COUNTER_COUNT; ++ii) {
+        stats_print_counter(out, stats_counter_names[ii][0], stats_counter_names[ii][1],
+                            __atomic_load_n(&stats_counters[ii], __ATOMIC_RELAXED));
+    }
+
+    blocks_stats_t bs;
+    blocks_stats(&bs);
+    stats_print_counter(out, "nufs_block_allocs_total", "Block allocation requests",
+                        bs.allocs);
+    stats_print_counter(out, "nufs_blocks_allocated_total", "Blocks handed out",
+                        bs.allocated);
+    stats_print_counter(out, "nufs_blocks_freed_total", "Blocks freed", bs.freed);
+    stats_print_counter(out, "nufs_bitmap_probed_total",
+                        "Block bitmap bits examined by allocations", bs.probed);
+    stats_print_counter(out, "nufs_blocks_shared_total",
+                        "Block references taken by clones", bs.shared);
+    stats_print_counter(out, "nufs_blocks_prefetched_total",
+                        "Blocks read ahead of sequential reads", bs.prefetched);
+}
+
+/**
+ * Read the control file's text.
+ *
+ * @param buf Destination.
+ * @param size Bytes wanted.
+ * @param offset Byte offset into the text.
+ *
+ * @return Bytes copied, 0 past the end, or -ENOMEM.
+ */
+int stats_read(char *buf, size_t size, off_t offset) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL) {
+        return -ENOMEM;
+    }
+    stats_print(out);
+    fclose(out);
+
+    size_t copied = 0;
+    if (offset >= 0 && (size_t)offset < len) {
+        copied = len - offset < size ? len - offset : size;
+        memcpy(buf, text + offset, copied);
+    }
+    free(text);
+    return (int)copied;
+}
+
+/**
+ * Get attributes of the control file or its directory.
+ *
+ * @param type S_IFDIR for the directory, S_IFREG for the file.
+ * @param st Stat structure to fill with attributes.
+ */
+void stats_stat(mode_t type, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = type == S_IFDIR ? S_IFDIR | 0555 : S_IFREG | 0444;
+    st->st_nlink = type == S_IFDIR ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+}
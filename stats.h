@@ -0,0 +1,155 @@
+/**
+ * @file stats.h
+ * @brief Operation counters and latency histograms for the NUFS filesystem.
+ *
+ * The front ends time every FUSE operation they serve, and the layers
+ * below count the work behind them: path components resolved, directory
+ * entries scanned, blocks allocated and bitmap bits probed. Everything
+ * is kept in memory with relaxed atomic adds, so recording never blocks.
+ *
+ * A mounted filesystem serves the numbers as text from the read-only
+ * control file /.nufs/stats, which doesn't show up in listings. The text
+ * is in the Prometheus exposition format, one sample per line:
+ *
+ * nufs_op_seconds_bucket{op="read",le="1.024e-06"} 17
+ * nufs_op_seconds_sum{op="read"} 0.012345678
+ * nufs_op_seconds_count{op="read"} 1234
+ * nufs_op_errors_total{op="read"} 0
+ * nufs_op_bytes_total{op="read"} 5054464
+ * nufs_path_components_total 4567
+ *
+ * Latency buckets double from 1.024us; operations never called are left
+ * out. Counters only grow, from zero at mount. Building with
+ * -DSTATS_ENABLED=0 compiles recording away; the control file then only
+ * has the counters of the block allocator.
+ *
+ * Assumptions:
+ * All functions are safe to call from several threads
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef STATS_ENABLED
+#define STATS_ENABLED 1
+#endif
+
+// Names of the control directory, in the root, and the file in it
+#define STATS_DIR_NAME ".nufs"
+#define STATS_FILE_NAME "stats"
+#define STATS_DIR "/" STATS_DIR_NAME
+#define STATS_FILE STATS_DIR "/" STATS_FILE_NAME
+
+// Latency buckets per operation; bucket i counts calls under
+// 2^(i + STATS_BUCKET_SHIFT) ns, the last one everything slower
+#define STATS_BUCKETS 24
+#define STATS_BUCKET_SHIFT 10
+
+/**
+ * Operations timed by the front ends.
+ */
+typedef enum stats_op {
+    STATS_ACCESS,
+    STATS_GETATTR,
+    STATS_SETATTR,
+    STATS_LOOKUP,
+    STATS_FORGET,
+    STATS_READDIR,
+    STATS_OPENDIR,
+    STATS_RELEASEDIR,
+    STATS_MKNOD,
+    STATS_MKDIR,
+    STATS_CREATE,
+    STATS_UNLINK,
+    STATS_RMDIR,
+    STATS_RENAME,
+    STATS_LINK,
+    STATS_CHMOD,
+    STATS_TRUNCATE,
+    STATS_UTIMENS,
+    STATS_OPEN,
+    STATS_RELEASE,
+    STATS_FLUSH,
+    STATS_FSYNC,
+    STATS_FSYNCDIR,
+    STATS_READ,
+    STATS_WRITE,
+    STATS_IOCTL,
+    STATS_STATFS,
+    STATS_OP_COUNT
+} stats_op_t;
+
+/**
+ * Work counted inside operations.
+ */
+typedef enum stats_counter {
+    STATS_PATH_LOOKUPS,     // tree_lookup() calls
+    STATS_PATH_CACHED,      // ... answered by the full-path cache
+    STATS_PATH_COMPONENTS,  // components resolved walking the tree
+    STATS_DIR_LOOKUPS,      // directory_lookup() calls
+    STATS_DIR_SCANNED,      // entries or index buckets examined by them
+    STATS_DIR_NEGATIVE,     // names found absent in the dentry cache instead
+    STATS_COUNTER_COUNT
+} stats_counter_t;
+
+// Counter values, indexed by stats_counter_t
+extern uint64_t stats_counters[STATS_COUNTER_COUNT];
+
+/**
+ * Add to a counter.
+ */
+#define STATS_ADD(counter, n)                                          \
+    do {                                                               \
+        if (STATS_ENABLED) {                                           \
+            __atomic_add_fetch(&stats_counters[(counter)], (n),        \
+                               __ATOMIC_RELAXED);                      \
+        }                                                              \
+    } while (0)
+
+/**
+ * Get the time an operation starts at.
+ *
+ * @return CLOCK_MONOTONIC time in ns, 0 when stats are compiled out.
+ */
+uint64_t stats_clock();
+
+/**
+ * Record a finished operation.
+ *
+ * @param op Operation.
+ * @param start Time from stats_clock() when it started.
+ * @param rv Its result: negative for an error, otherwise bytes moved by
+ *           read and write.
+ */
+void stats_op(stats_op_t op, uint64_t start, int rv);
+
+/**
+ * Read the control file's text.
+ *
+ * It's rendered afresh on every call, reading from offset 0 takes a new
+ * snapshot.
+ *
+ * @param buf Destination.
+ * @param size Bytes wanted.
+ * @param offset Byte offset into the text.
+ *
+ * @return Bytes copied, 0 past the end, or -ENOMEM.
+ */
+int stats_read(char *buf, size_t size, off_t offset);
+
+/**
+ * Get attributes of the control file or its directory.
+ *
+ * The file reports size 0; front ends open it with direct_io, so reads go
+ * on until the text runs out.
+ *
+ * @param type S_IFDIR for the directory, S_IFREG for the file.
+ * @param st Stat structure to fill with attributes.
+ */
+void stats_stat(mode_t type, struct stat *st);
+
+#endif
@@ -4,168 +4,345 @@
  *
  * Provides high-level file and directory operations that bridge
  * FUSE callbacks to the underlying inode and directory systems.
+ *
+ * Every path-based operation resolves its path once and then calls the
+ * matching inode-based operation, which the low-level front end uses
+ * directly.
+ *
+ * Locking: every operation here may run on several threads at once.
+ * Each inode has a reader/writer lock covering its fields, its data and,
+ * for a directory, its entries. Locks are taken in this order:
+ *
+ * 1. rename_lock, by any operation that locks more than one directory
+ *    (rename and rmdir)
+ * 2. directory inode locks; without rename_lock at most one is held
+ * 3. non-directory inode locks; copies between files take two, lower
+ *    inode number first
+ * 4. leaf locks that are never held while taking another: the handle
+ *    table, the dentry cache and the inode and block allocators
+ *
+ * Path resolution holds each directory's lock only while scanning it.
  */
-#include <stdio.h>
+#define _GNU_SOURCE
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "storage.h"
 #include "inode.h"
+#include "journal.h"
 #include "directory.h"
+#include "dcache.h"
+#include "stats.h"
+#include "trace.h"
 #include "helpers/blocks.h"
+#include "helpers/bitmap.h"
+
+// Outstanding references held outside the namespace, per inode
+static int *pins = NULL;
+
+// Open listings of each directory, and whether a compaction waits for
+// them to end; both change under the directory's lock
+static int *listers = NULL;
+static char *compact_waiting = NULL;
 
 /**
- * Initialize the storage system.
+ * How reads update access times, chosen with storage_option().
+ */
+typedef enum storage_atime {
+    STORAGE_ATIME_STRICT,
+    STORAGE_ATIME_RELATIME,
+    STORAGE_ATIME_NOATIME
+} storage_atime_t;
+
+static storage_atime_t atime_mode = STORAGE_ATIME_STRICT;
+static int atime_lazy = 0;
+
+// With lazytime, when each inode's access time was first held back in
+// memory, 0 if it wasn't; readers set it with atomic stores
+static int64_t *atime_held = NULL;
+
+// Runs of changed blocks an inode remembers before it falls back to
+// syncing the whole file
+#define STORAGE_DIRTY_RUNS 16
+
+/**
+ * What an inode changed since it was last synced.
  *
- * Sets up the disk image, initializes the inode table, and creates
- * the root directory if it doesn't already exist.
+ * Fields:
+ * - seq: Journal transaction of the latest change, 0 without a journal
+ * - runs: Data block runs below, -1 if there were too many to track
+ * - start, count: First block and length of each run
+ */
+typedef struct storage_dirty {
+    uint64_t seq;
+    int runs;
+    int start[STORAGE_DIRTY_RUNS];
+    int count[STORAGE_DIRTY_RUNS];
+} storage_dirty_t;
+
+// Change records per inode, NULL while clean; guarded by the inode's lock
+static storage_dirty_t **dirty = NULL;
+
+// Appended bytes one inode holds back before giving them blocks, and the
+// most all inodes together hold
+#define STORAGE_DELAY_BYTES (1 << 20)
+#define STORAGE_DELAY_TOTAL (64 << 20)
+
+/**
+ * Appends held back in memory, not yet given blocks.
  *
- * @param path Path to the disk image file.
+ * Fields:
+ * - buf: The bytes, which continue the file from its size on disk
+ * - len, cap: Bytes held and the room in buf
+ * - reserved: Blocks set aside for writing them out
  */
-void storage_init(const char *path) {
-    printf("+ storage_init(%s)\n", path);
-    
-    // Initialize the block system
-    blocks_init(path);
-    
-    // Initialize the inode table, reserves block 1
-    inode_init();
-    
-    // Initialize the root directory
-    directory_init();
+typedef struct storage_delay {
+    char *buf;
+    int len;
+    int cap;
+    int reserved;
+} storage_delay_t;
+
+// Held back appends per inode, NULL if none; guarded by the inode's lock,
+// but read without it to skip locking inodes that hold nothing
+static storage_delay_t **delayed = NULL;
+static int delayed_count = 0;
+
+// Bytes held back by all inodes
+static long delayed_bytes = 0;
+
+/**
+ * Open file handle.
+ *
+ * Fields:
+ * - inum: Open inode, -1 if the slot is free
+ * - flags: Flags the file was opened with
+ * - next: Offset just past the last read
+ * - ahead: End of the bytes prefetched so far
+ * - window: Bytes to keep prefetched past a read, 0 until reads look
+ *           sequential
+ */
+typedef struct storage_handle {
+    int inum;
+    int flags;
+    off_t next;
+    off_t ahead;
+    int window;
+} storage_handle_t;
+
+// Open file handle table, indexed by handle number
+static storage_handle_t *handles = NULL;
+static int handle_count = 0;
+
+// Lowest handle number that may be free
+static int handle_hint = 0;
+
+// Guards the handle table
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Held by operations that lock more than one directory
+static pthread_mutex_t rename_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Zeros that storage_read_iov_fh() hands out for holes
+static char storage_zeros[256 * 1024];
+
+// Entries storage_readdir_inum() copies out per hold of the directory lock
+#define STORAGE_READDIR_BATCH 32
+
+// Blocks a copy or clone shares, copies or frees per step, and the
+// journal room it wants before taking another in the same transaction:
+// up to three metadata blocks per block, plus the inode and tables
+#define STORAGE_COPY_STEP 8
+#define STORAGE_COPY_ROOM (3 * STORAGE_COPY_STEP + 8)
+
+/**
+ * Directory entry copied out of a directory for listing.
+ */
+typedef struct storage_listed {
+    char name[DIR_NAME_LENGTH];
+    int inum;
+    int next;
+} storage_listed_t;
+
+/**
+ * Check whether an inode is a directory without holding its lock.
+ *
+ * A live inode never changes type, so this is enough to pick which locks
+ * to take. A stale number may have been reused, so callers that care
+ * check again under the lock.
+ *
+ * @param node Pointer to the inode, may be NULL.
+ *
+ * @return 1 if the inode is a directory, 0 otherwise.
+ */
+static int storage_is_dir(inode_t *node) {
+    return node != NULL && S_ISDIR(__atomic_load_n(&node->mode, __ATOMIC_RELAXED));
 }
 
 /**
- * Get file/directory attributes.
+ * Record that an inode changed, for the next storage_sync_inum().
  *
- * @param path Absolute path to the file or directory.
- * @param st Pointer to stat structure to fill.
+ * Only data blocks need listing; the inode and its pointer tables are
+ * always synced. The caller holds the inode's write lock.
  *
- * @return 0 on success, -ENOENT if path doesn't exist.
+ * @param inum Inode number that changed.
+ * @param bnum First data block written, if count > 0.
+ * @param count Number of data blocks written.
  */
-int storage_stat(const char *path, struct stat *st) {
-    int inum = tree_lookup(path);
-    if (inum < 0) {
-        return -ENOENT;
+static void storage_touch(int inum, int bnum, int count) {
+    storage_dirty_t *rec = dirty[inum];
+    if (rec == NULL) {
+        rec = calloc(1, sizeof(storage_dirty_t));
+        dirty[inum] = rec;
     }
     
-    inode_t *node = get_inode(inum);
-    if (node == NULL) {
-        return -ENOENT;
+    // With a journal, syncing means waiting for the right commit
+    rec->seq = journal_seq();
+    if (rec->seq != 0 || count <= 0 || rec->runs < 0) {
+        return;
     }
     
-    memset(st, 0, sizeof(struct stat));
-    st->st_mode = node->mode;
-    st->st_size = node->size;
-    st->st_uid = node->uid;
-    st->st_gid = node->gid;
-    st->st_nlink = node->refs;
-    st->st_atime = node->atime;
-    st->st_mtime = node->mtime;
-    st->st_ino = inum;
-    
-    // Calculate blocks used for st_blocks, in 512-byte units
-    st->st_blocks = (node->size + 511) / 512;
-    st->st_blksize = BLOCK_SIZE;
+    // Extend a run this one overlaps or touches
+    for (int ii = 0; ii < rec->runs; ++ii) {
+        int end = rec->start[ii] + rec->count[ii];
+        if (bnum <= end && bnum + count >= rec->start[ii]) {
+            int start = bnum < rec->start[ii] ? bnum : rec->start[ii];
+            end = bnum + count > end ? bnum + count : end;
+            rec->start[ii] = start;
+            rec->count[ii] = end - start;
+            return;
+        }
+    }
     
-    return 0;
+    if (rec->runs == STORAGE_DIRTY_RUNS) {
+        rec->runs = -1;
+        return;
+    }
+    rec->start[rec->runs] = bnum;
+    rec->count[rec->runs] = count;
+    rec->runs++;
 }
 
 /**
- * Read data from a file.
- *
- * Reads data from the file's data blocks starting at the given offset.
+ * Convert an inode timestamp for stat.
  *
- * @param path Absolute path to the file.
- * @param buf Buffer to read data into.
- * @param size Maximum number of bytes to read.
- * @param offset Byte offset in the file to start reading from.
+ * @param ns Nanoseconds since the epoch.
  *
- * @return Number of bytes read, or negative error code.
+ * @return The same time as a timespec.
  */
-int storage_read(const char *path, char *buf, size_t size, off_t offset) {
-    int inum = tree_lookup(path);
-    if (inum < 0) {
-        return -ENOENT;
-    }
-    
-    inode_t *node = get_inode(inum);
-    if (node == NULL) {
-        return -ENOENT;
+static struct timespec storage_timespec(int64_t ns) {
+    struct timespec ts = {ns / 1000000000, ns % 1000000000};
+    if (ts.tv_nsec < 0) {
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000;
     }
-    
-    // Check if offset is beyond file size
-    if (offset >= node->size) {
-        return 0;
+    return ts;
+}
+
+/**
+ * Convert a time given to utimens to an inode timestamp.
+ *
+ * @param ts Time to set, or UTIME_NOW or UTIME_OMIT.
+ * @param now Current time from inode_now().
+ * @param old Timestamp the inode has now.
+ *
+ * @return Nanoseconds since the epoch.
+ */
+static int64_t storage_ns(const struct timespec *ts, int64_t now, int64_t old) {
+    if (ts->tv_nsec == UTIME_NOW) {
+        return now;
     }
-    
-    // Limit read size to remaining data
-    if (offset + (off_t)size > node->size) {
-        size = node->size - offset;
+    if (ts->tv_nsec == UTIME_OMIT) {
+        return old;
     }
-    
-    size_t bytes_read = 0;
-    
-    while (bytes_read < size) {
-        // Calculate which block and offset within block
-        int file_block = (offset + bytes_read) / BLOCK_SIZE;
-        int block_offset = (offset + bytes_read) % BLOCK_SIZE;
-        
-        // Get the actual disk block number
-        int bnum = inode_get_bnum(node, file_block);
-        if (bnum <= 0) {
-            break;  // No more blocks
-        }
-        
-        // Calculate how much to read from this block
-        size_t to_read = BLOCK_SIZE - block_offset;
-        if (to_read > size - bytes_read) {
-            to_read = size - bytes_read;
+    return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/**
+ * Get a file's size, counting appends still held back.
+ *
+ * The caller holds the inode's lock.
+ *
+ * @param inum Inode number.
+ *
+ * @return Size in bytes.
+ */
+static int storage_size(int inum) {
+    storage_delay_t *rec = delayed[inum];
+    return get_inode(inum)->size + (rec != NULL ? rec->len : 0);
+}
+
+/**
+ * Record the block whose end a grow from the given size zeroed.
+ *
+ * grow_inode() zeroes the bytes past the old size in the old last block,
+ * and gives the file a copy of it first if the block was shared.
+ *
+ * @param inum Inode number that grew.
+ * @param old_size Size in bytes before the grow.
+ */
+static void storage_touch_tail(int inum, int old_size) {
+    if (old_size % BLOCK_SIZE != 0) {
+        int bnum = inode_get_bnum(get_inode(inum), old_size / BLOCK_SIZE);
+        if (bnum > 0) {
+            storage_touch(inum, bnum, 1);
         }
-        
-        // Read from the block
-        char *block_data = blocks_get_block(bnum);
-        memcpy(buf + bytes_read, block_data + block_offset, to_read);
-        
-        bytes_read += to_read;
     }
-    
-    // Update access time
-    node->atime = time(NULL);
-    
-    return bytes_read;
 }
 
 /**
- * Write data to a file.
+ * Write data to a file whose write lock the caller holds.
  *
- * Grows the file if necessary to accommodate the write.
+ * Only the blocks the write touches are allocated, any it skips over
+ * stay holes; those it covers whole aren't zeroed first. A write the
+ * disk fills up during is cut short.
  *
- * @param path Absolute path to the file.
+ * @param inum Inode number of the file.
  * @param buf Buffer containing data to write.
  * @param size Number of bytes to write.
  * @param offset Byte offset in the file to start writing at.
  *
- * @return Number of bytes written, or negative error code.
+ * @return Number of bytes written, or -ENOSPC.
  */
-int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
-    int inum = tree_lookup(path);
-    if (inum < 0) {
-        return -ENOENT;
+static int storage_write_locked(int inum, const char *buf, size_t size, off_t offset) {
+    inode_t *node = get_inode(inum);
+    if (size == 0) {
+        return 0;
     }
     
-    inode_t *node = get_inode(inum);
-    if (node == NULL) {
-        return -ENOENT;
+    // Small files are written into the inode record itself
+    int was_inline = inode_is_inline(node);
+    if (was_inline && offset + (off_t)size <= INODE_INLINE_SIZE) {
+        char *data = inode_inline_data(node);
+        memcpy(data + offset, buf, size);
+        blocks_dirty(data + offset, size);
+        if (offset + (off_t)size > node->size) {
+            node->size = offset + size;
+            inode_dirty(node);
+        }
+        return size;
     }
     
-    // Grow file if necessary
-    off_t end_pos = offset + size;
+    // Back the range with blocks, then grow file if necessary
+    off_t end_pos = inode_alloc_range(node, offset, offset + size, 1);
+    if (was_inline && node->block != 0) {
+        storage_touch(inum, node->block, 1);  // The inline data moved here
+    }
+    if (end_pos <= offset) {
+        return -ENOSPC;  // No space
+    }
+    size = end_pos - offset;
+    int old_size = node->size;
     if (end_pos > node->size) {
-        if (grow_inode(node, end_pos) < 0) {
-            return -ENOSPC;  // No space
+        if (grow_inode(node, end_pos, 0) < 0) {
+            return -ENOSPC;
         }
+        storage_touch_tail(inum, old_size);
     }
     
     size_t bytes_written = 0;
@@ -174,322 +351,2609 @@ int storage_write(const char *path, const char *buf, size_t size, off_t offset)
         // Calculate which block and offset within block
         int file_block = (offset + bytes_written) / BLOCK_SIZE;
         int block_offset = (offset + bytes_written) % BLOCK_SIZE;
+        int want = bytes_to_blocks(block_offset + (size - bytes_written));
         
-        // Get the actual disk block number
-        int bnum = inode_get_bnum(node, file_block);
-        if (bnum <= 0) {
-            printf("! storage_write: no block for file_block %d\n", file_block);
+        // Get the contiguous run of disk blocks starting here
+        int bnum;
+        int run = inode_map_range(node, file_block, want, &bnum);
+        if (run <= 0 || bnum <= 0) {
+            TRACE(TRACE_ERROR, "storage_write: no block for file_block %d", file_block);
             break;
         }
         
-        // Calculate how much to write to this block
-        size_t to_write = BLOCK_SIZE - block_offset;
+        // Calculate how much to write to this run
+        size_t to_write = (size_t)run * BLOCK_SIZE - block_offset;
         if (to_write > size - bytes_written) {
             to_write = size - bytes_written;
         }
         
-        // Write to the block
-        char *block_data = blocks_get_block(bnum);
+        // Write the whole run at once
+        char *block_data = blocks_get_blocks(bnum, bytes_to_blocks(block_offset + to_write));
         memcpy(block_data + block_offset, buf + bytes_written, to_write);
+        blocks_dirty_data(bnum, bytes_to_blocks(block_offset + to_write));
+        storage_touch(inum, bnum, bytes_to_blocks(block_offset + to_write));
         
         bytes_written += to_write;
     }
     
-    // Update modification time
-    node->mtime = time(NULL);
-    
     return bytes_written;
 }
 
 /**
- * Truncate a file to the given size.
+ * Give held back appends their blocks and write them out.
  *
- * Grows or shrinks the file to the specified size.
+ * The blocks come as one allocation, so they end up contiguous where
+ * the disk allows. The caller holds the inode's write lock inside a
+ * journal operation.
  *
- * @param path Absolute path to the file.
- * @param size New size in bytes.
+ * @param inum Inode number.
  *
- * @return 0 on success, negative error on fail.
+ * @return 0 on success, -ENOSPC.
  */
-int storage_truncate(const char *path, off_t size) {
-    int inum = tree_lookup(path);
-    if (inum < 0) {
-        return -ENOENT;
+static int storage_undelay(int inum) {
+    storage_delay_t *rec = delayed[inum];
+    if (rec == NULL) {
+        return 0;
     }
+    __atomic_store_n(&delayed[inum], NULL, __ATOMIC_RELAXED);
+    int rec_len = rec->len;
     
-    inode_t *node = get_inode(inum);
-    if (node == NULL) {
-        return -ENOENT;
-    }
+    blocks_use_reserved(rec->reserved);
+    int rv = storage_write_locked(inum, rec->buf, rec->len, get_inode(inum)->size);
+    blocks_use_reserved(0);
     
-    if (size > node->size) {
-        return grow_inode(node, size);
-    } else if (size < node->size) {
-        return shrink_inode(node, size);
+    __atomic_sub_fetch(&delayed_bytes, rec->len, __ATOMIC_RELAXED);
+    free(rec->buf);
+    free(rec);
+    return rv < rec_len ? -ENOSPC : 0;
+}
+
+/**
+ * Forget held back appends without writing them.
+ *
+ * The caller holds the inode's write lock.
+ *
+ * @param inum Inode number.
+ */
+static void storage_drop_delayed(int inum) {
+    storage_delay_t *rec = delayed[inum];
+    if (rec == NULL) {
+        return;
     }
+    __atomic_store_n(&delayed[inum], NULL, __ATOMIC_RELAXED);
     
-    return 0;
+    blocks_unreserve(rec->reserved);
+    __atomic_sub_fetch(&delayed_bytes, rec->len, __ATOMIC_RELAXED);
+    free(rec->buf);
+    free(rec);
 }
 
 /**
- * Create a new file or directory.
+ * Hold back an append instead of giving it blocks now.
  *
- * Allocates a new inode and adds an entry in the parent directory.
+ * Only writes that continue a regular file from its current end are
+ * held, up to STORAGE_DELAY_BYTES per file. The blocks they will need
+ * are reserved here, so a full disk is reported by the write itself.
+ * The caller holds the inode's write lock inside a journal operation.
  *
- * @param path Absolute path for the new file/directory.
- * @param mode File type and permissions.
+ * @param inum Inode number of the file.
+ * @param buf Buffer containing data to write.
+ * @param size Number of bytes to write.
+ * @param offset Byte offset in the file to start writing at.
  *
- * @return 0 on success, negative error on fail.
+ * @return 1 if the bytes were held back, 0 if they have to be written
+ *         now, or -ENOSPC.
  */
-int storage_mknod(const char *path, int mode) {
-    // Check if file already exists
-    if (tree_lookup(path) >= 0) {
-        return -EEXIST;
+static int storage_delay(int inum, const char *buf, size_t size, off_t offset) {
+    inode_t *node = get_inode(inum);
+    storage_delay_t *rec = delayed[inum];
+    int held = rec != NULL ? rec->len : 0;
+    if (!S_ISREG(node->mode) || size == 0 || size > STORAGE_DELAY_BYTES ||
+        offset != (off_t)node->size + held) {
+        return 0;
     }
     
-    // Get parent directory
-    int parent_inum = tree_lookup_parent(path);
-    if (parent_inum < 0) {
-        return -ENOENT;  // Parent doesn't exist
+    // A full buffer is written out and the append starts the next one
+    if (held + size > STORAGE_DELAY_BYTES) {
+        int rv = storage_undelay(inum);
+        if (rv < 0) {
+            return rv;
+        }
+        rec = NULL;
+        held = 0;
     }
-    
-    inode_t *parent = get_inode(parent_inum);
-    if (parent == NULL) {
-        return -ENOENT;
+    if (__atomic_load_n(&delayed_bytes, __ATOMIC_RELAXED) + (long)size > STORAGE_DELAY_TOTAL) {
+        return 0;
     }
     
-    // Allocate new inode
-    int new_inum = alloc_inode();
-    if (new_inum < 0) {
-        return -ENOSPC;  // No free inodes
+    // Reserve blocks for everything held, pointer tables included
+    int reserved = rec != NULL ? rec->reserved : 0;
+    int needed = inode_blocks_needed(node, node->size, offset + size);
+    if (needed > reserved && blocks_reserve(needed - reserved) < 0) {
+        return 0;
     }
-    
-    inode_t *new_node = get_inode(new_inum);
-    new_node->mode = mode;
-    new_node->size = 0;
-    
-    // If creating a directory, allocate an initial block
-    if ((mode & S_IFDIR) != 0) {
-        grow_inode(new_node, BLOCK_SIZE);
+    if (rec == NULL) {
+        rec = calloc(1, sizeof(storage_delay_t));
+        if (rec == NULL) {
+            blocks_unreserve(needed);
+            return 0;
+        }
+        __atomic_store_n(&delayed[inum], rec, __ATOMIC_RELAXED);
+    }
+    if (needed > reserved) {
+        rec->reserved = needed;
     }
     
-    // Add entry to parent directory
-    const char *name = get_basename(path);
-    if (directory_put(parent, name, new_inum) < 0) {
-        free_inode(new_inum);
-        return -ENOSPC;
+    if (held + size > (size_t)rec->cap) {
+        int cap = rec->cap != 0 ? rec->cap : 64 << 10;
+        while ((size_t)cap < held + size) {
+            cap *= 2;
+        }
+        cap = cap < STORAGE_DELAY_BYTES ? cap : STORAGE_DELAY_BYTES;
+        char *grown = realloc(rec->buf, cap);
+        if (grown == NULL) {
+            return 0;
+        }
+        rec->buf = grown;
+        rec->cap = cap;
     }
     
-    printf("+ storage_mknod(%s, %o) -> inode %d\n", path, mode, new_inum);
-    return 0;
+    memcpy(rec->buf + held, buf, size);
+    rec->len = held + size;
+    __atomic_add_fetch(&delayed_bytes, size, __ATOMIC_RELAXED);
+    return 1;
 }
 
 /**
- * Delete a file.
+ * Write out an inode's held back appends.
  *
- * Decrements the reference count and frees the inode if no more links.
- * Removes the directory entry from the parent.
+ * Takes the inode's write lock, so the caller must not hold it.
  *
- * @param path Absolute path to the file to delete.
+ * @param inum Inode number.
  *
- * @return 0 on success, negative error on fail.
+ * @return 0 on success, -ENOSPC.
  */
-int storage_unlink(const char *path) {
-    int inum = tree_lookup(path);
-    if (inum < 0) {
-        return -ENOENT;
+static int storage_flush_delayed(int inum) {
+    if (__atomic_load_n(&delayed[inum], __ATOMIC_RELAXED) == NULL) {
+        return 0;
     }
     
-    // Get parent directory
-    int parent_inum = tree_lookup_parent(path);
-    if (parent_inum < 0) {
-        return -ENOENT;
-    }
+    journal_begin();
+    inode_wrlock(inum);
+    int rv = storage_undelay(inum);
+    inode_unlock(inum);
+    journal_end();
     
-    inode_t *parent = get_inode(parent_inum);
-    if (parent == NULL) {
-        return -ENOENT;
+    return rv;
+}
+
+/**
+ * Update a file's access time after a read, as the mount options say.
+ *
+ * Readers share the inode's lock, so the time is stored atomically.
+ *
+ * @param inum Inode number.
+ * @param node Pointer to the inode.
+ */
+static void storage_read_atime(int inum, inode_t *node) {
+    if (atime_mode == STORAGE_ATIME_NOATIME) {
+        return;
     }
     
-    // Remove from parent directory
-    const char *name = get_basename(path);
-    if (directory_delete(parent, name) < 0) {
-        return -ENOENT;
+    int64_t atime = __atomic_load_n(&node->atime, __ATOMIC_RELAXED);
+    int64_t now = inode_now();
+    if (atime_mode == STORAGE_ATIME_RELATIME && atime > node->mtime &&
+        now - atime < STORAGE_ATIME_AGE) {
+        return;
     }
+    __atomic_store_n(&node->atime, now, __ATOMIC_RELAXED);
     
-    // Decrement reference count
-    inode_t *node = get_inode(inum);
-    node->refs--;
-    
-    // Free inode if no more references
-    if (node->refs <= 0) {
-        free_inode(inum);
+    // A held back time goes out once it's been held a day
+    if (atime_lazy) {
+        int64_t held = 0;
+        if (__atomic_compare_exchange_n(&atime_held[inum], &held, now, 0, __ATOMIC_RELAXED,
+                                        __ATOMIC_RELAXED) ||
+            now - held < STORAGE_ATIME_AGE) {
+            return;
+        }
+        __atomic_store_n(&atime_held[inum], 0, __ATOMIC_RELAXED);
     }
-    
-    printf("+ storage_unlink(%s)\n", path);
-    return 0;
+    inode_dirty(node);
 }
 
 /**
- * Create a hard link.
- *
- * Creates a new directory entry pointing to an existing inode.
+ * Write out an access time lazytime held back.
  *
- * @param from Absolute path to existing file.
- * @param to Absolute path for the new link.
+ * The caller holds the inode's write lock, inside journal_begin().
  *
- * @return 0 on success, negative error on fail.
+ * @param inum Inode number.
  */
-int storage_link(const char *from, const char *to) {
-    // Get source inode
-    int from_inum = tree_lookup(from);
-    if (from_inum < 0) {
-        return -ENOENT;
+static void storage_flush_atime(int inum) {
+    if (atime_held != NULL && atime_held[inum] != 0) {
+        inode_dirty(get_inode(inum));
+        storage_touch(inum, 0, 0);
+        atime_held[inum] = 0;
     }
-    
-    // Check if destination already exists
-    if (tree_lookup(to) >= 0) {
-        return -EEXIST;
+}
+
+/**
+ * Write out the access times lazytime holds back for every inode.
+ *
+ * Runs at exit and before another image is mounted.
+ */
+static void storage_flush_all_atimes() {
+    for (int ii = 0; atime_held != NULL && ii < INODE_COUNT; ++ii) {
+        if (__atomic_load_n(&atime_held[ii], __ATOMIC_RELAXED) != 0) {
+            journal_begin();
+            inode_wrlock(ii);
+            storage_flush_atime(ii);
+            inode_unlock(ii);
+            journal_end();
+        }
     }
-    
-    // Get parent directory of destination
-    int parent_inum = tree_lookup_parent(to);
-    if (parent_inum < 0) {
-        return -ENOENT;
+}
+
+/**
+ * Apply a mount option of the storage layer.
+ *
+ * @param option Option name.
+ *
+ * @return 0 if the option was applied, -1 if it isn't one of ours.
+ */
+int storage_option(const char *option) {
+    if (strcmp(option, "strictatime") == 0) {
+        atime_mode = STORAGE_ATIME_STRICT;
+    } else if (strcmp(option, "relatime") == 0) {
+        atime_mode = STORAGE_ATIME_RELATIME;
+    } else if (strcmp(option, "noatime") == 0) {
+        atime_mode = STORAGE_ATIME_NOATIME;
+    } else if (strcmp(option, "lazytime") == 0) {
+        atime_lazy = 1;
+    } else if (strcmp(option, "nolazytime") == 0) {
+        atime_lazy = 0;
+    } else {
+        return -1;
     }
     
-    inode_t *parent = get_inode(parent_inum);
-    if (parent == NULL) {
-        return -ENOENT;
+    TRACE(TRACE_INFO, "storage_option: %s", option);
+    return 0;
+}
+
+/**
+ * Write out the held back appends of every inode.
+ *
+ * Runs at exit and before another image is mounted.
+ */
+static void storage_flush_all_delayed() {
+    for (int ii = 0; delayed != NULL && ii < delayed_count; ++ii) {
+        storage_flush_delayed(ii);
     }
-    
-    // Add entry to parent directory
-    const char *name = get_basename(to);
-    if (directory_put(parent, name, from_inum) < 0) {
-        return -ENOSPC;
+}
+
+/**
+ * Free an inode once nothing refers to it anymore.
+ *
+ * An inode is kept while it still has directory entries or is pinned
+ * by a front end. The caller holds the inode's write lock.
+ *
+ * @param inum Inode number to release.
+ */
+static void storage_release_inode(int inum) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL || node->refs > 0 || pins[inum] > 0) {
+        return;
     }
     
-    // Increment reference count
-    inode_t *node = get_inode(from_inum);
-    node->refs++;
+    // A directory's number may be reused, forget names cached under it
+    if (S_ISDIR(node->mode)) {
+        dcache_purge(inum);
+        directory_drop_index(node);
+    }
+    storage_drop_delayed(inum);
+    free(dirty[inum]);
+    dirty[inum] = NULL;
+    atime_held[inum] = 0;
+    free_inode(inum);
+}
+
+/**
+ * Drop one link to an inode and free it if that was the last.
+ *
+ * Takes the inode's write lock, so the caller must not hold it.
+ *
+ * @param inum Inode number that lost a directory entry.
+ */
+static void storage_drop_link(int inum) {
+    inode_wrlock(inum);
+    get_inode(inum)->refs--;
+    inode_dirty(get_inode(inum));
+    storage_touch(inum, 0, 0);
+    storage_release_inode(inum);
+    inode_unlock(inum);
+}
+
+/**
+ * Look up a name in a directory whose lock the caller holds.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name to look up.
+ *
+ * @return Inode number on success, -ENOENT if not found.
+ */
+static int storage_lookup_locked(int parent, const char *name) {
+    int inum = dcache_lookup(parent, name);
+    if (inum == DCACHE_NEGATIVE) {
+        STATS_ADD(STATS_DIR_NEGATIVE, 1);
+        return -ENOENT;
+    }
+    if (inum < 0) {
+        inum = directory_lookup(get_inode(parent), name);
+        if (inum < 0) {
+            dcache_insert_negative(parent, name);
+            return -ENOENT;
+        }
+        dcache_insert(parent, name, inum);
+    }
     
-    printf("+ storage_link(%s => %s)\n", from, to);
-    return 0;
+    return inum;
 }
 
 /**
- * Rename or move a file/directory.
+ * Look up a name in a directory whose lock the caller holds, reporting
+ * the slot it's in.
  *
- * Removes the entry from the old location and adds it to the new location.
+ * Names cached as absent are answered without a scan. The slot is only
+ * good until the directory is unlocked.
  *
- * @param from Current absolute path.
- * @param to New absolute path.
+ * @param parent Inode number of the directory.
+ * @param name Name to look up.
+ * @param slot Receives the entry's slot if found.
  *
- * @return 0 on success, negative error on fail.
+ * @return Inode number on success, -ENOENT if not found.
  */
-int storage_rename(const char *from, const char *to) {
-    // Get source inode
-    int from_inum = tree_lookup(from);
-    if (from_inum < 0) {
+static int storage_lookup_slot_locked(int parent, const char *name, int *slot) {
+    if (dcache_lookup(parent, name) == DCACHE_NEGATIVE) {
+        STATS_ADD(STATS_DIR_NEGATIVE, 1);
+        return -ENOENT;
+    }
+    
+    int inum = directory_lookup_slot(get_inode(parent), name, slot);
+    if (inum < 0) {
+        dcache_insert_negative(parent, name);
         return -ENOENT;
     }
+    dcache_insert(parent, name, inum);
+    return inum;
+}
+
+/**
+ * Compact a directory that has lost entries, once nobody is listing it.
+ *
+ * Compaction moves entries between slots, which a listing resuming from
+ * a slot would trip over, so with listings open it is left to the last
+ * storage_releasedir_inum(). The caller holds the directory's write
+ * lock inside a journal transaction.
+ *
+ * @param inum Inode number of the directory.
+ */
+static void storage_compact_locked(int inum) {
+    inode_t *dir = get_inode(inum);
+    if (!directory_sparse(dir)) {
+        compact_waiting[inum] = 0;
+    } else if (__atomic_load_n(&listers[inum], __ATOMIC_RELAXED) > 0) {
+        compact_waiting[inum] = 1;
+    } else {
+        compact_waiting[inum] = 0;
+        if (directory_compact(dir) > 0) {
+            storage_touch(inum, 0, 0);
+        }
+    }
+}
+
+/**
+ * Format a disk image with the given geometry.
+ *
+ * @param path Path to the disk image file.
+ * @param block_size Bytes per block.
+ * @param block_count Blocks in the image.
+ * @param inode_count Inodes in the inode table.
+ * @param inode_size Bytes per inode record, a power of two; what the
+ *                   fields leave holds small files inline.
+ * @param journal_blocks Blocks reserved for the journal, 0 for none.
+ *
+ * @return 0 on success, -EINVAL for a bad geometry or an I/O failure.
+ */
+int storage_mkfs(const char *path, int block_size, int block_count, int inode_count,
+                 int inode_size, int journal_blocks) {
+    TRACE(TRACE_INFO, "storage_mkfs(%s, %d x %d, %d inodes of %d bytes, %d journal blocks)",
+          path, block_count, block_size, inode_count, inode_size, journal_blocks);
     
-    // If destination exists, remove it first
-    int to_inum = tree_lookup(to);
-    if (to_inum >= 0) {
-        storage_unlink(to);
+    // Records are a power of two, so none straddles a block
+    if (inode_size < (int)sizeof(inode_t) || (inode_size & (inode_size - 1)) != 0 ||
+        inode_size > block_size) {
+        return -EINVAL;
+    }
+    if (blocks_format(path, block_size, block_count, inode_count, inode_size,
+                      journal_blocks) < 0) {
+        return -EINVAL;
     }
+    return 0;
+}
+
+/**
+ * Initialize the storage system.
+ *
+ * Sets up the disk image, initializes the inode table, and creates
+ * the root directory if it doesn't already exist. Inodes that were
+ * unlinked while still pinned by a previous mount are reclaimed.
+ * A missing or empty image is formatted with the default geometry.
+ * Committed journal transactions are replayed before anything else.
+ *
+ * @param path Path to the disk image file.
+ */
+void storage_init(const char *path) {
+    static int registered = 0;
     
-    // Get parent directories
-    int from_parent_inum = tree_lookup_parent(from);
-    int to_parent_inum = tree_lookup_parent(to);
+    trace_init();
+    TRACE(TRACE_INFO, "storage_init(%s)", path);
     
-    if (from_parent_inum < 0 || to_parent_inum < 0) {
-        return -ENOENT;
+    // Make a previously mounted image durable before letting go of it
+    storage_flush_all_delayed();
+    storage_flush_all_atimes();
+    journal_close();
+    
+    // Images that don't exist yet get the default geometry; block devices
+    // always report size 0, so they have to be formatted with mkfs.nufs
+    struct stat st;
+    if (stat(path, &st) != 0 || (S_ISREG(st.st_mode) && st.st_size == 0)) {
+        storage_mkfs(path, STORAGE_DEFAULT_BLOCK_SIZE, STORAGE_DEFAULT_BLOCK_COUNT,
+                     STORAGE_DEFAULT_INODE_COUNT, STORAGE_DEFAULT_INODE_SIZE,
+                     STORAGE_DEFAULT_JOURNAL_BLOCKS);
     }
     
-    inode_t *from_parent = get_inode(from_parent_inum);
-    inode_t *to_parent = get_inode(to_parent_inum);
+    // Initialize the block system and bring the metadata up to date
+    blocks_init(path);
+    journal_open();
+    
+    // Held back appends and access times go out at exit, before the
+    // journal closes
+    if (!registered) {
+        atexit(storage_flush_all_delayed);
+        atexit(storage_flush_all_atimes);
+        registered = 1;
+    }
     
-    if (from_parent == NULL || to_parent == NULL) {
-        return -ENOENT;
+    // Drop any names cached from a previous image
+    dcache_init();
+    for (int ii = 0; ii < handle_count; ++ii) {
+        handles[ii].inum = -1;
     }
+    handle_hint = 0;
     
-    // Add to new location first
-    const char *to_name = get_basename(to);
-    if (directory_put(to_parent, to_name, from_inum) < 0) {
-        return -ENOSPC;
+    // Initialize the inode table and size the per-inode state to it
+    for (int ii = 0; dirty != NULL && ii < INODE_COUNT; ++ii) {
+        free(dirty[ii]);
     }
+    inode_init();
+    free(pins);
+    pins = calloc(INODE_COUNT, sizeof(int));
+    free(listers);
+    listers = calloc(INODE_COUNT, sizeof(int));
+    free(compact_waiting);
+    compact_waiting = calloc(INODE_COUNT, sizeof(char));
+    free(atime_held);
+    atime_held = calloc(INODE_COUNT, sizeof(int64_t));
+    free(dirty);
+    dirty = calloc(INODE_COUNT, sizeof(storage_dirty_t *));
+    free(delayed);
+    delayed = calloc(INODE_COUNT, sizeof(storage_delay_t *));
+    delayed_count = INODE_COUNT;
     
-    // Remove from old location
-    const char *from_name = get_basename(from);
-    directory_delete(from_parent, from_name);
+    // Initialize the root directory
+    journal_begin();
+    directory_init();
     
-    printf("+ storage_rename(%s => %s)\n", from, to);
-    return 0;
+    // Reclaim orphans left by a mount that ended with them still pinned
+    void *ibm = get_inode_bitmap();
+    for (int ii = 1; ii < INODE_COUNT; ++ii) {
+        if (bitmap_get(ibm, ii) && get_inode(ii)->refs <= 0) {
+            TRACE(TRACE_INFO, "storage_init: reclaiming orphan inode %d", ii);
+            inode_wrlock(ii);
+            storage_release_inode(ii);
+            inode_unlock(ii);
+        }
+    }
+    journal_end();
 }
 
 /**
- * Update file access and modification times.
+ * Look up a name in a directory.
  *
- * @param path Absolute path to the file.
- * @param ts Array of two timespec: [0] = atime, [1] = mtime.
+ * @param parent Inode number of the directory.
+ * @param name Name to look up.
  *
- * @return 0 on success, negative error on fail.
+ * @return Inode number on success, -ENOENT if not found.
  */
-int storage_set_time(const char *path, const struct timespec ts[2]) {
+int storage_lookup(int parent, const char *name) {
+    inode_t *dir = get_inode(parent);
+    if (!storage_is_dir(dir)) {
+        return -ENOENT;
+    }
+    
+    inode_rdlock(parent);
+    int inum = storage_lookup_locked(parent, name);
+    inode_unlock(parent);
+    
+    return inum;
+}
+
+/**
+ * Get file/directory attributes.
+ *
+ * @param path Absolute path to the file or directory.
+ * @param st Pointer to stat structure to fill.
+ *
+ * @return 0 on success, -ENOENT if path doesn't exist.
+ */
+int storage_stat(const char *path, struct stat *st) {
     int inum = tree_lookup(path);
     if (inum < 0) {
         return -ENOENT;
     }
     
+    return storage_stat_inum(inum, st);
+}
+
+/**
+ * Get file/directory attributes by inode number.
+ *
+ * @param inum Inode number.
+ * @param st Pointer to stat structure to fill.
+ *
+ * @return 0 on success, -ENOENT if the inode doesn't exist.
+ */
+int storage_stat_inum(int inum, struct stat *st) {
     inode_t *node = get_inode(inum);
     if (node == NULL) {
         return -ENOENT;
     }
     
-    node->atime = ts[0].tv_sec;
-    node->mtime = ts[1].tv_sec;
+    inode_rdlock(inum);
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = node->mode;
+    st->st_size = storage_size(inum);
+    st->st_uid = node->uid;
+    st->st_gid = node->gid;
+    st->st_nlink = node->refs;
+    st->st_atim = storage_timespec(__atomic_load_n(&node->atime, __ATOMIC_RELAXED));
+    st->st_mtim = storage_timespec(node->mtime);
+    st->st_ino = inum;
+    
+    // Calculate blocks used for st_blocks, in 512-byte units; inline
+    // data takes what its bytes do
+    if (inode_is_inline(node)) {
+        st->st_blocks = ((off_t)node->size + 511) / 512;
+    } else {
+        st->st_blocks = ((off_t)inode_blocks_used(node) * BLOCK_SIZE + 511) / 512;
+    }
+    if (delayed[inum] != NULL) {
+        st->st_blocks += (delayed[inum]->len + 511) / 512;
+    }
+    st->st_blksize = BLOCK_SIZE;
+    inode_unlock(inum);
     
     return 0;
 }
 
 /**
- * List directory contents.
+ * Get filesystem statistics.
  *
- * Returns a linked list of all entries in the directory.
+ * Both allocators keep count of what's free as they go, so this doesn't
+ * scan the bitmaps and is cheap enough to poll.
  *
- * @param path Absolute path to the directory.
+ * @param st Pointer to statvfs structure to fill.
  *
- * @return Linked list of filenames, or NULL if not a directory.
- *         Caller must free with slist_free().
+ * @return 0.
  */
-slist_t *storage_list(const char *path) {
-    return directory_list(path);
+int storage_statfs(struct statvfs *st) {
+    const nufs_super_t *sb = blocks_super();
+    
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = BLOCK_SIZE;
+    st->f_frsize = BLOCK_SIZE;
+    st->f_blocks = BLOCK_COUNT - sb->data_start;  // Metadata isn't space for files
+    st->f_bfree = blocks_free_count();
+    st->f_bavail = st->f_bfree;
+    st->f_files = INODE_COUNT;
+    st->f_ffree = inode_free_count();
+    st->f_favail = st->f_ffree;
+    st->f_namemax = DIR_NAME_LENGTH - 1;
+    
+    return 0;
 }
 
 /**
- * Change file mode/permissions.
+ * Get an inode's generation number.
+ *
+ * @param inum Inode number.
+ *
+ * @return Generation, changed each time the number is reused; 0 if the
+ *         number is out of range.
+ */
+unsigned storage_generation_inum(int inum) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return 0;
+    }
+    
+    // Only changes when alloc_inode() hands the number out again
+    inode_rdlock(inum);
+    unsigned generation = node->generation;
+    inode_unlock(inum);
+    return generation;
+}
+
+/**
+ * Read data from a file.
  *
  * @param path Absolute path to the file.
- * @param mode New mode (permissions).
+ * @param buf Buffer to read data into.
+ * @param size Maximum number of bytes to read.
+ * @param offset Byte offset in the file to start reading from.
  *
- * @return 0 on success, negative error on fail.
+ * @return Number of bytes read, or negative error code.
  */
-int storage_chmod(const char *path, mode_t mode) {
+int storage_read(const char *path, char *buf, size_t size, off_t offset) {
     int inum = tree_lookup(path);
     if (inum < 0) {
         return -ENOENT;
     }
     
+    return storage_read_inum(inum, buf, size, offset);
+}
+
+/**
+ * Read data from a file by inode number.
+ *
+ * Reads data from the file's data blocks starting at the given offset.
+ *
+ * @param inum Inode number of the file.
+ * @param buf Buffer to read data into.
+ * @param size Maximum number of bytes to read.
+ * @param offset Byte offset in the file to start reading from.
+ *
+ * @return Number of bytes read, or negative error code.
+ */
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset) {
     inode_t *node = get_inode(inum);
     if (node == NULL) {
         return -ENOENT;
     }
     
-    // Preserve file type, update permissions
-    node->mode = (node->mode & S_IFMT) | (mode & ~S_IFMT);
+    journal_begin();
+    inode_rdlock(inum);
     
-    return 0;
+    // Check if offset is beyond file size
+    int file_size = storage_size(inum);
+    if (offset >= file_size) {
+        inode_unlock(inum);
+        journal_end();
+        return 0;
+    }
+    
+    // Limit read size to remaining data
+    if (offset + (off_t)size > file_size) {
+        size = file_size - offset;
+    }
+    
+    // Bytes past the size on disk are still held back in memory
+    size_t on_disk = 0;
+    if (offset < node->size) {
+        on_disk = offset + (off_t)size > node->size ? (size_t)(node->size - offset) : size;
+    }
+    
+    size_t bytes_read = 0;
+    if (inode_is_inline(node)) {
+        memcpy(buf, inode_inline_data(node) + offset, on_disk);
+        bytes_read = on_disk;
+    }
+    
+    while (bytes_read < on_disk) {
+        // Calculate which block and offset within block
+        int file_block = (offset + bytes_read) / BLOCK_SIZE;
+        int block_offset = (offset + bytes_read) % BLOCK_SIZE;
+        int want = bytes_to_blocks(block_offset + (on_disk - bytes_read));
+        
+        // Get the contiguous run of disk blocks starting here
+        int bnum;
+        int run = inode_map_range(node, file_block, want, &bnum);
+        if (run <= 0) {
+            break;  // No more blocks
+        }
+        
+        // Calculate how much to read from this run
+        size_t to_read = (size_t)run * BLOCK_SIZE - block_offset;
+        if (to_read > on_disk - bytes_read) {
+            to_read = on_disk - bytes_read;
+        }
+        
+        // Read the whole run at once; a hole reads as zeros
+        if (bnum == 0) {
+            memset(buf + bytes_read, 0, to_read);
+        } else {
+            char *block_data = blocks_get_blocks(bnum, bytes_to_blocks(block_offset + to_read));
+            memcpy(buf + bytes_read, block_data + block_offset, to_read);
+        }
+        
+        bytes_read += to_read;
+    }
+    
+    if (bytes_read == on_disk && size > on_disk) {
+        off_t held = offset + (off_t)on_disk - node->size;
+        memcpy(buf + on_disk, delayed[inum]->buf + held, size - on_disk);
+        bytes_read = size;
+    }
+    
+    storage_read_atime(inum, node);
+    inode_unlock(inum);
+    journal_end();
+    
+    TRACE_EVENT(TRACE_READ, inum, offset, bytes_read);
+    return bytes_read;
+}
+
+/**
+ * Write data to a file.
+ *
+ * @param path Absolute path to the file.
+ * @param buf Buffer containing data to write.
+ * @param size Number of bytes to write.
+ * @param offset Byte offset in the file to start writing at.
+ *
+ * @return Number of bytes written, or negative error code.
+ */
+int storage_write(const char *path, const char *buf, size_t size, off_t offset) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    return storage_write_inum(inum, buf, size, offset);
+}
+
+/**
+ * Write data to a file by inode number.
+ *
+ * Grows the file if necessary to accommodate the write. Appends are
+ * held back in memory and get their blocks together, when the file is
+ * synced, truncated or closed, when a write lands elsewhere, or once
+ * enough of them pile up.
+ *
+ * @param inum Inode number of the file.
+ * @param buf Buffer containing data to write.
+ * @param size Number of bytes to write.
+ * @param offset Byte offset in the file to start writing at.
+ *
+ * @return Number of bytes written, or negative error code.
+ */
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    
+    if (offset + (off_t)size > INT_MAX) {
+        return -EFBIG;  // Size is stored as an int
+    }
+    
+    journal_begin();
+    inode_wrlock(inum);
+    int rv = storage_delay(inum, buf, size, offset);
+    if (rv == 0) {
+        // Held back appends come first, this write may cover them
+        rv = storage_undelay(inum);
+        if (rv == 0) {
+            rv = storage_write_locked(inum, buf, size, offset);
+        }
+    } else if (rv > 0) {
+        rv = size;
+    }
+    
+    // Update modification time
+    if (rv >= 0) {
+        node->mtime = inode_now();
+        inode_dirty(node);
+        storage_touch(inum, 0, 0);
+    }
+    inode_unlock(inum);
+    journal_end();
+    
+    TRACE_EVENT(TRACE_WRITE, inum, offset, rv);
+    return rv;
 }
 
+/**
+ * Truncate a file to the given size.
+ *
+ * @param path Absolute path to the file.
+ * @param size New size in bytes.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_truncate(const char *path, off_t size) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    return storage_truncate_inum(inum, size);
+}
+
+/**
+ * Truncate a file to the given size by inode number.
+ *
+ * Grows or shrinks the file to the specified size.
+ *
+ * @param inum Inode number of the file.
+ * @param size New size in bytes.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_truncate_inum(int inum, off_t size) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    
+    if (size > INT_MAX) {
+        return -EFBIG;
+    }
+    
+    journal_begin();
+    inode_wrlock(inum);
+    
+    // Held back appends the new size cuts off needn't be written at all
+    if (size <= node->size) {
+        storage_drop_delayed(inum);
+    }
+    int rv = storage_undelay(inum);
+    if (rv == 0 && size > node->size) {
+        int was_inline = inode_is_inline(node);
+        int old_size = node->size;
+        rv = grow_inode(node, size, 0) < 0 ? -EFBIG : 0;
+        if (was_inline && node->block != 0) {
+            storage_touch(inum, node->block, 1);
+        } else if (rv == 0) {
+            storage_touch_tail(inum, old_size);
+        }
+    } else if (rv == 0 && size < node->size) {
+        rv = shrink_inode(node, size);
+    }
+    storage_touch(inum, 0, 0);
+    inode_unlock(inum);
+    journal_end();
+    
+    TRACE_EVENT(TRACE_TRUNCATE, inum, size, rv);
+    return rv;
+}
+
+/**
+ * Find the next data or hole in a file by inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param offset Byte offset to search from.
+ * @param whence SEEK_DATA or SEEK_HOLE.
+ *
+ * @return Offset found, -ENXIO, -EINVAL or -ENOENT.
+ */
+off_t storage_seek_inum(int inum, off_t offset, int whence) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+    
+    inode_rdlock(inum);
+    off_t size = storage_size(inum);
+    if (offset < 0 || offset >= size) {
+        inode_unlock(inum);
+        return -ENXIO;
+    }
+    
+    // Runs of blocks are either all data or all holes
+    int want_data = whence == SEEK_DATA;
+    off_t found = -1;
+    int nblocks = node->size == 0 ? 0 : bytes_to_blocks(node->size);
+    if (inode_is_inline(node)) {
+        found = want_data ? offset : size;  // Inline data has no holes
+        nblocks = 0;
+    }
+    for (int ii = offset / BLOCK_SIZE; ii < nblocks;) {
+        int bnum;
+        int run = inode_map_range(node, ii, nblocks - ii, &bnum);
+        if (run <= 0) {
+            break;
+        }
+        if ((bnum != 0) == want_data) {
+            found = (off_t)ii * BLOCK_SIZE;
+            break;
+        }
+        ii += run;
+    }
+    
+    // Past the blocks on disk come held back appends, then the end
+    if (found < 0) {
+        if (!want_data) {
+            found = size;
+        } else if (size > node->size) {
+            found = node->size;
+        }
+    }
+    inode_unlock(inum);
+    
+    if (found < 0) {
+        return -ENXIO;
+    }
+    return found > offset ? found : offset;
+}
+
+/**
+ * Copy bytes between files whose write locks the caller holds.
+ *
+ * Where a block of the source lines up with one of the destination, the
+ * destination shares it instead of copying; so does a last block that
+ * ends both files. The rest goes through a buffer. The destination grows
+ * to cover the range, and only as far as the copy got if it stops short.
+ * Neither file may hold back appends.
+ *
+ * @param src Inode number of the source.
+ * @param src_offset Byte offset in the source to copy from.
+ * @param dst Inode number of the destination.
+ * @param dst_offset Byte offset in the destination to copy to.
+ * @param size Number of bytes to copy, at most to the source's end.
+ *
+ * @return Number of bytes copied, or -ENOSPC or -ENOMEM if none were.
+ */
+static int storage_copy_locked(int src, off_t src_offset, int dst, off_t dst_offset,
+                               size_t size) {
+    inode_t *from = get_inode(src);
+    inode_t *to = get_inode(dst);
+    int old_size = to->size;
+    int end = dst_offset + size;
+    if (end > to->size) {
+        if (grow_inode(to, end, 0) < 0) {
+            return -ENOSPC;
+        }
+        storage_touch_tail(dst, old_size);
+    }
+    
+    char *buf = NULL;
+    int rv = 0;
+    size_t copied = 0;
+    while (copied < size) {
+        off_t src_pos = src_offset + copied;
+        off_t dst_pos = dst_offset + copied;
+        size_t left = size - copied;
+        
+        // Share the blocks that line up; inline data has none to share
+        int count = 0;
+        if (src_pos % BLOCK_SIZE == 0 && dst_pos % BLOCK_SIZE == 0 && !inode_is_inline(from)) {
+            count = left / BLOCK_SIZE;
+            if (src_pos + (off_t)left == from->size && dst_pos + (off_t)left == to->size) {
+                count = bytes_to_blocks(left);
+            }
+        }
+        if (count > 0) {
+            int file_bnum = dst_pos / BLOCK_SIZE;
+            int got = inode_share_range(to, file_bnum, from, src_pos / BLOCK_SIZE, count);
+            for (int ii = 0; ii < got;) {
+                int bnum;
+                int run = inode_map_range(to, file_bnum + ii, got - ii, &bnum);
+                if (run <= 0) {
+                    break;
+                }
+                if (bnum != 0) {
+                    storage_touch(dst, bnum, run);  // The source may not have synced them
+                }
+                ii += run;
+            }
+            copied += (size_t)got * BLOCK_SIZE < left ? (size_t)got * BLOCK_SIZE : left;
+            if (got < count) {
+                rv = -ENOSPC;
+                break;
+            }
+            continue;
+        }
+        
+        // Copy the rest up to the next block edge in either file
+        size_t chunk = BLOCK_SIZE - src_pos % BLOCK_SIZE;
+        if (BLOCK_SIZE - dst_pos % BLOCK_SIZE < chunk) {
+            chunk = BLOCK_SIZE - dst_pos % BLOCK_SIZE;
+        }
+        chunk = chunk < left ? chunk : left;
+        if (buf == NULL && (buf = malloc(BLOCK_SIZE)) == NULL) {
+            rv = -ENOMEM;
+            break;
+        }
+        if (inode_is_inline(from)) {
+            memcpy(buf, inode_inline_data(from) + src_pos, chunk);
+        } else {
+            int bnum = inode_get_bnum(from, src_pos / BLOCK_SIZE);
+            if (bnum > 0) {
+                memcpy(buf, (char *)blocks_get_block(bnum) + src_pos % BLOCK_SIZE, chunk);
+            } else {
+                memset(buf, 0, chunk);
+            }
+        }
+        int wrote = storage_write_locked(dst, buf, chunk, dst_pos);
+        if (wrote > 0) {
+            copied += wrote;
+        }
+        if (wrote < (int)chunk) {
+            rv = -ENOSPC;
+            break;
+        }
+    }
+    free(buf);
+    
+    // Don't leave the destination longer than what was copied
+    int keep = dst_offset + copied > (size_t)old_size ? (int)(dst_offset + copied) : old_size;
+    if (keep < to->size) {
+        shrink_inode(to, keep);
+    }
+    if (copied > 0 || end > old_size) {
+        to->mtime = inode_now();
+        inode_dirty(to);
+        storage_touch(dst, 0, 0);
+    }
+    return copied > 0 ? (int)copied : rv;
+}
+
+/**
+ * Check that both files of a copy are regular files.
+ *
+ * Safe without their locks, though only a check under them is final.
+ *
+ * @param src Inode number of the source.
+ * @param dst Inode number of the destination.
+ *
+ * @return 0 if they are, -EISDIR for a directory, -EINVAL for anything
+ *         else.
+ */
+static int storage_check_pair(int src, int dst) {
+    int src_mode = __atomic_load_n(&get_inode(src)->mode, __ATOMIC_RELAXED);
+    int dst_mode = __atomic_load_n(&get_inode(dst)->mode, __ATOMIC_RELAXED);
+    if (S_ISDIR(src_mode) || S_ISDIR(dst_mode)) {
+        return -EISDIR;
+    }
+    if (!S_ISREG(src_mode) || !S_ISREG(dst_mode)) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Lock the two files of a copy, lower inode number first.
+ *
+ * Held back appends of both are written out, so that their blocks can
+ * be shared. The caller is inside a journal operation.
+ *
+ * @param src Inode number of the source.
+ * @param dst Inode number of the destination, may be src.
+ *
+ * @return 0 with both locked, or a negative error with neither: -EISDIR
+ *         for a directory, -EINVAL for anything else not a regular file,
+ *         -ENOSPC if held back appends couldn't be written.
+ */
+static int storage_lock_pair(int src, int dst) {
+    // A directory is locked before its files, so one is never locked
+    // here in inode number order
+    int rv = storage_check_pair(src, dst);
+    if (rv < 0) {
+        return rv;
+    }
+    
+    int first = src < dst ? src : dst;
+    int second = src < dst ? dst : src;
+    inode_wrlock(first);
+    if (second != first) {
+        inode_wrlock(second);
+    }
+    
+    rv = storage_check_pair(src, dst);  // Freed and reused in the meantime
+    if (rv == 0 && (storage_undelay(src) < 0 || storage_undelay(dst) < 0)) {
+        rv = -ENOSPC;
+    }
+    
+    if (rv < 0) {
+        if (second != first) {
+            inode_unlock(second);
+        }
+        inode_unlock(first);
+    }
+    return rv;
+}
+
+/**
+ * Unlock the two files locked by storage_lock_pair().
+ *
+ * @param src Inode number of the source.
+ * @param dst Inode number of the destination.
+ */
+static void storage_unlock_pair(int src, int dst) {
+    if (src != dst) {
+        inode_unlock(src);
+    }
+    inode_unlock(dst);
+}
+
+/**
+ * Copy bytes between locked files for as long as the transaction has room.
+ *
+ * Goes in steps of STORAGE_COPY_STEP blocks, at least one of them, and
+ * stops after the step that leaves the journal short of another.
+ *
+ * @param src Inode number of the source.
+ * @param src_offset Byte offset in the source to copy from.
+ * @param dst Inode number of the destination.
+ * @param dst_offset Byte offset in the destination to copy to.
+ * @param size Number of bytes to copy, at most to the source's end.
+ *
+ * @return Number of bytes copied, or a negative error code if none were.
+ */
+static int storage_copy_some(int src, off_t src_offset, int dst, off_t dst_offset,
+                             size_t size) {
+    size_t copied = 0;
+    do {
+        size_t step = size - copied;
+        if (step > (size_t)STORAGE_COPY_STEP * BLOCK_SIZE) {
+            step = (size_t)STORAGE_COPY_STEP * BLOCK_SIZE;
+        }
+        int rv = storage_copy_locked(src, src_offset + copied, dst, dst_offset + copied, step);
+        if (rv < 0) {
+            return copied > 0 ? (int)copied : rv;
+        }
+        copied += rv;
+        if ((size_t)rv < step) {
+            break;
+        }
+    } while (copied < size && journal_room() >= STORAGE_COPY_ROOM);
+    return (int)copied;
+}
+
+/**
+ * Shrink a locked file for as long as the transaction has room.
+ *
+ * Goes in steps of STORAGE_COPY_STEP blocks, at least one of them.
+ *
+ * @param inum Inode number of the file, larger than size.
+ * @param size Size in bytes to shrink it to.
+ */
+static void storage_shrink_some(int inum, int size) {
+    inode_t *node = get_inode(inum);
+    do {
+        int keep = node->size - STORAGE_COPY_STEP * BLOCK_SIZE;
+        shrink_inode(node, keep > size ? keep : size);
+    } while (node->size > size && journal_room() >= STORAGE_COPY_ROOM);
+    storage_touch(inum, 0, 0);
+}
+
+/**
+ * Copy a byte range from one file to another by inode number.
+ *
+ * Takes as many transactions as the journal needs, so a crash can leave
+ * the range partly copied, as a short write would.
+ *
+ * @param src Inode number of the source.
+ * @param src_offset Byte offset in the source to copy from.
+ * @param dst Inode number of the destination, may be src.
+ * @param dst_offset Byte offset in the destination to copy to.
+ * @param size Number of bytes to copy.
+ *
+ * @return Bytes copied, or a negative error code.
+ */
+int storage_copy_range_inum(int src, off_t src_offset, int dst, off_t dst_offset,
+                            size_t size) {
+    if (get_inode(src) == NULL || get_inode(dst) == NULL) {
+        return -ENOENT;
+    }
+    if (src_offset < 0 || dst_offset < 0) {
+        return -EINVAL;
+    }
+    if (dst_offset > INT_MAX) {
+        return -EFBIG;
+    }
+    if (src_offset > INT_MAX) {
+        return 0;  // No file is larger
+    }
+    size = size > INT_MAX ? INT_MAX : size;
+    if (src == dst && src_offset < dst_offset + (off_t)size &&
+        dst_offset < src_offset + (off_t)size) {
+        return -EINVAL;  // The ranges overlap
+    }
+    
+    size_t copied = 0;
+    int rv;
+    do {
+        journal_begin();
+        rv = storage_lock_pair(src, dst);
+        if (rv == 0) {
+            // Nothing is copied from past the source's end
+            off_t src_size = get_inode(src)->size;
+            off_t src_pos = src_offset + copied;
+            if (src_pos >= src_size) {
+                size = copied;
+            } else if (src_pos + (off_t)(size - copied) > src_size) {
+                size = copied + (src_size - src_pos);
+            }
+            if (dst_offset + (off_t)size > INT_MAX) {
+                rv = -EFBIG;
+            } else if (copied < size) {
+                rv = storage_copy_some(src, src_pos, dst, dst_offset + copied, size - copied);
+            }
+            storage_unlock_pair(src, dst);
+        }
+        journal_end();
+        copied += rv > 0 ? rv : 0;
+    } while (rv > 0 && copied < size);
+    rv = copied > 0 ? (int)copied : rv;
+    
+    TRACE_EVENT(TRACE_COPY, dst, src, rv);
+    return rv;
+}
+
+/**
+ * Make a file a clone of another by inode number.
+ *
+ * The destination is emptied, then the source shared into it, in as
+ * many transactions as the journal needs; a crash can leave it partly
+ * cloned.
+ *
+ * @param src Inode number of the file to clone.
+ * @param dst Inode number of the file to replace the contents of.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int storage_clone_inum(int src, int dst) {
+    if (get_inode(src) == NULL || get_inode(dst) == NULL) {
+        return -ENOENT;
+    }
+    if (blocks_super()->refcount_blocks == 0) {
+        return -EOPNOTSUPP;  // Sharing would be a copy
+    }
+    if (src == dst) {
+        return -EINVAL;
+    }
+    
+    int copied = 0;
+    int rv;
+    do {
+        journal_begin();
+        rv = storage_lock_pair(src, dst);
+        if (rv == 0) {
+            // Each step clones the source as it is by then
+            int size = get_inode(src)->size;
+            copied = copied < size ? copied : size;
+            if (get_inode(dst)->size > copied) {
+                storage_shrink_some(dst, copied);
+                rv = 1;
+            } else if (copied < size) {
+                int got = storage_copy_some(src, copied, dst, copied, size - copied);
+                copied += got > 0 ? got : 0;
+                rv = got < 0 ? got : 1;
+            }
+            storage_unlock_pair(src, dst);
+        }
+        journal_end();
+    } while (rv > 0);
+    
+    TRACE_EVENT(TRACE_COPY, dst, src, rv);
+    return rv;
+}
+
+/**
+ * Create a new file or directory.
+ *
+ * @param path Absolute path for the new file/directory.
+ * @param mode File type and permissions.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_mknod(const char *path, int mode) {
+    // Get parent directory
+    int parent_inum = tree_lookup_parent(path);
+    if (parent_inum < 0) {
+        return -ENOENT;  // Parent doesn't exist
+    }
+    
+    int rv = storage_mknod_at(parent_inum, get_basename(path), mode);
+    if (rv < 0) {
+        return rv;
+    }
+    
+    TRACE(TRACE_DEBUG, "storage_mknod(%s, %o) -> inode %d", path, mode, rv);
+    return 0;
+}
+
+/**
+ * Create a new file or directory in the given directory.
+ *
+ * Allocates a new inode and adds an entry in the parent directory.
+ *
+ * @param parent Inode number of the parent directory.
+ * @param name Name of the new entry.
+ * @param mode File type and permissions.
+ *
+ * @return Inode number of the new object, or negative error on fail.
+ */
+int storage_mknod_at(int parent, const char *name, int mode) {
+    inode_t *dir = get_inode(parent);
+    if (!storage_is_dir(dir)) {
+        return -ENOENT;
+    }
+    
+    journal_begin();
+    inode_wrlock(parent);
+    
+    // Check if file already exists
+    if (storage_lookup_locked(parent, name) >= 0) {
+        inode_unlock(parent);
+        journal_end();
+        return -EEXIST;
+    }
+    
+    // Allocate new inode
+    int new_inum = alloc_inode();
+    if (new_inum < 0) {
+        inode_unlock(parent);
+        journal_end();
+        return -ENOSPC;  // No free inodes
+    }
+    
+    // Only stale lookups can reach the new inode before it has a name,
+    // and they never wait on another lock while holding it
+    inode_wrlock(new_inum);
+    inode_t *new_node = get_inode(new_inum);
+    __atomic_store_n(&new_node->mode, mode, __ATOMIC_RELAXED);  // see storage_is_dir()
+    new_node->size = 0;
+    inode_dirty(new_node);
+    
+    // If creating a directory, allocate an initial block
+    if ((mode & S_IFDIR) != 0) {
+        grow_inode(new_node, BLOCK_SIZE, 1);
+    }
+    
+    // Add entry to parent directory
+    if (directory_put(dir, name, new_inum) < 0) {
+        free_inode(new_inum);
+        inode_unlock(new_inum);
+        inode_unlock(parent);
+        journal_end();
+        return -ENOSPC;
+    }
+    
+    storage_touch(new_inum, 0, 0);
+    storage_touch(parent, 0, 0);
+    inode_unlock(new_inum);
+    inode_unlock(parent);
+    journal_end();
+    return new_inum;
+}
+
+/**
+ * Delete a file.
+ *
+ * @param path Absolute path to the file to delete.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_unlink(const char *path) {
+    // Get parent directory
+    int parent_inum = tree_lookup_parent(path);
+    if (parent_inum < 0) {
+        return -ENOENT;
+    }
+    
+    int rv = storage_unlink_at(parent_inum, get_basename(path));
+    if (rv < 0) {
+        return rv;
+    }
+    
+    TRACE(TRACE_DEBUG, "storage_unlink(%s)", path);
+    return 0;
+}
+
+/**
+ * Delete a name from the given directory.
+ *
+ * Decrements the reference count and frees the inode if no more links
+ * and no front end still has it pinned.
+ *
+ * @param parent Inode number of the parent directory.
+ * @param name Name of the entry to delete.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_unlink_at(int parent, const char *name) {
+    inode_t *dir = get_inode(parent);
+    if (!storage_is_dir(dir)) {
+        return -ENOENT;
+    }
+    
+    journal_begin();
+    inode_wrlock(parent);
+    int slot;
+    int inum = storage_lookup_slot_locked(parent, name, &slot);
+    if (inum < 0) {
+        inode_unlock(parent);
+        journal_end();
+        return -ENOENT;
+    }
+    
+    // Remove from parent directory
+    directory_delete_at(dir, slot);
+    storage_touch(parent, 0, 0);
+    storage_compact_locked(parent);
+    inode_unlock(parent);
+    
+    // Decrement reference count, free inode if no more references
+    storage_drop_link(inum);
+    journal_end();
+    
+    return 0;
+}
+
+/**
+ * Remove an empty directory.
+ *
+ * @param path Absolute path to the directory.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_rmdir(const char *path) {
+    int parent_inum = tree_lookup_parent(path);
+    if (parent_inum < 0) {
+        return -ENOENT;
+    }
+    
+    int rv = storage_rmdir_at(parent_inum, get_basename(path));
+    if (rv < 0) {
+        return rv;
+    }
+    
+    TRACE(TRACE_DEBUG, "storage_rmdir(%s)", path);
+    return 0;
+}
+
+/**
+ * Remove an empty directory from the given directory.
+ *
+ * The emptiness check and the removal happen under the directory's
+ * lock, so nothing can be created in it in between.
+ *
+ * @param parent Inode number of the parent directory.
+ * @param name Name of the directory to remove.
+ *
+ * @return 0 on success, -ENOTDIR, -ENOTEMPTY or another negative error.
+ */
+int storage_rmdir_at(int parent, const char *name) {
+    inode_t *dir = get_inode(parent);
+    if (!storage_is_dir(dir)) {
+        return -ENOENT;
+    }
+    
+    // Locks both the parent and the victim, so needs the rename lock
+    journal_begin();
+    pthread_mutex_lock(&rename_lock);
+    inode_wrlock(parent);
+    
+    int rv = 0;
+    int slot;
+    int inum = storage_lookup_slot_locked(parent, name, &slot);
+    if (inum < 0) {
+        rv = -ENOENT;
+    } else if (inum == parent) {
+        rv = -EINVAL;
+    } else {
+        inode_wrlock(inum);
+        inode_t *node = get_inode(inum);
+        if (!S_ISDIR(node->mode)) {
+            rv = -ENOTDIR;
+        } else if (!directory_empty(node)) {
+            rv = -ENOTEMPTY;
+        } else {
+            directory_delete_at(dir, slot);
+            node->refs--;
+            inode_dirty(node);
+            storage_touch(parent, 0, 0);
+            storage_release_inode(inum);
+            storage_compact_locked(parent);
+        }
+        inode_unlock(inum);
+    }
+    
+    inode_unlock(parent);
+    pthread_mutex_unlock(&rename_lock);
+    journal_end();
+    return rv;
+}
+
+/**
+ * Create a hard link.
+ *
+ * @param from Absolute path to existing file.
+ * @param to Absolute path for the new link.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_link(const char *from, const char *to) {
+    // Get source inode
+    int from_inum = tree_lookup(from);
+    if (from_inum < 0) {
+        return -ENOENT;
+    }
+    
+    // Get parent directory of destination
+    int parent_inum = tree_lookup_parent(to);
+    if (parent_inum < 0) {
+        return -ENOENT;
+    }
+    
+    int rv = storage_link_at(from_inum, parent_inum, get_basename(to));
+    if (rv < 0) {
+        return rv;
+    }
+    
+    TRACE(TRACE_DEBUG, "storage_link(%s => %s)", from, to);
+    return 0;
+}
+
+/**
+ * Create a hard link to an inode in the given directory.
+ *
+ * Creates a new directory entry pointing to an existing inode.
+ *
+ * @param inum Inode number of the existing file.
+ * @param parent Inode number of the directory for the new link.
+ * @param name Name of the new link.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_link_at(int inum, int parent, const char *name) {
+    inode_t *node = get_inode(inum);
+    inode_t *dir = get_inode(parent);
+    if (node == NULL || !storage_is_dir(dir)) {
+        return -ENOENT;
+    }
+    
+    // Directories can't be hard linked, which also keeps this to one
+    // directory lock
+    if (storage_is_dir(node)) {
+        return -EPERM;
+    }
+    
+    journal_begin();
+    inode_wrlock(parent);
+    inode_wrlock(inum);
+    
+    int rv = 0;
+    if (node->refs <= 0) {
+        rv = -ENOENT;  // Lost its last name while we resolved it
+    } else if (S_ISDIR(node->mode)) {
+        rv = -EPERM;  // Freed and reused as a directory in the meantime
+    } else if (node->refs >= INODE_MAX_LINKS) {
+        rv = -EMLINK;
+    } else if (storage_lookup_locked(parent, name) >= 0) {
+        rv = -EEXIST;  // Destination already exists
+    } else if (directory_put(dir, name, inum) < 0) {
+        rv = -ENOSPC;
+    } else {
+        // Increment reference count
+        node->refs++;
+        inode_dirty(node);
+        storage_touch(inum, 0, 0);
+        storage_touch(parent, 0, 0);
+    }
+    
+    inode_unlock(inum);
+    inode_unlock(parent);
+    journal_end();
+    return rv;
+}
+
+/**
+ * Rename or move a file/directory.
+ *
+ * @param from Current absolute path.
+ * @param to New absolute path.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_rename(const char *from, const char *to) {
+    // Get parent directories
+    int from_parent_inum = tree_lookup_parent(from);
+    int to_parent_inum = tree_lookup_parent(to);
+    
+    if (from_parent_inum < 0 || to_parent_inum < 0) {
+        return -ENOENT;
+    }
+    
+    int rv = storage_rename_at(from_parent_inum, get_basename(from),
+                               to_parent_inum, get_basename(to));
+    if (rv < 0) {
+        return rv;
+    }
+    
+    TRACE(TRACE_DEBUG, "storage_rename(%s => %s)", from, to);
+    return 0;
+}
+
+/**
+ * Rename or move a directory entry.
+ *
+ * Both names are looked up once, to their slots, and the move is done
+ * on those: a name that replaces another takes over its slot, and a
+ * rename within a directory rewrites the entry in place.
+ *
+ * @param from_parent Inode number of the current parent directory.
+ * @param from_name Current name.
+ * @param to_parent Inode number of the new parent directory.
+ * @param to_name New name.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_rename_at(int from_parent, const char *from_name,
+                      int to_parent, const char *to_name) {
+    inode_t *from_dir = get_inode(from_parent);
+    inode_t *to_dir = get_inode(to_parent);
+    if (!storage_is_dir(from_dir) || !storage_is_dir(to_dir)) {
+        return -ENOENT;
+    }
+    
+    // Lock both directories, lower inode number first
+    journal_begin();
+    pthread_mutex_lock(&rename_lock);
+    int first = from_parent < to_parent ? from_parent : to_parent;
+    int second = from_parent < to_parent ? to_parent : from_parent;
+    inode_wrlock(first);
+    if (second != first) {
+        inode_wrlock(second);
+    }
+    
+    int rv = 0;
+    
+    // Get source inode
+    int from_slot;
+    int to_slot;
+    int from_inum = storage_lookup_slot_locked(from_parent, from_name, &from_slot);
+    int to_inum = from_inum < 0 ? -ENOENT
+                                : storage_lookup_slot_locked(to_parent, to_name, &to_slot);
+    if (from_inum < 0) {
+        rv = -ENOENT;
+    } else if (to_inum == from_inum) {
+        rv = 0;  // Both names already refer to the same inode
+    } else if (to_inum == from_parent) {
+        rv = -ENOTEMPTY;  // Replacing an ancestor, which holds the source
+    } else if (to_inum >= 0) {
+        // Destination exists, the source takes over its entry
+        inode_wrlock(to_inum);
+        inode_t *victim = get_inode(to_inum);
+        if (S_ISDIR(victim->mode) && !directory_empty(victim)) {
+            rv = -ENOTEMPTY;
+        } else {
+            directory_replace_at(to_dir, to_slot, from_inum);
+            directory_delete_at(from_dir, from_slot);
+            victim->refs--;
+            inode_dirty(victim);
+            storage_touch(to_inum, 0, 0);
+            storage_release_inode(to_inum);
+        }
+        inode_unlock(to_inum);
+    } else if (from_parent == to_parent) {
+        if (directory_rename_at(to_dir, from_slot, to_name) < 0) {
+            rv = -ENOSPC;
+        }
+    } else if (directory_put(to_dir, to_name, from_inum) < 0) {
+        rv = -ENOSPC;
+    } else {
+        directory_delete_at(from_dir, from_slot);
+    }
+    
+    if (rv == 0 && from_inum != to_inum) {
+        storage_touch(from_parent, 0, 0);
+        storage_touch(to_parent, 0, 0);
+        storage_compact_locked(from_parent);
+    }
+    
+    if (second != first) {
+        inode_unlock(second);
+    }
+    inode_unlock(first);
+    pthread_mutex_unlock(&rename_lock);
+    journal_end();
+    return rv;
+}
+
+/**
+ * Update file access and modification times.
+ *
+ * @param path Absolute path to the file.
+ * @param ts Array of two timespec: [0] = atime, [1] = mtime.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_set_time(const char *path, const struct timespec ts[2]) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    return storage_set_time_inum(inum, ts);
+}
+
+/**
+ * Update file access and modification times by inode number.
+ *
+ * Either time may be UTIME_NOW or UTIME_OMIT.
+ *
+ * @param inum Inode number of the file.
+ * @param ts Array of two timespec: [0] = atime, [1] = mtime.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_set_time_inum(int inum, const struct timespec ts[2]) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    
+    journal_begin();
+    inode_wrlock(inum);
+    int64_t now = inode_now();
+    node->atime = storage_ns(&ts[0], now, node->atime);
+    node->mtime = storage_ns(&ts[1], now, node->mtime);
+    inode_dirty(node);
+    storage_touch(inum, 0, 0);
+    inode_unlock(inum);
+    journal_end();
+    
+    return 0;
+}
+
+/**
+ * List directory contents.
+ *
+ * Returns a linked list of all entries in the directory.
+ *
+ * @param path Absolute path to the directory.
+ *
+ * @return Linked list of filenames, or NULL if not a directory.
+ *         Caller must free with slist_free().
+ */
+slist_t *storage_list(const char *path) {
+    return directory_list(path);
+}
+
+/**
+ * List a directory in a single pass, with attributes.
+ *
+ * @param path Absolute path to the directory.
+ * @param slot Slot to start from.
+ * @param fill Called for each entry in slot order.
+ * @param ctx Passed through to fill.
+ *
+ * @return 0 on success, -ENOENT or -ENOTDIR.
+ */
+int storage_readdir(const char *path, int slot, storage_fill_t fill, void *ctx) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    return storage_readdir_inum(inum, slot, fill, ctx);
+}
+
+/**
+ * List a directory by inode number.
+ *
+ * Entries are copied out a batch at a time under the directory's lock
+ * and stat'ed after it's dropped: an entry may itself be a directory,
+ * and only one directory lock may be held without rename_lock.
+ *
+ * @param inum Inode number of the directory.
+ * @param slot Slot to start from.
+ * @param fill Called for each entry in slot order.
+ * @param ctx Passed through to fill.
+ *
+ * @return 0 on success, -ENOTDIR if the inode isn't a directory.
+ */
+int storage_readdir_inum(int inum, int slot, storage_fill_t fill, void *ctx) {
+    // Slots must stay put between batches
+    int rv = storage_opendir_inum(inum);
+    if (rv < 0) {
+        return rv;
+    }
+    
+    inode_t *dir = get_inode(inum);
+    storage_listed_t batch[STORAGE_READDIR_BATCH];
+    for (;;) {
+        int count = 0;
+        inode_rdlock(inum);
+        dir_iter_t it;
+        directory_iter_init(&it, dir, slot);
+        while (count < STORAGE_READDIR_BATCH && directory_next(&it)) {
+            strcpy(batch[count].name, it.name);
+            batch[count].inum = it.inum;
+            batch[count].next = it.slot;
+            count++;
+        }
+        inode_unlock(inum);
+        
+        for (int ii = 0; ii < count; ++ii) {
+            struct stat st;
+            if (storage_stat_inum(batch[ii].inum, &st) < 0) {
+                continue;  // Removed since the batch was copied
+            }
+            if (fill(ctx, batch[ii].name, &st, batch[ii].next) != 0) {
+                count = -1;
+                break;
+            }
+        }
+        
+        if (count < STORAGE_READDIR_BATCH) {
+            break;
+        }
+        slot = batch[count - 1].next;
+    }
+    
+    storage_releasedir_inum(inum);
+    return 0;
+}
+
+/**
+ * Open a directory for listing.
+ *
+ * @param path Absolute path to the directory.
+ *
+ * @return Inode number of the directory, -ENOENT or -ENOTDIR.
+ */
+int storage_opendir(const char *path) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    int rv = storage_opendir_inum(inum);
+    return rv < 0 ? rv : inum;
+}
+
+/**
+ * Open a directory for listing by inode number.
+ *
+ * @param inum Inode number of the directory.
+ *
+ * @return 0 on success, -ENOTDIR if the inode isn't a directory.
+ */
+int storage_opendir_inum(int inum) {
+    if (!storage_is_dir(get_inode(inum))) {
+        return -ENOTDIR;
+    }
+    
+    // Listings only start under the shared lock, so compaction can
+    // count them under the exclusive one
+    inode_rdlock(inum);
+    __atomic_add_fetch(&listers[inum], 1, __ATOMIC_RELAXED);
+    inode_unlock(inum);
+    return 0;
+}
+
+/**
+ * End a listing started with storage_opendir_inum().
+ *
+ * The last listing to end runs any compaction that waited for it.
+ *
+ * @param inum Inode number of the directory.
+ */
+void storage_releasedir_inum(int inum) {
+    if (inum < 0 || inum >= INODE_COUNT) {
+        return;
+    }
+    
+    if (__atomic_sub_fetch(&listers[inum], 1, __ATOMIC_RELAXED) > 0 ||
+        !__atomic_load_n(&compact_waiting[inum], __ATOMIC_RELAXED)) {
+        return;
+    }
+    
+    journal_begin();
+    inode_wrlock(inum);
+    if (compact_waiting[inum] && storage_is_dir(get_inode(inum))) {
+        storage_compact_locked(inum);
+    }
+    inode_unlock(inum);
+    journal_end();
+}
+
+/**
+ * Change file mode/permissions.
+ *
+ * @param path Absolute path to the file.
+ * @param mode New mode (permissions).
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_chmod(const char *path, mode_t mode) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    return storage_chmod_inum(inum, mode);
+}
+
+/**
+ * Change file mode/permissions by inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param mode New mode (permissions).
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_chmod_inum(int inum, mode_t mode) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    
+    // Preserve file type, update permissions
+    journal_begin();
+    inode_wrlock(inum);
+    __atomic_store_n(&node->mode, (node->mode & S_IFMT) | (mode & ~S_IFMT), __ATOMIC_RELAXED);
+    inode_dirty(node);
+    storage_touch(inum, 0, 0);
+    inode_unlock(inum);
+    journal_end();
+    
+    return 0;
+}
+
+/**
+ * Make a file's or directory's changes durable.
+ *
+ * @param path Absolute path to the file or directory.
+ * @param wait Nonzero to wait until the changes are on disk.
+ *
+ * @return 0 on success, -ENOENT, -ENOSPC or -EIO.
+ */
+int storage_sync(const char *path, int wait) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    return storage_sync_inum(inum, wait);
+}
+
+/**
+ * Make an inode's changes durable.
+ *
+ * The change record is only dropped once a waiting sync succeeded, so a
+ * sync that merely started the writes doesn't hide them from the next.
+ *
+ * @param inum Inode number.
+ * @param wait Nonzero to wait until the changes are on disk.
+ *
+ * @return 0 on success, -ENOENT, -ENOSPC or -EIO.
+ */
+int storage_sync_inum(int inum, int wait) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return -ENOENT;
+    }
+    
+    // Held back appends need their blocks before they can be synced
+    int rv = storage_flush_delayed(inum);
+    if (rv < 0) {
+        return rv;
+    }
+    
+    // So does an access time lazytime held back
+    if (__atomic_load_n(&atime_held[inum], __ATOMIC_RELAXED) != 0) {
+        journal_begin();
+        inode_wrlock(inum);
+        storage_flush_atime(inum);
+        inode_unlock(inum);
+        journal_end();
+    }
+    
+    inode_wrlock(inum);
+    storage_dirty_t *rec = dirty[inum];
+    if (rec == NULL) {
+        inode_unlock(inum);
+        return 0;  // Nothing changed since the last sync
+    }
+    
+    // Journaled changes are made durable by their commit, which can't
+    // happen while the inode is locked
+    if (rec->seq != 0) {
+        uint64_t seq = rec->seq;
+        if (wait) {
+            dirty[inum] = NULL;
+            free(rec);
+        }
+        inode_unlock(inum);
+        if (wait) {
+            journal_wait(seq);
+        }
+        return 0;
+    }
+    
+    if (S_ISDIR(node->mode)) {
+        rv = directory_sync(node, wait);
+    } else {
+        rv = inode_sync(node, rec->runs < 0, wait);
+        for (int ii = 0; ii < rec->runs; ++ii) {
+            rv |= blocks_sync(blocks_get_block(rec->start[ii]),
+                              (size_t)rec->count[ii] * BLOCK_SIZE, wait);
+        }
+    }
+
+    // So are the bitmaps, or the blocks and inode could be handed out
+    // again after a crash
+    rv |= blocks_sync(get_blocks_bitmap(), BLOCK_BITMAP_SIZE, wait);
+    rv |= blocks_sync(get_inode_bitmap(), (INODE_COUNT + 7) / 8, wait);
+    if (wait && rv == 0) {
+        dirty[inum] = NULL;
+        free(rec);
+    }
+    inode_unlock(inum);
+    
+    return rv < 0 ? -EIO : 0;
+}
+
+/**
+ * Hold a reference to an inode from outside the namespace.
+ *
+ * @param inum Inode number to pin.
+ */
+void storage_pin(int inum) {
+    if (inum >= 0 && inum < INODE_COUNT) {
+        // Pins only rise under the shared lock, so readers can race
+        inode_rdlock(inum);
+        __atomic_add_fetch(&pins[inum], 1, __ATOMIC_RELAXED);
+        inode_unlock(inum);
+    }
+}
+
+/**
+ * Drop references taken with storage_pin().
+ *
+ * Frees the inode if it has been unlinked and this was the last pin.
+ *
+ * @param inum Inode number to unpin.
+ * @param count Number of references to drop.
+ */
+void storage_unpin(int inum, unsigned long count) {
+    if (inum < 0 || inum >= INODE_COUNT) {
+        return;
+    }
+    
+    journal_begin();
+    inode_wrlock(inum);
+    if ((unsigned long)pins[inum] <= count) {
+        pins[inum] = 0;
+    } else {
+        pins[inum] -= count;
+    }
+    
+    if (pins[inum] == 0 && inode_allocated(inum)) {
+        storage_release_inode(inum);
+    }
+    inode_unlock(inum);
+    journal_end();
+}
+
+/**
+ * Follow a handle's reads and pick the bytes to prefetch for this one.
+ *
+ * Kernel read-ahead can hand a stream's reads to several threads, so
+ * they arrive a little out of order; a read counts as sequential if it
+ * starts within a window of where the last one ended. The prefetch is
+ * topped up once half the window past this read has been used, so that
+ * it goes out in large pieces. The caller holds handle_lock.
+ *
+ * @param handle Handle being read.
+ * @param offset Byte offset of the read.
+ * @param size Bytes asked for.
+ * @param from Receives the start of the bytes to prefetch.
+ * @param to Receives their end, equal to from if there are none.
+ */
+static void storage_readahead(storage_handle_t *handle, off_t offset, size_t size,
+                              off_t *from, off_t *to) {
+    off_t end = offset + (off_t)size;
+    off_t slack = handle->window > 0 ? handle->window : STORAGE_READAHEAD_MIN;
+    
+    if (offset > handle->next + slack || offset < handle->next - slack) {
+        handle->window = 0;
+        handle->ahead = end;
+    } else if (handle->window == 0) {
+        handle->window = STORAGE_READAHEAD_MIN;
+    } else if (handle->window < STORAGE_READAHEAD_MAX) {
+        handle->window *= 2;
+    }
+    if (end > handle->next) {
+        handle->next = end;
+    }
+    
+    if (handle->window == 0) {
+        return;
+    }
+    if (handle->ahead < end) {
+        handle->ahead = end;
+    }
+    if (handle->ahead - end > handle->window / 2) {
+        return;
+    }
+    *from = handle->ahead;
+    *to = end + handle->window;
+    handle->ahead = *to;
+}
+
+/**
+ * Look up a handle about to be read, and follow the read for read-ahead.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param size Bytes asked for.
+ * @param offset Byte offset of the read.
+ * @param from Receives the start of the bytes to prefetch.
+ * @param to Receives their end, equal to from if there are none.
+ *
+ * @return Inode number, or -EBADF if the handle is not open.
+ */
+static int storage_handle_read(uint64_t fh, size_t size, off_t offset, off_t *from, off_t *to) {
+    int inum = -EBADF;
+    
+    pthread_mutex_lock(&handle_lock);
+    if (fh < (uint64_t)handle_count && handles[fh].inum >= 0) {
+        inum = handles[fh].inum;
+        storage_readahead(&handles[fh], offset, size, from, to);
+    }
+    pthread_mutex_unlock(&handle_lock);
+    
+    return inum;
+}
+
+/**
+ * Start reading the blocks behind part of a file.
+ *
+ * Holes and bytes past the size on disk are skipped.
+ *
+ * @param inum Inode number of the file.
+ * @param offset Byte offset of the part.
+ * @param len Length of the part in bytes.
+ */
+static void storage_prefetch(int inum, off_t offset, off_t len) {
+    inode_t *node = get_inode(inum);
+    if (node == NULL) {
+        return;
+    }
+    
+    inode_rdlock(inum);
+    off_t end = offset + len < node->size ? offset + len : node->size;
+    if (!inode_is_inline(node) && offset < end) {
+        int file_block = offset / BLOCK_SIZE;
+        int last = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        while (file_block < last) {
+            int bnum;
+            int run = inode_map_range(node, file_block, last - file_block, &bnum);
+            if (run <= 0) {
+                break;
+            }
+            if (bnum != 0) {
+                blocks_prefetch(bnum, run);
+            }
+            file_block += run;
+        }
+    }
+    inode_unlock(inum);
+}
+
+/**
+ * Get the inode number behind an open file handle.
+ *
+ * @param fh File handle returned by storage_open().
+ *
+ * @return Inode number, or -EBADF if the handle is not open.
+ */
+static int storage_handle_inum(uint64_t fh) {
+    int inum = -EBADF;
+    
+    pthread_mutex_lock(&handle_lock);
+    if (fh < (uint64_t)handle_count && handles[fh].inum >= 0) {
+        inum = handles[fh].inum;
+    }
+    pthread_mutex_unlock(&handle_lock);
+    
+    return inum;
+}
+
+/**
+ * Get the inode number behind a file handle that was opened for writing.
+ *
+ * @param fh File handle returned by storage_open().
+ *
+ * @return Inode number, or -EBADF if the handle is not open or is
+ *         read-only.
+ */
+static int storage_handle_write_inum(uint64_t fh) {
+    int inum = -EBADF;
+    
+    pthread_mutex_lock(&handle_lock);
+    if (fh < (uint64_t)handle_count && handles[fh].inum >= 0 &&
+        (handles[fh].flags & O_ACCMODE) != O_RDONLY) {
+        inum = handles[fh].inum;
+    }
+    pthread_mutex_unlock(&handle_lock);
+    
+    return inum;
+}
+
+/**
+ * Open a file, returning a handle for the _fh operations.
+ *
+ * The path is resolved once here. The inode stays pinned until the
+ * handle is released, so it outlives an unlink of its last name.
+ *
+ * @param path Absolute path to the file.
+ * @param flags open(2) flags.
+ *
+ * @return File handle (>= 0) on success, negative error on fail.
+ */
+int storage_open(const char *path, int flags) {
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return -ENOENT;
+    }
+    
+    return storage_open_inum(inum, flags);
+}
+
+/**
+ * Open a file by inode number, returning a handle for the _fh operations.
+ *
+ * @param inum Inode number of the file.
+ * @param flags open(2) flags.
+ *
+ * @return File handle (>= 0) on success, negative error on fail.
+ */
+int storage_open_inum(int inum, int flags) {
+    if (get_inode(inum) == NULL) {
+        return -ENOENT;
+    }
+    
+    pthread_mutex_lock(&handle_lock);
+    int fh = handle_hint;
+    while (fh < handle_count && handles[fh].inum >= 0) {
+        fh++;
+    }
+    
+    // Table is full, double it
+    if (fh == handle_count) {
+        int new_count = handle_count ? handle_count * 2 : 16;
+        storage_handle_t *grown = realloc(handles, new_count * sizeof(storage_handle_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&handle_lock);
+            return -ENOMEM;
+        }
+        for (int ii = handle_count; ii < new_count; ++ii) {
+            grown[ii].inum = -1;
+        }
+        handles = grown;
+        handle_count = new_count;
+    }
+    
+    handles[fh].inum = inum;
+    handles[fh].flags = flags;
+    handles[fh].next = 0;
+    handles[fh].ahead = 0;
+    handles[fh].window = 0;
+    handle_hint = fh + 1;
+    pthread_mutex_unlock(&handle_lock);
+    storage_pin(inum);
+    
+    return fh;
+}
+
+/**
+ * Release a file handle.
+ *
+ * @param fh File handle returned by storage_open().
+ *
+ * @return 0 on success, -EBADF if the handle is not open, or -ENOSPC.
+ */
+int storage_release_fh(uint64_t fh) {
+    pthread_mutex_lock(&handle_lock);
+    if (fh >= (uint64_t)handle_count || handles[fh].inum < 0) {
+        pthread_mutex_unlock(&handle_lock);
+        return -EBADF;
+    }
+    
+    int inum = handles[fh].inum;
+    handles[fh].inum = -1;
+    if ((int)fh < handle_hint) {
+        handle_hint = fh;
+    }
+    pthread_mutex_unlock(&handle_lock);
+    int rv = storage_flush_delayed(inum);
+    storage_unpin(inum, 1);
+    
+    return rv;
+}
+
+/**
+ * Get attributes of an open file.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param st Pointer to stat structure to fill.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_stat_fh(uint64_t fh, struct stat *st) {
+    int inum = storage_handle_inum(fh);
+    if (inum < 0) {
+        return inum;
+    }
+    return storage_stat_inum(inum, st);
+}
+
+/**
+ * Read data from an open file.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param buf Buffer to read data into.
+ * @param size Maximum number of bytes to read.
+ * @param offset Byte offset in the file to start reading from.
+ *
+ * @return Number of bytes read, or negative error code.
+ */
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset) {
+    off_t from = 0;
+    off_t to = 0;
+    int inum = storage_handle_read(fh, size, offset, &from, &to);
+    if (inum < 0) {
+        return inum;
+    }
+    
+    int rv = storage_read_inum(inum, buf, size, offset);
+    if (rv > 0 && to > from) {
+        storage_prefetch(inum, from, to - from);
+    }
+    return rv;
+}
+
+/**
+ * Read data from an open file without copying it.
+ *
+ * Holes come from a run of zeros in memory and appends held back from
+ * their buffer. A run of blocks goes out as a range of the image file
+ * where blocks_file_backed() says so, and in memory otherwise.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param size Maximum number of bytes to read.
+ * @param offset Byte offset in the file to start reading from.
+ * @param iov Receives the pieces, room for STORAGE_IOV_MAX(size).
+ * @param count Receives the number of pieces.
+ * @param flags 0 or STORAGE_IOV_UNLOCKED.
+ *
+ * @return Number of bytes read, or negative error code.
+ */
+int storage_read_iov_fh(uint64_t fh, size_t size, off_t offset, storage_iov_t *iov, int *count,
+                        int flags) {
+    off_t from = 0;
+    off_t to = 0;
+    int inum = storage_handle_read(fh, size, offset, &from, &to);
+    if (inum < 0) {
+        return inum;
+    }
+    if (to > from) {
+        storage_prefetch(inum, from, to - from);
+    }
+    
+    inode_t *node = get_inode(inum);
+    journal_begin();
+    inode_rdlock(inum);
+    
+    // Limit read size to the data there is
+    int file_size = storage_size(inum);
+    if (offset >= file_size) {
+        size = 0;
+    } else if (offset + (off_t)size > file_size) {
+        size = file_size - offset;
+    }
+    
+    // Bytes past the size on disk are still held back in memory
+    size_t on_disk = 0;
+    if (offset < node->size) {
+        on_disk = offset + (off_t)size > node->size ? (size_t)(node->size - offset) : size;
+    }
+    
+    // Freed blocks of an unjournaled image can be reused at once
+    int in_file = (flags & STORAGE_IOV_UNLOCKED) == 0 || blocks_super()->journal_blocks != 0;
+    int pieces = 0;
+    size_t bytes_read = 0;
+    if (inode_is_inline(node) && on_disk > 0) {
+        iov[pieces++] = (storage_iov_t){inode_inline_data(node) + offset, -1, 0, on_disk};
+        bytes_read = on_disk;
+    }
+    
+    while (bytes_read < on_disk) {
+        int file_block = (offset + bytes_read) / BLOCK_SIZE;
+        int block_offset = (offset + bytes_read) % BLOCK_SIZE;
+        int want = bytes_to_blocks(block_offset + (on_disk - bytes_read));
+        
+        int bnum;
+        int run = inode_map_range(node, file_block, want, &bnum);
+        if (run <= 0) {
+            break;  // No more blocks
+        }
+        
+        size_t len = (size_t)run * BLOCK_SIZE - block_offset;
+        if (len > on_disk - bytes_read) {
+            len = on_disk - bytes_read;
+        }
+        int blocks = bytes_to_blocks(block_offset + len);
+        
+        storage_iov_t *piece = &iov[pieces++];
+        *piece = (storage_iov_t){NULL, -1, 0, len};
+        if (bnum == 0) {
+            // A long hole takes more than one piece of zeros
+            if (len > sizeof(storage_zeros)) {
+                len = sizeof(storage_zeros);
+                piece->len = len;
+            }
+            piece->data = storage_zeros;
+        } else if (in_file && blocks_file_backed(bnum, blocks)) {
+            piece->fd = blocks_file();
+            piece->pos = (off_t)BLOCK_SIZE * bnum + block_offset;
+        } else {
+            piece->data = (char *)blocks_get_blocks(bnum, blocks) + block_offset;
+        }
+        
+        bytes_read += len;
+    }
+    
+    if (bytes_read == on_disk && size > on_disk) {
+        off_t held = offset + (off_t)on_disk - node->size;
+        iov[pieces++] = (storage_iov_t){delayed[inum]->buf + held, -1, 0, size - on_disk};
+        bytes_read = size;
+    }
+    
+    storage_read_atime(inum, node);
+    TRACE_EVENT(TRACE_READ, inum, offset, bytes_read);
+    *count = pieces;
+    return bytes_read;
+}
+
+/**
+ * Finish a read started with storage_read_iov_fh().
+ *
+ * @param fh File handle the read was made through.
+ */
+void storage_read_iov_end(uint64_t fh) {
+    inode_unlock(storage_handle_inum(fh));
+    journal_end();
+}
+
+/**
+ * Write data to an open file.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param buf Buffer containing data to write.
+ * @param size Number of bytes to write.
+ * @param offset Byte offset in the file to start writing at.
+ *
+ * @return Number of bytes written, or negative error code.
+ */
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset) {
+    int inum = storage_handle_inum(fh);
+    if (inum < 0) {
+        return inum;
+    }
+    return storage_write_inum(inum, buf, size, offset);
+}
+
+/**
+ * Truncate an open file to the given size.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param size New size in bytes.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_truncate_fh(uint64_t fh, off_t size) {
+    int inum = storage_handle_inum(fh);
+    if (inum < 0) {
+        return inum;
+    }
+    return storage_truncate_inum(inum, size);
+}
+
+/**
+ * Make an open file's changes durable.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param wait Nonzero to wait until the changes are on disk.
+ *
+ * @return 0 on success, -EBADF or -EIO.
+ */
+int storage_sync_fh(uint64_t fh, int wait) {
+    int inum = storage_handle_inum(fh);
+    if (inum < 0) {
+        return inum;
+    }
+    return storage_sync_inum(inum, wait);
+}
+
+/**
+ * Find the next data or hole in an open file.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param offset Byte offset to search from.
+ * @param whence SEEK_DATA or SEEK_HOLE.
+ *
+ * @return Offset found, -ENXIO, -EINVAL or -EBADF.
+ */
+off_t storage_seek_fh(uint64_t fh, off_t offset, int whence) {
+    int inum = storage_handle_inum(fh);
+    if (inum < 0) {
+        return inum;
+    }
+    return storage_seek_inum(inum, offset, whence);
+}
+
+/**
+ * Copy a byte range from a file into an open file.
+ *
+ * @param from Absolute path to the source.
+ * @param from_offset Byte offset in the source to copy from.
+ * @param fh File handle of the destination, returned by storage_open()
+ *           for writing.
+ * @param offset Byte offset in the destination to copy to.
+ * @param size Number of bytes to copy.
+ *
+ * @return Bytes copied, or a negative error code.
+ */
+int storage_copy_range_fh(const char *from, off_t from_offset, uint64_t fh, off_t offset,
+                          size_t size) {
+    int inum = storage_handle_write_inum(fh);
+    if (inum < 0) {
+        return inum;
+    }
+    int src = tree_lookup(from);
+    if (src < 0) {
+        return -ENOENT;
+    }
+    return storage_copy_range_inum(src, from_offset, inum, offset, size);
+}
+
+/**
+ * Make an open file a clone of another file.
+ *
+ * @param from Absolute path to the file to clone.
+ * @param fh File handle of the file to replace, returned by storage_open()
+ *           for writing.
+ *
+ * @return 0 on success, or a negative error code.
+ */
+int storage_clone_fh(const char *from, uint64_t fh) {
+    int inum = storage_handle_write_inum(fh);
+    if (inum < 0) {
+        return inum;
+    }
+    int src = tree_lookup(from);
+    if (src < 0) {
+        return -ENOENT;
+    }
+    return storage_clone_inum(src, inum);
+}
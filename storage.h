@@ -6,27 +6,121 @@
  * All paths are absolute (starting with '/')
  * The filesystem is initialized before any operations are called
  * Maximum file size is limited by available blocks
+ * Everything but storage_mkfs() and storage_init() may be called from
+ * several threads at once
  */
 #ifndef NUFS_STORAGE_H
 #define NUFS_STORAGE_H
 
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "helpers/slist.h"
 
+// Geometry for images created without mkfs: 1MB of 4K blocks
+#define STORAGE_DEFAULT_BLOCK_SIZE 4096
+#define STORAGE_DEFAULT_BLOCK_COUNT 256
+#define STORAGE_DEFAULT_INODE_COUNT 128
+
+// Inode record size for new images: the fields leave 192 bytes inline
+#define STORAGE_DEFAULT_INODE_SIZE 256
+#define STORAGE_DEFAULT_JOURNAL_BLOCKS 16
+
+// Age past which relatime updates an access time anyway, and lazytime
+// writes a held back one out: 24 hours in ns
+#define STORAGE_ATIME_AGE (24LL * 3600 * 1000000000)
+
+// Bytes read ahead of a handle once its reads look sequential: the
+// window starts at the first size and doubles with each sequential read
+// up to the second
+#define STORAGE_READAHEAD_MIN (128 * 1024)
+#define STORAGE_READAHEAD_MAX (1024 * 1024)
+
+/**
+ * A piece of a read from storage_read_iov_fh().
+ *
+ * Fields:
+ * - data: The bytes in memory, or NULL if they're in the image file
+ * - fd: Image file descriptor, when data is NULL
+ * - pos: Byte offset of the bytes in the image file, when data is NULL
+ * - len: Number of bytes
+ */
+typedef struct storage_iov {
+    const char *data;
+    int fd;
+    off_t pos;
+    size_t len;
+} storage_iov_t;
+
+// Most pieces a read of size bytes comes in: one per block it spans at
+// worst, blocks being 4K or more, and one for appends held in memory
+#define STORAGE_IOV_MAX(size) ((size) / 4096 + 3)
+
+// storage_read_iov_fh() flag: the pieces are used after the read ends
+#define STORAGE_IOV_UNLOCKED 1
+
+/**
+ * Format a disk image with the given geometry.
+ *
+ * Writes a superblock and empty bitmaps and inode table, discarding any
+ * previous contents. The root directory is created by the next
+ * storage_init().
+ *
+ * @param path Path to the disk image file.
+ * @param block_size Bytes per block, a power of two from 4K to 64K.
+ * @param block_count Blocks in the image, a multiple of 8.
+ * @param inode_count Inodes in the inode table.
+ * @param inode_size Bytes per inode record, a power of two no smaller
+ *                   than the inode's fields and no larger than a block.
+ *                   Files that fit in what the fields leave are stored
+ *                   inline.
+ * @param journal_blocks Blocks reserved for the journal, 0 for an image
+ *                       without one.
+ *
+ * @return 0 on success, -EINVAL for a bad geometry or an I/O failure.
+ */
+int storage_mkfs(const char *path, int block_size, int block_count, int inode_count,
+                 int inode_size, int journal_blocks);
+
 /**
  * Initialize the storage system.
  *
  * Sets up the disk image, inode table, and root directory.
- * Creates the disk image file if it doesn't exist.
+ * Creates the disk image file with the default geometry if it doesn't
+ * exist. Images formatted before superblocks existed are mounted in
+ * the legacy 1MB layout. On images with a journal, committed
+ * transactions are replayed first and the journal runs until the next
+ * storage_init() or exit.
  *
  * @param path Path to the disk image file.
  */
 void storage_init(const char *path);
 
+/**
+ * Apply a mount option of the storage layer.
+ *
+ * The options choose how reads update access times:
+ * - strictatime: on every read, the default
+ * - relatime: only if the access time isn't after the modification
+ *   time, or is STORAGE_ATIME_AGE old
+ * - noatime: never
+ * - lazytime: whichever of the above is chosen, the new access time is
+ *   only kept in memory; it goes to disk with the inode's next other
+ *   change, an fsync of the file, a read STORAGE_ATIME_AGE after it was
+ *   held back, or unmount (nolazytime turns this off again)
+ *
+ * Stays in effect across storage_init() calls.
+ *
+ * @param option Option name, as given to -o.
+ *
+ * @return 0 if the option was applied, -1 if it isn't one of these.
+ */
+int storage_option(const char *option);
+
 /**
  * Get file/directory attributes.
  *
@@ -59,7 +153,9 @@ int storage_read(const char *path, char *buf, size_t size, off_t offset);
  * Write data to a file.
  *
  * Writes 'size' bytes from 'buf' to the file at 'offset'.
- * Grows the file if necessary.
+ * Grows the file if necessary. Appends may be held in memory and only
+ * given blocks when the file is synced, truncated or released; reads
+ * and stat see them all the same.
  *
  * @param path Absolute path to the file.
  * @param buf Buffer containing data to write.
@@ -108,6 +204,26 @@ int storage_mknod(const char *path, int mode);
  */
 int storage_unlink(const char *path);
 
+/**
+ * Remove an empty directory.
+ *
+ * @param path Absolute path to the directory.
+ *
+ * @return 0 on success, -ENOTDIR if it isn't a directory, -ENOTEMPTY if
+ *         it still has entries, or another negative error.
+ */
+int storage_rmdir(const char *path);
+
+/**
+ * Remove an empty directory from the given directory.
+ *
+ * @param parent Inode number of the parent directory.
+ * @param name Name of the directory to remove.
+ *
+ * @return 0 on success, -ENOTDIR, -ENOTEMPTY or another negative error.
+ */
+int storage_rmdir_at(int parent, const char *name);
+
 /**
  * Create a hard link.
  *
@@ -116,7 +232,8 @@ int storage_unlink(const char *path);
  * @param from Absolute path to existing file.
  * @param to Absolute path for the new link.
  *
- * @return 0 on success, negative error on fail.
+ * @return 0 on success, -EMLINK if the file has INODE_MAX_LINKS links
+ *         already, or another negative error.
  */
 int storage_link(const char *from, const char *to);
 
@@ -136,6 +253,9 @@ int storage_rename(const char *from, const char *to);
 /**
  * Update file access and modification times.
  *
+ * Times are kept to the nanosecond; either may be UTIME_NOW or
+ * UTIME_OMIT.
+ *
  * @param path Absolute path to the file.
  * @param ts Array of two timespec: [0] = atime, [1] = mtime.
  *
@@ -155,6 +275,32 @@ int storage_set_time(const char *path, const struct timespec ts[2]);
  */
 slist_t *storage_list(const char *path);
 
+/**
+ * Callback for storage_readdir(), called once per entry.
+ *
+ * @param ctx Caller's context pointer.
+ * @param name Entry name, only valid during the call.
+ * @param st Attributes of the entry's inode.
+ * @param next Slot to pass to storage_readdir() to resume after this entry.
+ *
+ * @return 0 to keep listing, nonzero to stop.
+ */
+typedef int (*storage_fill_t)(void *ctx, const char *name, const struct stat *st, int next);
+
+/**
+ * List a directory in a single pass, with attributes.
+ *
+ * No lock is held while fill runs, so it may call back into storage.
+ *
+ * @param path Absolute path to the directory.
+ * @param slot Slot to start from: 0, or a next value from an earlier call.
+ * @param fill Called for each entry in slot order.
+ * @param ctx Passed through to fill.
+ *
+ * @return 0 on success, -ENOENT or -ENOTDIR.
+ */
+int storage_readdir(const char *path, int slot, storage_fill_t fill, void *ctx);
+
 /**
  * Change file mode/permissions.
  *
@@ -165,5 +311,463 @@ slist_t *storage_list(const char *path);
  */
 int storage_chmod(const char *path, mode_t mode);
 
-#endif
+/**
+ * Look up a name in a directory.
+ *
+ * @param parent Inode number of the directory.
+ * @param name Name to look up.
+ *
+ * @return Inode number on success, -ENOENT if not found.
+ */
+int storage_lookup(int parent, const char *name);
+
+/**
+ * Get file/directory attributes by inode number.
+ *
+ * @param inum Inode number.
+ * @param st Pointer to stat structure to fill.
+ *
+ * @return 0 on success, -ENOENT if the inode doesn't exist.
+ */
+int storage_stat_inum(int inum, struct stat *st);
+
+/**
+ * Get filesystem statistics.
+ *
+ * Fills in the block size, total, free and available blocks, total and
+ * free inodes and the longest name. Blocks count only the data area;
+ * blocks freed in the running journal transaction are counted as free,
+ * those set aside for held back appends aren't. Takes no inode locks and
+ * costs the same however full the image is.
+ *
+ * @param st Pointer to statvfs structure to fill.
+ *
+ * @return 0.
+ */
+int storage_statfs(struct statvfs *st);
+
+/**
+ * Get an inode's generation number.
+ *
+ * Together with the inode number it names one file for the life of the
+ * image, even after the number is reused.
+ *
+ * @param inum Inode number.
+ *
+ * @return Generation, 0 if the number is out of range.
+ */
+unsigned storage_generation_inum(int inum);
+
+/**
+ * List a directory by inode number, see storage_readdir().
+ *
+ * @param inum Inode number of the directory.
+ * @param slot Slot to start from.
+ * @param fill Called for each entry in slot order.
+ * @param ctx Passed through to fill.
+ *
+ * @return 0 on success, -ENOTDIR if the inode isn't a directory.
+ */
+int storage_readdir_inum(int inum, int slot, storage_fill_t fill, void *ctx);
+
+/**
+ * Open a directory for listing.
+ *
+ * Until the matching storage_releasedir_inum(), the directory isn't
+ * compacted, so slots passed between storage_readdir() calls keep
+ * naming the same entries.
+ *
+ * @param path Absolute path to the directory.
+ *
+ * @return Inode number of the directory, -ENOENT or -ENOTDIR.
+ */
+int storage_opendir(const char *path);
+
+/**
+ * Open a directory for listing by inode number, see storage_opendir().
+ *
+ * @param inum Inode number of the directory.
+ *
+ * @return 0 on success, -ENOTDIR if the inode isn't a directory.
+ */
+int storage_opendir_inum(int inum);
+
+/**
+ * End a listing started with storage_opendir() or storage_opendir_inum().
+ *
+ * Directories that lost most of their entries while listed are compacted
+ * once the last listing ends.
+ *
+ * @param inum Inode number of the directory.
+ */
+void storage_releasedir_inum(int inum);
+
+/**
+ * Read data from a file by inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param buf Buffer to read data into.
+ * @param size Maximum number of bytes to read.
+ * @param offset Byte offset in the file to start reading from.
+ *
+ * @return Number of bytes read, or negative error code.
+ */
+int storage_read_inum(int inum, char *buf, size_t size, off_t offset);
 
+/**
+ * Write data to a file by inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param buf Buffer containing data to write.
+ * @param size Number of bytes to write.
+ * @param offset Byte offset in the file to start writing at.
+ *
+ * @return Number of bytes written, or negative error code.
+ */
+int storage_write_inum(int inum, const char *buf, size_t size, off_t offset);
+
+/**
+ * Truncate a file to the given size by inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param size New size in bytes.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_truncate_inum(int inum, off_t size);
+
+/**
+ * Find the next data or hole in a file, as lseek(2) does.
+ *
+ * Holes are found at block granularity; the end of the file counts as
+ * one. Appends still held in memory are data.
+ *
+ * @param inum Inode number of the file.
+ * @param offset Byte offset to search from.
+ * @param whence SEEK_DATA or SEEK_HOLE.
+ *
+ * @return Offset of the first data or hole at or after offset, -ENXIO
+ *         if offset is past the end (or, for SEEK_DATA, only a hole
+ *         follows), -EINVAL or -ENOENT.
+ */
+off_t storage_seek_inum(int inum, off_t offset, int whence);
+
+/**
+ * Copy a byte range from one file to another, as copy_file_range(2) does.
+ *
+ * Blocks that start at the same offset within a block in both files are
+ * shared rather than copied, holes included, so aligned copies only cost
+ * pointer tables; a file that writes a shared block gets a copy of its
+ * own first. The destination grows to cover the range. Images from
+ * before version 5 of the format can't share, and copy everything.
+ *
+ * @param src Inode number of the source.
+ * @param src_offset Byte offset in the source to copy from.
+ * @param dst Inode number of the destination, may be src.
+ * @param dst_offset Byte offset in the destination to copy to.
+ * @param size Number of bytes to copy.
+ *
+ * @return Bytes copied, short if the source ends first or the disk fills
+ *         up; or -ENOENT, -EISDIR, -EINVAL (not regular files, or the
+ *         ranges overlap within one file), -EFBIG or -ENOSPC.
+ */
+int storage_copy_range_inum(int src, off_t src_offset, int dst, off_t dst_offset,
+                            size_t size);
+
+/**
+ * Make a file a clone of another, as the FICLONE ioctl does.
+ *
+ * The destination's contents are replaced by the source's, sharing all
+ * of its blocks (see storage_copy_range_inum()).
+ *
+ * @param src Inode number of the file to clone.
+ * @param dst Inode number of the file to replace the contents of.
+ *
+ * @return 0 on success, -EOPNOTSUPP on images from before version 5,
+ *         -ENOENT, -EISDIR, -EINVAL (not regular files, or the same
+ *         file) or -ENOSPC.
+ */
+int storage_clone_inum(int src, int dst);
+
+/**
+ * Create a new file or directory in the given directory.
+ *
+ * @param parent Inode number of the parent directory.
+ * @param name Name of the new entry.
+ * @param mode File type and permissions.
+ *
+ * @return Inode number of the new object, or negative error on fail.
+ */
+int storage_mknod_at(int parent, const char *name, int mode);
+
+/**
+ * Delete a name from the given directory.
+ *
+ * The inode itself is freed once it has no links and no pins.
+ *
+ * @param parent Inode number of the parent directory.
+ * @param name Name of the entry to delete.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_unlink_at(int parent, const char *name);
+
+/**
+ * Create a hard link to an inode in the given directory.
+ *
+ * @param inum Inode number of the existing file.
+ * @param parent Inode number of the directory for the new link.
+ * @param name Name of the new link.
+ *
+ * @return 0 on success, -EMLINK at INODE_MAX_LINKS links, or another
+ *         negative error.
+ */
+int storage_link_at(int inum, int parent, const char *name);
+
+/**
+ * Rename or move a directory entry.
+ *
+ * @param from_parent Inode number of the current parent directory.
+ * @param from_name Current name.
+ * @param to_parent Inode number of the new parent directory.
+ * @param to_name New name.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_rename_at(int from_parent, const char *from_name,
+                      int to_parent, const char *to_name);
+
+/**
+ * Update file access and modification times by inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param ts Array of two timespec: [0] = atime, [1] = mtime.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_set_time_inum(int inum, const struct timespec ts[2]);
+
+/**
+ * Change file mode/permissions by inode number.
+ *
+ * @param inum Inode number of the file.
+ * @param mode New mode (permissions).
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_chmod_inum(int inum, mode_t mode);
+
+/**
+ * Make a file's or directory's changes durable.
+ *
+ * Only what the inode changed since its last sync is written: the data
+ * blocks it wrote, its inode and pointer tables, and for a directory its
+ * dirent and index blocks. An inode with no changes returns at once.
+ * On a journaled image this waits for the commit holding its latest
+ * change, which also makes every earlier operation durable.
+ *
+ * @param path Absolute path to the file or directory.
+ * @param wait Nonzero to wait until the changes are on disk, 0 to only
+ *             start writing them.
+ *
+ * @return 0 on success, -ENOENT, -ENOSPC or -EIO.
+ */
+int storage_sync(const char *path, int wait);
+
+/**
+ * Make an inode's changes durable, see storage_sync().
+ *
+ * @param inum Inode number.
+ * @param wait Nonzero to wait until the changes are on disk, 0 to only
+ *             start writing them.
+ *
+ * @return 0 on success, -ENOENT, -ENOSPC or -EIO.
+ */
+int storage_sync_inum(int inum, int wait);
+
+/**
+ * Hold a reference to an inode from outside the namespace.
+ *
+ * A pinned inode survives the removal of its last link until it is
+ * unpinned, e.g. while the kernel still knows its node ID.
+ *
+ * @param inum Inode number to pin.
+ */
+void storage_pin(int inum);
+
+/**
+ * Drop references taken with storage_pin().
+ *
+ * @param inum Inode number to unpin.
+ * @param count Number of references to drop.
+ */
+void storage_unpin(int inum, unsigned long count);
+
+/**
+ * Open a file, returning a handle for the _fh operations.
+ *
+ * The path is resolved once, later operations on the handle go straight
+ * to the inode. The inode stays pinned until the handle is released.
+ *
+ * @param path Absolute path to the file.
+ * @param flags open(2) flags.
+ *
+ * @return File handle (>= 0) on success, negative error on fail.
+ */
+int storage_open(const char *path, int flags);
+
+/**
+ * Open a file by inode number, returning a handle for the _fh operations.
+ *
+ * @param inum Inode number of the file.
+ * @param flags open(2) flags.
+ *
+ * @return File handle (>= 0) on success, negative error on fail.
+ */
+int storage_open_inum(int inum, int flags);
+
+/**
+ * Release a file handle.
+ *
+ * Appends to the file still held in memory are given their blocks.
+ *
+ * @param fh File handle returned by storage_open().
+ *
+ * @return 0 on success, -EBADF if the handle is not open, or -ENOSPC.
+ */
+int storage_release_fh(uint64_t fh);
+
+/**
+ * Get attributes of an open file.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param st Pointer to stat structure to fill.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_stat_fh(uint64_t fh, struct stat *st);
+
+/**
+ * Read data from an open file.
+ *
+ * The handle remembers where its last read ended. While reads keep
+ * starting near there, the blocks of the next STORAGE_READAHEAD_MIN to
+ * STORAGE_READAHEAD_MAX bytes are prefetched with blocks_prefetch(); a
+ * read elsewhere starts the window over.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param buf Buffer to read data into.
+ * @param size Maximum number of bytes to read.
+ * @param offset Byte offset in the file to start reading from.
+ *
+ * @return Number of bytes read, or negative error code.
+ */
+int storage_read_fh(uint64_t fh, char *buf, size_t size, off_t offset);
+
+/**
+ * Read data from an open file without copying it.
+ *
+ * The bytes are handed out as pieces, in file order: each is either in
+ * memory or a range of the image file (data NULL, read from fd at pos),
+ * for the caller to send on as they are. The file stays read locked
+ * until storage_read_iov_end(), which must follow on the same thread;
+ * memory pieces are only valid until then. With STORAGE_IOV_UNLOCKED
+ * in flags, file ranges stay valid after it too: they are only handed
+ * out on a journaled image, whose freed blocks aren't reused before the
+ * next commit, and the rest comes in memory. Reads ahead like
+ * storage_read_fh().
+ *
+ * @param fh File handle returned by storage_open().
+ * @param size Maximum number of bytes to read.
+ * @param offset Byte offset in the file to start reading from.
+ * @param iov Receives the pieces, room for STORAGE_IOV_MAX(size).
+ * @param count Receives the number of pieces.
+ * @param flags 0 or STORAGE_IOV_UNLOCKED.
+ *
+ * @return Number of bytes read, or negative error code, in which case
+ *         storage_read_iov_end() must not be called.
+ */
+int storage_read_iov_fh(uint64_t fh, size_t size, off_t offset, storage_iov_t *iov, int *count,
+                        int flags);
+
+/**
+ * Finish a read started with storage_read_iov_fh().
+ *
+ * @param fh File handle the read was made through.
+ */
+void storage_read_iov_end(uint64_t fh);
+
+/**
+ * Write data to an open file.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param buf Buffer containing data to write.
+ * @param size Number of bytes to write.
+ * @param offset Byte offset in the file to start writing at.
+ *
+ * @return Number of bytes written, or negative error code.
+ */
+int storage_write_fh(uint64_t fh, const char *buf, size_t size, off_t offset);
+
+/**
+ * Truncate an open file to the given size.
+ *
+ * @param fh File handle returned by storage_open().
+ * @param size New size in bytes.
+ *
+ * @return 0 on success, negative error on fail.
+ */
+int storage_truncate_fh(uint64_t fh, off_t size);
+
+/**
+ * Make an open file's changes durable, see storage_sync().
+ *
+ * @param fh Handle returned by storage_open().
+ * @param wait Nonzero to wait until the changes are on disk, 0 to only
+ *             start writing them.
+ *
+ * @return 0 on success, -EBADF or -EIO.
+ */
+int storage_sync_fh(uint64_t fh, int wait);
+
+/**
+ * Find the next data or hole in an open file, see storage_seek_inum().
+ *
+ * @param fh File handle returned by storage_open().
+ * @param offset Byte offset to search from.
+ * @param whence SEEK_DATA or SEEK_HOLE.
+ *
+ * @return Offset found, -ENXIO, -EINVAL or -EBADF.
+ */
+off_t storage_seek_fh(uint64_t fh, off_t offset, int whence);
+
+/**
+ * Copy a byte range from a file into an open file, see
+ * storage_copy_range_inum().
+ *
+ * @param from Absolute path to the source.
+ * @param from_offset Byte offset in the source to copy from.
+ * @param fh File handle of the destination, returned by storage_open()
+ *           for writing.
+ * @param offset Byte offset in the destination to copy to.
+ * @param size Number of bytes to copy.
+ *
+ * @return Bytes copied, or a negative error code (-EBADF for a handle
+ *         that isn't open or is read-only).
+ */
+int storage_copy_range_fh(const char *from, off_t from_offset, uint64_t fh, off_t offset,
+                          size_t size);
+
+/**
+ * Make an open file a clone of another file, see storage_clone_inum().
+ *
+ * @param from Absolute path to the file to clone.
+ * @param fh File handle of the file to replace, returned by storage_open()
+ *           for writing.
+ *
+ * @return 0 on success, or a negative error code (-EBADF for a handle
+ *         that isn't open or is read-only).
+ */
+int storage_clone_fh(const char *from, uint64_t fh);
+
+#endif
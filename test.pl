@@ -2,7 +2,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 34;
+use Test::Simple tests => 59;
 use IO::Handle;
 
 sub mount {
@@ -41,6 +41,54 @@ sub read_text_slice {
     return $data;
 }
 
+sub write_bytes {
+    my ($name, $data) = @_;
+    open my $fh, ">", "mnt/$name" or return;
+    binmode $fh;
+    print $fh $data;
+    close $fh;
+}
+
+sub read_bytes {
+    my ($name) = @_;
+    open my $fh, "<", "mnt/$name" or return "";
+    binmode $fh;
+    local $/ = undef;
+    my $data = <$fh> // "";
+    close $fh;
+    return $data;
+}
+
+# ioctl numbers as nufs_ioctl.h builds them: _IOWR is direction 3
+sub nufs_ioc {
+    my ($dir, $nr, $size) = @_;
+    return ($dir << 30) | ($size << 16) | (ord("N") << 8) | $nr;
+}
+
+my $NUFS_IOC_SEEK_DATA = nufs_ioc(3, 1, 8);
+my $NUFS_IOC_SEEK_HOLE = nufs_ioc(3, 2, 8);
+
+sub nufs_seek {
+    my ($name, $cmd, $offset) = @_;
+    open my $fh, "<", "mnt/$name" or return -1;
+    my $arg = pack("q", $offset);
+    my $done = ioctl($fh, $cmd, $arg);
+    close $fh;
+    return $done ? unpack("q", $arg) : -1;
+}
+
+# Copy or clone the file at a mount path into an open file; returns the
+# bytes copied, or -1 with $! set
+my $NUFS_IOC_COPY_RANGE = nufs_ioc(3, 3, 3 * 8 + 4096);
+my $NUFS_IOC_CLONE = nufs_ioc(1, 4, 3 * 8 + 4096);
+
+sub nufs_copy {
+    my ($fh, $cmd, $src, $src_offset, $dst_offset, $length) = @_;
+    my $arg = pack("q q q Z4096", $src_offset, $dst_offset, $length, $src);
+    ioctl($fh, $cmd, $arg) or return -1;
+    return (unpack("q q q", $arg))[2];
+}
+
 system("rm -f data.nufs test.log");
 
 say "#           == Basic Tests ==";
@@ -205,5 +253,160 @@ for my $i (1..5) {
 }
 ok($all_ok, "5 x 100KB files created and verified");
 
-unmount()
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "#           == Sparse Files ==";
+
+write_bytes("grow.bin", "abc");
+truncate("mnt/grow.bin", 100000);
+ok(read_bytes("grow.bin") eq "abc" . ("\0" x 99997), "Truncate extends a file with zeros");
+
+my $far = 10 * 1024 * 1024;
+open my $sparse, ">", "mnt/sparse.bin" or die "can't create sparse.bin";
+binmode $sparse;
+seek $sparse, $far, 0;
+print $sparse "end";
+close $sparse;
+ok((-s "mnt/sparse.bin" // 0) == $far + 3, "Write past the end grows the file");
+ok(read_text_slice("sparse.bin", 4096, 1024 * 1024) eq "\0" x 4096, "The hole reads back as zeros");
+my $sectors = (stat "mnt/sparse.bin")[12] // 0;
+say "# st_blocks: $sectors";
+ok($sectors > 0 && $sectors <= 64, "The hole takes no blocks");
+
+ok(nufs_seek("sparse.bin", $NUFS_IOC_SEEK_DATA, 0) == $far, "SEEK_DATA skips the hole");
+ok(nufs_seek("sparse.bin", $NUFS_IOC_SEEK_HOLE, 0) == 0, "SEEK_HOLE finds the hole at the start");
+ok(nufs_seek("sparse.bin", $NUFS_IOC_SEEK_HOLE, $far) == $far + 3,
+   "SEEK_HOLE past the last data is the end of the file");
+
+write_bytes("shrink.bin", "x" x 8192);
+truncate("mnt/shrink.bin", 100);
+truncate("mnt/shrink.bin", 8192);
+ok(read_bytes("shrink.bin") eq ("x" x 100) . ("\0" x 8092),
+   "Truncate down and back up reads zeros in the old tail");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "#           == Clones and Copies ==";
+
+my $orig = join("", map { sprintf("%08d", $_) } 0 .. 1999);  # 16000 bytes
+write_bytes("orig.bin", $orig);
+write_bytes("clone.bin", "");
+open my $clone, "+<", "mnt/clone.bin" or die "can't open clone.bin";
+ok(nufs_copy($clone, $NUFS_IOC_CLONE, "/orig.bin", 0, 0, 0) >= 0, "Clone a file");
+close $clone;
+ok(read_bytes("clone.bin") eq $orig, "The clone reads back the source");
+
+open $clone, "+<", "mnt/clone.bin" or die "can't open clone.bin";
+seek $clone, 5000, 0;
+print $clone "CLONE";
+close $clone;
+my $changed = $orig;
+substr($changed, 5000, 5) = "CLONE";
+ok(read_bytes("clone.bin") eq $changed, "A write to the clone lands in the clone");
+ok(read_bytes("orig.bin") eq $orig, "A write to the clone leaves the source alone");
+
+open my $src, "+<", "mnt/orig.bin" or die "can't open orig.bin";
+print $src "SOURCE";
+close $src;
+ok(read_bytes("clone.bin") eq $changed, "A write to the source leaves the clone alone");
+
+write_bytes("copy.bin", "-" x 100);
+open my $copy, "+<", "mnt/copy.bin" or die "can't open copy.bin";
+my $copied = nufs_copy($copy, $NUFS_IOC_COPY_RANGE, "/clone.bin", 1001, 3003, 9000);
+close $copy;
+ok($copied == 9000, "Copy an unaligned range");
+ok(read_bytes("copy.bin") eq ("-" x 100) . ("\0" x 2903) . substr($changed, 1001, 9000),
+   "The copied range reads back the source's bytes");
+
+open my $ro, "<", "mnt/clone.bin" or die "can't open clone.bin";
+my $cloned = nufs_copy($ro, $NUFS_IOC_CLONE, "/orig.bin", 0, 0, 0);
+my $ebadf = $!{EBADF};
+close $ro;
+ok($cloned < 0 && $ebadf, "Clone into a read-only descriptor fails with EBADF");
+
+unmount();
+
+system("rm -f data.nufs test.log");
+
+mount();
+
+say "#           == Renames ==";
+
+write_text("old.txt", "old");
+write_text("new.txt", "new");
+ok(rename("mnt/old.txt", "mnt/new.txt") && read_text("new.txt") eq "old" && !-e "mnt/old.txt",
+   "Rename over an existing file replaces it");
 
+mkdir("mnt/full");
+write_text("full/inside.txt", "inside");
+mkdir("mnt/empty");
+ok(rename("mnt/full", "mnt/empty") && !-e "mnt/full" && read_text("empty/inside.txt") eq "inside",
+   "Rename over an empty directory replaces it");
+
+mkdir("mnt/other");
+my $renamed = rename("mnt/other", "mnt/empty");
+ok(!$renamed && $!{ENOTEMPTY}, "Rename over a non-empty directory fails with ENOTEMPTY");
+ok(-d "mnt/other" && read_text("empty/inside.txt") eq "inside", "A failed rename changes nothing");
+
+# More entries than one block holds, so the directory is hash indexed
+mkdir("mnt/hashed");
+for my $i (0 .. 99) {
+    write_text("hashed/file$i", "content $i");
+}
+ok(rename("mnt/hashed/file50", "mnt/hashed/moved50") && read_text("hashed/moved50") eq "content 50" &&
+   !-e "mnt/hashed/file50", "Rename within a hash indexed directory");
+my @names = split /\s+/, `ls mnt/hashed`;
+my $found = grep { -e "mnt/hashed/file$_" } grep { $_ != 50 } 0 .. 99;
+ok(@names == 100 && $found == 99, "The other names still resolve");
+
+unmount();
+
+# More inodes than the default image has
+system("rm -f data.nufs test.log");
+system("./mkfs.nufs -s 8M -i 1024 data.nufs >> test.log 2>&1") == 0 or die "mkfs.nufs failed";
+
+mount();
+
+say "#           == Directory Compaction ==";
+
+# Empty files take no blocks, so du only counts the directory's own;
+# long names take several replies to list
+mkdir("mnt/many");
+my $stem = "long_name_to_take_several_listing_replies";
+my @all = map { sprintf("%s_%03d", $stem, $_) } 0 .. 399;
+write_bytes("many/$_", "") for @all;
+my $du_full = (split /\s+/, `du -k mnt/many`)[0];
+
+# Delete nine in ten entries partway through a listing
+opendir my $dir, "mnt/many" or die "can't list many";
+my %seen;
+for (1 .. 10) {
+    my $name = readdir $dir;
+    $seen{$name}++ if defined $name;
+}
+unlink("mnt/many/$all[$_]") for grep { $_ % 10 != 0 } 0 .. $#all;
+while (defined(my $name = readdir $dir)) {
+    $seen{$name}++;
+}
+closedir $dir;
+my @kept = @all[grep { $_ % 10 == 0 } 0 .. $#all];
+my $once = grep { ($seen{$_} // 0) == 1 } @kept;
+ok($once == @kept, "A listing returns every surviving entry once while others are deleted");
+
+# The directory compacts once the kernel's releasedir arrives
+sleep 1;
+my @listed = split /\s+/, `ls mnt/many`;
+ok("@listed" eq "@kept", "ls lists the surviving entries");
+my $du_kept = (split /\s+/, `du -k mnt/many`)[0];
+say "# du: $du_full KB with all entries, $du_kept KB after deleting";
+ok($du_kept < $du_full, "Compaction releases the directory's trailing blocks");
+
+unmount();
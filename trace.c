@@ -0,0 +1,165 @@
+/**
+ * @file trace.c
+ * @brief Implementation of leveled tracing.
+ *
+ * Messages are formatted straight to stderr. Events claim a ring slot
+ * with one atomic increment and fill it in place, so recording never
+ * blocks; the ring is only turned into text when it's dumped.
+ */
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+int trace_level = TRACE_OFF;
+trace_record_t *trace_ring = NULL;
+
+// Total events ever recorded; the next one goes in slot trace_next % size
+static uint64_t trace_next = 0;
+
+// Where the ring is written at exit
+static const char *trace_ring_path = NULL;
+
+// Per-thread ids, handed out on a thread's first event
+static uint32_t trace_threads = 0;
+static __thread uint32_t trace_thread = 0;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+
+// Printable names, indexed by trace_event_t
+static const char *trace_names[TRACE_EVENT_COUNT] = {
+    [TRACE_ALLOC_INODE] = "alloc_inode",
+    [TRACE_FREE_INODE] = "free_inode",
+    [TRACE_GROW] = "grow",
+    [TRACE_SHRINK] = "shrink",
+    [TRACE_DIR_PUT] = "dir_put",
+    [TRACE_DIR_DELETE] = "dir_delete",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_TRUNCATE] = "truncate",
+    [TRACE_COMMIT] = "commit",
+    [TRACE_COPY] = "copy",
+    [TRACE_DIR_COMPACT] = "dir_compact",
+};
+
+/**
+ * Write the ring to NUFS_TRACE_RING at exit.
+ */
+static void trace_exit() {
+    trace_dump(trace_ring_path);
+}
+
+/**
+ * Parse the environment, once.
+ */
+static void trace_setup() {
+    const char *level = getenv("NUFS_TRACE");
+    if (level != NULL) {
+        if (strcmp(level, "error") == 0) {
+            trace_level = TRACE_ERROR;
+        } else if (strcmp(level, "info") == 0) {
+            trace_level = TRACE_INFO;
+        } else if (strcmp(level, "debug") == 0) {
+            trace_level = TRACE_DEBUG;
+        } else {
+            trace_level = atoi(level);
+        }
+    }
+
+    trace_ring_path = getenv("NUFS_TRACE_RING");
+    if (TRACE_MAX_LEVEL >= TRACE_DEBUG && trace_ring_path != NULL) {
+        trace_ring = calloc(TRACE_RING_SIZE, sizeof(trace_record_t));
+        if (trace_ring != NULL) {
+            atexit(trace_exit);
+        }
+    }
+}
+
+/**
+ * Read the tracing configuration from the environment.
+ */
+void trace_init() {
+    pthread_once(&trace_once, trace_setup);
+}
+
+/**
+ * Write a message to stderr.
+ *
+ * @param level Message level.
+ * @param fmt printf-style format.
+ */
+void trace_log(int level, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+
+    // One line per message even with several threads logging
+    flockfile(stderr);
+    fputs(level == TRACE_ERROR ? "! " : "+ ", stderr);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+
+    va_end(args);
+}
+
+/**
+ * Append an event to the ring.
+ *
+ * @param event Event kind.
+ * @param a First argument.
+ * @param b Second argument.
+ * @param c Third argument.
+ */
+void trace_record(trace_event_t event, int64_t a, int64_t b, int64_t c) {
+    if (trace_thread == 0) {
+        trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    uint64_t seq = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    trace_record_t *rec = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+    rec->ns = (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+    rec->event = event;
+    rec->thread = trace_thread;
+    rec->arg[0] = a;
+    rec->arg[1] = b;
+    rec->arg[2] = c;
+}
+
+/**
+ * Write the events in the ring as text, oldest first.
+ *
+ * @param path File to write.
+ *
+ * @return Number of events written, or -1 if the file can't be opened.
+ */
+int trace_dump(const char *path) {
+    if (trace_ring == NULL) {
+        return 0;
+    }
+
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        return -1;
+    }
+
+    uint64_t end = __atomic_load_n(&trace_next, __ATOMIC_RELAXED);
+    uint64_t start = end > TRACE_RING_SIZE ? end - TRACE_RING_SIZE : 0;
+    for (uint64_t seq = start; seq < end; ++seq) {
+        trace_record_t *rec = &trace_ring[seq & (TRACE_RING_SIZE - 1)];
+        const char *name = rec->event < TRACE_EVENT_COUNT ? trace_names[rec->event] : "?";
+        fprintf(out, "%llu.%09llu t%u %s %lld %lld %lld\n",
+                (unsigned long long)(rec->ns / 1000000000u),
+                (unsigned long long)(rec->ns % 1000000000u), rec->thread, name,
+                (long long)rec->arg[0], (long long)rec->arg[1], (long long)rec->arg[2]);
+    }
+
+    fclose(out);
+    return (int)(end - start);
+}
@@ -0,0 +1,138 @@
+/**
+ * @file trace.h
+ * @brief Leveled tracing for the NUFS filesystem.
+ *
+ * Two kinds of trace output, both off unless asked for:
+ *
+ * Messages: printf-style text written to stderr, filtered by level
+ * Events: fixed-size binary records written into an in-memory ring, for
+ * hot paths where formatting text would cost more than the operation
+ *
+ * Tracing is configured from the environment when storage starts:
+ *
+ * NUFS_TRACE=error|info|debug sets the message level (default: off)
+ * NUFS_TRACE_RING=<file> enables the event ring; it's written to the
+ * file as text when the process exits
+ *
+ * Building with -DTRACE_MAX_LEVEL=<n> removes every message above level
+ * n from the binary; events are kept only at TRACE_DEBUG. With
+ * TRACE_MAX_LEVEL=0 tracing compiles away entirely.
+ *
+ * Assumptions:
+ * Tracing never fails, a full ring overwrites its oldest events
+ * All functions are safe to call from several threads
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Message levels, each includes the ones below it
+#define TRACE_OFF 0
+#define TRACE_ERROR 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+
+// Highest level compiled in
+#ifndef TRACE_MAX_LEVEL
+#define TRACE_MAX_LEVEL TRACE_DEBUG
+#endif
+
+// Events the ring buffer can hold; must be a power of two
+#define TRACE_RING_SIZE (1 << 16)
+
+/**
+ * Event kinds recorded in the ring, with the meaning of their arguments.
+ */
+typedef enum trace_event {
+    TRACE_ALLOC_INODE,   // inum
+    TRACE_FREE_INODE,    // inum
+    TRACE_GROW,          // inum, old blocks, new blocks
+    TRACE_SHRINK,        // inum, old blocks, new blocks
+    TRACE_DIR_PUT,       // dir inum, child inum, slot
+    TRACE_DIR_DELETE,    // dir inum, child inum
+    TRACE_READ,          // inum, offset, bytes read
+    TRACE_WRITE,         // inum, offset, bytes written
+    TRACE_TRUNCATE,      // inum, new size, result
+    TRACE_COMMIT,        // seq, metadata blocks, data blocks
+    TRACE_COPY,          // dst inum, src inum, bytes copied
+    TRACE_DIR_COMPACT,   // dir inum, entries moved, blocks released
+    TRACE_EVENT_COUNT
+} trace_event_t;
+
+/**
+ * One binary event record.
+ */
+typedef struct trace_record {
+    uint64_t ns;      // CLOCK_MONOTONIC timestamp
+    uint32_t event;   // trace_event_t
+    uint32_t thread;  // small per-thread id, in order of first event
+    int64_t arg[3];   // event arguments
+} trace_record_t;
+
+// Current message level, TRACE_OFF until trace_init() finds one
+extern int trace_level;
+
+// Event ring, NULL unless events are enabled
+extern trace_record_t *trace_ring;
+
+/**
+ * Log a message at the given level.
+ *
+ * Arguments are only evaluated when the level is enabled.
+ */
+#define TRACE(level, ...)                                              \
+    do {                                                               \
+        if ((level) <= TRACE_MAX_LEVEL && (level) <= trace_level) {    \
+            trace_log((level), __VA_ARGS__);                           \
+        }                                                              \
+    } while (0)
+
+/**
+ * Record an event in the ring.
+ *
+ * Arguments are only evaluated when the ring is enabled.
+ */
+#define TRACE_EVENT(event, a, b, c)                                    \
+    do {                                                               \
+        if (TRACE_MAX_LEVEL >= TRACE_DEBUG && trace_ring != NULL) {    \
+            trace_record((event), (a), (b), (c));                      \
+        }                                                              \
+    } while (0)
+
+/**
+ * Read the tracing configuration from the environment.
+ *
+ * Only the first call has any effect.
+ */
+void trace_init();
+
+/**
+ * Write a message to stderr. Use TRACE() instead.
+ *
+ * @param level Message level, picks the "! " or "+ " prefix.
+ * @param fmt printf-style format, without a trailing newline.
+ */
+void trace_log(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Append an event to the ring. Use TRACE_EVENT() instead.
+ *
+ * @param event Event kind.
+ * @param a First argument.
+ * @param b Second argument.
+ * @param c Third argument.
+ */
+void trace_record(trace_event_t event, int64_t a, int64_t b, int64_t c);
+
+/**
+ * Write the events in the ring as text, oldest first.
+ *
+ * @param path File to write.
+ *
+ * @return Number of events written, or -1 if the file can't be opened.
+ */
+int trace_dump(const char *path);
+
+#endif